@@ -25,30 +25,191 @@
 ** -LICENSE-END-
 */
 
+#include <pthread.h>
+
 #include "DeckLinkAPI.h"
 
+struct AVFrame;
+struct Clip;
+
+struct LoopFrame {
+	IDeckLinkMutableVideoFrame*		frame;
+	int64_t							pts;
+};
+
+const int kMaxOutputs		= 8;
+const int kSharedSlots		= 8;	// rendered slots kept for the outputs behind
+const int kOffsetHistory	= 64;	// more than the preroll
+
+// An output slot rendered once and scheduled on every output
+struct SlotFrame {
+	IDeckLinkVideoFrame*			frame;
+	unsigned long					slot;
+};
+
+class Player;
+
 enum OutputSignal {
 	kOutputSignalPip		= 0,
 	kOutputSignalDrop		= 1
 };
 
 
-class Player : public IDeckLinkVideoOutputCallback, public IDeckLinkAudioOutputCallback
+// One of the -C devices, with its own schedule on the shared frames
+class Output : public IDeckLinkVideoOutputCallback, public IDeckLinkAudioOutputCallback
+{
+public:
+	Output(Player *player, int index, int device);
+	virtual ~Output() {}
+
+	bool			Open(IDeckLink *deckLink, int connection);
+	void			Close();
+	void			ScheduleNextFrame();
+	void			WriteNextAudioSamples();
+	void			CheckAudio(uint32_t buffered);
+
+	Player*							m_player;
+	int								m_index;			// reader of the audio ring
+	int								m_device;			// -C number
+	IDeckLink*						m_deckLink;
+	IDeckLinkOutput*				m_deckLinkOutput;
+	bool							m_genlocked;
+
+	// m_slot is on the output clock, m_slot + m_slotOffset is the frame shown
+	unsigned long					m_slot;
+	long							m_slotOffset;
+	int64_t							m_origin;			// us when its stream time was 0
+	bool							m_aligned;
+	unsigned long					m_framesScheduled;
+	unsigned long					m_framesCompleted;
+	unsigned long					m_framesLate;
+	unsigned long					m_framesDroppedOut;
+
+	BMDTimeValue					m_audioStreamTime;
+	int64_t							m_audioGap;
+	int64_t							m_audioSkip;
+	bool							m_audioStarved;
+	unsigned long					m_audioUnderruns;
+	bool							m_prerolled;
+
+	// A/V offset at the output and the water level, in samples
+	int64_t							m_audioPosition;	// source time of the next one
+	int64_t							m_audioRepeat;
+	double							m_avOffset;			// smoothed, audio ahead if > 0
+	double							m_avOffsetMax;
+	unsigned						m_avOffsetFar;
+	unsigned long					m_samplesDropped;
+	unsigned long					m_samplesRepeated;
+	unsigned long					m_audioWaterlevel;
+	unsigned long					m_lowestBuffered;
+	int64_t							m_waterlevelTime;
+	unsigned long					m_waterlevelRaises;
+
+	// *** DeckLink API implementation of IDeckLinkVideoOutputCallback IDeckLinkAudioOutputCallback *** //
+	// IUnknown needs only a dummy implementation
+	virtual HRESULT STDMETHODCALLTYPE	QueryInterface (REFIID iid, LPVOID *ppv)	{return E_NOINTERFACE;}
+	virtual ULONG STDMETHODCALLTYPE		AddRef ()									{return 1;}
+	virtual ULONG STDMETHODCALLTYPE		Release ()									{return 1;}
+
+	virtual HRESULT STDMETHODCALLTYPE	ScheduledFrameCompleted (IDeckLinkVideoFrame* completedFrame, BMDOutputFrameCompletionResult result);
+	virtual HRESULT STDMETHODCALLTYPE	ScheduledPlaybackHasStopped ();
+
+	virtual HRESULT STDMETHODCALLTYPE	RenderAudioSamples (bool preroll);
+};
+
+
+class Player
 {
+	friend class Output;
+
 public:
 	Player();
 
 protected:
 	bool							m_running;
-	IDeckLink*						m_deckLink;
-	IDeckLinkOutput*				m_deckLinkOutput;
+	IDeckLinkOutput*				m_deckLinkOutput;	// of the first output, creates the frames
+
+	// Decoded and converted once for all the outputs
+	Output*							m_outputs[kMaxOutputs];
+	int								m_outputCount;
+	int								m_outputsPrerolled;
+	int								m_outputsDrained;
+	pthread_mutex_t					m_renderMutex;
+	SlotFrame						m_slots[kSharedSlots];
 
 	unsigned long					m_frameWidth;
 	unsigned long					m_frameHeight;
 	BMDTimeValue					m_frameDuration;
 	BMDTimeScale					m_frameTimescale;
 	unsigned long					m_framesPerSecond;
-	unsigned long					m_totalFramesScheduled;
+	unsigned long					m_nextSlot;
+	BMDFieldDominance				m_fieldDominance;
+
+	// Frame rate conversion, output slots are filled with the last source
+	// frame due at their time, repeating or dropping source frames
+	AVFrame*						m_nextFrame;
+	AVFrame*						m_shownFrame;
+	bool							m_haveNext;
+	bool							m_intraOnly;
+	int64_t							m_srcFrameDuration;
+	int64_t							m_lastPts;
+	IDeckLinkMutableVideoFrame*		m_currentFrame;
+	unsigned long					m_framesRepeated;
+	unsigned long					m_framesDropped;
+	unsigned long					m_framesSkipped;
+
+	// Underruns hold the source timeline back, audio gets the same gap
+	BMDTimeValue					m_timeOffset;
+	BMDTimeValue					m_slotTimeOffset[kOffsetHistory];
+
+	// -live, the timeline follows the input to hold the queue depth
+	double							m_liveDrift;
+	BMDTimeValue					m_liveAdjusted;
+	BMDTimeValue					m_liveDepth;
+	unsigned long					m_liveJumped;
+	IDeckLinkMutableVideoFrame*		m_blackFrame;
+	bool							m_starved;
+	unsigned long					m_underruns;
+	unsigned long					m_underrunFrames;
+	unsigned long					m_underrunLength;
+
+	// Late output recovery
+	bool							m_dropToKey;
+	bool							m_lateMode;
+	unsigned long					m_healthyCompletions;
+	unsigned long					m_lateRecoveries;
+
+	// Playlist, the decoder moves to the next clip at its marker
+	Clip*							m_clip;
+	bool							m_draining;
+	bool							m_ended;			// past the last clip
+	int64_t							m_switchTime;
+	int64_t							m_switchTimeMax;
+	unsigned long					m_clipSwitches;
+	pthread_t						m_fillThread;
+	bool							m_fillThreadStarted;
+	pthread_t						m_audioThread;
+	bool							m_audioThreadStarted;
+
+	// -S, data packets written at their time
+	pthread_t						m_serialThread;
+	bool							m_serialThreadStarted;
+	unsigned long					m_serialWritten;
+	unsigned long					m_serialLate;
+
+	// -loop from memory, the converted frames of the whole clip
+	LoopFrame*						m_cache;
+	unsigned						m_cacheCount;
+	unsigned						m_cacheNext;
+	int								m_cacheShown;
+	int64_t							m_cacheLoop;
+
+	// -ss and -arm
+	bool							m_cueing;
+	int64_t							m_cueStart;
+	unsigned long					m_cueDecoded;
+	bool							m_armed;
+	bool							m_playing;
 
 	OutputSignal					m_outputSignal;
 	unsigned long					m_audioBufferSampleLength;
@@ -57,29 +218,50 @@ protected:
 	BMDAudioSampleRate				m_audioSampleRate;
 	unsigned long					m_audioSampleDepth;
 
+	int64_t							m_initTime;
+	bool							m_firstFrameShown;
+
 	// Generated message map functions
 
 	// Signal Generator Implementation
 	void			StartRunning (int videomode);
 	void			StopRunning ();
-	void			ScheduleNextFrame (bool prerolling);
-	void			WriteNextAudioSamples ();
+	unsigned		WaitForBuffers ();
+	void			StartPlayback ();
+	IDeckLinkVideoFrame*	RenderSlot (unsigned long slot);
+	IDeckLinkVideoFrame*	FrameForSlot (unsigned long slot);
+	void			FrameCompleted (Output *output, BMDOutputFrameCompletionResult result);
+	void			AlignOutput (Output *output);
+	void			OutputPrerolled ();
+	void			OutputDrained ();
 
-	IDeckLinkDisplayMode *GetDisplayModeByIndex(int selectedIndex);
+	bool			DecodeFrame (int64_t limit);
+	bool			DecodeUntil (BMDTimeValue time);
+	IDeckLinkMutableVideoFrame*	ConvertFrame (AVFrame *frame);
+	IDeckLinkMutableVideoFrame*	CreateBlackFrame ();
+	void			Underrun ();
+	void			UnderrunEnded ();
+	void			CheckLateness (Output *output, BMDOutputFrameCompletionResult result);
+	void			SetupDecoder ();
+	bool			NextClip (int64_t entered);
+	void			StartDecoding ();
+	bool			FillCache ();
+	bool			CacheUntil (BMDTimeValue time);
+	void			Arm ();
+	void			LiveAdjust (BMDTimeValue time);
+	void			LiveReport ();
+	BMDTimeValue	SourceTime (Output *output, BMDTimeValue now);
 
 public:
-	bool			Init(int videomode, int connection, int camera);
+	void			WriteSerial ();
 
-	// *** DeckLink API implementation of IDeckLinkVideoOutputCallback IDeckLinkAudioOutputCallback *** //
-	// IUnknown needs only a dummy implementation
-	virtual HRESULT STDMETHODCALLTYPE	QueryInterface (REFIID iid, LPVOID *ppv)	{return E_NOINTERFACE;}
-	virtual ULONG STDMETHODCALLTYPE		AddRef ()									{return 1;}
-	virtual ULONG STDMETHODCALLTYPE		Release ()									{return 1;}
+protected:
 
-	virtual HRESULT STDMETHODCALLTYPE	ScheduledFrameCompleted (IDeckLinkVideoFrame* completedFrame, BMDOutputFrameCompletionResult result);
-	virtual HRESULT STDMETHODCALLTYPE	ScheduledPlaybackHasStopped ();
+	IDeckLinkDisplayMode *GetDisplayModeByIndex(int selectedIndex);
 
-	virtual HRESULT STDMETHODCALLTYPE	RenderAudioSamples (bool preroll);
+public:
+	bool			Init(Clip *clip, int videomode, int connection,
+					 const int *devices, int count);
 };
 
 
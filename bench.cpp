@@ -0,0 +1,99 @@
+/*
+ * Blackmagic Devices Decklink microbenchmarks
+ * Copyright (c) 2026 the bmdtools authors.
+ *
+ * This file is part of bmdtools.
+ *
+ * bmdtools is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * bmdtools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with bmdtools; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "bench.h"
+
+int64_t bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int bench_init(Bench *b, const char *name, int ops, int64_t bytes)
+{
+    memset(b, 0, sizeof(*b));
+    b->name    = name;
+    b->bytes   = bytes;
+    b->samples = (int64_t *)malloc(ops * sizeof(*b->samples));
+    if (!b->samples) {
+        fprintf(stderr, "%s: out of memory\n", name);
+        return -1;
+    }
+    b->size = ops;
+    return 0;
+}
+
+static int cmp_sample(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+void bench_report(Bench *b)
+{
+    int64_t total = 0, p50, p99, max;
+    double ns_op, gb_s;
+
+    if (!b->count) {
+        free(b->samples);
+        return;
+    }
+
+    for (int i = 0; i < b->count; i++)
+        total += b->samples[i];
+    qsort(b->samples, b->count, sizeof(*b->samples), cmp_sample);
+    p50   = b->samples[b->count / 2];
+    p99   = b->samples[(b->count - 1) * 99 / 100];
+    max   = b->samples[b->count - 1];
+    ns_op = (double)total / b->count;
+    gb_s  = total ? (double)b->bytes * b->count / total : 0;
+
+    fprintf(stderr, "%-32s %8d ops %12.1f ns/op %8.2f GB/s "
+            "p50 %10" PRId64 " p99 %10" PRId64 " ns\n",
+            b->name, b->count, ns_op, gb_s, p50, p99);
+    printf("{\"name\":\"%s\",\"ops\":%d,\"bytes_per_op\":%" PRId64 ","
+           "\"ns_per_op\":%.1f,\"gb_per_s\":%.3f,\"p50_ns\":%" PRId64 ","
+           "\"p99_ns\":%" PRId64 ",\"max_ns\":%" PRId64 "}\n",
+           b->name, b->count, b->bytes, ns_op, gb_s, p50, p99, max);
+    fflush(stdout);
+
+    free(b->samples);
+    b->samples = NULL;
+}
+
+int bench_selected(int argc, char **argv, const char *name)
+{
+    if (argc < 2)
+        return 1;
+    for (int i = 1; i < argc; i++)
+        if (strstr(name, argv[i]))
+            return 1;
+    return 0;
+}
@@ -0,0 +1,57 @@
+/*
+ * Blackmagic Devices Decklink microbenchmarks
+ * Copyright (c) 2026 the bmdtools authors.
+ *
+ * This file is part of bmdtools.
+ *
+ * bmdtools is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * bmdtools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with bmdtools; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef BMDTOOLS_BENCH_H
+#define BMDTOOLS_BENCH_H
+
+#include <stdint.h>
+
+/*
+ * Every operation is timed on its own.  The report gives the mean, the
+ * throughput of the bytes each operation moves or produces, the median and
+ * the 99th percentile: a table on stderr and, to compare builds, one JSON
+ * object per line on stdout.
+ */
+typedef struct Bench {
+    const char *name;
+    int64_t bytes;          /* per operation */
+    int64_t *samples;       /* ns */
+    int count, size;
+} Bench;
+
+/* monotonic, ns */
+int64_t bench_now(void);
+
+int bench_init(Bench *b, const char *name, int ops, int64_t bytes);
+
+static inline void bench_add(Bench *b, int64_t ns)
+{
+    if (b->count < b->size)
+        b->samples[b->count++] = ns;
+}
+
+/* print the results and free the samples */
+void bench_report(Bench *b);
+
+/* true if the benchmark is selected by the command line */
+int bench_selected(int argc, char **argv, const char *name);
+
+#endif /* BMDTOOLS_BENCH_H */
@@ -0,0 +1,458 @@
+/*
+ * Blackmagic Devices Decklink microbenchmarks
+ * Copyright (c) 2026 the bmdtools authors.
+ *
+ * This file is part of bmdtools.
+ *
+ * bmdtools is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * bmdtools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with bmdtools; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * The bmdcapture hot paths on their own: the packet queue between the
+ * capture callback and the muxer, the colour bars drawn without a signal,
+ * raw video muxed into NUT, written to a pipe and sent over loopback UDP.
+ * Arguments select benchmarks by name.
+ */
+
+#define main bmdcapture_main
+#include "bmdcapture.cpp"
+#undef main
+
+#include <sched.h>
+#include <arpa/inet.h>
+
+#include "bench.h"
+
+static const int kQueueDepth = 16;      /* packets in flight */
+
+typedef struct QueueLoad {
+    AVPacketQueue *q;
+    uint8_t *data;
+    int size, ops;
+    Bench put;
+} QueueLoad;
+
+/* as the capture callback does, the packet wraps the card buffer */
+static void *queue_producer(void *arg)
+{
+    QueueLoad *l = (QueueLoad *)arg;
+
+    for (int i = 0; i < l->ops; i++) {
+        AVPacket pkt;
+        int64_t t;
+
+        while (avpacket_queue_size(l->q) >=
+               (unsigned long long)kQueueDepth * l->size)
+            sched_yield();
+
+        av_init_packet(&pkt);
+        pkt.data = l->data;
+        pkt.size = l->size;
+        pkt.pts  = i;
+        t        = bench_now();
+        avpacket_queue_put(l->q, &pkt);
+        bench_add(&l->put, bench_now() - t);
+    }
+    return NULL;
+}
+
+static void bench_queue(const char *put_name, const char *get_name,
+                        int size, int ops)
+{
+    AVPacketQueue q;
+    QueueLoad l;
+    Bench get;
+    pthread_t th;
+
+    avpacket_queue_init(&q);
+    l.q    = &q;
+    l.size = size;
+    l.ops  = ops;
+    l.data = (uint8_t *)av_mallocz(size);
+    if (!l.data || bench_init(&l.put, put_name, ops, size) < 0)
+        goto end;
+    if (bench_init(&get, get_name, ops, size) < 0) {
+        bench_report(&l.put);
+        goto end;
+    }
+
+    pthread_create(&th, NULL, queue_producer, &l);
+    for (int i = 0; i < ops; i++) {
+        AVPacket pkt;
+        int64_t t = bench_now();
+
+        avpacket_queue_get(&q, &pkt, 1);
+        bench_add(&get, bench_now() - t);
+        av_free_packet(&pkt);
+    }
+    pthread_join(th, NULL);
+
+    bench_report(&l.put);
+    bench_report(&get);
+end:
+    avpacket_queue_end(&q);
+    av_free(l.data);
+}
+
+static void bench_bars(const char *name, int width, int height, int ops)
+{
+    int size     = width * height * 2;
+    uint8_t *buf = (uint8_t *)av_malloc(size);
+    Bench b;
+
+    if (buf && bench_init(&b, name, ops, size) == 0) {
+        for (int i = 0; i < ops; i++) {
+            int64_t t = bench_now();
+
+            fill_colour_bars(buf, width, height);
+            bench_add(&b, bench_now() - t);
+        }
+        bench_report(&b);
+    }
+    av_free(buf);
+}
+
+static int discard_write(void *opaque, uint8_t *buf, int size)
+{
+    return size;
+}
+
+static void bench_mux(const char *name, enum AVCodecID codec_id,
+                      enum AVPixelFormat fmt, int width, int height,
+                      int size, int ops)
+{
+    AVFormatContext *oc = NULL;
+    AVCodecParameters *par;
+    AVStream *st;
+    AVPacket src;
+    uint8_t *buf;
+    Bench b;
+
+    av_init_packet(&src);
+    src.data = NULL;
+    src.size = 0;
+    if (avformat_alloc_output_context2(&oc, NULL, "nut", NULL) < 0)
+        return;
+
+    buf = (uint8_t *)av_malloc(65536);
+    if (buf)
+        oc->pb = avio_alloc_context(buf, 65536, 1, NULL, NULL,
+                                    discard_write, NULL);
+    if (!oc->pb) {
+        av_free(buf);
+        goto end;
+    }
+
+    st = avformat_new_stream(oc, NULL);
+    if (!st)
+        goto end;
+    par             = st->codecpar;
+    par->codec_id   = codec_id;
+    par->codec_type = AVMEDIA_TYPE_VIDEO;
+    par->width      = width;
+    par->height     = height;
+    par->format     = fmt;
+    st->time_base   = (AVRational){ 1, 25 };
+    if (codec_id == AV_CODEC_ID_V210)
+        par->bits_per_coded_sample = 10;
+    if (codec_id == AV_CODEC_ID_RAWVIDEO)
+        par->codec_tag = avcodec_pix_fmt_to_codec_tag(fmt);
+
+    if (av_new_packet(&src, size) < 0 ||
+        avformat_write_header(oc, NULL) < 0)
+        goto end;
+    memset(src.data, 0x80, size);
+    src.flags       |= AV_PKT_FLAG_KEY;
+    src.stream_index = st->index;
+    src.duration     = 1;
+
+    if (bench_init(&b, name, ops, size) == 0) {
+        for (int i = 0; i < ops; i++) {
+            AVPacket pkt;
+            int64_t t;
+
+            av_packet_ref(&pkt, &src);
+            pkt.pts = pkt.dts = i;
+            t = bench_now();
+            av_interleaved_write_frame(oc, &pkt);
+            bench_add(&b, bench_now() - t);
+        }
+        bench_report(&b);
+    }
+    av_write_trailer(oc);
+
+end:
+    av_packet_unref(&src);
+    if (oc->pb) {
+        av_freep(&oc->pb->buffer);
+        avio_context_free(&oc->pb);
+    }
+    avformat_free_context(oc);
+}
+
+static int fd_write(void *opaque, uint8_t *buf, int size)
+{
+    int fd   = *(int *)opaque;
+    int done = 0;
+
+    while (done < size) {
+        ssize_t n = write(fd, buf + done, size - done);
+        if (n < 0)
+            return AVERROR(errno);
+        done += n;
+    }
+    return size;
+}
+
+/* avconv on the other end, reading as fast as it can */
+static void *pipe_drain(void *arg)
+{
+    int fd = *(int *)arg;
+    static uint8_t buf[1 << 20];
+
+    while (read(fd, buf, sizeof(buf)) > 0)
+        ;
+    return NULL;
+}
+
+/*
+ * A card frame from the callback to the reader of -f pipe:1, the copy in
+ * the queue and the NUT muxer included: through libavformat's buffer and
+ * write() or vmspliced.
+ */
+static void bench_pipe(const char *name, int splice, int width, int height,
+                       int ops)
+{
+    int size            = width * height * 2;
+    AVFormatContext *oc = NULL;
+    AVCodecParameters *par;
+    AVStream *st;
+    uint8_t *frame, *buf;
+    pthread_t th;
+    int fds[2], reading = 0;
+    Bench b;
+
+    if (pipe(fds) < 0)
+        return;
+    frame = (uint8_t *)av_malloc(size);
+    if (!frame ||
+        avformat_alloc_output_context2(&oc, NULL, "nut", NULL) < 0)
+        goto end;
+    memset(frame, 0x80, size);
+
+    if (splice) {
+        oc->pb = pipeout_open(fds[1], kPipeSize);
+    } else {
+        // what avio_open() sets up for pipe:1, on the same pipe size
+        fcntl(fds[1], F_SETPIPE_SZ, 1024 * 1024);
+        buf = (uint8_t *)av_malloc(32768);
+        if (buf)
+            oc->pb = avio_alloc_context(buf, 32768, 1, &fds[1], NULL,
+                                        fd_write, NULL);
+        if (!oc->pb)
+            av_free(buf);
+    }
+    if (!oc->pb)
+        goto end;
+    pipe_out = splice;
+
+    st = avformat_new_stream(oc, NULL);
+    if (!st)
+        goto end;
+    par             = st->codecpar;
+    par->codec_id   = AV_CODEC_ID_RAWVIDEO;
+    par->codec_type = AVMEDIA_TYPE_VIDEO;
+    par->width      = width;
+    par->height     = height;
+    par->format     = AV_PIX_FMT_UYVY422;
+    par->codec_tag  = avcodec_pix_fmt_to_codec_tag(AV_PIX_FMT_UYVY422);
+    st->time_base   = (AVRational){ 1, 25 };
+    if (avformat_write_header(oc, NULL) < 0)
+        goto end;
+
+    reading = !pthread_create(&th, NULL, pipe_drain, &fds[0]);
+    if (bench_init(&b, name, ops, size) == 0) {
+        for (int i = 0; i < ops; i++) {
+            AVPacket pkt;
+            int64_t t;
+
+            av_init_packet(&pkt);
+            pkt.data         = frame;
+            pkt.size         = size;
+            pkt.pts          = pkt.dts = i;
+            pkt.flags       |= AV_PKT_FLAG_KEY;
+            pkt.stream_index = st->index;
+            t = bench_now();
+            dup_packet(&pkt);
+            av_interleaved_write_frame(oc, &pkt);
+            bench_add(&b, bench_now() - t);
+        }
+        bench_report(&b);
+    }
+    av_write_trailer(oc);
+
+end:
+    pipe_out = 0;
+    if (oc && splice) {
+        pipeout_close(&oc->pb);
+    } else if (oc && oc->pb) {
+        av_freep(&oc->pb->buffer);
+        avio_context_free(&oc->pb);
+    }
+    close(fds[1]);
+    if (reading)
+        pthread_join(th, NULL);
+    close(fds[0]);
+    avformat_free_context(oc);
+    av_free(frame);
+}
+
+typedef struct UdpReceiver {
+    int fd;
+    long datagrams;
+    Bench gaps;
+} UdpReceiver;
+
+/* the time between two datagrams, until none came for a while */
+static void *udp_receive(void *arg)
+{
+    UdpReceiver *r = (UdpReceiver *)arg;
+    static uint8_t buf[65536];
+    int64_t last = 0;
+
+    while (recv(r->fd, buf, sizeof(buf), 0) > 0) {
+        int64_t now = bench_now();
+
+        if (last)
+            bench_add(&r->gaps, now - last);
+        last = now;
+        r->datagrams++;
+    }
+    return NULL;
+}
+
+/*
+ * 1080p frames at 25 fps to a receiver on loopback with the default socket
+ * buffer: a burst of datagrams per frame as libavformat sends them, or
+ * spread by udpout.  The report is of the gaps the receiver sees.
+ */
+static void bench_udp(const char *name, int paced, int frames)
+{
+    const int size = 1920 * 1080 * 2, packet_size = 1472;
+    int64_t frame_duration = 40000;
+    struct sockaddr_in addr = { 0 };
+    socklen_t len = sizeof(addr);
+    struct timeval tv = { 0, 300000 };
+    UdpReceiver r = { -1 };
+    AVIOContext *pb = NULL;
+    uint8_t *frame;
+    long sent = 0;
+    int64_t start;
+    pthread_t th;
+    char url[64];
+    int fd = -1;
+
+    frame = (uint8_t *)av_mallocz(size);
+    r.fd  = socket(AF_INET, SOCK_DGRAM, 0);
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (!frame || r.fd < 0 ||
+        bind(r.fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        getsockname(r.fd, (struct sockaddr *)&addr, &len) < 0)
+        goto end;
+    setsockopt(r.fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    if (paced) {
+        snprintf(url, sizeof(url), "udp://127.0.0.1:%d?pkt_size=%d",
+                 ntohs(addr.sin_port), packet_size);
+        pb = udpout_open(url, frame_duration, kUdpQueue * size);
+    } else {
+        fd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if ((paced && !pb) || (!paced && fd < 0))
+        goto end;
+    if (bench_init(&r.gaps, name, frames * (size / packet_size + 1),
+                   packet_size) < 0)
+        goto end;
+    if (pthread_create(&th, NULL, udp_receive, &r)) {
+        bench_report(&r.gaps);
+        goto end;
+    }
+
+    start = av_gettime_relative();
+    for (int i = 0; i < frames; i++) {
+        int64_t wait = start + i * frame_duration - av_gettime_relative();
+
+        // as the capture callback hands them over
+        if (wait > 0)
+            av_usleep(wait);
+        if (paced) {
+            avio_write(pb, frame, size);
+            udpout_frame(pb);
+            sent += (size + packet_size - 1) / packet_size;
+        } else {
+            for (int off = 0; off < size; off += packet_size, sent++)
+                send(fd, frame + off, FFMIN(packet_size, size - off), 0);
+        }
+    }
+    udpout_close(&pb);
+    pthread_join(th, NULL);
+
+    fprintf(stderr, "%s: %ld of %ld datagrams received\n", name,
+            r.datagrams, sent);
+    bench_report(&r.gaps);
+
+end:
+    udpout_close(&pb);
+    if (fd >= 0)
+        close(fd);
+    if (r.fd >= 0)
+        close(r.fd);
+    av_free(frame);
+}
+
+int main(int argc, char *argv[])
+{
+    av_register_all();
+
+    if (bench_selected(argc, argv, "avpacket_queue/uyvy1080"))
+        bench_queue("avpacket_queue_put/uyvy1080", "avpacket_queue_get/uyvy1080",
+                    1920 * 1080 * 2, 2000);
+    if (bench_selected(argc, argv, "avpacket_queue/audio"))
+        bench_queue("avpacket_queue_put/audio", "avpacket_queue_get/audio",
+                    1920 * 8 * 4, 100000);
+    if (bench_selected(argc, argv, "fill_colour_bars/1080"))
+        bench_bars("fill_colour_bars/1080", 1920, 1080, 500);
+    if (bench_selected(argc, argv, "nut_mux/v210_1080"))
+        bench_mux("nut_mux/v210_1080", AV_CODEC_ID_V210, AV_PIX_FMT_YUV422P10,
+                  1920, 1080, (1920 + 47) / 48 * 128 * 1080, 5000);
+    if (bench_selected(argc, argv, "nut_mux/uyvy1080"))
+        bench_mux("nut_mux/uyvy1080", AV_CODEC_ID_RAWVIDEO, AV_PIX_FMT_UYVY422,
+                  1920, 1080, 1920 * 1080 * 2, 5000);
+    if (bench_selected(argc, argv, "pipe_out/write_uyvy1080"))
+        bench_pipe("pipe_out/write_uyvy1080", 0, 1920, 1080, 2000);
+    if (bench_selected(argc, argv, "pipe_out/vmsplice_uyvy1080"))
+        bench_pipe("pipe_out/vmsplice_uyvy1080", 1, 1920, 1080, 2000);
+    if (bench_selected(argc, argv, "udp_out/burst_uyvy1080"))
+        bench_udp("udp_out/burst_uyvy1080", 0, 50);
+    if (bench_selected(argc, argv, "udp_out/paced_uyvy1080"))
+        bench_udp("udp_out/paced_uyvy1080", 1, 50);
+
+    return 0;
+}
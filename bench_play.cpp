@@ -0,0 +1,177 @@
+/*
+ * Blackmagic Devices Decklink microbenchmarks
+ * Copyright (c) 2026 the bmdtools authors.
+ *
+ * This file is part of bmdtools.
+ *
+ * bmdtools is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * bmdtools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with bmdtools; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * The bmdplay hot paths on their own: the packet queues between the
+ * demuxer and the decoders and the conversion to the output frame.
+ * Arguments select benchmarks by name.
+ */
+
+#define main bmdplay_main
+#include "bmdplay.cpp"
+#undef main
+
+#include <sched.h>
+
+#include "bench.h"
+
+static const int kQueueDepth = 16;      /* packets in flight */
+
+typedef struct QueueLoad {
+    PacketQueue *q;
+    AVPacket *src;
+    int ops;
+    Bench put;
+} QueueLoad;
+
+static uint64_t queued(PacketQueue *q)
+{
+    uint64_t n;
+
+    pthread_mutex_lock(&q->mutex);
+    n = q->nb_packets;
+    pthread_mutex_unlock(&q->mutex);
+    return n;
+}
+
+/* as fill_queues does, the packets are references from the demuxer */
+static void *queue_producer(void *arg)
+{
+    QueueLoad *l = (QueueLoad *)arg;
+
+    for (int i = 0; i < l->ops; i++) {
+        AVPacket pkt;
+        int64_t t;
+
+        while (queued(l->q) >= kQueueDepth)
+            sched_yield();
+
+        av_packet_ref(&pkt, l->src);
+        pkt.pts = i;
+        t       = bench_now();
+        packet_queue_put(l->q, &pkt);
+        bench_add(&l->put, bench_now() - t);
+    }
+    return NULL;
+}
+
+static void bench_queue(const char *put_name, const char *get_name,
+                        int size, int ops)
+{
+    PacketQueue q;
+    AVPacket src;
+    QueueLoad l;
+    Bench get;
+    pthread_t th;
+
+    packet_queue_init(&q);
+    l.q   = &q;
+    l.src = &src;
+    l.ops = ops;
+    if (av_new_packet(&src, size) < 0)
+        goto end;
+    if (bench_init(&l.put, put_name, ops, size) < 0)
+        goto end;
+    if (bench_init(&get, get_name, ops, size) < 0) {
+        bench_report(&l.put);
+        goto end;
+    }
+
+    pthread_create(&th, NULL, queue_producer, &l);
+    for (int i = 0; i < ops; i++) {
+        AVPacket pkt;
+        int64_t t = bench_now();
+
+        packet_queue_get(&q, &pkt, 1);
+        bench_add(&get, bench_now() - t);
+        av_packet_unref(&pkt);
+    }
+    pthread_join(th, NULL);
+
+    bench_report(&l.put);
+    bench_report(&get);
+    av_packet_unref(&src);
+end:
+    packet_queue_end(&q);
+}
+
+/* into the 1080 UYVY output frame, as bmdplay converts every picture */
+static void bench_scale(const char *name, int src_w, int src_h,
+                        enum AVPixelFormat src_fmt, int threads, int ops)
+{
+    uint8_t *src[4] = { NULL }, *dst[4] = { NULL };
+    int src_stride[4], dst_stride[4];
+    int size       = av_image_get_buffer_size(AV_PIX_FMT_UYVY422, 1920, 1080, 1);
+    AVRational sar = { 1, 1 };
+    SliceScaler *s = NULL;
+    Bench b;
+
+    if (av_image_alloc(src, src_stride, src_w, src_h, src_fmt, 64) < 0 ||
+        av_image_alloc(dst, dst_stride, 1920, 1080, AV_PIX_FMT_UYVY422, 64) < 0)
+        goto end;
+    memset(src[0], 0, av_image_get_buffer_size(src_fmt, src_w, src_h, 64));
+
+    s = slice_scaler_alloc(src_w, src_h, src_fmt, sar, 1920, 1080,
+                           AV_PIX_FMT_UYVY422, threads);
+    if (!s || bench_init(&b, name, ops, size) < 0)
+        goto end;
+
+    for (int i = 0; i < ops; i++) {
+        int64_t t = bench_now();
+
+        slice_scaler_scale(s, src, src_stride, dst, dst_stride);
+        bench_add(&b, bench_now() - t);
+    }
+    bench_report(&b);
+
+end:
+    slice_scaler_free(&s);
+    av_freep(&src[0]);
+    av_freep(&dst[0]);
+}
+
+int main(int argc, char *argv[])
+{
+    int threads = FFMIN(FFMAX(sysconf(_SC_NPROCESSORS_ONLN), 1), 16);
+
+    av_register_all();
+
+    if (bench_selected(argc, argv, "packet_queue/video"))
+        bench_queue("packet_queue_put/video", "packet_queue_get/video",
+                    512 * 1024, 100000);
+    if (bench_selected(argc, argv, "packet_queue/audio"))
+        bench_queue("packet_queue_put/audio", "packet_queue_get/audio",
+                    4096, 100000);
+    if (bench_selected(argc, argv, "slice_scaler/yuv420p_1080"))
+        bench_scale("slice_scaler/yuv420p_1080", 1920, 1080,
+                    AV_PIX_FMT_YUV420P, threads, 500);
+    if (bench_selected(argc, argv, "slice_scaler/yuv420p_1080_1thread"))
+        bench_scale("slice_scaler/yuv420p_1080_1thread", 1920, 1080,
+                    AV_PIX_FMT_YUV420P, 1, 200);
+    if (bench_selected(argc, argv, "slice_scaler/yuv422p10_1080"))
+        bench_scale("slice_scaler/yuv422p10_1080", 1920, 1080,
+                    AV_PIX_FMT_YUV422P10, threads, 500);
+    if (bench_selected(argc, argv, "slice_scaler/yuv420p_720_up"))
+        bench_scale("slice_scaler/yuv420p_720_up", 1280, 720,
+                    AV_PIX_FMT_YUV420P, threads, 500);
+
+    return 0;
+}
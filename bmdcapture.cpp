@@ -28,11 +28,17 @@
 #include <fcntl.h>
 #include <time.h>
 #include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include "compat.h"
 #include "DeckLinkAPI.h"
 #include "Capture.h"
 #include "modes.h"
+#include "trace.h"
+#include "framebus.h"
+#include "pipeout.h"
+#include "udpout.h"
 extern "C" {
 #include "libavformat/avformat.h"
 #include "libavutil/time.h"
@@ -40,8 +46,6 @@ extern "C" {
 
 pthread_mutex_t sleepMutex;
 pthread_cond_t sleepCond;
-int videoOutputFile = -1;
-int audioOutputFile = -1;
 
 IDeckLink *deckLink;
 IDeckLinkInput *deckLinkInput;
@@ -58,6 +62,7 @@ static int g_maxFrames           = -1;
 static int serial_fd             = -1;
 static int wallclock             = 0;
 static int draw_bars             = 1;
+const char *g_traceFile          = NULL;
 bool g_verbose                   = false;
 unsigned long long g_memoryLimit = 1024 * 1024 * 1024;            // 1GByte(>50 sec)
 
@@ -65,9 +70,38 @@ static unsigned long frameCount = 0;
 static unsigned int dropped     = 0, totaldropped = 0;
 static enum AVPixelFormat pix_fmt     = AV_PIX_FMT_UYVY422;
 static enum AVSampleFormat sample_fmt = AV_SAMPLE_FMT_S16;
+
+static FILE *trace_file;
+static int64_t trace_start = -1;
+
+static const char *replay_file;
+static int replay_fast;
+static FILE *replay_trace;
+static TraceHeader replay_header;
+static int replay_stop, replay_done;
+static unsigned long packets_written;
+
+static double g_pretrigger;                 // -B, seconds kept before a trigger
+static double g_posttrigger = 10;           // -E, seconds written after it
+static const char *g_controlSocket;
+static int control_fd = -1;
+static int trigger;
+static AVDictionary *clip_opts;
+
+static const int kBusSlots = 16;
+static const char *g_busName;
+static FrameBus *bus;
+
+static const int kPipeSize = 8 * 1024 * 1024;
+static int pipe_out;                        // -f pipe:1 to a pipe, vmspliced
+
+static const int kUdpQueue = 4;             /* frames */
+static int udp_out;                         // -f udp:// or rtp://, paced
+
 typedef struct AVPacketQueue {
     AVPacketList *first_pkt, *last_pkt;
     int nb_packets;
+    unsigned long total;        /* packets ever put */
     unsigned long long size;
     int abort_request;
     pthread_mutex_t mutex;
@@ -75,6 +109,25 @@ typedef struct AVPacketQueue {
 } AVPacketQueue;
 
 static AVPacketQueue queue;
+static AVPacketQueue ring;                  // -B, the last seconds of packets
+
+/* -a, -D: a stream in a file of its own, written by a thread of its own */
+typedef struct StreamOutput {
+    const char *filename;
+    AVFormatContext *oc;        /* NULL for the text sidecar */
+    FILE *text;
+    AVRational time_base;       /* of the packets queued */
+    AVPacketQueue queue;
+    pthread_t thread;
+    int running;
+    unsigned long packets;
+    int64_t bytes;
+} StreamOutput;
+
+static const char *g_dataOutputFile;
+static StreamOutput audio_out, data_out;
+static AVPacketQueue *audio_queue = &queue;
+static AVPacketQueue *data_queue  = &queue;
 
 static AVPacket flush_pkt;
 
@@ -109,12 +162,27 @@ static void avpacket_queue_end(AVPacketQueue *q)
     pthread_cond_destroy(&q->cond);
 }
 
+/* frames for the pipe are copied once, into pages it can take as they are */
+static int dup_packet(AVPacket *pkt)
+{
+    AVBufferRef *buf;
+
+    if (pipe_out && !pkt->buf && (buf = pipeout_alloc(pkt->size))) {
+        memcpy(buf->data, pkt->data, pkt->size);
+        pkt->buf  = buf;
+        pkt->data = buf->data;
+        return 0;
+    }
+
+    return av_dup_packet(pkt);
+}
+
 static int avpacket_queue_put(AVPacketQueue *q, AVPacket *pkt)
 {
     AVPacketList *pkt1;
 
     /* duplicate the packet */
-    if (pkt != &flush_pkt && av_dup_packet(pkt) < 0) {
+    if (pkt != &flush_pkt && dup_packet(pkt) < 0) {
         return -1;
     }
 
@@ -135,6 +203,7 @@ static int avpacket_queue_put(AVPacketQueue *q, AVPacket *pkt)
 
     q->last_pkt = pkt1;
     q->nb_packets++;
+    q->total++;
     q->size += pkt1->pkt.size + sizeof(*pkt1);
 
     pthread_cond_signal(&q->cond);
@@ -187,6 +256,21 @@ static unsigned long long avpacket_queue_size(AVPacketQueue *q)
     return size;
 }
 
+static unsigned long avpacket_queue_total(AVPacketQueue *q)
+{
+    unsigned long total;
+    pthread_mutex_lock(&q->mutex);
+    total = q->total;
+    pthread_mutex_unlock(&q->mutex);
+    return total;
+}
+
+/* -m: the frames asked for are in */
+static bool max_frames_reached(void)
+{
+    return g_maxFrames > 0 && frameCount >= (unsigned long)g_maxFrames;
+}
+
 AVOutputFormat *fmt = NULL;
 AVFormatContext *oc;
 AVStream *audio_st, *video_st, *data_st;
@@ -315,12 +399,12 @@ void write_data_packet(char *data, int size, int64_t pts)
     av_init_packet(&pkt);
 
     pkt.flags        |= AV_PKT_FLAG_KEY;
-    pkt.stream_index  = data_st->index;
+    pkt.stream_index  = data_st ? data_st->index : 0;
     pkt.data          = (uint8_t*)data;
     pkt.size          = size;
     pkt.dts = pkt.pts = pts;
 
-    avpacket_queue_put(&queue, &pkt);
+    avpacket_queue_put(data_queue, &pkt);
 }
 
 void write_audio_packet(IDeckLinkAudioInputPacket *audioFrame)
@@ -348,7 +432,21 @@ void write_audio_packet(IDeckLinkAudioInputPacket *audioFrame)
     pkt.stream_index = audio_st->index;
     pkt.data         = (uint8_t *)audioFrameBytes;
 
-    avpacket_queue_put(&queue, &pkt);
+    avpacket_queue_put(audio_queue, &pkt);
+}
+
+/* UYVY colour bars in place of the missing picture */
+static void fill_colour_bars(void *frameBytes, int width, int height)
+{
+    unsigned bars[8] = {
+        0xEA80EA80, 0xD292D210, 0xA910A9A5, 0x90229035,
+        0x6ADD6ACA, 0x51EF515A, 0x286D28EF, 0x10801080 };
+    unsigned *p = (unsigned *)frameBytes;
+
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x += 2)
+            *p++ = bars[(x * 8) / width];
+    }
 }
 
 void write_video_packet(IDeckLinkVideoInputFrame *videoFrame,
@@ -371,19 +469,9 @@ void write_video_packet(IDeckLinkVideoInputFrame *videoFrame,
     videoFrame->GetBytes(&frameBytes);
 
     if (videoFrame->GetFlags() & bmdFrameHasNoInputSource) {
-        if (pix_fmt == AV_PIX_FMT_UYVY422 && draw_bars) {
-            unsigned bars[8] = {
-                0xEA80EA80, 0xD292D210, 0xA910A9A5, 0x90229035,
-                0x6ADD6ACA, 0x51EF515A, 0x286D28EF, 0x10801080 };
-            int width  = videoFrame->GetWidth();
-            int height = videoFrame->GetHeight();
-            unsigned *p = (unsigned *)frameBytes;
-
-            for (int y = 0; y < height; y++) {
-                for (int x = 0; x < width; x += 2)
-                    *p++ = bars[(x * 8) / width];
-            }
-        }
+        if (pix_fmt == AV_PIX_FMT_UYVY422 && draw_bars)
+            fill_colour_bars(frameBytes, videoFrame->GetWidth(),
+                             videoFrame->GetHeight());
         if (!no_video) {
             time(&cur_time);
             fprintf(stderr,"%s "
@@ -419,12 +507,97 @@ void write_video_packet(IDeckLinkVideoInputFrame *videoFrame,
 }
 
 
+static void trace_callback(IDeckLinkVideoInputFrame *videoFrame,
+                           IDeckLinkAudioInputPacket *audioFrame)
+{
+    TraceRecord r = { 0 };
+    int64_t now = av_gettime_relative();
+
+    if (trace_start < 0)
+        trace_start = now;
+
+    r.arrival    = now - trace_start;
+    r.video_time = -1;
+    r.audio_time = -1;
+
+    if (videoFrame) {
+        BMDTimeValue frameTime, frameDuration;
+
+        videoFrame->GetStreamTime(&frameTime, &frameDuration, frameRateScale);
+        r.video_time = frameTime;
+        r.flags      = videoFrame->GetFlags();
+        r.row_bytes  = videoFrame->GetRowBytes();
+        r.video_size = r.row_bytes * videoFrame->GetHeight();
+    }
+
+    if (audioFrame) {
+        BMDTimeValue packetTime;
+
+        audioFrame->GetPacketTime(&packetTime, 48000);
+        r.audio_time    = packetTime;
+        r.audio_samples = audioFrame->GetSampleFrameCount();
+    }
+
+    if (trace_write(trace_file, &r) < 0) {
+        fprintf(stderr, "Cannot write the trace, stopped tracing\n");
+        fclose(trace_file);
+        trace_file = NULL;
+    }
+}
+
+/* -P, the frame as it came, for the readers of the bus */
+static void publish_frame(IDeckLinkVideoInputFrame *videoFrame,
+                          IDeckLinkAudioInputPacket *audioFrame)
+{
+    FrameBusFrame f = { 0 };
+    void *video = NULL, *audio = NULL;
+
+    f.pts       = -1;
+    f.audio_pts = -1;
+
+    if (videoFrame) {
+        BMDTimeValue frameTime, frameDuration;
+
+        videoFrame->GetStreamTime(&frameTime, &frameDuration, frameRateScale);
+        videoFrame->GetBytes(&video);
+        f.pts          = frameTime;
+        f.flags        = videoFrame->GetFlags();
+        f.pixel_format = videoFrame->GetPixelFormat();
+        f.row_bytes    = videoFrame->GetRowBytes();
+        f.video_size   = f.row_bytes * videoFrame->GetHeight();
+    }
+
+    if (audioFrame) {
+        BMDTimeValue packetTime;
+
+        audioFrame->GetPacketTime(&packetTime, 48000);
+        audioFrame->GetBytes(&audio);
+        f.audio_pts     = packetTime;
+        f.audio_samples = audioFrame->GetSampleFrameCount();
+        f.audio_size    = f.audio_samples * g_audioChannels *
+                          (g_audioSampleDepth / 8);
+    }
+
+    framebus_put(bus, &f, video, audio);
+}
+
 HRESULT DeckLinkCaptureDelegate::VideoInputFrameArrived(
     IDeckLinkVideoInputFrame *videoFrame, IDeckLinkAudioInputPacket *audioFrame)
 {
 
     frameCount++;
 
+    if (trace_file)
+        trace_callback(videoFrame, audioFrame);
+
+    // -P alone, nothing to mux
+    if (!oc) {
+        publish_frame(videoFrame, audioFrame);
+        if (max_frames_reached())
+            pthread_cond_signal(&sleepCond);
+        return S_OK;
+    }
+
     // Handle Video Frame
     if (videoFrame) {
         BMDTimeValue frameTime;
@@ -446,8 +619,11 @@ HRESULT DeckLinkCaptureDelegate::VideoInputFrameArrived(
         if (serial_fd > 0) {
             char line[8] = {0};
             int count = read(serial_fd, line, 7);
-            if (count > 0)
+            if (count > 0) {
                 fprintf(stderr, "read %d bytes: %s  \n", count, line);
+                if (g_pretrigger > 0)
+                    __atomic_store_n(&trigger, 1, __ATOMIC_RELEASE);
+            }
             else line[0] = ' ';
             write_data_packet(line, 7, pts);
         }
@@ -464,6 +640,8 @@ HRESULT DeckLinkCaptureDelegate::VideoInputFrameArrived(
     if (audioFrame)
         write_audio_packet(audioFrame);
 
+    if (bus)
+        publish_frame(videoFrame, audioFrame);
 
     return S_OK;
 }
@@ -555,6 +733,16 @@ int usage(int status)
         "    -d <filler>          When the source is offline draw a black frame or color bars\n"
         "                         0: black frame\n"
         "                         1: color bars\n"
+        "    -T <tracefile>       Record what each input callback carried\n"
+        "    -R <tracefile>       Replay a trace instead of capturing from a card\n"
+        "    -X                   Replay as fast as the muxer takes it\n"
+        "    -B <seconds>         Keep the last seconds in memory, write them to a new\n"
+        "                         file on SIGUSR1, -K or a byte on -S; -f has a %%d\n"
+        "    -E <seconds>         Seconds after the trigger written too (default is 10)\n"
+        "    -K <socket>          Unix socket taking triggers\n"
+        "    -P <name>            Publish the frames on a shared memory bus, with or without -f\n"
+        "    -a <filename>        Write the audio to a file of its own, e.g. a .wav\n"
+        "    -D <filename>        Write the -S or -w data to a text file of its own\n"
         "Capture video and audio to a file.\n"
         "Raw video and audio can be sent to a pipe to avconv or vlc e.g.:\n"
         "\n"
@@ -571,8 +759,14 @@ static void *push_packet(void *ctx)
     int ret;
 
     while (avpacket_queue_get(&queue, &pkt, 1)) {
+        int video = pkt.stream_index == video_st->index;
+
         av_interleaved_write_frame(s, &pkt);
-        if ((g_maxFrames > 0 && frameCount >= g_maxFrames) ||
+        if (udp_out && video)
+            udpout_frame(s->pb);
+        __atomic_add_fetch(&packets_written, 1, __ATOMIC_RELEASE);
+        // the replay stops by itself once the muxer caught up
+        if ((!replay_file && max_frames_reached()) ||
             avpacket_queue_size(&queue) > g_memoryLimit) {
             pthread_cond_signal(&sleepCond);
         }
@@ -581,16 +775,507 @@ static void *push_packet(void *ctx)
     return NULL;
 }
 
+/* -D, a line per packet: the frame, the time in seconds and the text */
+static void write_text(StreamOutput *o, AVPacket *pkt)
+{
+    int len = strnlen((const char *)pkt->data, pkt->size);
+
+    fprintf(o->text, "%" PRId64 " %.6f ", pkt->pts,
+            pkt->pts * av_q2d(o->time_base));
+    for (int i = 0; i < len; i++) {
+        char c = pkt->data[i];
+        fputc(c == '\n' || c == '\r' ? ' ' : c, o->text);
+    }
+    fputc('\n', o->text);
+}
+
+/* nothing to interleave with, each packet goes out as it comes */
+static void *write_stream(void *ctx)
+{
+    StreamOutput *o = (StreamOutput *)ctx;
+    AVPacket pkt;
+
+    while (avpacket_queue_get(&o->queue, &pkt, 1)) {
+        o->packets++;
+        o->bytes += pkt.size;
+        if (o->oc)
+            av_write_frame(o->oc, &pkt);
+        else
+            write_text(o, &pkt);
+        av_packet_unref(&pkt);
+        __atomic_add_fetch(&packets_written, 1, __ATOMIC_RELEASE);
+        if (avpacket_queue_size(&o->queue) > g_memoryLimit)
+            pthread_cond_signal(&sleepCond);
+    }
+
+    return NULL;
+}
+
+static int start_stream_output(StreamOutput *o, AVPacketQueue **q)
+{
+    avpacket_queue_init(&o->queue);
+    if (pthread_create(&o->thread, NULL, write_stream, o)) {
+        fprintf(stderr, "Cannot start writing %s\n", o->filename);
+        avpacket_queue_end(&o->queue);
+        return -1;
+    }
+    o->running = 1;
+    *q         = &o->queue;
+
+    return 0;
+}
+
+/* -a, the audio alone, a WAV turns into RF64 past 4 GB */
+static int open_audio_output(const char *filename)
+{
+    AVOutputFormat *afmt = av_guess_format(NULL, filename, NULL);
+    AVDictionary *opts   = NULL;
+    AVFormatContext *s;
+    int ret;
+
+    if (!afmt) {
+        fprintf(stderr, "Unable to guess the format of %s\n", filename);
+        return -1;
+    }
+    s = avformat_alloc_context();
+    if (!s)
+        return -1;
+    s->oformat = afmt;
+    snprintf(s->filename, sizeof(s->filename), "%s", filename);
+    audio_st = add_audio_stream(s, fmt->audio_codec);
+
+    if (!(afmt->flags & AVFMT_NOFILE) &&
+        avio_open(&s->pb, filename, AVIO_FLAG_WRITE) < 0) {
+        fprintf(stderr, "Could not open '%s'\n", filename);
+        avformat_free_context(s);
+        return -1;
+    }
+
+    if (!strcmp(afmt->name, "wav"))
+        av_dict_set(&opts, "rf64", "auto", 0);
+    ret = avformat_write_header(s, &opts);
+    av_dict_free(&opts);
+    if (ret < 0) {
+        fprintf(stderr, "Could not write the header of '%s'\n", filename);
+        if (!(afmt->flags & AVFMT_NOFILE))
+            avio_close(s->pb);
+        avformat_free_context(s);
+        return -1;
+    }
+
+    audio_out.filename  = filename;
+    audio_out.oc        = s;
+    audio_out.time_base = audio_st->time_base;
+
+    return start_stream_output(&audio_out, &audio_queue);
+}
+
+static int open_data_output(const char *filename)
+{
+    data_out.text = fopen(filename, "w");
+    if (!data_out.text) {
+        fprintf(stderr, "Could not open '%s'\n", filename);
+        return -1;
+    }
+    // a few lines a frame, written out in large blocks
+    setvbuf(data_out.text, NULL, _IOFBF, 1024 * 1024);
+
+    data_out.filename  = filename;
+    data_out.time_base = video_st->time_base;
+
+    return start_stream_output(&data_out, &data_queue);
+}
+
+/* once the callbacks stopped, what is queued is written out */
+static void close_stream_output(StreamOutput *o)
+{
+    if (o->running) {
+        avpacket_queue_put(&o->queue, &flush_pkt);
+        pthread_join(o->thread, NULL);
+        avpacket_queue_end(&o->queue);
+        fprintf(stderr, "%s: %lu packets, %.1f MB\n", o->filename,
+                o->packets, (double)o->bytes / 1024 / 1024);
+    }
+
+    if (o->oc) {
+        av_write_trailer(o->oc);
+        if (!(o->oc->oformat->flags & AVFMT_NOFILE))
+            avio_close(o->oc->pb);
+        avformat_free_context(o->oc);
+        o->oc = NULL;
+    }
+    if (o->text) {
+        fclose(o->text);
+        o->text = NULL;
+    }
+}
+
+/* everything the writers have to get through */
+static unsigned long packets_queued(void)
+{
+    unsigned long total = avpacket_queue_total(&queue);
+
+    if (audio_queue != &queue)
+        total += avpacket_queue_total(audio_queue);
+    if (data_queue != &queue)
+        total += avpacket_queue_total(data_queue);
+
+    return total;
+}
+
+/*
+ * Feed the recorded callbacks to the delegate, at their original cadence
+ * or back to back, then wait for the muxer to write out what was queued.
+ */
+static void *replay_frames(void *ctx)
+{
+    DeckLinkCaptureDelegate *delegate = (DeckLinkCaptureDelegate *)ctx;
+    TraceRecord r;
+    uint8_t *video = NULL, *audio = NULL;
+    size_t video_size = 0, audio_size = 0;
+    unsigned long long qsize, peak = 0;
+    unsigned long frames = 0, total;
+    int64_t start = av_gettime_relative(), first = -1, last = 0, elapsed;
+
+    while (!__atomic_load_n(&replay_stop, __ATOMIC_ACQUIRE) &&
+           trace_read(replay_trace, &r)) {
+        IDeckLinkVideoInputFrame *videoFrame = NULL;
+        IDeckLinkAudioInputPacket *audioFrame = NULL;
+
+        if (first < 0)
+            first = r.arrival;
+        last = r.arrival;
+
+        if (!replay_fast) {
+            int64_t wait = start + r.arrival - first - av_gettime_relative();
+            if (wait > 0)
+                av_usleep(wait);
+        }
+
+        if (r.video_time >= 0) {
+            if (r.video_size > video_size) {
+                av_free(video);
+                video_size = r.video_size;
+                video      = (uint8_t *)av_malloc(video_size);
+                if (!video)
+                    break;
+                if (pix_fmt == AV_PIX_FMT_UYVY422) {
+                    unsigned *p = (unsigned *)video;
+                    for (size_t i = 0; i < video_size / 4; i++)
+                        p[i] = 0x10801080;
+                } else {
+                    memset(video, 0, video_size);
+                }
+            }
+            videoFrame = trace_video_frame(&replay_header, &r, video);
+        }
+
+        if (r.audio_time >= 0) {
+            size_t size = (size_t)r.audio_samples * g_audioChannels *
+                          (g_audioSampleDepth / 8);
+            if (size > audio_size) {
+                av_free(audio);
+                audio_size = size;
+                audio      = (uint8_t *)av_mallocz(audio_size);
+                if (!audio) {
+                    if (videoFrame)
+                        videoFrame->Release();
+                    break;
+                }
+            }
+            audioFrame = trace_audio_packet(&r, audio);
+        }
+
+        delegate->VideoInputFrameArrived(videoFrame, audioFrame);
+
+        if (videoFrame)
+            videoFrame->Release();
+        if (audioFrame)
+            audioFrame->Release();
+
+        frames++;
+        qsize = avpacket_queue_size(&queue);
+        if (qsize > peak)
+            peak = qsize;
+
+        if (max_frames_reached())
+            break;
+    }
+
+    total = packets_queued();
+    while (!__atomic_load_n(&replay_stop, __ATOMIC_ACQUIRE) &&
+           __atomic_load_n(&packets_written, __ATOMIC_ACQUIRE) < total)
+        av_usleep(1000);
+
+    elapsed = av_gettime_relative() - start;
+    fprintf(stderr,
+            "Replayed %lu frames in %.3f s, %.2f fps, %.2fx real time, "
+            "up to %.1f MB queued\n",
+            frames, elapsed / 1000000.0,
+            frames * 1000000.0 / FFMAX(elapsed, 1),
+            (double)(last - FFMAX(first, 0)) / FFMAX(elapsed, 1),
+            (double)peak / 1024 / 1024);
+
+    av_free(video);
+    av_free(audio);
+
+    pthread_mutex_lock(&sleepMutex);
+    replay_done = 1;
+    pthread_cond_signal(&sleepCond);
+    pthread_mutex_unlock(&sleepMutex);
+
+    return NULL;
+}
+
+/* -B, a file written from the ring on a trigger */
+typedef struct Clip {
+    AVPacketQueue queue;
+    char filename[1024];
+    int64_t start, end;         /* us on the packet clock */
+    pthread_t thread;
+    struct Clip *next;
+} Clip;
+
+static Clip *clips;
+static int clip_count;
+
+static int64_t packet_time(AVPacket *pkt)
+{
+    AVRational us = { 1, AV_TIME_BASE };
+
+    return av_rescale_q(pkt->pts, oc->streams[pkt->stream_index]->time_base, us);
+}
+
+static AVFormatContext *open_clip(const char *filename)
+{
+    AVFormatContext *s = avformat_alloc_context();
+    AVDictionary *opts = NULL;
+
+    if (!s)
+        return NULL;
+    s->oformat = fmt;
+    snprintf(s->filename, sizeof(s->filename), "%s", filename);
+
+    // the same streams in the same order as the packets
+    add_video_stream(s, fmt->video_codec);
+    add_audio_stream(s, fmt->audio_codec);
+    if (data_st)
+        add_data_stream(s, AV_CODEC_ID_TEXT);
+
+    if (!(fmt->flags & AVFMT_NOFILE) &&
+        avio_open(&s->pb, s->filename, AVIO_FLAG_WRITE) < 0) {
+        fprintf(stderr, "Could not open '%s'\n", s->filename);
+        avformat_free_context(s);
+        return NULL;
+    }
+
+    av_dict_copy(&opts, clip_opts, 0);
+    if (avformat_write_header(s, &opts) < 0) {
+        fprintf(stderr, "Could not write the header of '%s'\n", s->filename);
+        if (!(fmt->flags & AVFMT_NOFILE))
+            avio_close(s->pb);
+        avformat_free_context(s);
+        s = NULL;
+    }
+    av_dict_free(&opts);
+
+    return s;
+}
+
+static void *write_clip(void *ctx)
+{
+    Clip *c = (Clip *)ctx;
+    AVFormatContext *s = open_clip(c->filename);
+    AVRational us = { 1, AV_TIME_BASE };
+    AVPacket pkt;
+    int64_t last = c->start;
+
+    while (avpacket_queue_get(&c->queue, &pkt, 1)) {
+        AVStream *src, *dst;
+        int64_t offset;
+
+        if (!s) {
+            av_packet_unref(&pkt);
+            continue;
+        }
+
+        // the file starts at 0
+        src    = oc->streams[pkt.stream_index];
+        dst    = s->streams[pkt.stream_index];
+        last   = FFMAX(last, packet_time(&pkt));
+        offset = av_rescale_q(c->start, us, src->time_base);
+
+        pkt.pts      = av_rescale_q(pkt.pts - offset, src->time_base, dst->time_base);
+        pkt.dts      = av_rescale_q(pkt.dts - offset, src->time_base, dst->time_base);
+        pkt.duration = av_rescale_q(pkt.duration, src->time_base, dst->time_base);
+        av_interleaved_write_frame(s, &pkt);
+    }
+
+    if (s) {
+        av_write_trailer(s);
+        if (!(fmt->flags & AVFMT_NOFILE))
+            avio_close(s->pb);
+        avformat_free_context(s);
+        fprintf(stderr, "%s: %.1f s written\n", c->filename,
+                (last - c->start) / 1000000.0);
+    }
+    avpacket_queue_end(&c->queue);
+
+    return NULL;
+}
+
+/* the ring goes first, the packets up to -E seconds from now follow */
+static Clip *start_clip(int64_t now)
+{
+    Clip *c = (Clip *)av_mallocz(sizeof(Clip));
+    AVPacketList *p;
+
+    if (!c)
+        return NULL;
+    avpacket_queue_init(&c->queue);
+    av_get_frame_filename(c->filename, sizeof(c->filename),
+                          g_videoOutputFile, clip_count++);
+    c->start = now;
+    c->end   = now + g_posttrigger * 1000000;
+
+    // shared with the ring, not copied
+    pthread_mutex_lock(&ring.mutex);
+    if (ring.first_pkt)
+        c->start = packet_time(&ring.first_pkt->pkt);
+    for (p = ring.first_pkt; p; p = p->next) {
+        AVPacket ref;
+
+        if (av_packet_ref(&ref, &p->pkt) < 0)
+            break;
+        avpacket_queue_put(&c->queue, &ref);
+    }
+    pthread_mutex_unlock(&ring.mutex);
+
+    if (pthread_create(&c->thread, NULL, write_clip, c)) {
+        fprintf(stderr, "Cannot start writing %s\n", c->filename);
+        avpacket_queue_end(&c->queue);
+        av_free(c);
+        return NULL;
+    }
+    c->next = clips;
+    clips   = c;
+
+    fprintf(stderr, "Trigger: %s from %.1f s before, %.1f MB kept\n",
+            c->filename, (now - c->start) / 1000000.0,
+            (double)avpacket_queue_size(&ring) / 1024 / 1024);
+
+    return c;
+}
+
+/*
+ * -B, in place of push_packet: nothing is written until a trigger, then
+ * a thread per clip writes it out while the capture goes on.
+ */
+static void *keep_packets(void *ctx)
+{
+    Clip *clip = NULL;
+    AVPacket pkt;
+
+    while (avpacket_queue_get(&queue, &pkt, 1)) {
+        int64_t now = packet_time(&pkt);
+        AVPacketList *oldest;
+
+        if (__atomic_exchange_n(&trigger, 0, __ATOMIC_ACQ_REL)) {
+            // a trigger while writing makes the clip longer
+            if (clip)
+                clip->end = now + g_posttrigger * 1000000;
+            else
+                clip = start_clip(now);
+        }
+        if (clip && now >= clip->end) {
+            avpacket_queue_put(&clip->queue, &flush_pkt);
+            clip = NULL;
+        }
+        if (clip) {
+            AVPacket ref;
+
+            if (av_packet_ref(&ref, &pkt) >= 0)
+                avpacket_queue_put(&clip->queue, &ref);
+            if (avpacket_queue_size(&clip->queue) > g_memoryLimit)
+                pthread_cond_signal(&sleepCond);
+        }
+
+        avpacket_queue_put(&ring, &pkt);
+        for (;;) {
+            pthread_mutex_lock(&ring.mutex);
+            oldest = ring.first_pkt;
+            pthread_mutex_unlock(&ring.mutex);
+            if (!oldest || packet_time(&oldest->pkt) >= now - g_pretrigger * 1000000)
+                break;
+            avpacket_queue_get(&ring, &pkt, 0);
+            av_packet_unref(&pkt);
+        }
+
+        __atomic_add_fetch(&packets_written, 1, __ATOMIC_RELEASE);
+        if (!replay_file && max_frames_reached())
+            pthread_cond_signal(&sleepCond);
+    }
+
+    if (clip)
+        avpacket_queue_put(&clip->queue, &flush_pkt);
+
+    return NULL;
+}
+
+/* -K, anything written to the socket is a trigger */
+static void *control_thread(void *ctx)
+{
+    char buf[64];
+    int fd;
+
+    while ((fd = accept(control_fd, NULL, NULL)) >= 0) {
+        while (read(fd, buf, sizeof(buf)) > 0)
+            __atomic_store_n(&trigger, 1, __ATOMIC_RELEASE);
+        close(fd);
+    }
+
+    return NULL;
+}
+
+static int open_control(const char *path)
+{
+    struct sockaddr_un addr = { 0 };
+    pthread_t th;
+
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    unlink(path);
+
+    control_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (control_fd < 0 ||
+        bind(control_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(control_fd, 4) < 0 ||
+        pthread_create(&th, NULL, control_thread, NULL)) {
+        fprintf(stderr, "Cannot listen on %s\n", path);
+        return -1;
+    }
+    pthread_detach(th);
+
+    return 0;
+}
+
 static void exit_handler(int sig)
 {
    pthread_cond_signal(&sleepCond);
 }
 
+static void trigger_handler(int sig)
+{
+    __atomic_store_n(&trigger, 1, __ATOMIC_RELEASE);
+}
+
 static void set_signal()
 {
     signal(SIGINT , exit_handler);
     signal(SIGTERM, exit_handler);
     signal(SIGHUP,  exit_handler);
+    if (g_pretrigger > 0)
+        signal(SIGUSR1, trigger_handler);
 }
 
 int main(int argc, char *argv[])
@@ -605,20 +1290,14 @@ int main(int argc, char *argv[])
     AVDictionary *opts = NULL;
     BMDPixelFormat pix = bmdFormat8BitYUV;
     HRESULT result;
-    pthread_t th;
+    pthread_t th, replay_th;
 
     pthread_mutex_init(&sleepMutex, NULL);
     pthread_cond_init(&sleepCond, NULL);
     av_register_all();
 
-    if (!deckLinkIterator) {
-        fprintf(stderr,
-                "This application requires the DeckLink drivers installed.\n");
-        goto bail;
-    }
-
     // Parse command line options
-    while ((ch = getopt(argc, argv, "?hvc:s:f:a:m:n:p:M:F:C:A:V:o:w:S:d:")) != -1) {
+    while ((ch = getopt(argc, argv, "?hvc:s:f:a:m:n:p:M:F:C:A:V:o:w:S:d:T:R:XB:E:K:P:D:")) != -1) {
         switch (ch) {
         case 'v':
             g_verbose = true;
@@ -695,6 +1374,12 @@ int main(int argc, char *argv[])
         case 'f':
             g_videoOutputFile = optarg;
             break;
+        case 'a':
+            g_audioOutputFile = optarg;
+            break;
+        case 'D':
+            g_dataOutputFile = optarg;
+            break;
         case 'n':
             g_maxFrames = atoi(optarg);
             break;
@@ -729,6 +1414,27 @@ int main(int argc, char *argv[])
         case 'd':
             draw_bars = atoi(optarg);
             break;
+        case 'T':
+            g_traceFile = optarg;
+            break;
+        case 'R':
+            replay_file = optarg;
+            break;
+        case 'X':
+            replay_fast = 1;
+            break;
+        case 'B':
+            g_pretrigger = atof(optarg);
+            break;
+        case 'E':
+            g_posttrigger = atof(optarg);
+            break;
+        case 'K':
+            g_controlSocket = optarg;
+            break;
+        case 'P':
+            g_busName = optarg;
+            break;
         case '?':
         case 'h':
             usage(0);
@@ -742,6 +1448,89 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
+    if (!g_videoOutputFile && !g_busName) {
+        fprintf(stderr,
+                "Missing argument: Please specify output path using -f\n");
+        goto bail;
+    }
+
+    if ((g_audioOutputFile || g_dataOutputFile) &&
+        (!g_videoOutputFile || g_pretrigger > 0)) {
+        fprintf(stderr, "-a and -D need -f and do not go with -B\n");
+        goto bail;
+    }
+
+    if (g_dataOutputFile && serial_fd <= 0 && !wallclock) {
+        fprintf(stderr, "-D needs a data stream, -S or -w\n");
+        goto bail;
+    }
+
+    if (!fmt && g_videoOutputFile) {
+        fmt = av_guess_format(NULL, g_videoOutputFile, NULL);
+        if (!fmt) {
+            fprintf(
+                stderr,
+                "Unable to guess output format, please specify explicitly using -F\n");
+            goto bail;
+        }
+    }
+
+    if (g_pretrigger > 0) {
+        char filename[1024];
+
+        if (!g_videoOutputFile ||
+            av_get_frame_filename(filename, sizeof(filename),
+                                  g_videoOutputFile, 0) < 0) {
+            fprintf(stderr,
+                    "-f needs a %%d for the number of the file with -B\n");
+            goto bail;
+        }
+        if (g_controlSocket && open_control(g_controlSocket) < 0)
+            goto bail;
+    }
+
+    if (replay_file) {
+        replay_trace = trace_open(replay_file, &replay_header);
+        if (!replay_trace) {
+            fprintf(stderr, "Cannot read the trace %s\n", replay_file);
+            goto bail;
+        }
+
+        pix = replay_header.pixel_format;
+        switch (pix) {
+        case bmdFormat8BitYUV:
+            pix_fmt = AV_PIX_FMT_UYVY422;
+            break;
+        case bmdFormat10BitYUV:
+            pix_fmt = AV_PIX_FMT_YUV422P10;
+            break;
+        case bmdFormat10BitRGB:
+            pix_fmt = AV_PIX_FMT_RGB48;
+            break;
+        case bmdFormat8BitARGB:
+            pix_fmt = AV_PIX_FMT_ARGB;
+            break;
+        default:
+            fprintf(stderr, "Unsupported pixel format in the trace\n");
+            goto bail;
+        }
+
+        g_audioChannels    = replay_header.audio_channels;
+        g_audioSampleDepth = replay_header.audio_depth;
+        sample_fmt         = g_audioSampleDepth == 32 ? AV_SAMPLE_FMT_S32
+                                                      : AV_SAMPLE_FMT_S16;
+
+        displayMode = trace_display_mode(&replay_header);
+        delegate    = new DeckLinkCaptureDelegate();
+        goto output;
+    }
+
+    if (!deckLinkIterator) {
+        fprintf(stderr,
+                "This application requires the DeckLink drivers installed.\n");
+        goto bail;
+    }
+
     /* Connect to the first DeckLink instance */
     do
         result = deckLinkIterator->Next(&deckLink);
@@ -829,22 +1618,6 @@ int main(int argc, char *argv[])
         goto bail;
     }
 
-    if (!g_videoOutputFile) {
-        fprintf(stderr,
-                "Missing argument: Please specify output path using -f\n");
-        goto bail;
-    }
-
-    if (!fmt) {
-        fmt = av_guess_format(NULL, g_videoOutputFile, NULL);
-        if (!fmt) {
-            fprintf(
-                stderr,
-                "Unable to guess output format, please specify explicitly using -F\n");
-            goto bail;
-        }
-    }
-
     if (g_videoModeIndex < 0) {
         fprintf(stderr, "No video mode specified\n");
         usage(0);
@@ -877,6 +1650,50 @@ int main(int argc, char *argv[])
         goto bail;
     }
 
+output:
+    if (g_traceFile) {
+        TraceHeader h = { { 0 } };
+
+        displayMode->GetFrameRate(&h.frame_duration, &h.time_scale);
+        h.pixel_format   = pix;
+        h.width          = displayMode->GetWidth();
+        h.height         = displayMode->GetHeight();
+        h.audio_channels = g_audioChannels;
+        h.audio_depth    = g_audioSampleDepth;
+
+        trace_file = trace_create(g_traceFile, &h);
+        if (!trace_file) {
+            fprintf(stderr, "Cannot create the trace %s\n", g_traceFile);
+            goto bail;
+        }
+    }
+
+    if (g_busName) {
+        FrameBusFormat f = { 0 };
+
+        displayMode->GetFrameRate(&frameRateDuration, &frameRateScale);
+        f.pixel_format   = pix;
+        f.width          = displayMode->GetWidth();
+        f.height         = displayMode->GetHeight();
+        f.row_bytes      = row_bytes(pix, f.width);
+        f.frame_duration = frameRateDuration;
+        f.time_scale     = frameRateScale;
+        f.audio_channels = g_audioChannels;
+        f.audio_depth    = g_audioSampleDepth;
+        f.video_size     = f.row_bytes * f.height;
+        f.audio_size     = 2 * ((48000 * frameRateDuration + frameRateScale - 1) /
+                                frameRateScale) *
+                           g_audioChannels * (g_audioSampleDepth / 8);
+
+        bus = framebus_create(g_busName, &f, kBusSlots);
+        if (!bus)
+            goto bail;
+    }
+
+    // the bus alone needs no muxer
+    if (!g_videoOutputFile)
+        goto start;
+
     oc          = avformat_alloc_context();
     oc->oformat = fmt;
 
@@ -899,38 +1716,100 @@ int main(int argc, char *argv[])
     fmt->audio_codec = (sample_fmt == AV_SAMPLE_FMT_S16 ? AV_CODEC_ID_PCM_S16LE : AV_CODEC_ID_PCM_S32LE);
 
     video_st = add_video_stream(oc, fmt->video_codec);
-    audio_st = add_audio_stream(oc, fmt->audio_codec);
+    if (!g_audioOutputFile)
+        audio_st = add_audio_stream(oc, fmt->audio_codec);
 
-    if (serial_fd > 0 || wallclock)
+    if ((serial_fd > 0 || wallclock) && !g_dataOutputFile)
         data_st = add_data_stream(oc, AV_CODEC_ID_TEXT);
 
-    if (!(fmt->flags & AVFMT_NOFILE)) {
-        if (avio_open(&oc->pb, oc->filename, AVIO_FLAG_WRITE) < 0) {
-            fprintf(stderr, "Could not open '%s'\n", oc->filename);
-            exit(1);
+    if (g_pretrigger > 0) {
+        // only times the packets, each clip gets its own
+        audio_st->time_base.num = 1;
+        audio_st->time_base.den = 48000;
+        clip_opts = opts;
+        avpacket_queue_init(&ring);
+    } else {
+        if (!(fmt->flags & AVFMT_NOFILE)) {
+            if (!strcmp(oc->filename, "pipe:1") ||
+                !strcmp(oc->filename, "pipe:")) {
+                oc->pb   = pipeout_open(1, kPipeSize);
+                pipe_out = oc->pb != NULL;
+            }
+            if (!strncmp(oc->filename, "udp://", 6) ||
+                !strncmp(oc->filename, "rtp://", 6)) {
+                long frame_size = row_bytes(pix, displayMode->GetWidth()) *
+                                  displayMode->GetHeight();
+
+                oc->pb = udpout_open(oc->filename,
+                                     frameRateDuration * 1000000 / frameRateScale,
+                                     kUdpQueue * frame_size);
+                if (!oc->pb)
+                    exit(1);
+                udp_out = 1;
+            }
+            if (!pipe_out && !udp_out &&
+                avio_open(&oc->pb, oc->filename, AVIO_FLAG_WRITE) < 0) {
+                fprintf(stderr, "Could not open '%s'\n", oc->filename);
+                exit(1);
+            }
         }
+
+        avformat_write_header(oc, &opts);
+
+        if (g_audioOutputFile && open_audio_output(g_audioOutputFile) < 0)
+            goto bail;
+        if (g_dataOutputFile && open_data_output(g_dataOutputFile) < 0)
+            goto bail;
     }
 
-    avformat_write_header(oc, &opts);
+start:
     avpacket_queue_init(&queue);
 
-    result = deckLinkInput->StartStreams();
-    if (result != S_OK) {
-        goto bail;
+    if (replay_file) {
+        if (pthread_create(&replay_th, NULL, replay_frames, delegate))
+            goto bail;
+    } else {
+        result = deckLinkInput->StartStreams();
+        if (result != S_OK) {
+            goto bail;
+        }
     }
     // All Okay.
     exitStatus = 0;
 
-    if (pthread_create(&th, NULL, push_packet, oc))
+    if (oc && pthread_create(&th, NULL,
+                             g_pretrigger > 0 ? keep_packets : push_packet, oc))
         goto bail;
 
     // Block main thread until signal occurs
     pthread_mutex_lock(&sleepMutex);
     set_signal();
-    pthread_cond_wait(&sleepCond, &sleepMutex);
+    if (!replay_done)
+        pthread_cond_wait(&sleepCond, &sleepMutex);
     pthread_mutex_unlock(&sleepMutex);
-    deckLinkInput->StopStreams();
+    if (replay_file) {
+        __atomic_store_n(&replay_stop, 1, __ATOMIC_RELEASE);
+        pthread_join(replay_th, NULL);
+    } else {
+        deckLinkInput->StopStreams();
+    }
     fprintf(stderr, "Stopping Capture\n");
+    // what is queued is written, and the writer is done with oc->pb
+    if (oc) {
+        avpacket_queue_put(&queue, &flush_pkt);
+        pthread_join(th, NULL);
+    }
+    if (g_pretrigger > 0) {
+        // the clip being written is cut here, the others finish
+        while (clips) {
+            Clip *c = clips;
+
+            pthread_join(c->thread, NULL);
+            clips = c->next;
+            av_free(c);
+        }
+        avpacket_queue_end(&ring);
+    }
     avpacket_queue_end(&queue);
 
 bail:
@@ -953,9 +1832,31 @@ bail:
         deckLinkIterator->Release();
     }
 
-    if (oc != NULL) {
+    if (trace_file)
+        fclose(trace_file);
+    if (replay_trace)
+        fclose(replay_trace);
+
+    framebus_close(bus);
+
+    close_stream_output(&audio_out);
+    close_stream_output(&data_out);
+
+    if (control_fd >= 0) {
+        shutdown(control_fd, SHUT_RDWR);
+        close(control_fd);
+        unlink(g_controlSocket);
+    }
+
+    if (oc != NULL && g_pretrigger > 0) {
+        avformat_free_context(oc);
+    } else if (oc != NULL) {
         av_write_trailer(oc);
-        if (!(fmt->flags & AVFMT_NOFILE)) {
+        if (pipe_out) {
+            pipeout_close(&oc->pb);
+        } else if (udp_out) {
+            udpout_close(&oc->pb);
+        } else if (!(fmt->flags & AVFMT_NOFILE)) {
             /* close the output file */
             avio_close(oc->pb);
         }
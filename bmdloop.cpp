@@ -0,0 +1,1210 @@
+/*
+ * Blackmagic Devices Decklink capture to playout loop
+ * Copyright (c) 2026 the bmdtools authors.
+ *
+ * This file is part of bmdtools.
+ *
+ * bmdtools is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * bmdtools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with bmdtools; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * The input frames are scheduled on the output as they are, no copy nor
+ * conversion.  Each output slot takes the input frame captured a fixed
+ * number of frames before it goes on air, measured on the output clock:
+ * frames are repeated or skipped when the input and the output clocks
+ * drift apart by more than a quarter of a frame either way.
+ *
+ * With -t the frames go through a file instead, the delay can then be
+ * minutes long and is changed from stdin while the output runs.
+ */
+
+#include <inttypes.h>
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <signal.h>
+#include <errno.h>
+#include <poll.h>
+
+#include "compat.h"
+#include "DeckLinkAPI.h"
+#include "Capture.h"
+#include "modes.h"
+#include "timeshift.h"
+
+static const int kMaxHeld    = 16;  // input frames held back, the driver lends a few more
+static const int kMaxPending = 16;  // output frames scheduled and not completed
+static const int kReadAhead  = 8;   // -t, frames read before their slot
+static const int kPlayFrames = kReadAhead + kMaxPending + 2;
+
+struct HeldFrame {
+    IDeckLinkVideoInputFrame *video;
+    IDeckLinkAudioInputPacket *audio;
+    int64_t arrival;                // us on the host clock
+};
+
+struct PendingSlot {
+    unsigned long slot;
+    int64_t arrival;
+};
+
+// -t, an output frame read back from the file
+struct PlayFrame {
+    IDeckLinkMutableVideoFrame *video;
+    uint8_t *audio;
+    TimeshiftFrame info;
+    unsigned long slot;             // read for this output slot
+    int scheduled;                  // on the output and not completed
+    bool busy;                      // being read, ready or shown
+};
+
+// what goes out in a slot
+struct SlotSource {
+    IDeckLinkVideoFrame *video;
+    void *audio;
+    uint32_t samples;
+    int64_t arrival;
+    int play;                       // -t frame, -1 otherwise
+    bool fresh;
+};
+
+class LoopOutput : public IDeckLinkVideoOutputCallback
+{
+public:
+    // IUnknown needs only a dummy implementation
+    virtual HRESULT STDMETHODCALLTYPE QueryInterface(REFIID iid, LPVOID *ppv) { return E_NOINTERFACE; }
+    virtual ULONG STDMETHODCALLTYPE AddRef(void) { return 1; }
+    virtual ULONG STDMETHODCALLTYPE Release(void) { return 1; }
+
+    virtual HRESULT STDMETHODCALLTYPE ScheduledFrameCompleted(IDeckLinkVideoFrame *completedFrame,
+                                                              BMDOutputFrameCompletionResult result);
+    virtual HRESULT STDMETHODCALLTYPE ScheduledPlaybackHasStopped(void);
+};
+
+static pthread_mutex_t loopMutex;
+static pthread_cond_t loopCond;
+static volatile sig_atomic_t stopping;
+
+static int g_videoModeIndex   = -1;
+static int g_audioChannels    = 2;
+static int g_audioSampleDepth = 16;
+static int g_delay            = 3;
+static int g_ahead            = 2;
+static bool g_verbose         = false;
+static FILE *latency_log;
+
+static IDeckLinkInput *deckLinkInput;
+static IDeckLinkOutput *deckLinkOutput;
+static BMDTimeValue frameDuration;
+static BMDTimeScale frameTimescale;
+
+// Everything below is under loopMutex
+static HeldFrame held[kMaxHeld];
+static int heldFirst, heldCount;
+static unsigned long framesIn;
+
+static HeldFrame shown;             // the last scheduled, repeated if nothing is due
+static bool haveShown;
+static PendingSlot pending[kMaxPending];
+static int pendingFirst, pendingCount;
+static unsigned long nextSlot;
+static bool playing;
+static int64_t origin;              // host time of the stream time 0
+static bool originKnown;
+static int64_t audioNext = -1;      // sample contiguous to the last scheduled
+
+static unsigned long framesShown, framesRepeated, framesSkipped;
+static unsigned long framesLate, framesDroppedOut;
+
+struct LatencyStats {
+    int64_t min, max, sum;
+    unsigned long count;
+};
+
+static LatencyStats latencyTotal, latencyPeriod;
+static int minDelay, maxDelay;
+
+// -t, under loopMutex as well
+static Timeshift *timeshift;
+static pthread_cond_t readCond;
+static size_t videoBytes, audioBytes;
+static PlayFrame play[kPlayFrames];
+static int ready[kReadAhead];
+static int readyFirst, readyCount;
+static int shownPlay = -1;
+static unsigned long readSlot;      // the slot read for next
+static uint64_t readIndex;          // the frame read last
+static bool readStarted;
+static unsigned delayGeneration;
+static bool haveInput;
+static uint64_t lastIndex;          // the newest frame captured
+static int64_t firstArrival, lastArrival;
+static unsigned long underruns;
+
+static int64_t now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static int64_t slot_us(int64_t slots)
+{
+    return slots * frameDuration * 1000000 / frameTimescale;
+}
+
+static void latency_add(LatencyStats *s, int64_t latency)
+{
+    if (!s->count || latency < s->min)
+        s->min = latency;
+    if (!s->count || latency > s->max)
+        s->max = latency;
+    s->sum += latency;
+    s->count++;
+}
+
+static void release_held(HeldFrame *f)
+{
+    if (f->video)
+        f->video->Release();
+    if (f->audio)
+        f->audio->Release();
+    f->video = NULL;
+    f->audio = NULL;
+}
+
+/* with loopMutex held */
+static void drop_oldest(void)
+{
+    release_held(&held[heldFirst]);
+    heldFirst = (heldFirst + 1) % kMaxHeld;
+    heldCount--;
+}
+
+/* with loopMutex held, follow the output clock on the host clock */
+static void update_origin(void)
+{
+    BMDTimeValue streamTime;
+    double speed;
+    int64_t sample;
+
+    if (deckLinkOutput->GetScheduledStreamTime(1000000, &streamTime,
+                                               &speed) != S_OK || speed <= 0)
+        return;
+
+    sample = now_us() - streamTime;
+    if (!originKnown)
+        origin = sample;
+    else
+        origin += (sample - origin) / 16;
+    originKnown = true;
+}
+
+/* with loopMutex held */
+static bool pick_held(SlotSource *src)
+{
+    int64_t target  = origin + slot_us(nextSlot) - slot_us(g_delay - 1);
+    int64_t half    = slot_us(1) / 2;
+    int64_t quarter = slot_us(1) / 4;
+    bool fresh      = false;
+
+    // only what surely arrived by now, or the frames racing the
+    // scheduling are skipped and repeated in turn
+    if (target > now_us() - half - quarter)
+        target = now_us() - half - quarter;
+
+    if (!playing) {
+        // preroll on the newest one, the timeline is not there yet
+        while (heldCount > 1) {
+            drop_oldest();
+            framesSkipped++;
+        }
+        fresh = heldCount > 0;
+    } else if (heldCount && held[heldFirst].arrival <= target + half + quarter) {
+        // the input got ahead of the output, catch up
+        while (heldCount > 1 &&
+               held[(heldFirst + 1) % kMaxHeld].arrival <= target + half - quarter) {
+            drop_oldest();
+            framesSkipped++;
+        }
+        fresh = true;
+    }
+
+    if (fresh) {
+        release_held(&shown);
+        shown     = held[heldFirst];
+        haveShown = true;
+        heldFirst = (heldFirst + 1) % kMaxHeld;
+        heldCount--;
+    }
+
+    if (!haveShown)
+        return false;
+
+    src->video   = shown.video;
+    src->audio   = NULL;
+    src->samples = 0;
+    if (fresh && shown.audio) {
+        shown.audio->GetBytes(&src->audio);
+        src->samples = shown.audio->GetSampleFrameCount();
+    }
+    src->arrival = shown.arrival;
+    src->play    = -1;
+    src->fresh   = fresh;
+
+    return true;
+}
+
+/* with loopMutex held, what the reader got for the slot */
+static bool pick_timeshift(SlotSource *src)
+{
+    PlayFrame *p;
+    bool fresh = false;
+
+    while (readyCount && play[ready[readyFirst]].slot < nextSlot) {
+        play[ready[readyFirst]].busy = false;
+        readyFirst = (readyFirst + 1) % kReadAhead;
+        readyCount--;
+    }
+
+    if (readyCount && play[ready[readyFirst]].slot == nextSlot) {
+        if (shownPlay >= 0)
+            play[shownPlay].busy = false;
+        shownPlay  = ready[readyFirst];
+        readyFirst = (readyFirst + 1) % kReadAhead;
+        readyCount--;
+        fresh      = true;
+        pthread_cond_signal(&readCond);
+    } else if (playing) {
+        underruns++;
+    }
+
+    if (shownPlay < 0)
+        return false;
+
+    p = &play[shownPlay];
+    src->video   = p->video;
+    src->audio   = fresh ? p->audio : NULL;
+    src->samples = fresh ? p->info.audio_samples : 0;
+    src->arrival = p->info.arrival;
+    src->play    = shownPlay;
+    src->fresh   = fresh;
+
+    return true;
+}
+
+/* with loopMutex held, false if nothing could be scheduled */
+static bool schedule_slot(void)
+{
+    SlotSource src;
+
+    if (pendingCount == kMaxPending ||
+        !(timeshift ? pick_timeshift(&src) : pick_held(&src)))
+        return false;
+
+    if (deckLinkOutput->ScheduleVideoFrame(src.video,
+                                           nextSlot * frameDuration,
+                                           frameDuration,
+                                           frameTimescale) != S_OK) {
+        fprintf(stderr, "Cannot schedule slot %lu\n", nextSlot);
+        nextSlot++;
+        return false;
+    }
+    if (src.play >= 0)
+        play[src.play].scheduled++;
+
+    if (src.audio && src.samples) {
+        int64_t start = nextSlot * frameDuration * 48000 / frameTimescale;
+
+        // the packets of consecutive frames are played back to back
+        if (audioNext >= 0 && llabs(audioNext - start) < src.samples / 2)
+            start = audioNext;
+        deckLinkOutput->ScheduleAudioSamples(src.audio, src.samples, start,
+                                             48000, NULL);
+        audioNext = start + src.samples;
+    } else if (!src.fresh) {
+        audioNext = -1;
+        framesRepeated++;
+    }
+    if (shown.audio) {
+        shown.audio->Release();
+        shown.audio = NULL;
+    }
+
+    pending[(pendingFirst + pendingCount) % kMaxPending].slot    = nextSlot;
+    pending[(pendingFirst + pendingCount) % kMaxPending].arrival = src.arrival;
+    pendingCount++;
+    nextSlot++;
+
+    return true;
+}
+
+HRESULT LoopOutput::ScheduledFrameCompleted(IDeckLinkVideoFrame *completedFrame,
+                                            BMDOutputFrameCompletionResult result)
+{
+    pthread_mutex_lock(&loopMutex);
+
+    if (playing)
+        update_origin();
+
+    for (int i = 0; timeshift && i < kPlayFrames; i++) {
+        if (play[i].scheduled && play[i].video == completedFrame) {
+            play[i].scheduled--;
+            pthread_cond_signal(&readCond);
+            break;
+        }
+    }
+
+    if (pendingCount) {
+        PendingSlot p = pending[pendingFirst];
+        // from the end of the capture of the frame to the start of its display
+        int64_t latency = origin + slot_us(p.slot) - p.arrival + slot_us(1);
+
+        pendingFirst = (pendingFirst + 1) % kMaxPending;
+        pendingCount--;
+
+        switch (result) {
+        case bmdOutputFrameDisplayedLate:
+            framesLate++;
+            // fall through
+        case bmdOutputFrameCompleted:
+            framesShown++;
+            latency_add(&latencyTotal, latency);
+            latency_add(&latencyPeriod, latency);
+            if (latency_log)
+                fprintf(latency_log, "%lu %" PRId64 " %" PRId64 "%s\n",
+                        p.slot, p.arrival, latency,
+                        result == bmdOutputFrameDisplayedLate ? " late" : "");
+            break;
+        case bmdOutputFrameDropped:
+            framesDroppedOut++;
+            break;
+        default:
+            break;
+        }
+    }
+
+    if (playing && !stopping) {
+        while (pendingCount < g_ahead + 1 && schedule_slot())
+            ;
+    }
+
+    pthread_mutex_unlock(&loopMutex);
+
+    return S_OK;
+}
+
+HRESULT LoopOutput::ScheduledPlaybackHasStopped(void)
+{
+    pthread_mutex_lock(&loopMutex);
+    playing = false;
+    pthread_cond_signal(&loopCond);
+    pthread_mutex_unlock(&loopMutex);
+
+    return S_OK;
+}
+
+DeckLinkCaptureDelegate::DeckLinkCaptureDelegate() : m_refCount(0)
+{
+    pthread_mutex_init(&m_mutex, NULL);
+}
+
+DeckLinkCaptureDelegate::~DeckLinkCaptureDelegate()
+{
+    pthread_mutex_destroy(&m_mutex);
+}
+
+ULONG DeckLinkCaptureDelegate::AddRef(void)
+{
+    pthread_mutex_lock(&m_mutex);
+    m_refCount++;
+    pthread_mutex_unlock(&m_mutex);
+
+    return (ULONG)m_refCount;
+}
+
+ULONG DeckLinkCaptureDelegate::Release(void)
+{
+    pthread_mutex_lock(&m_mutex);
+    m_refCount--;
+    pthread_mutex_unlock(&m_mutex);
+
+    if (m_refCount == 0) {
+        delete this;
+        return 0;
+    }
+
+    return (ULONG)m_refCount;
+}
+
+HRESULT DeckLinkCaptureDelegate::VideoInputFrameArrived(
+    IDeckLinkVideoInputFrame *videoFrame, IDeckLinkAudioInputPacket *audioFrame)
+{
+    int64_t arrival = now_us();
+    HeldFrame *f;
+
+    if (!videoFrame)
+        return S_OK;
+
+    if (timeshift) {
+        TimeshiftFrame f = { 0 };
+        void *video, *audio = NULL;
+        size_t bytes = 0;
+        int ret = -1;
+
+        if ((size_t)videoFrame->GetRowBytes() * videoFrame->GetHeight() == videoBytes) {
+            videoFrame->GetBytes(&video);
+            f.arrival = arrival;
+            f.flags   = videoFrame->GetFlags();
+            if (audioFrame) {
+                audioFrame->GetBytes(&audio);
+                f.audio_samples = audioFrame->GetSampleFrameCount();
+                bytes           = (size_t)f.audio_samples * g_audioChannels *
+                                  (g_audioSampleDepth / 8);
+                if (bytes > audioBytes) {
+                    bytes           = audioBytes;
+                    f.audio_samples = audioBytes / (g_audioChannels *
+                                                    (g_audioSampleDepth / 8));
+                }
+            }
+            ret = timeshift_put(timeshift, &f, video, audio, bytes);
+        }
+
+        pthread_mutex_lock(&loopMutex);
+        framesIn++;
+        if (!ret) {
+            if (!haveInput)
+                firstArrival = arrival;
+            haveInput   = true;
+            lastIndex   = f.index;
+            lastArrival = arrival;
+        } else {
+            framesSkipped++;
+        }
+        pthread_cond_signal(&loopCond);
+        pthread_mutex_unlock(&loopMutex);
+
+        return S_OK;
+    }
+
+    // kept until the output is done with it, no copy
+    videoFrame->AddRef();
+    if (audioFrame)
+        audioFrame->AddRef();
+
+    pthread_mutex_lock(&loopMutex);
+    if (heldCount == kMaxHeld) {
+        drop_oldest();
+        framesSkipped++;
+    }
+    f = &held[(heldFirst + heldCount) % kMaxHeld];
+    f->video   = videoFrame;
+    f->audio   = audioFrame;
+    f->arrival = arrival;
+    heldCount++;
+    framesIn++;
+    pthread_cond_signal(&loopCond);
+    pthread_mutex_unlock(&loopMutex);
+
+    return S_OK;
+}
+
+HRESULT DeckLinkCaptureDelegate::VideoInputFormatChanged(
+    BMDVideoInputFormatChangedEvents events, IDeckLinkDisplayMode *mode,
+    BMDDetectedVideoInputFormatFlags)
+{
+    return S_OK;
+}
+
+/* with loopMutex held, a frame of the pool nobody uses */
+static int free_play_frame(void)
+{
+    for (int i = 0; i < kPlayFrames; i++)
+        if (!play[i].busy && !play[i].scheduled)
+            return i;
+    return -1;
+}
+
+/*
+ * with loopMutex held, the frame captured -d frames before the slot goes
+ * on air: the one after the last read, unless that is off by more than
+ * three quarters of a frame, the clocks drifted or the delay changed
+ */
+static bool timeshift_index(unsigned long slot, uint64_t *index)
+{
+    double want;
+    int64_t i;
+
+    if (!haveInput)
+        return false;
+
+    want = lastIndex + (double)(origin + slot_us(slot) - slot_us(g_delay - 1) -
+                                lastArrival) / slot_us(1);
+    i    = readStarted ? (int64_t)readIndex + 1 : llround(want);
+    if (fabs(want - i) > 0.75)
+        i = llround(want);
+
+    // not captured yet
+    if (i > (int64_t)lastIndex)
+        return false;
+    if (i < (int64_t)timeshift_oldest(timeshift))
+        i = timeshift_oldest(timeshift);
+    *index = i;
+
+    return true;
+}
+
+/* with loopMutex held */
+static void wait_read(int64_t us)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += us * 1000;
+    ts.tv_sec  += ts.tv_nsec / 1000000000;
+    ts.tv_nsec %= 1000000000;
+    pthread_cond_timedwait(&readCond, &loopMutex, &ts);
+}
+
+/* -t, reads the frames of the next slots back from the file */
+static void *timeshift_reader(void *arg)
+{
+    pthread_mutex_lock(&loopMutex);
+    while (!stopping) {
+        unsigned generation = delayGeneration;
+        unsigned long slot;
+        uint64_t index;
+        PlayFrame *p;
+        void *bytes;
+        int n, ret;
+
+        if (readSlot < nextSlot)
+            readSlot = nextSlot;
+        slot = readSlot;
+
+        n = free_play_frame();
+        if (readyCount == kReadAhead || n < 0 || !timeshift_index(slot, &index)) {
+            wait_read(5000);
+            continue;
+        }
+
+        p       = &play[n];
+        p->busy = true;
+        pthread_mutex_unlock(&loopMutex);
+
+        p->video->GetBytes(&bytes);
+        ret = timeshift_read(timeshift, index, &p->info, bytes, p->audio);
+
+        pthread_mutex_lock(&loopMutex);
+        // not on disk yet, or the delay changed meanwhile
+        if (ret < 0 || generation != delayGeneration) {
+            p->busy = false;
+            if (ret < 0)
+                wait_read(5000);
+            continue;
+        }
+
+        p->slot = slot;
+        ready[(readyFirst + readyCount) % kReadAhead] = n;
+        readyCount++;
+        readSlot    = slot + 1;
+        readIndex   = index;
+        readStarted = true;
+        pthread_cond_signal(&loopCond);
+    }
+    pthread_mutex_unlock(&loopMutex);
+
+    return NULL;
+}
+
+/* frames, or seconds with an s after them, -1 if neither */
+static int parse_delay(const char *arg, int *frames)
+{
+    char *end;
+    double value = strtod(arg, &end);
+
+    if (end == arg)
+        return -1;
+    if (*end == 's')
+        value = value * frameTimescale / frameDuration;
+    *frames = lrint(value);
+
+    return 0;
+}
+
+/* with loopMutex held */
+static void set_delay(int delay)
+{
+    if (delay < minDelay)
+        delay = minDelay;
+    if (delay > maxDelay)
+        delay = maxDelay;
+    g_delay = delay;
+
+    // a cut after what is scheduled already
+    if (timeshift) {
+        while (readyCount) {
+            play[ready[readyFirst]].busy = false;
+            readyFirst = (readyFirst + 1) % kReadAhead;
+            readyCount--;
+        }
+        delayGeneration++;
+        readSlot    = nextSlot;
+        readStarted = false;
+        pthread_cond_signal(&readCond);
+    }
+
+    fprintf(stderr, "Delay %d frames, %.2f s\n", g_delay,
+            slot_us(g_delay) / 1000000.0);
+}
+
+/* a delay per line, +/- to change it by that much */
+static bool read_delay(void)
+{
+    static char line[64];
+    static size_t len;
+    char *eol;
+    ssize_t n;
+
+    n = read(0, line + len, sizeof(line) - 1 - len);
+    if (n <= 0)
+        return false;
+    len      += n;
+    line[len] = 0;
+
+    while ((eol = strchr(line, '\n'))) {
+        int frames;
+
+        *eol = 0;
+        if (!parse_delay(line, &frames)) {
+            pthread_mutex_lock(&loopMutex);
+            set_delay(line[0] && strchr("+-", line[0]) ? g_delay + frames : frames);
+            pthread_mutex_unlock(&loopMutex);
+        } else if (line[0]) {
+            fprintf(stderr, "Cannot parse the delay %s\n", line);
+        }
+        len -= eol + 1 - line;
+        memmove(line, eol + 1, len + 1);
+    }
+    // too long to be a delay
+    if (len == sizeof(line) - 1)
+        len = 0;
+
+    return true;
+}
+
+static void report(LatencyStats *s)
+{
+    double frame = slot_us(1);
+
+    fprintf(stderr,
+            "In %lu Out %lu Repeated %lu Skipped %lu Late %lu Dropped %lu",
+            framesIn, framesShown, framesRepeated, framesSkipped,
+            framesLate, framesDroppedOut);
+    if (timeshift)
+        fprintf(stderr, " Underruns %lu", underruns);
+    if (s->count)
+        fprintf(stderr, " Latency %.2f/%.2f/%.2f frames (min/avg/max)",
+                s->min / frame, (double)s->sum / s->count / frame,
+                s->max / frame);
+    fprintf(stderr, "\n");
+}
+
+int usage(int status)
+{
+    HRESULT result;
+    IDeckLinkIterator *deckLinkIterator;
+    IDeckLink *deckLink;
+    int numDevices = 0;
+
+    fprintf(stderr,
+            "Usage: bmdloop -m <mode id> [OPTIONS]\n"
+            "\n"
+            "    -m <mode id>:\n"
+            );
+
+    // Create an IDeckLinkIterator object to enumerate all DeckLink cards in the system
+    deckLinkIterator = CreateDeckLinkIteratorInstance();
+    if (deckLinkIterator == NULL) {
+        fprintf(
+            stderr,
+            "A DeckLink iterator could not be created.  The DeckLink drivers may not be installed.\n");
+        return 1;
+    }
+
+    // Enumerate all cards in this system
+    while (deckLinkIterator->Next(&deckLink) == S_OK) {
+        BMDProbeString str;
+        // Increment the total number of DeckLink cards found
+        numDevices++;
+        if (numDevices > 1) {
+            printf("\n\n");
+        }
+
+        // Print the model name of the DeckLink card
+        result = deckLink->GetModelName(&str);
+        if (result == S_OK) {
+            printf("-> %s (-C %d )\n\n",
+                   ToStr(str),
+                   numDevices - 1);
+            FreeStr(str);
+        }
+
+        print_input_modes(deckLink);
+        // Release the IDeckLink instance when we've finished with it to prevent leaks
+        deckLink->Release();
+    }
+    deckLinkIterator->Release();
+
+    // If no DeckLink cards were found in the system, inform the user
+    if (numDevices == 0) {
+        printf("No Blackmagic Design devices were found.\n");
+    }
+    printf("\n");
+
+    fprintf(
+        stderr,
+        "    -v                   Report each frame latency\n"
+        "    -C <num>             number of card to capture from\n"
+        "    -O <num>             number of card to play out to (default is -C)\n"
+        "    -p <pixel>           PixelFormat (yuv8, yuv10, rgb10)\n"
+        "    -c <channels>        Audio Channels (2, 8 or 16 - default is 2)\n"
+        "    -s <depth>           Audio Sample Depth (16 or 32 - default is 16)\n"
+        "    -d <frames>          Delay from capture to display (default is 3)\n"
+        "    -b <frames>          Frames scheduled ahead on the output (default is 2)\n"
+        "    -L <file>            Log the latency of each frame shown\n"
+        "    -t <file>            Go through a file, the delay can be minutes\n"
+        "    -l <seconds>         Length of the -t file (default is 60 or twice -d)\n"
+        "Play out the captured video and audio a fixed number of frames later.\n"
+        "-d takes frames or seconds with an s after them, a new one can be given\n"
+        "on stdin while playing out, with + or - to change it by that much.\n"
+        "\n"
+        "    bmdloop -m 7 -C 0 -O 1 -d 2 -b 1\n"
+        "    bmdloop -m 7 -C 0 -O 1 -t /var/tmp/timeshift -l 600 -d 300s\n\n\n"
+        );
+
+    exit(status);
+}
+
+static IDeckLink *get_device(IDeckLinkIterator *deckLinkIterator, int index)
+{
+    IDeckLink *deckLink = NULL;
+
+    for (int i = 0; i <= index; i++) {
+        if (deckLink)
+            deckLink->Release();
+        if (deckLinkIterator->Next(&deckLink) != S_OK)
+            return NULL;
+    }
+
+    return deckLink;
+}
+
+static void exit_handler(int sig)
+{
+    stopping = 1;
+    pthread_cond_signal(&loopCond);
+    pthread_cond_signal(&readCond);
+}
+
+static void set_signal()
+{
+    signal(SIGINT , exit_handler);
+    signal(SIGTERM, exit_handler);
+    signal(SIGHUP,  exit_handler);
+}
+
+int main(int argc, char *argv[])
+{
+    IDeckLinkIterator *deckLinkIterator = NULL;
+    IDeckLink *inputDevice = NULL, *outputDevice = NULL;
+    IDeckLinkDisplayModeIterator *displayModeIterator = NULL;
+    IDeckLinkDisplayMode *displayMode = NULL;
+    DeckLinkCaptureDelegate *delegate = NULL;
+    LoopOutput output;
+    BMDDisplayMode selectedDisplayMode;
+    BMDPixelFormat pix = bmdFormat8BitYUV;
+    int exitStatus     = 1;
+    int camera         = 0, playout = -1, displayModeCount = 0;
+    const char *logFile = NULL, *timeshiftFile = NULL, *delayArg = "3";
+    double timeshiftLength = 0;
+    pthread_t reader;
+    bool readerRunning = false, stdinOpen = true;
+    int ch;
+
+    pthread_mutex_init(&loopMutex, NULL);
+    pthread_cond_init(&loopCond, NULL);
+    pthread_cond_init(&readCond, NULL);
+
+    // Parse command line options
+    while ((ch = getopt(argc, argv, "?hvm:C:O:p:c:s:d:b:L:t:l:")) != -1) {
+        switch (ch) {
+        case 'v':
+            g_verbose = true;
+            break;
+        case 'm':
+            g_videoModeIndex = atoi(optarg);
+            break;
+        case 'C':
+            camera = atoi(optarg);
+            break;
+        case 'O':
+            playout = atoi(optarg);
+            break;
+        case 'p':
+            if (!strcmp("8", optarg) || !strcmp("yuv8", optarg)) {
+                pix = bmdFormat8BitYUV;
+            } else if (!strcmp("10", optarg) || !strcmp("yuv10", optarg)) {
+                pix = bmdFormat10BitYUV;
+            } else if (!strcmp("rgb10", optarg)) {
+                pix = bmdFormat10BitRGB;
+            } else {
+                fprintf(stderr,
+                        "Invalid argument: Pixel Format must be yuv8, yuv10 or rgb10\n");
+                return 1;
+            }
+            break;
+        case 'c':
+            g_audioChannels = atoi(optarg);
+            if (g_audioChannels != 2 &&
+                g_audioChannels != 8 &&
+                g_audioChannels != 16) {
+                fprintf(
+                    stderr,
+                    "Invalid argument: Audio Channels must be either 2, 8 or 16\n");
+                return 1;
+            }
+            break;
+        case 's':
+            g_audioSampleDepth = atoi(optarg);
+            if (g_audioSampleDepth != 16 && g_audioSampleDepth != 32) {
+                fprintf(stderr,
+                        "Invalid argument:"
+                        " Audio Sample Depth must be either 16 bits"
+                        " or 32 bits\n");
+                return 1;
+            }
+            break;
+        case 'd':
+            delayArg = optarg;
+            break;
+        case 'b':
+            g_ahead = atoi(optarg);
+            break;
+        case 'L':
+            logFile = optarg;
+            break;
+        case 't':
+            timeshiftFile = optarg;
+            break;
+        case 'l':
+            timeshiftLength = atof(optarg);
+            break;
+        case '?':
+        case 'h':
+            usage(0);
+        }
+    }
+
+    if (g_videoModeIndex < 0) {
+        fprintf(stderr, "No video mode specified\n");
+        usage(0);
+    }
+
+    if (g_ahead < 1 || g_ahead > kMaxPending - 2) {
+        fprintf(stderr, "Invalid argument: -b must be between 1 and %d\n",
+                kMaxPending - 2);
+        return 1;
+    }
+
+    if (logFile) {
+        latency_log = fopen(logFile, "w");
+        if (!latency_log) {
+            fprintf(stderr, "Cannot open %s\n", logFile);
+            return 1;
+        }
+    } else if (g_verbose) {
+        latency_log = stderr;
+    }
+
+    deckLinkIterator = CreateDeckLinkIteratorInstance();
+    if (!deckLinkIterator) {
+        fprintf(stderr,
+                "This application requires the DeckLink drivers installed.\n");
+        goto bail;
+    }
+    inputDevice = get_device(deckLinkIterator, camera);
+    deckLinkIterator->Release();
+
+    if (playout < 0 || playout == camera) {
+        outputDevice = inputDevice;
+        if (outputDevice)
+            outputDevice->AddRef();
+    } else {
+        deckLinkIterator = CreateDeckLinkIteratorInstance();
+        outputDevice     = get_device(deckLinkIterator, playout);
+        deckLinkIterator->Release();
+    }
+    deckLinkIterator = NULL;
+
+    if (!inputDevice || !outputDevice) {
+        fprintf(stderr, "No DeckLink PCI cards found.\n");
+        goto bail;
+    }
+
+    if (inputDevice->QueryInterface(IID_IDeckLinkInput,
+                                    (void **)&deckLinkInput) != S_OK) {
+        deckLinkInput = NULL;
+        fprintf(stderr, "-C %d has no input\n", camera);
+        goto bail;
+    }
+    if (outputDevice->QueryInterface(IID_IDeckLinkOutput,
+                                     (void **)&deckLinkOutput) != S_OK) {
+        deckLinkOutput = NULL;
+        fprintf(stderr, "-O %d has no output\n", playout < 0 ? camera : playout);
+        goto bail;
+    }
+
+    if (deckLinkInput->GetDisplayModeIterator(&displayModeIterator) != S_OK) {
+        fprintf(stderr, "Could not obtain the video input display mode iterator\n");
+        goto bail;
+    }
+    while (displayModeIterator->Next(&displayMode) == S_OK) {
+        if (g_videoModeIndex == displayModeCount)
+            break;
+        displayModeCount++;
+        displayMode->Release();
+        displayMode = NULL;
+    }
+    if (!displayMode) {
+        fprintf(stderr, "Invalid mode %d\n", g_videoModeIndex);
+        goto bail;
+    }
+    selectedDisplayMode = displayMode->GetDisplayMode();
+    displayMode->GetFrameRate(&frameDuration, &frameTimescale);
+
+    if (parse_delay(delayArg, &g_delay)) {
+        fprintf(stderr, "Invalid argument: -d %s\n", delayArg);
+        goto bail;
+    }
+
+    if (timeshiftFile) {
+        long width     = displayMode->GetWidth();
+        long height    = displayMode->GetHeight();
+        unsigned slots;
+
+        if (timeshiftLength <= 0)
+            timeshiftLength = fmax(60, 2.0 * slot_us(g_delay) / 1000000);
+        slots = lrint(timeshiftLength * frameTimescale / frameDuration);
+
+        // the reader keeps ahead of the output, the writer of the reader
+        minDelay = g_ahead + kReadAhead + 8;
+        maxDelay = (int)slots - kReadAhead - 16;
+        if (maxDelay < minDelay) {
+            fprintf(stderr, "Invalid argument: -l %g is too short\n",
+                    timeshiftLength);
+            goto bail;
+        }
+
+        videoBytes = row_bytes(pix, width) * height;
+        audioBytes = 2 * ((48000 * frameDuration + frameTimescale - 1) /
+                          frameTimescale) *
+                     g_audioChannels * (g_audioSampleDepth / 8);
+        timeshift = timeshift_open(timeshiftFile, slots, videoBytes, audioBytes);
+        if (!timeshift)
+            goto bail;
+
+        for (int i = 0; i < kPlayFrames; i++) {
+            if (deckLinkOutput->CreateVideoFrame(width, height,
+                                                 row_bytes(pix, width), pix,
+                                                 bmdFrameFlagDefault,
+                                                 &play[i].video) != S_OK) {
+                play[i].video = NULL;
+                fprintf(stderr, "Cannot allocate the output frames\n");
+                goto bail;
+            }
+            play[i].audio = (uint8_t *)malloc(audioBytes);
+        }
+    } else {
+        // a frame is captured whole before it can be scheduled
+        minDelay = g_ahead + 1;
+        maxDelay = g_ahead + kMaxHeld - 2;
+    }
+    if (g_delay < minDelay) {
+        fprintf(stderr, "-d %d is shorter than -b %d plus %d frames, using %d\n",
+                g_delay, g_ahead, minDelay - g_ahead, minDelay);
+        g_delay = minDelay;
+    }
+    if (g_delay > maxDelay) {
+        fprintf(stderr, "-d %d is longer than %s, using %d\n", g_delay,
+                timeshiftFile ? "the file" : "the frames held", maxDelay);
+        g_delay = maxDelay;
+    }
+
+    if (deckLinkInput->EnableVideoInput(selectedDisplayMode, pix, 0) != S_OK ||
+        deckLinkInput->EnableAudioInput(bmdAudioSampleRate48kHz,
+                                        g_audioSampleDepth,
+                                        g_audioChannels) != S_OK) {
+        fprintf(stderr,
+                "Failed to enable the input. Is another application using "
+                "the card?\n");
+        goto bail;
+    }
+    if (deckLinkOutput->EnableVideoOutput(selectedDisplayMode,
+                                          bmdVideoOutputFlagDefault) != S_OK ||
+        deckLinkOutput->EnableAudioOutput(bmdAudioSampleRate48kHz,
+                                          g_audioSampleDepth,
+                                          g_audioChannels,
+                                          bmdAudioOutputStreamTimestamped) != S_OK) {
+        fprintf(stderr,
+                "Failed to enable the output. Is another application using "
+                "the card?\n");
+        goto bail;
+    }
+
+    delegate = new DeckLinkCaptureDelegate();
+    deckLinkInput->SetCallback(delegate);
+    deckLinkOutput->SetScheduledFrameCompletionCallback(&output);
+
+    set_signal();
+    if (deckLinkInput->StartStreams() != S_OK) {
+        fprintf(stderr, "Cannot start the capture\n");
+        goto bail;
+    }
+
+    // the first frame prerolls the output
+    pthread_mutex_lock(&loopMutex);
+    while (!heldCount && !haveInput && !stopping)
+        pthread_cond_wait(&loopCond, &loopMutex);
+    if (timeshift && !stopping) {
+        // the delay goes in the file before the output starts
+        fprintf(stderr, "Buffering %.2f s\n", slot_us(g_delay) / 1000000.0);
+        while (!stopping && now_us() < firstArrival + slot_us(g_delay - 1))
+            pthread_cond_wait(&loopCond, &loopMutex);
+        origin = now_us();
+        if (!stopping &&
+            !pthread_create(&reader, NULL, timeshift_reader, NULL))
+            readerRunning = true;
+        while (!stopping && readerRunning &&
+               readyCount < (g_ahead < kReadAhead ? g_ahead + 1 : kReadAhead))
+            pthread_cond_wait(&loopCond, &loopMutex);
+    }
+    if (!stopping) {
+        deckLinkOutput->BeginAudioPreroll();
+        for (int i = 0; i <= g_ahead && schedule_slot(); i++)
+            ;
+        deckLinkOutput->EndAudioPreroll();
+        playing = true;
+        origin  = now_us();     // until the output clock runs
+    }
+    pthread_mutex_unlock(&loopMutex);
+
+    if (!stopping &&
+        deckLinkOutput->StartScheduledPlayback(0, frameTimescale, 1.0) != S_OK) {
+        fprintf(stderr, "Cannot start the playout\n");
+        goto bail;
+    }
+    exitStatus = 0;
+
+    // Report every second until a signal occurs, new delays come on stdin
+    while (!stopping) {
+        struct timespec ts;
+        int64_t next = now_us() + 1000000;
+
+        while (stdinOpen && !stopping && now_us() < next) {
+            struct pollfd fd = { 0, POLLIN, 0 };
+
+            if (poll(&fd, 1, (next - now_us() + 999) / 1000) > 0)
+                stdinOpen = read_delay();
+        }
+
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += (next > now_us() ? next - now_us() : 0) * 1000;
+        ts.tv_sec  += ts.tv_nsec / 1000000000;
+        ts.tv_nsec %= 1000000000;
+        pthread_mutex_lock(&loopMutex);
+        while (!stdinOpen && !stopping &&
+               pthread_cond_timedwait(&loopCond, &loopMutex, &ts) != ETIMEDOUT)
+            ;
+        if (!stopping && !g_verbose) {
+            report(&latencyPeriod);
+            memset(&latencyPeriod, 0, sizeof(latencyPeriod));
+        }
+        pthread_mutex_unlock(&loopMutex);
+    }
+
+    fprintf(stderr, "Stopping Loop\n");
+    if (readerRunning) {
+        pthread_cond_signal(&readCond);
+        pthread_join(reader, NULL);
+        readerRunning = false;
+    }
+    deckLinkInput->StopStreams();
+    deckLinkOutput->StopScheduledPlayback(0, NULL, 0);
+    pthread_mutex_lock(&loopMutex);
+    playing = false;
+    report(&latencyTotal);
+    pthread_mutex_unlock(&loopMutex);
+
+bail:
+    if (readerRunning) {
+        stopping = 1;
+        pthread_cond_signal(&readCond);
+        pthread_join(reader, NULL);
+    }
+    if (deckLinkOutput) {
+        deckLinkOutput->DisableAudioOutput();
+        deckLinkOutput->DisableVideoOutput();
+        deckLinkOutput->SetScheduledFrameCompletionCallback(NULL);
+        deckLinkOutput->Release();
+    }
+    if (deckLinkInput) {
+        deckLinkInput->DisableAudioInput();
+        deckLinkInput->DisableVideoInput();
+        deckLinkInput->SetCallback(NULL);
+        deckLinkInput->Release();
+    }
+
+    while (heldCount)
+        drop_oldest();
+    release_held(&shown);
+
+    if (timeshift)
+        timeshift_close(timeshift);
+    for (int i = 0; i < kPlayFrames; i++) {
+        if (play[i].video)
+            play[i].video->Release();
+        free(play[i].audio);
+    }
+
+    if (displayMode)
+        displayMode->Release();
+    if (displayModeIterator)
+        displayModeIterator->Release();
+    if (outputDevice)
+        outputDevice->Release();
+    if (inputDevice)
+        inputDevice->Release();
+    if (latency_log && latency_log != stderr)
+        fclose(latency_log);
+
+    return exitStatus;
+}
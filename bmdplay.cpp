@@ -23,6 +23,8 @@
 #include <stdlib.h>
 #include <math.h>
 #include <string.h>
+#include <time.h>
+#include <errno.h>
 #include <libgen.h>
 #include <signal.h>
 #include <pthread.h>
@@ -31,46 +33,106 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <arpa/inet.h>
 extern "C" {
 #include <libavformat/avformat.h>
 #include <libavcodec/avcodec.h>
 #include <libavutil/imgutils.h>
 #include <libavutil/mathematics.h>
-#include "libswscale/swscale.h"
+#include <libavutil/opt.h>
+#include <libavutil/parseutils.h>
+#include <libavutil/time.h>
+#include <libavutil/timecode.h>
+#include <libswresample/swresample.h>
 }
 #include "compat.h"
 #include "Play.h"
 
+#include "framebus.h"
 #include "modes.h"
+#include "readahead.h"
+#include "scaler.h"
 
 pthread_mutex_t sleepMutex;
 pthread_cond_t sleepCond;
 IDeckLinkConfiguration *deckLinkConfiguration;
 
-AVFormatContext *ic;
-AVFrame *avframe;
-
 typedef struct PlayStream {
     AVStream *st;
     AVCodecContext *codec;
 } PlayStream;
 
-PlayStream audio;
-PlayStream video;
+/*
+ * An entry of the playlist.  Packets are rebased on a single timeline in
+ * microseconds, each clip starting where the video of the previous one
+ * ends, and the decoders of a clip are used until its switch marker.
+ */
+typedef struct Clip {
+    char *filename;
+    int index;
+    AVFormatContext *ic;
+    AVIOContext *pb;            /* readahead, unless libavformat reads */
+    FrameBus *bus;              /* shm:, read in place of the demuxer */
+    AVBufferPool *bus_video;
+    AVBufferPool *bus_audio;
+    AVPacket bus_pending;       /* the audio of the frame just read */
+    PlayStream audio;
+    PlayStream video;
+    int64_t frame_duration;     /* nominal, timeline units */
+    int64_t start;              /* first timestamp, or the cue, timeline units */
+    int64_t offset;             /* where the clip begins on the timeline */
+    int64_t end;                /* end of its video on the timeline */
+    AVFrame *first_frame;       /* decoded ahead of the switch */
+    struct PacketQueue *pending; /* read while decoding it */
+    int64_t open_time;          /* us to open and probe */
+    int64_t wait_time;          /* us the demuxer waited for it */
+    int64_t decode_time;        /* us to decode the first picture */
+    int refs;
+    struct Clip *next;
+} Clip;
+
+static const AVRational timeline_tb = { 1, AV_TIME_BASE };
 
 static enum AVPixelFormat pix_fmt = AV_PIX_FMT_UYVY422;
 static BMDPixelFormat pix         = bmdFormat8BitYUV;
 
-static int buffer    = 2000 * 1000;
-static int serial_fd = -1;
-
-const unsigned long kAudioWaterlevel = 48000 / 4;      /* small */
+static enum AVSampleFormat audio_fmt = AV_SAMPLE_FMT_S16;
+static int audio_channels            = 2;
+static int play_audio                = 0;
+
+static int buffer         = 500;     /* ms, or frames if buffer_frames */
+static int buffer_frames  = 0;
+static int buffer_timeout = 5000;    /* ms */
+static int serial_fd      = -1;
+static int scale_threads  = 0;
+static int io_mode        = READAHEAD_BUFFERED;  /* -1 for libavformat's */
+
+const unsigned long kAudioWaterlevel = 48000 / 4;      /* to start with */
+const unsigned long kMinAudioWaterlevel = 48000 / 25;
+const unsigned long kMaxAudioWaterlevel = 48000 / 2;
+const int64_t kAudioDriftSoft        = 48000 / 500;     /* resampled away */
+const int64_t kAudioDriftHard        = 48000 / 10;      /* cut or padded */
+const int64_t kAudioDriftStep        = 2;               /* per callback */
+const unsigned kAudioRingSize        = 1 << 16;        /* ~1.3s at 48kHz */
+const unsigned kMinPreroll           = 2;
+const unsigned kMaxPreroll           = 50;
+const unsigned kRecoveryFrames       = 2;               /* lead after a catch up */
+const unsigned kHealthyCompletions   = 100;             /* before full decoding */
+const unsigned kMaxPending           = 1000;            /* packets read ahead */
+const unsigned kLivePreroll          = 3;               /* frames */
+const int64_t kLiveDepth             = 2;               /* frames queued */
+const double kLiveGain               = 256;             /* slots to settle */
+const int64_t kLiveJump              = 8;               /* frames over */
+const int kReadaheadBlock            = 8 << 20;         /* bytes */
+const int kReadaheadBlocks           = 4;
+const int64_t kReadAhead             = 10 * AV_TIME_BASE; /* queued, at least */
 
 typedef struct PacketQueue {
     AVPacketList *first_pkt, *last_pkt;
     uint64_t nb_packets;
     int size;
+    int64_t max_duration;       /* timeline units, the writer waits past it */
     int abort_request;
     pthread_mutex_t mutex;
     pthread_cond_t cond;
@@ -79,7 +141,57 @@ typedef struct PacketQueue {
 PacketQueue audioqueue;
 PacketQueue videoqueue;
 PacketQueue dataqueue;
-struct SwsContext *sws;
+SliceScaler *scaler;
+
+/*
+ * Single producer ring of interleaved sample frames, read by the audio
+ * callback of each output without locking or allocating.
+ */
+typedef struct SampleRing {
+    uint8_t *data;
+    unsigned size;          /* in sample frames, power of two */
+    unsigned frame_size;    /* in bytes */
+    unsigned head;          /* advanced by the producer */
+    unsigned tail[kMaxOutputs]; /* advanced by each consumer */
+    int readers;
+} SampleRing;
+
+SampleRing audioring;
+int64_t audio_start_time = AV_NOPTS_VALUE;  /* first sample, 48kHz units */
+
+/* decoded audio against its timestamps, 48kHz units */
+static int64_t audio_drift_max;
+static unsigned long audio_drift_soft, audio_drift_hard;
+
+/* queued in place of a packet where the next clip begins */
+static AVPacket switch_pkt;
+
+/* the next clip, opened ahead by the loader thread */
+static FILE *playlist;
+static pthread_mutex_t clip_mutex;
+static pthread_cond_t clip_cond;
+static Clip *loaded_clip;
+static int playlist_done;
+
+/* -loop: the file plays from memory, or is rewound and streamed again */
+static int loop;
+static int64_t loop_budget = 1024;   /* MB */
+static char *loop_file;
+static Clip *spare_clip;
+static uint8_t *loop_samples;
+static int64_t loop_period;          /* timeline units */
+
+/* -ss and -arm: start at a cue point, on SIGUSR1 if armed */
+static int64_t cue_point = AV_NOPTS_VALUE;  /* from the start of the file */
+static int arm;
+static volatile sig_atomic_t triggered;
+static volatile sig_atomic_t stopping;     /* SIGINT or the playlist is over */
+static int64_t trigger_time;
+
+/* -live: a few frames queued, the input clock followed */
+static int live;
+static int64_t live_input_pts = AV_NOPTS_VALUE;  /* newest video, timeline units */
+static int64_t live_input_time;                  /* us, when it was read */
 
 static void packet_queue_init(PacketQueue *q)
 {
@@ -116,6 +228,23 @@ static void packet_queue_end(PacketQueue *q)
     pthread_cond_destroy(&q->cond);
 }
 
+static void packet_queue_abort(PacketQueue *q)
+{
+    pthread_mutex_lock(&q->mutex);
+    q->abort_request = 1;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->mutex);
+}
+
+/* timestamp span of the queued packets, -1 if unknown, with q->mutex held */
+static int64_t packet_queue_span(PacketQueue *q)
+{
+    if (!q->first_pkt || q->first_pkt->pkt.pts == AV_NOPTS_VALUE ||
+        q->last_pkt->pkt.pts == AV_NOPTS_VALUE)
+        return -1;
+    return q->last_pkt->pkt.pts - q->first_pkt->pkt.pts;
+}
+
 static int packet_queue_put(PacketQueue *q, AVPacket *pkt)
 {
     AVPacketList *pkt1;
@@ -128,6 +257,10 @@ static int packet_queue_put(PacketQueue *q, AVPacket *pkt)
 
     pthread_mutex_lock(&q->mutex);
 
+    while (q->max_duration && !q->abort_request &&
+           packet_queue_span(q) >= q->max_duration)
+        pthread_cond_wait(&q->cond, &q->mutex);
+
     if (!q->last_pkt)
 
         q->first_pkt = pkt1;
@@ -149,6 +282,22 @@ static int packet_queue_put(PacketQueue *q, AVPacket *pkt)
     return 0;
 }
 
+/* timestamp span of the queued packets, or an estimate from their number */
+static int64_t packet_queue_duration(PacketQueue *q, int64_t frame_duration)
+{
+    int64_t duration;
+
+    pthread_mutex_lock(&q->mutex);
+    duration = packet_queue_span(q);
+    if (duration >= 0)
+        duration += q->last_pkt->pkt.duration;
+    else
+        duration = q->nb_packets * frame_duration;
+    pthread_mutex_unlock(&q->mutex);
+
+    return duration;
+}
+
 static int packet_queue_get(PacketQueue *q, AVPacket *pkt, int block)
 {
     AVPacketList *pkt1;
@@ -171,6 +320,8 @@ static int packet_queue_get(PacketQueue *q, AVPacket *pkt, int block)
             q->size -= pkt1->pkt.size + sizeof(*pkt1);
             *pkt     = pkt1->pkt;
             av_free(pkt1);
+            if (q->max_duration)
+                pthread_cond_signal(&q->cond);
             ret = 1;
             break;
         } else if (!block) {
@@ -188,230 +339,371 @@ static int packet_queue_get(PacketQueue *q, AVPacket *pkt, int block)
     return ret;
 }
 
-int64_t first_audio_pts = AV_NOPTS_VALUE;
-int64_t first_video_pts = AV_NOPTS_VALUE;
-int64_t first_pts       = AV_NOPTS_VALUE;
-int fill_me             = 1;
+static int sample_ring_init(SampleRing *r, unsigned size, unsigned frame_size,
+                            int readers)
+{
+    memset(r, 0, sizeof(SampleRing));
+    r->data = (uint8_t *)av_malloc((size_t)size * frame_size);
+    if (!r->data)
+        return -1;
+    r->size       = size;
+    r->frame_size = frame_size;
+    r->readers    = readers;
+    return 0;
+}
 
-void *fill_queues(void *unused)
+static void sample_ring_free(SampleRing *r)
 {
-    AVPacket pkt;
-    AVStream *st;
-    int once = 0;
+    av_freep(&r->data);
+}
 
-    while (fill_me) {
-        int err = av_read_frame(ic, &pkt);
-        if (err) {
-            pthread_cond_signal(&sleepCond);
-            return NULL;
-        }
-        if (videoqueue.nb_packets > 1000) {
-            if (!once++)
-                fprintf(stderr, "Queue size %d problems ahead\n",
-                        videoqueue.size);
-        }
-        st = ic->streams[pkt.stream_index];
-        switch (st->codecpar->codec_type) {
-        case AVMEDIA_TYPE_VIDEO:
-            if (pkt.pts != AV_NOPTS_VALUE) {
-                if (first_pts == AV_NOPTS_VALUE) {
-                    first_pts       = first_video_pts = pkt.pts;
-                    if (audio.st) {
-                        first_audio_pts =
-                            av_rescale_q(pkt.pts, video.st->time_base,
-                                         audio.st->time_base);
-                    }
-                }
-                pkt.pts -= first_video_pts;
-            }
-            packet_queue_put(&videoqueue, &pkt);
-            break;
-        case AVMEDIA_TYPE_AUDIO:
-            if (pkt.pts != AV_NOPTS_VALUE) {
-                if (first_pts == AV_NOPTS_VALUE) {
-                    first_pts       = first_audio_pts = pkt.pts;
-                    first_video_pts =
-                        av_rescale_q(pkt.pts, audio.st->time_base,
-                                     video.st->time_base);
-                }
-                pkt.pts -= first_audio_pts;
-            }
-            packet_queue_put(&audioqueue, &pkt);
-            break;
-        case AVMEDIA_TYPE_DATA:
-	    packet_queue_put(&dataqueue, &pkt);
-            break;
-        default:
-            av_packet_unref(&pkt);
-            break;
-        }
+/* the tail of the reader furthest behind */
+static unsigned sample_ring_tail(SampleRing *r, unsigned head)
+{
+    unsigned tail = __atomic_load_n(&r->tail[0], __ATOMIC_ACQUIRE);
+
+    for (int i = 1; i < r->readers; i++) {
+        unsigned t = __atomic_load_n(&r->tail[i], __ATOMIC_ACQUIRE);
+        if (head - t > head - tail)
+            tail = t;
     }
-    return NULL;
+
+    return tail;
 }
 
-void sigfunc(int signum)
+static unsigned sample_ring_fill(SampleRing *r)
 {
-    pthread_cond_signal(&sleepCond);
+    unsigned head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+
+    return head - sample_ring_tail(r, head);
 }
 
-int usage(int status)
+/* contiguous sample frames ready to be read */
+static unsigned sample_ring_peek(SampleRing *r, int reader, uint8_t **ptr)
 {
-    HRESULT result;
-    IDeckLinkIterator *deckLinkIterator;
-    IDeckLink *deckLink;
-    int numDevices = 0;
+    unsigned head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    unsigned tail = r->tail[reader];
+    unsigned pos  = tail & (r->size - 1);
 
-    fprintf(stderr,
-            "Usage: bmdplay -m <mode id> [OPTIONS]\n"
-            "\n"
-            "    -m <mode id>:\n"
-            );
+    *ptr = r->data + (size_t)pos * r->frame_size;
+    return FFMIN(head - tail, r->size - pos);
+}
 
-    // Create an IDeckLinkIterator object to enumerate all DeckLink cards in the system
-    deckLinkIterator = CreateDeckLinkIteratorInstance();
-    if (deckLinkIterator == NULL) {
-        fprintf(
-            stderr,
-            "A DeckLink iterator could not be created.  The DeckLink drivers may not be installed.\n");
-        return 1;
-    }
+static void sample_ring_consume(SampleRing *r, int reader, unsigned count)
+{
+    __atomic_store_n(&r->tail[reader], r->tail[reader] + count,
+                     __ATOMIC_RELEASE);
+}
 
-    // Enumerate all cards in this system
-    while (deckLinkIterator->Next(&deckLink) == S_OK) {
-        BMDProbeString str;
+/* contiguous room for sample frames */
+static unsigned sample_ring_reserve(SampleRing *r, uint8_t **ptr)
+{
+    unsigned tail = sample_ring_tail(r, r->head);
+    unsigned pos  = r->head & (r->size - 1);
 
-        // Increment the total number of DeckLink cards found
-        numDevices++;
-        if (numDevices > 1)
-            printf("\n\n");
+    *ptr = r->data + (size_t)pos * r->frame_size;
+    return FFMIN(r->size - (r->head - tail), r->size - pos);
+}
 
-        // *** Print the model name of the DeckLink card
-        result = deckLink->GetModelName(&str);
-        if (result == S_OK) {
-            printf("-> %s (-C %d )\n\n",
-                   ToStr(str),
-                   numDevices - 1);
-            FreeStr(str);
+static void sample_ring_commit(SampleRing *r, unsigned count)
+{
+    __atomic_store_n(&r->head, r->head + count, __ATOMIC_RELEASE);
+}
+
+int fill_me             = 1;
+int fill_done           = 0;
+
+static void clip_close(Clip *c)
+{
+    avcodec_free_context(&c->audio.codec);
+    avcodec_free_context(&c->video.codec);
+    avformat_close_input(&c->ic);
+    readahead_close(&c->pb);
+    av_packet_unref(&c->bus_pending);
+    av_buffer_pool_uninit(&c->bus_video);
+    av_buffer_pool_uninit(&c->bus_audio);
+    framebus_close(c->bus);
+    av_frame_free(&c->first_frame);
+    if (c->pending) {
+        packet_queue_end(c->pending);
+        av_freep(&c->pending);
+    }
+    av_freep(&c->filename);
+    av_free(c);
+}
+
+/*
+ * The demuxer and each decoder let go of the clip once past it, a looping
+ * file is then kept to be rewound rather than opened again.
+ */
+static void clip_unref(Clip *c)
+{
+    if (!c || __atomic_sub_fetch(&c->refs, 1, __ATOMIC_ACQ_REL))
+        return;
+
+    if (loop_file && fill_me) {
+        pthread_mutex_lock(&clip_mutex);
+        if (!spare_clip) {
+            spare_clip = c;
+            c          = NULL;
+            pthread_cond_broadcast(&clip_cond);
         }
+        pthread_mutex_unlock(&clip_mutex);
+    }
 
-        print_output_modes(deckLink);
-        // Release the IDeckLink instance when we've finished with it to prevent leaks
-        deckLink->Release();
+    if (c)
+        clip_close(c);
+}
+
+/* seek back to the start, to be played again as a new clip */
+static int clip_rewind(Clip *c)
+{
+    int64_t start = av_gettime_relative();
+    int64_t ts    = c->ic->start_time == AV_NOPTS_VALUE ? 0 : c->ic->start_time;
+
+    if (avformat_seek_file(c->ic, -1, INT64_MIN, ts, ts, 0) < 0)
+        return -1;
+
+    if (c->audio.codec)
+        avcodec_flush_buffers(c->audio.codec);
+    avcodec_flush_buffers(c->video.codec);
+    av_frame_free(&c->first_frame);
+    if (c->pending) {
+        packet_queue_end(c->pending);
+        av_freep(&c->pending);
     }
-    deckLinkIterator->Release();
 
-    // If no DeckLink cards were found in the system, inform the user
-    if (numDevices == 0)
-        printf("No Blackmagic Design devices were found.\n");
-    printf("\n");
+    c->start     = AV_NOPTS_VALUE;
+    c->offset    = 0;
+    c->end       = 0;
+    c->next      = NULL;
+    c->open_time = av_gettime_relative() - start;
 
-    fprintf(
-        stderr,
-        "    -f <filename>        Filename of input video file\n"
-        "    -C <num>             Card number to be used\n"
-        "    -b <num>             Milliseconds of pre-buffering before playback (default = 2000 ms)\n"
-        "    -p <pixel>           PixelFormat Depth (8 or 10 - default is 8)\n"
-        "    -S <port>            Serial device (i.e: /dev/ttyS0, /dev/ttyUSB0)\n"
-        "    -O <output>          Output connection:\n"
-        "                         1: Composite video + analog audio\n"
-        "                         2: Components video + analog audio\n"
-        "                         3: HDMI video + audio\n"
-        "                         4: SDI video + audio\n\n");
+    return 0;
+}
 
-    return status;
+/*
+ * shm:<name>, the frames bmdcapture -P publishes: the streams are made up
+ * from the format of the bus, the packets are the frames copied out.
+ */
+static int clip_open_bus(Clip *c, const char *name)
+{
+    FrameBusFormat f;
+    AVCodecParameters *par;
+    AVStream *st;
+
+    c->bus = framebus_open(name, &f);
+    if (!c->bus)
+        return -1;
+
+    c->ic = avformat_alloc_context();
+    if (!c->ic || !(st = avformat_new_stream(c->ic, NULL)))
+        return -1;
+
+    par             = st->codecpar;
+    par->codec_type = AVMEDIA_TYPE_VIDEO;
+    par->width      = f.width;
+    par->height     = f.height;
+    switch (f.pixel_format) {
+    case bmdFormat10BitYUV:
+        par->codec_id              = AV_CODEC_ID_V210;
+        par->bits_per_coded_sample = 10;
+        break;
+    case bmdFormat10BitRGB:
+        par->codec_id              = AV_CODEC_ID_R210;
+        par->bits_per_coded_sample = 10;
+        break;
+    case bmdFormat8BitARGB:
+        par->codec_id  = AV_CODEC_ID_RAWVIDEO;
+        par->format    = AV_PIX_FMT_ARGB;
+        par->codec_tag = avcodec_pix_fmt_to_codec_tag(AV_PIX_FMT_ARGB);
+        break;
+    default:
+        par->codec_id  = AV_CODEC_ID_RAWVIDEO;
+        par->format    = AV_PIX_FMT_UYVY422;
+        par->codec_tag = avcodec_pix_fmt_to_codec_tag(AV_PIX_FMT_UYVY422);
+        break;
+    }
+    st->time_base.num      = 1;
+    st->time_base.den      = f.time_scale;
+    st->avg_frame_rate.num = f.time_scale;
+    st->avg_frame_rate.den = f.frame_duration;
+
+    if (f.audio_channels) {
+        if (!(st = avformat_new_stream(c->ic, NULL)))
+            return -1;
+        par              = st->codecpar;
+        par->codec_type  = AVMEDIA_TYPE_AUDIO;
+        par->codec_id    = f.audio_depth == 32 ? AV_CODEC_ID_PCM_S32LE :
+                                                 AV_CODEC_ID_PCM_S16LE;
+        par->channels    = f.audio_channels;
+        par->sample_rate = 48000;
+        st->time_base.num = 1;
+        st->time_base.den = 48000;
+    }
+
+    // recycled, a frame does not cost an allocation
+    c->bus_video = av_buffer_pool_init(f.video_size + AV_INPUT_BUFFER_PADDING_SIZE,
+                                       NULL);
+    c->bus_audio = av_buffer_pool_init(f.audio_size + AV_INPUT_BUFFER_PADDING_SIZE,
+                                       NULL);
+
+    return c->bus_video && c->bus_audio ? 0 : -1;
 }
 
-int main(int argc, char *argv[])
+/* the picture of the next frame on the bus, its audio on the next call */
+static int bus_read(Clip *c, AVPacket *pkt)
 {
-    Player generator;
-    int ch, ret;
-    int videomode  = 2;
-    int connection = 0;
-    int camera     = 0;
-    char *filename = NULL;
+    if (c->bus_pending.data) {
+        *pkt = c->bus_pending;
+        av_init_packet(&c->bus_pending);
+        c->bus_pending.data = NULL;
+        c->bus_pending.size = 0;
+        return 0;
+    }
 
-    while ((ch = getopt(argc, argv, "?hs:f:a:m:n:F:C:O:b:p:S:")) != -1) {
-        switch (ch) {
-        case 'p':
-            switch (atoi(optarg)) {
-            case  8:
-                pix     = bmdFormat8BitYUV;
-                pix_fmt = AV_PIX_FMT_UYVY422;
-                break;
-            case 10:
-                pix     = bmdFormat10BitYUV;
-                pix_fmt = AV_PIX_FMT_YUV422P10;
+    while (fill_me) {
+        AVBufferRef *video = av_buffer_pool_get(c->bus_video);
+        AVBufferRef *audio = av_buffer_pool_get(c->bus_audio);
+        FrameBusFrame f;
+        int ret = -1, got = 0;
+
+        if (video && audio)
+            ret = framebus_read(c->bus, &f, video->data, audio->data, 100);
+        if (ret <= 0) {
+            av_buffer_unref(&video);
+            av_buffer_unref(&audio);
+            if (ret < 0)
                 break;
-            default:
-                fprintf(
-                    stderr,
-                    "Invalid argument: Pixel Format Depth must be either 8 bits or 10 bits\n");
-                return usage(1);
-            }
-            break;
-        case 'f':
-            filename = strdup(optarg);
-            break;
-        case 'm':
-            videomode = atoi(optarg);
-            break;
-        case 'O':
-            connection = atoi(optarg);
-            break;
-        case 'C':
-            camera = atoi(optarg);
-            break;
-        case 'b':
-            buffer = atoi(optarg) * 1000;
-            break;
-        case 'S':
-            serial_fd = open(optarg, O_RDWR | O_NONBLOCK);
-            break;
-        case '?':
-        case 'h':
-            return usage(0);
+            continue;
+        }
+
+        if (f.pts >= 0 && f.video_size) {
+            av_init_packet(pkt);
+            pkt->buf          = video;
+            pkt->data         = video->data;
+            pkt->size         = f.video_size;
+            pkt->pts          = f.pts;
+            pkt->dts          = f.pts;
+            pkt->flags       |= AV_PKT_FLAG_KEY;
+            pkt->stream_index = c->video.st->index;
+            got               = 1;
+        } else {
+            av_buffer_unref(&video);
+        }
+
+        if (c->audio.st && f.audio_pts >= 0 && f.audio_size) {
+            AVPacket *a = video ? &c->bus_pending : pkt;
+
+            av_init_packet(a);
+            a->buf          = audio;
+            a->data         = audio->data;
+            a->size         = f.audio_size;
+            a->pts          = f.audio_pts;
+            a->dts          = f.audio_pts;
+            a->flags       |= AV_PKT_FLAG_KEY;
+            a->stream_index = c->audio.st->index;
+            audio           = NULL;
+            got             = 1;
         }
+        av_buffer_unref(&audio);
+
+        if (got)
+            return 0;
     }
 
-    if (!filename)
-        return usage(1);
+    return AVERROR_EOF;
+}
 
-    av_register_all();
-    ic = avformat_alloc_context();
+static int clip_read(Clip *c, AVPacket *pkt)
+{
+    return c->bus ? bus_read(c, pkt) : av_read_frame(c->ic, pkt);
+}
+
+static Clip *clip_open(const char *filename)
+{
+    int64_t start = av_gettime_relative();
+    Clip *c       = (Clip *)av_mallocz(sizeof(Clip));
+
+    if (!c)
+        return NULL;
+
+    c->filename = av_strdup(filename);
+    c->start    = AV_NOPTS_VALUE;
+
+    if (!strncmp(filename, "shm:", 4)) {
+        if (clip_open_bus(c, filename + 4) < 0) {
+            fprintf(stderr, "Cannot open %s\n", filename);
+            clip_close(c);
+            return NULL;
+        }
+        goto streams;
+    }
+
+    if (io_mode >= 0)
+        c->pb = readahead_open(filename, (enum ReadaheadMode)io_mode,
+                               kReadaheadBlock, kReadaheadBlocks);
+    if (c->pb || live) {
+        c->ic = avformat_alloc_context();
+        if (!c->ic) {
+            clip_close(c);
+            return NULL;
+        }
+    }
+    if (c->pb) {
+        c->ic->pb     = c->pb;
+        c->ic->flags |= AVFMT_FLAG_CUSTOM_IO;
+    }
+    // live, start from the first packets and hold none back
+    if (live) {
+        c->ic->flags               |= AVFMT_FLAG_NOBUFFER;
+        c->ic->probesize            = 1 << 16;
+        c->ic->max_analyze_duration = AV_TIME_BASE / 10;
+    }
 
-    avformat_open_input(&ic, filename, NULL, NULL);
-    avformat_find_stream_info(ic, NULL);
+    if (avformat_open_input(&c->ic, filename, NULL, NULL) < 0 ||
+        avformat_find_stream_info(c->ic, NULL) < 0) {
+        fprintf(stderr, "Cannot open %s\n", filename);
+        clip_close(c);
+        return NULL;
+    }
 
-    for (int i = 0; i < ic->nb_streams; i++) {
-        AVStream *st           = ic->streams[i];
+streams:
+    for (unsigned i = 0; i < c->ic->nb_streams; i++) {
+        AVStream *st           = c->ic->streams[i];
         AVCodecParameters *par = st->codecpar;
         AVCodec *codec         = avcodec_find_decoder(par->codec_id);
+        PlayStream *ps;
+
         switch (par->codec_type) {
         case AVMEDIA_TYPE_AUDIO:
         case AVMEDIA_TYPE_VIDEO:
+            ps = par->codec_type == AVMEDIA_TYPE_AUDIO ? &c->audio : &c->video;
+            if (ps->st)
+                continue;
             if (codec) {
                 AVCodecContext *avctx  = avcodec_alloc_context3(codec);
                 if (!avctx) {
                     av_log(NULL, AV_LOG_ERROR, "Out of memory\n");
-                    exit(1);
+                    clip_close(c);
+                    return NULL;
                 }
 
+                avctx->pkt_timebase = timeline_tb;
+                if (live) {
+                    avctx->flags       |= AV_CODEC_FLAG_LOW_DELAY;
+                    avctx->thread_type  = FF_THREAD_SLICE;
+                }
                 if (avcodec_parameters_to_context(avctx, par) < 0 ||
                     avcodec_open2(avctx, codec, NULL) < 0) {
                     avcodec_free_context(&avctx);
                     av_log(NULL, AV_LOG_ERROR, "Codec open failed\n");
-                    exit(1);
-                }
-
-                if (par->codec_type == AVMEDIA_TYPE_AUDIO) {
-                    audio.st    = st;
-                    audio.codec = avctx;
+                    clip_close(c);
+                    return NULL;
                 }
 
-                if (par->codec_type == AVMEDIA_TYPE_VIDEO) {
-                    video.st    = st;
-                    video.codec = avctx;
-                }
+                ps->st    = st;
+                ps->codec = avctx;
             } else {
                 fprintf(
                     stderr, "cannot find codecs for %s\n",
@@ -421,392 +713,2696 @@ int main(int argc, char *argv[])
             }
             break;
         default:
-            av_log(NULL, AV_LOG_VERBOSE, "Skipping stream %d\n", i);
+            av_log(NULL, AV_LOG_VERBOSE, "Skipping stream %u\n", i);
         }
     }
 
-    if (!audio.st) {
-        av_log(NULL, AV_LOG_INFO,
-               "No audio stream found - bmdplay will just play video\n");
-    }
-
-    if (!video.st) {
-        av_log(NULL, AV_LOG_ERROR,
-               "No video stream found - bmdplay will close now.\n");
-        return 1;
+    if (!c->video.st) {
+        av_log(NULL, AV_LOG_ERROR, "No video stream found in %s\n", filename);
+        clip_close(c);
+        return NULL;
     }
 
-    av_dump_format(ic, 0, filename, 0);
-
-    sws = sws_getContext(video.st->codecpar->width,
-                         video.st->codecpar->height,
-                         (AVPixelFormat)video.st->codecpar->format,
-                         video.st->codecpar->width,
-                         video.st->codecpar->height,
-                         pix_fmt,
-                         SWS_BILINEAR, NULL, NULL, NULL);
-
-    signal(SIGINT, sigfunc);
-    pthread_mutex_init(&sleepMutex, NULL);
-    pthread_cond_init(&sleepCond, NULL);
+    if (c->video.st->avg_frame_rate.num > 0 &&
+        c->video.st->avg_frame_rate.den > 0)
+        c->frame_duration = av_rescale_q(1, av_inv_q(c->video.st->avg_frame_rate),
+                                         timeline_tb);
 
-    free(filename);
+    c->open_time = av_gettime_relative() - start;
 
-    ret = generator.Init(videomode, connection, camera);
+    return c;
+}
 
-    avformat_close_input(&ic);
+/*
+ * Move the packet on the timeline, the first timestamp of the file lands
+ * on the clip offset.  Returns the type of the stream it belongs to, or
+ * AVMEDIA_TYPE_UNKNOWN if it is not played.
+ */
+static enum AVMediaType clip_rebase(Clip *c, AVPacket *pkt)
+{
+    AVStream *st = c->ic->streams[pkt->stream_index];
+    enum AVMediaType type = st->codecpar->codec_type;
+    int64_t shift;
+
+    if ((type == AVMEDIA_TYPE_VIDEO && st != c->video.st) ||
+        (type == AVMEDIA_TYPE_AUDIO && (st != c->audio.st || !play_audio)) ||
+        (type == AVMEDIA_TYPE_DATA && serial_fd < 0))
+        return AVMEDIA_TYPE_UNKNOWN;
+
+    if (c->start == AV_NOPTS_VALUE && pkt->pts != AV_NOPTS_VALUE &&
+        (type == AVMEDIA_TYPE_VIDEO || type == AVMEDIA_TYPE_AUDIO))
+        c->start = av_rescale_q(pkt->pts, st->time_base, timeline_tb);
+
+    shift = c->offset - (c->start == AV_NOPTS_VALUE ? 0 : c->start);
+    if (pkt->pts != AV_NOPTS_VALUE)
+        pkt->pts = av_rescale_q(pkt->pts, st->time_base, timeline_tb) + shift;
+    if (pkt->dts != AV_NOPTS_VALUE)
+        pkt->dts = av_rescale_q(pkt->dts, st->time_base, timeline_tb) + shift;
+    pkt->duration = av_rescale_q(pkt->duration, st->time_base, timeline_tb);
+
+    if (type == AVMEDIA_TYPE_VIDEO && pkt->pts != AV_NOPTS_VALUE)
+        c->end = FFMAX(c->end, pkt->pts + (pkt->duration ? pkt->duration :
+                                                           c->frame_duration));
+
+    return type;
+}
+
+/*
+ * Decode the first picture of the clip, so that the switch does not pay
+ * for the decoder startup.  What else is read meanwhile is kept pending.
+ */
+static void clip_predecode(Clip *c)
+{
+    int64_t start = av_gettime_relative();
+    AVPacket pkt;
+
+    c->first_frame = av_frame_alloc();
+    c->pending     = (PacketQueue *)av_malloc(sizeof(PacketQueue));
+    if (!c->first_frame || !c->pending)
+        return;
+    packet_queue_init(c->pending);
+
+    while (fill_me && c->pending->nb_packets < kMaxPending &&
+           clip_read(c, &pkt) >= 0) {
+        switch (clip_rebase(c, &pkt)) {
+        case AVMEDIA_TYPE_VIDEO:
+            avcodec_send_packet(c->video.codec, &pkt);
+            av_packet_unref(&pkt);
+            if (avcodec_receive_frame(c->video.codec, c->first_frame) >= 0)
+                goto done;
+            break;
+        case AVMEDIA_TYPE_AUDIO:
+        case AVMEDIA_TYPE_DATA:
+            packet_queue_put(c->pending, &pkt);
+            break;
+        default:
+            av_packet_unref(&pkt);
+            break;
+        }
+    }
+
+done:
+    c->decode_time = av_gettime_relative() - start;
+}
+
+/*
+ * Seek to the keyframe before the cue, which becomes the start of the
+ * clip: the frames before it are decoded only to get there.
+ */
+static int clip_cue(Clip *c, int64_t cue)
+{
+    int64_t ts = (c->ic->start_time == AV_NOPTS_VALUE ? 0 :
+                  c->ic->start_time) + cue;
+
+    if (avformat_seek_file(c->ic, -1, INT64_MIN, ts, ts, 0) < 0)
+        return -1;
+
+    c->start = ts;      // the timeline is in AV_TIME_BASE units
+
+    return 0;
+}
+
+/*
+ * -ss takes a time, or a timecode hh:mm:ss:ff counted from the start
+ * timecode of the file if it has one.
+ */
+static int64_t parse_cue(Clip *c, const char *arg)
+{
+    AVRational rate = c->video.st->avg_frame_rate;
+    AVDictionaryEntry *e;
+    AVTimecode tc, start;
+    int64_t cue;
+    int colons = 0;
+
+    for (const char *p = arg; *p; p++)
+        colons += *p == ':' || *p == ';';
+
+    if (colons < 3)
+        return av_parse_time(&cue, arg, 1) < 0 ? AV_NOPTS_VALUE : cue;
+
+    if (rate.num <= 0 || rate.den <= 0 ||
+        av_timecode_init_from_string(&tc, rate, arg, NULL) < 0)
+        return AV_NOPTS_VALUE;
+
+    e = av_dict_get(c->video.st->metadata, "timecode", NULL, 0);
+    if (!e)
+        e = av_dict_get(c->ic->metadata, "timecode", NULL, 0);
+    if (e && av_timecode_init_from_string(&start, rate, e->value, NULL) >= 0 &&
+        tc.start >= start.start)
+        tc.start -= start.start;
+
+    return av_rescale_q(tc.start, av_inv_q(rate), timeline_tb);
+}
+
+/* next entry of the playlist, blank lines and # comments are skipped */
+static char *playlist_next(void)
+{
+    char line[4096];
+
+    if (loop_file)
+        return strdup(loop_file);
+
+    while (playlist && fgets(line, sizeof(line), playlist)) {
+        char *p = line + strspn(line, " \t");
+
+        p[strcspn(p, "\r\n")] = 0;
+        if (*p && *p != '#')
+            return strdup(p);
+    }
+
+    return NULL;
+}
+
+/* open the entries one ahead of the demuxer */
+void *load_clips(void *unused)
+{
+    char *filename;
+
+    for (;;) {
+        Clip *c;
+
+        pthread_mutex_lock(&clip_mutex);
+        while (loaded_clip && fill_me)
+            pthread_cond_wait(&clip_cond, &clip_mutex);
+        c          = spare_clip;
+        spare_clip = NULL;
+        pthread_mutex_unlock(&clip_mutex);
+
+        if (!fill_me) {
+            if (c)
+                clip_close(c);
+            break;
+        }
+
+        if (c && clip_rewind(c) < 0) {
+            fprintf(stderr, "Cannot rewind %s\n", c->filename);
+            clip_close(c);
+            c = NULL;
+        }
+
+        if (!c) {
+            if (!(filename = playlist_next()))
+                break;
+            c = clip_open(filename);
+            free(filename);
+            if (!c) {
+                if (loop_file)
+                    break;
+                continue;
+            }
+        }
+
+        pthread_mutex_lock(&clip_mutex);
+        loaded_clip = c;
+        pthread_cond_broadcast(&clip_cond);
+        pthread_mutex_unlock(&clip_mutex);
+    }
+
+    pthread_mutex_lock(&clip_mutex);
+    playlist_done = 1;
+    pthread_cond_broadcast(&clip_cond);
+    pthread_mutex_unlock(&clip_mutex);
+
+    return NULL;
+}
+
+/* take the clip opened ahead and make it follow c on the timeline */
+static Clip *next_clip(Clip *c)
+{
+    int64_t start = av_gettime_relative();
+    Clip *next;
+
+    pthread_mutex_lock(&clip_mutex);
+    while (!loaded_clip && !playlist_done && fill_me)
+        pthread_cond_wait(&clip_cond, &clip_mutex);
+    next        = loaded_clip;
+    loaded_clip = NULL;
+    pthread_cond_broadcast(&clip_cond);
+    pthread_mutex_unlock(&clip_mutex);
+
+    if (!next)
+        return NULL;
+
+    next->wait_time = av_gettime_relative() - start;
+    next->index     = c->index + 1;
+    next->offset    = c->end;
+    next->end       = c->end;
+    next->refs      = 2 + play_audio;
+
+    clip_predecode(next);
+
+    return next;
+}
+
+void *fill_queues(void *arg)
+{
+    Clip *c = (Clip *)arg;
+    AVPacket pkt;
+    int once = 0;
+
+    while (fill_me) {
+        int err = clip_read(c, &pkt);
+        if (err) {
+            Clip *next = next_clip(c);
+            if (!next) {
+                // a marker with no clip after it, the decoders drain and stop
+                packet_queue_put(&videoqueue, &switch_pkt);
+                if (play_audio)
+                    packet_queue_put(&audioqueue, &switch_pkt);
+                fill_done = 1;
+                clip_unref(c);
+                return NULL;
+            }
+
+            // the decoders find the next clip through the marker
+            c->next = next;
+            packet_queue_put(&videoqueue, &switch_pkt);
+            if (play_audio)
+                packet_queue_put(&audioqueue, &switch_pkt);
+            while (next->pending &&
+                   packet_queue_get(next->pending, &pkt, 0) > 0)
+                packet_queue_put(next->audio.st &&
+                                 pkt.stream_index == next->audio.st->index ?
+                                 &audioqueue : &dataqueue, &pkt);
+            clip_unref(c);
+            c = next;
+            continue;
+        }
+        if (videoqueue.nb_packets > 1000) {
+            if (!once++)
+                fprintf(stderr, "Queue size %d problems ahead\n",
+                        videoqueue.size);
+        }
+        switch (clip_rebase(c, &pkt)) {
+        case AVMEDIA_TYPE_VIDEO:
+            if (live && pkt.pts != AV_NOPTS_VALUE &&
+                pkt.pts > live_input_pts) {
+                __atomic_store_n(&live_input_time, av_gettime_relative(),
+                                 __ATOMIC_RELAXED);
+                __atomic_store_n(&live_input_pts, pkt.pts, __ATOMIC_RELEASE);
+            }
+            packet_queue_put(&videoqueue, &pkt);
+            break;
+        case AVMEDIA_TYPE_AUDIO:
+            packet_queue_put(&audioqueue, &pkt);
+            break;
+        case AVMEDIA_TYPE_DATA:
+	    packet_queue_put(&dataqueue, &pkt);
+            break;
+        default:
+            av_packet_unref(&pkt);
+            break;
+        }
+    }
+    clip_unref(c);
+    return NULL;
+}
+
+/*
+ * Copy interleaved samples, adding silent channels or dropping the extra
+ * ones to match the output layout.
+ */
+static void copy_samples(uint8_t *dst, const uint8_t *src, unsigned count,
+                         int in_size, int out_size)
+{
+    int size = FFMIN(in_size, out_size);
+
+    if (in_size == out_size) {
+        memcpy(dst, src, (size_t)count * in_size);
+        return;
+    }
+
+    for (unsigned i = 0; i < count; i++) {
+        memcpy(dst + (size_t)i * out_size, src + (size_t)i * in_size, size);
+        memset(dst + (size_t)i * out_size + size, 0, out_size - size);
+    }
+}
+
+/* copy interleaved samples in the ring, waiting for room */
+static int sample_ring_write(SampleRing *r, const uint8_t *src, int count,
+                             int channels, int bytes)
+{
+    int in_size = channels * bytes;
+
+    while (count > 0) {
+        uint8_t *dst;
+        unsigned n = sample_ring_reserve(r, &dst);
+
+        if (!n) {
+            if (!fill_me)
+                return -1;
+            usleep(5000);
+            continue;
+        }
+
+        n = FFMIN(n, (unsigned)count);
+        copy_samples(dst, src, n, in_size, r->frame_size);
+        sample_ring_commit(r, n);
+
+        src   += (size_t)n * in_size;
+        count -= n;
+    }
+
+    return 0;
+}
+
+/* pad with silence, where a clip has less audio than video or none */
+static int sample_ring_silence(SampleRing *r, int64_t count)
+{
+    while (count > 0) {
+        uint8_t *dst;
+        unsigned n = sample_ring_reserve(r, &dst);
+
+        if (!n) {
+            if (!fill_me)
+                return -1;
+            usleep(5000);
+            continue;
+        }
+
+        n = FFMIN(n, count);
+        memset(dst, 0, (size_t)n * r->frame_size);
+        sample_ring_commit(r, n);
+        count -= n;
+    }
+
+    return 0;
+}
+
+/* resample to 48kHz in the output sample format, mono goes on both sides */
+static struct SwrContext *setup_resampler(AVCodecContext *avctx,
+                                          AVFrame *frame, int *channels)
+{
+    int64_t in_layout  = avctx->channel_layout;
+    int64_t out_layout;
+    struct SwrContext *swr;
+
+    if (!in_layout)
+        in_layout = av_get_default_channel_layout(avctx->channels);
+    out_layout = avctx->channels == 1 ? AV_CH_LAYOUT_STEREO : in_layout;
+
+    swr = swr_alloc_set_opts(NULL,
+                             out_layout, audio_fmt, 48000,
+                             in_layout, (AVSampleFormat)frame->format,
+                             frame->sample_rate, 0, NULL);
+    if (!swr)
+        return NULL;
+
+    if (!in_layout) {
+        av_opt_set_int(swr, "ich", avctx->channels, 0);
+        av_opt_set_int(swr, "och", avctx->channels, 0);
+    }
+
+    if (swr_init(swr) < 0) {
+        swr_free(&swr);
+        return NULL;
+    }
+
+    *channels = out_layout ? av_get_channel_layout_nb_channels(out_layout) :
+                             avctx->channels;
+
+    return swr;
+}
+
+/* decoded audio to 48kHz in the output sample format */
+typedef struct AudioConverter {
+    struct SwrContext *swr;
+    int in_format;
+    int in_rate;
+    int channels;
+    int bytes;
+    uint8_t *buf;
+    int buf_samples;
+} AudioConverter;
+
+static void audio_converter_init(AudioConverter *ac)
+{
+    memset(ac, 0, sizeof(AudioConverter));
+    ac->in_format = AV_SAMPLE_FMT_NONE;
+    ac->bytes     = av_get_bytes_per_sample(audio_fmt);
+}
+
+/* the next frame may come from another decoder */
+static void audio_converter_reset(AudioConverter *ac)
+{
+    swr_free(&ac->swr);
+    ac->in_format = AV_SAMPLE_FMT_NONE;
+}
+
+static void audio_converter_free(AudioConverter *ac)
+{
+    swr_free(&ac->swr);
+    av_freep(&ac->buf);
+}
+
+/*
+ * Convert the frame in ac->buf, or what the resampler still holds if frame
+ * is NULL.  Returns the number of sample frames, negative on error.
+ */
+static int audio_convert(AudioConverter *ac, AVCodecContext *avctx,
+                         AVFrame *frame)
+{
+    int count;
+
+    if (!frame)
+        return ac->swr && ac->buf ?
+               swr_convert(ac->swr, &ac->buf, ac->buf_samples, NULL, 0) : 0;
+
+    if (frame->format != ac->in_format || frame->sample_rate != ac->in_rate) {
+        ac->in_format = frame->format;
+        ac->in_rate   = frame->sample_rate;
+        swr_free(&ac->swr);
+        ac->swr = setup_resampler(avctx, frame, &ac->channels);
+        if (!ac->swr)
+            fprintf(stderr, "Cannot convert %s %dHz audio\n",
+                    av_get_sample_fmt_name((AVSampleFormat)ac->in_format),
+                    ac->in_rate);
+    }
+    if (!ac->swr)
+        return 0;
+
+    count = av_rescale_rnd(swr_get_delay(ac->swr, ac->in_rate) +
+                           frame->nb_samples, 48000, ac->in_rate,
+                           AV_ROUND_UP);
+    if (count > ac->buf_samples) {
+        av_freep(&ac->buf);
+        ac->buf = (uint8_t *)av_malloc((size_t)count * ac->channels *
+                                       ac->bytes);
+        if (!ac->buf)
+            return AVERROR(ENOMEM);
+        ac->buf_samples = count;
+    }
+
+    return swr_convert(ac->swr, &ac->buf, count,
+                       (const uint8_t **)frame->extended_data,
+                       frame->nb_samples);
+}
+
+/*
+ * On a switch marker the decoder and the resampler are drained, then the
+ * first samples of the next clip are put at their place on the timeline,
+ * padding with silence or dropping what overlaps.
+ */
+void *decode_audio(void *arg)
+{
+    Clip *c          = (Clip *)arg;
+    AVFrame *frame   = av_frame_alloc();
+    AVRational tb    = { 1, 48000 };
+    int64_t position = AV_NOPTS_VALUE;    /* next sample, 48kHz units */
+    int64_t skip     = 0;
+    int64_t resync   = 0;                 /* compensating until there */
+    bool align       = false;
+    AudioConverter ac;
+    AVPacket pkt;
+
+    audio_converter_init(&ac);
+
+    while (fill_me && packet_queue_get(&audioqueue, &pkt, 1) > 0) {
+        bool draining = pkt.data == switch_pkt.data;
+        int ret       = -1;
+
+        if (c->audio.codec)
+            ret = avcodec_send_packet(c->audio.codec, draining ? NULL : &pkt);
+        av_packet_unref(&pkt);
+
+        while (ret >= 0 && avcodec_receive_frame(c->audio.codec, frame) >= 0) {
+            int count;
+
+            if (audio_start_time == AV_NOPTS_VALUE) {
+                audio_start_time = frame->pts == AV_NOPTS_VALUE ? 0 :
+                    av_rescale_q(frame->pts, timeline_tb, tb);
+                // cued, nothing plays before the cue point
+                if (audio_start_time < 0) {
+                    skip             = -audio_start_time;
+                    audio_start_time = 0;
+                }
+            }
+            if (position == AV_NOPTS_VALUE)
+                position = audio_start_time;
+
+            // the samples follow the timestamps, not just their count
+            if (!align && ac.swr && frame->pts != AV_NOPTS_VALUE) {
+                int64_t drift = av_rescale_q(frame->pts, timeline_tb, tb) -
+                                position - swr_get_delay(ac.swr, 48000);
+
+                if (FFABS(drift) > FFABS(audio_drift_max))
+                    audio_drift_max = drift;
+                if (FFABS(drift) > kAudioDriftHard) {
+                    fprintf(stderr, "Audio %" PRId64 " ms off its timestamps, "
+                            "realigned\n", drift / 48);
+                    align = true;
+                    audio_drift_hard++;
+                } else if (FFABS(drift) > kAudioDriftSoft && position >= resync) {
+                    // at most 0.1% faster or slower, inaudible
+                    int64_t distance = FFMAX(48000, FFABS(drift) * 1000);
+
+                    if (swr_set_compensation(ac.swr, drift, distance) >= 0) {
+                        resync = position + distance;
+                        audio_drift_soft++;
+                    }
+                }
+            }
+
+            if (align && frame->pts != AV_NOPTS_VALUE) {
+                int64_t target = av_rescale_q(frame->pts, timeline_tb, tb);
+
+                if (target > position &&
+                    sample_ring_silence(&audioring, target - position) < 0)
+                    goto end;
+                skip     = FFMAX(position - target, 0);
+                position = FFMAX(position, target);
+                align    = false;
+            }
+
+            count = audio_convert(&ac, c->audio.codec, frame);
+            if (count < 0)
+                goto end;
+            if (count > 0 && skip) {
+                int n = FFMIN(skip, count);
+                memmove(ac.buf, ac.buf + (size_t)n * ac.channels * ac.bytes,
+                        (size_t)(count - n) * ac.channels * ac.bytes);
+                count -= n;
+                skip  -= n;
+            }
+            if (count > 0 &&
+                sample_ring_write(&audioring, ac.buf, count, ac.channels,
+                                  ac.bytes) < 0)
+                goto end;
+            if (count > 0)
+                position += count;
+        }
+
+        if (draining) {
+            Clip *next = c->next;
+            int count;
+
+            while ((count = audio_convert(&ac, c->audio.codec, NULL)) > 0) {
+                if (sample_ring_write(&audioring, ac.buf, count, ac.channels,
+                                      ac.bytes) < 0)
+                    goto end;
+                position += count;
+            }
+            audio_converter_reset(&ac);
+            align  = true;
+            resync = 0;
+
+            clip_unref(c);
+            c = next;
+        }
+    }
+
+end:
+    clip_unref(c);
+    audio_converter_free(&ac);
+    av_frame_free(&frame);
+    return NULL;
+}
+
+void *serial_writer(void *arg)
+{
+    ((Player *)arg)->WriteSerial();
+    return NULL;
+}
+
+/*
+ * -loop from memory: the cached samples over and over, each pass as long
+ * as the video one so that the rounding does not add up.
+ */
+void *loop_audio(void *unused)
+{
+    AVRational tb = { 1, 48000 };
+    int bytes     = av_get_bytes_per_sample(audio_fmt);
+
+    for (int64_t i = 0; fill_me; i++) {
+        int64_t count = av_rescale_q((i + 1) * loop_period, timeline_tb, tb) -
+                        av_rescale_q(i * loop_period, timeline_tb, tb);
+
+        if (sample_ring_write(&audioring, loop_samples, count,
+                              audio_channels, bytes) < 0)
+            break;
+    }
+
+    return NULL;
+}
+
+void sigfunc(int signum)
+{
+    stopping = 1;
+    pthread_cond_signal(&sleepCond);
+}
+
+void trigger(int signum)
+{
+    trigger_time = av_gettime_relative();
+    triggered    = 1;
+    pthread_cond_signal(&sleepCond);
+}
+
+int usage(int status)
+{
+    HRESULT result;
+    IDeckLinkIterator *deckLinkIterator;
+    IDeckLink *deckLink;
+    int numDevices = 0;
+
+    fprintf(stderr,
+            "Usage: bmdplay -m <mode id> [OPTIONS]\n"
+            "\n"
+            "    -m <mode id>:\n"
+            );
+
+    // Create an IDeckLinkIterator object to enumerate all DeckLink cards in the system
+    deckLinkIterator = CreateDeckLinkIteratorInstance();
+    if (deckLinkIterator == NULL) {
+        fprintf(
+            stderr,
+            "A DeckLink iterator could not be created.  The DeckLink drivers may not be installed.\n");
+        return 1;
+    }
+
+    // Enumerate all cards in this system
+    while (deckLinkIterator->Next(&deckLink) == S_OK) {
+        BMDProbeString str;
+
+        // Increment the total number of DeckLink cards found
+        numDevices++;
+        if (numDevices > 1)
+            printf("\n\n");
+
+        // *** Print the model name of the DeckLink card
+        result = deckLink->GetModelName(&str);
+        if (result == S_OK) {
+            printf("-> %s (-C %d )\n\n",
+                   ToStr(str),
+                   numDevices - 1);
+            FreeStr(str);
+        }
+
+        print_output_modes(deckLink);
+        // Release the IDeckLink instance when we've finished with it to prevent leaks
+        deckLink->Release();
+    }
+    deckLinkIterator->Release();
+
+    // If no DeckLink cards were found in the system, inform the user
+    if (numDevices == 0)
+        printf("No Blackmagic Design devices were found.\n");
+    printf("\n");
+
+    fprintf(
+        stderr,
+        "    -f <filename>        Filename of input video file\n"
+        "    -l <playlist>        File listing the inputs to play back to back, one per line (- for stdin)\n"
+        "    -loop                Play the input over and over, from memory if it fits\n"
+        "    -M <megabytes>       Memory for the -loop frame cache (default = 1024)\n"
+        "    -ss <time>           Start at time, or at timecode hh:mm:ss:ff, in the input\n"
+        "    -arm                 Preroll and wait for SIGUSR1 to start playback\n"
+        "    -live                Live input, a few frames of latency following its clock\n"
+        "                         -f shm:<name> reads the bus of bmdcapture -P, live\n"
+        "    -io <method>         Input reading: avio, buffered, direct or mmap (default = buffered)\n"
+        "    -C <num>[,<num>...]  Card numbers to be used, the same playout on each\n"
+        "    -b <num>[f]          Milliseconds (or frames with f) to buffer before playback (default = 500 ms)\n"
+        "    -w <num>             Milliseconds to wait for the buffer to fill (default = 5000 ms)\n"
+        "    -p <pixel>           PixelFormat Depth (8 or 10 - default is 8)\n"
+        "    -t <threads>         Threads used to scale to the output mode (default = number of cpus)\n"
+        "    -S <port>            Serial device (i.e: /dev/ttyS0, /dev/ttyUSB0)\n"
+        "    -O <output>          Output connection:\n"
+        "                         1: Composite video + analog audio\n"
+        "                         2: Components video + analog audio\n"
+        "                         3: HDMI video + audio\n"
+        "                         4: SDI video + audio\n\n");
+
+    return status;
+}
+
+int main(int argc, char *argv[])
+{
+    Player generator;
+    int ch, ret;
+    int videomode  = 2;
+    int connection = 0;
+    int devices[kMaxOutputs] = { 0 };
+    int nb_devices = 1;
+    char *filename = NULL;
+    char *cue_arg  = NULL;
+    bool buffer_set = false;
+    Clip *clip;
+    static const struct option options[] = {
+        { "loop", no_argument,       &loop, 1   },
+        { "ss",   required_argument, NULL,  's' },
+        { "arm",  no_argument,       &arm,  1   },
+        { "io",   required_argument, NULL,  'I' },
+        { "live", no_argument,       &live, 1   },
+        { NULL,   0,                 NULL,  0   }
+    };
+
+    while ((ch = getopt_long_only(argc, argv, "?hs:f:l:a:m:n:F:C:O:b:p:S:t:w:M:",
+                                  options, NULL)) != -1) {
+        switch (ch) {
+        case 'p':
+            switch (atoi(optarg)) {
+            case  8:
+                pix     = bmdFormat8BitYUV;
+                pix_fmt = AV_PIX_FMT_UYVY422;
+                break;
+            case 10:
+                pix     = bmdFormat10BitYUV;
+                pix_fmt = AV_PIX_FMT_YUV422P10;
+                break;
+            default:
+                fprintf(
+                    stderr,
+                    "Invalid argument: Pixel Format Depth must be either 8 bits or 10 bits\n");
+                return usage(1);
+            }
+            break;
+        case 'f':
+            filename = strdup(optarg);
+            break;
+        case 'l':
+            playlist = strcmp(optarg, "-") ? fopen(optarg, "r") : stdin;
+            if (!playlist) {
+                fprintf(stderr, "Cannot open the playlist %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'm':
+            videomode = atoi(optarg);
+            break;
+        case 'O':
+            connection = atoi(optarg);
+            break;
+        case 'C': {
+            char *p    = optarg;
+            nb_devices = 0;
+            do {
+                if (nb_devices == kMaxOutputs) {
+                    fprintf(stderr, "At most %d outputs can be used\n",
+                            kMaxOutputs);
+                    return 1;
+                }
+                devices[nb_devices] = strtol(p, &p, 10);
+                for (int i = 0; i < nb_devices; i++)
+                    if (devices[i] == devices[nb_devices]) {
+                        fprintf(stderr, "-C %d is listed twice\n",
+                                devices[i]);
+                        return 1;
+                    }
+                nb_devices++;
+            } while (*p++ == ',');
+            break;
+        }
+        case 'b': {
+            char *end;
+            buffer        = strtol(optarg, &end, 10);
+            buffer_frames = *end == 'f';
+            buffer_set    = true;
+            break;
+        }
+        case 'w':
+            buffer_timeout = atoi(optarg);
+            break;
+        case 'S':
+            // not waiting for the carrier, the writes block
+            serial_fd = open(optarg, O_RDWR | O_NONBLOCK);
+            if (serial_fd < 0) {
+                fprintf(stderr, "Cannot open %s: %s\n", optarg,
+                        strerror(errno));
+                return 1;
+            }
+            fcntl(serial_fd, F_SETFL,
+                  fcntl(serial_fd, F_GETFL) & ~O_NONBLOCK);
+            break;
+        case 't':
+            scale_threads = atoi(optarg);
+            break;
+        case 'M':
+            loop_budget = atoll(optarg);
+            break;
+        case 's':
+            cue_arg = optarg;
+            break;
+        case 'I':
+            if (!strcmp(optarg, "avio")) {
+                io_mode = -1;
+            } else if (!strcmp(optarg, "buffered")) {
+                io_mode = READAHEAD_BUFFERED;
+            } else if (!strcmp(optarg, "direct")) {
+                io_mode = READAHEAD_DIRECT;
+            } else if (!strcmp(optarg, "mmap")) {
+                io_mode = READAHEAD_MMAP;
+            } else {
+                fprintf(stderr, "Invalid argument: -io must be avio, buffered, direct or mmap\n");
+                return usage(1);
+            }
+            break;
+        case '?':
+        case 'h':
+            return usage(0);
+        }
+    }
+
+    // the bus is always live, and can not be rewound
+    if (filename && !strncmp(filename, "shm:", 4)) {
+        if (loop || cue_arg) {
+            fprintf(stderr, "-loop and -ss need a file, not a bus\n");
+            return 1;
+        }
+        live = 1;
+    }
+
+    if (live && !buffer_set) {
+        buffer        = kLivePreroll;
+        buffer_frames = 1;
+    }
+
+    if (loop && playlist) {
+        fprintf(stderr, "-loop plays a single file, not a playlist\n");
+        return 1;
+    }
+
+    if (!filename && playlist)
+        filename = playlist_next();
+
+    if (!filename)
+        return usage(1);
+
+    av_register_all();
+
+    clip = clip_open(filename);
+    if (!clip)
+        return 1;
+
+    if (!clip->audio.st) {
+        av_log(NULL, AV_LOG_INFO,
+               "No audio stream found - bmdplay will just play video\n");
+    } else {
+        // the card takes 48kHz 16 or 32bit audio on 2, 8 or 16 channels
+        AVCodecContext *avctx = clip->audio.codec;
+
+        play_audio = 1;
+        if (av_get_bytes_per_sample(avctx->sample_fmt) > 2)
+            audio_fmt = AV_SAMPLE_FMT_S32;
+        if (avctx->channels > 8)
+            audio_channels = 16;
+        else if (avctx->channels > 2)
+            audio_channels = 8;
+        if (avctx->channels > 16)
+            av_log(NULL, AV_LOG_WARNING,
+                   "Only the first 16 of %d audio channels will be played\n",
+                   avctx->channels);
+    }
+    clip->refs = 2 + play_audio;
+
+    if (cue_arg) {
+        cue_point = parse_cue(clip, cue_arg);
+        if (cue_point == AV_NOPTS_VALUE || cue_point < 0) {
+            fprintf(stderr, "Invalid cue point %s\n", cue_arg);
+            return 1;
+        }
+    }
+
+    if (!clip->bus)
+        av_dump_format(clip->ic, 0, filename, 0);
+
+    if (scale_threads <= 0)
+        scale_threads = FFMIN(FFMAX(sysconf(_SC_NPROCESSORS_ONLN), 1), 16);
+
+    signal(SIGINT, sigfunc);
+    signal(SIGUSR1, trigger);
+    pthread_mutex_init(&sleepMutex, NULL);
+    pthread_cond_init(&sleepCond, NULL);
+    pthread_mutex_init(&clip_mutex, NULL);
+    pthread_cond_init(&clip_cond, NULL);
+
+    free(filename);
+
+    av_init_packet(&switch_pkt);
+    switch_pkt.data = (uint8_t *)"SWITCH";
+
+    playlist_done = !playlist;
+
+    ret = generator.Init(clip, videomode, connection, devices, nb_devices);
 
     fprintf(stderr, "video %" PRId64 " audio %" PRId64 "\n",
             videoqueue.nb_packets,
             audioqueue.nb_packets);
 
-    return ret;
+    return ret;
+}
+
+Player::Player()
+{
+    m_audioSampleRate      = bmdAudioSampleRate48kHz;
+    m_running              = false;
+    m_outputSignal         = kOutputSignalDrop;
+    m_deckLinkOutput       = NULL;
+    m_outputCount          = 0;
+    m_outputsPrerolled     = 0;
+    m_outputsDrained       = 0;
+    m_nextSlot             = 0;
+    m_nextFrame            = NULL;
+    m_shownFrame           = NULL;
+    m_haveNext             = false;
+    m_intraOnly            = false;
+    m_srcFrameDuration     = 0;
+    m_lastPts              = AV_NOPTS_VALUE;
+    m_currentFrame         = NULL;
+    m_framesRepeated       = 0;
+    m_framesDropped        = 0;
+    m_framesSkipped        = 0;
+    m_initTime             = av_gettime_relative();
+    m_firstFrameShown      = false;
+    m_timeOffset           = 0;
+    m_blackFrame           = NULL;
+    m_starved              = false;
+    m_underruns            = 0;
+    m_underrunFrames       = 0;
+    m_underrunLength       = 0;
+    m_dropToKey            = false;
+    m_lateMode             = false;
+    m_healthyCompletions   = 0;
+    m_lateRecoveries       = 0;
+    m_clip                 = NULL;
+    m_draining             = false;
+    m_ended                = false;
+    m_switchTime           = 0;
+    m_clipSwitches         = 0;
+    m_switchTimeMax        = 0;
+    m_fillThreadStarted    = false;
+    m_audioThreadStarted   = false;
+    m_cache                = NULL;
+    m_cacheCount           = 0;
+    m_cacheNext            = 0;
+    m_cacheShown           = -1;
+    m_cacheLoop            = 0;
+    m_cueing               = false;
+    m_cueStart             = 0;
+    m_cueDecoded           = 0;
+    m_armed                = false;
+    m_playing              = false;
+    memset(m_slots, 0, sizeof(m_slots));
+    memset(m_slotTimeOffset, 0, sizeof(m_slotTimeOffset));
+    m_liveDrift            = 0;
+    m_liveAdjusted         = 0;
+    m_liveDepth            = 0;
+    m_liveJumped           = 0;
+    m_serialThreadStarted  = false;
+    m_serialWritten        = 0;
+    m_serialLate           = 0;
+    pthread_mutex_init(&m_renderMutex, NULL);
+}
+
+bool Player::Init(Clip *clip, int videomode, int connection,
+                  const int *devices, int count)
+{
+    // Initialize the DeckLink API
+    IDeckLinkIterator *deckLinkIterator = CreateDeckLinkIteratorInstance();
+    IDeckLink *deckLink;
+    int found = 0;
+
+    m_clip = clip;
+
+    if (!deckLinkIterator) {
+        fprintf(stderr,
+                "This application requires the DeckLink drivers installed.\n");
+        goto bail;
+    }
+
+    if (play_audio) {
+        m_audioSampleDepth  = av_get_bytes_per_sample(audio_fmt) * 8;
+        m_audioChannelCount = audio_channels;
+
+        if (sample_ring_init(&audioring, kAudioRingSize,
+                             m_audioChannelCount * m_audioSampleDepth / 8,
+                             count) < 0) {
+            fprintf(stderr, "Cannot allocate the audio buffer\n");
+            goto bail;
+        }
+    }
+
+    for (int i = 0; i < count; i++)
+        m_outputs[i] = new Output(this, i, devices[i]);
+    m_outputCount = count;
+
+    for (int n = 0; deckLinkIterator->Next(&deckLink) == S_OK; n++) {
+        Output *output = NULL;
+
+        for (int i = 0; i < count; i++)
+            if (devices[i] == n)
+                output = m_outputs[i];
+
+        if (!output) {
+            deckLink->Release();
+            continue;
+        }
+        if (!output->Open(deckLink, connection))
+            goto bail;
+        found++;
+    }
+
+    if (found < count) {
+        fprintf(stderr, "No DeckLink PCI cards found\n");
+        goto bail;
+    }
+
+    m_deckLinkOutput = m_outputs[0]->m_deckLinkOutput;
+
+    for (int i = 0; count > 1 && i < count; i++)
+        if (!m_outputs[i]->m_genlocked)
+            fprintf(stderr, "-C %d is not locked to a reference, it will "
+                    "drift from the other outputs\n", m_outputs[i]->m_device);
+
+    m_nextFrame  = av_frame_alloc();
+    m_shownFrame = av_frame_alloc();
+
+    packet_queue_init(&audioqueue);
+    packet_queue_init(&videoqueue);
+    packet_queue_init(&dataqueue);
+    // Start playing
+    StartRunning(videomode);
+
+    // SIGUSR1 starts an armed playback, SIGINT or the end of the playlist
+    // ends it
+    pthread_mutex_lock(&sleepMutex);
+    while (!stopping) {
+        if (!triggered && live) {
+            struct timespec ts;
+
+            // and -live reports the latency every second
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec++;
+            if (pthread_cond_timedwait(&sleepCond, &sleepMutex,
+                                       &ts) == ETIMEDOUT) {
+                LiveReport();
+                continue;
+            }
+        } else if (!triggered) {
+            pthread_cond_wait(&sleepCond, &sleepMutex);
+        }
+        if (!triggered)
+            continue;
+        triggered = 0;
+        if (__atomic_exchange_n(&m_armed, false, __ATOMIC_ACQ_REL)) {
+            StartPlayback();
+            fprintf(stderr, "Triggered, playback started %" PRId64
+                    " us after the signal\n",
+                    av_gettime_relative() - trigger_time);
+        } else {
+            fprintf(stderr, "Trigger ignored, not armed\n");
+        }
+    }
+    pthread_mutex_unlock(&sleepMutex);
+    fill_me = 0;
+    fprintf(stderr, "Exiting, cleaning up\n");
+    pthread_mutex_lock(&clip_mutex);
+    pthread_cond_broadcast(&clip_cond);
+    pthread_mutex_unlock(&clip_mutex);
+    if (m_audioThreadStarted) {
+        packet_queue_abort(&audioqueue);
+        pthread_join(m_audioThread, NULL);
+    }
+    if (m_fillThreadStarted) {
+        packet_queue_abort(&videoqueue);
+        packet_queue_abort(&audioqueue);
+        pthread_join(m_fillThread, NULL);
+    }
+    if (m_serialThreadStarted) {
+        packet_queue_abort(&dataqueue);
+        pthread_join(m_serialThread, NULL);
+    }
+    packet_queue_end(&audioqueue);
+    packet_queue_end(&videoqueue);
+    packet_queue_end(&dataqueue);
+
+    fprintf(stderr, "%lu frames rendered, %lu repeated, "
+            "%lu dropped, %lu not decoded\n",
+            m_nextSlot, m_framesRepeated,
+            m_framesDropped + m_framesSkipped, m_framesSkipped);
+    fprintf(stderr, "%lu video underruns, %lu frames (%" PRId64 " ms) "
+            "held, %lu late recoveries\n",
+            m_underruns + (m_underrunLength > 0), m_underrunFrames,
+            av_rescale(m_underrunFrames, 1000 * m_frameDuration,
+                       m_frameTimescale), m_lateRecoveries);
+    for (int i = 0; i < m_outputCount; i++) {
+        Output *output = m_outputs[i];
+
+        fprintf(stderr, "-C %d: %lu frames scheduled, %lu displayed late, "
+                "%lu dropped by the card, audio ran dry %lu times\n",
+                output->m_device, output->m_framesScheduled,
+                output->m_framesLate, output->m_framesDroppedOut,
+                output->m_audioUnderruns);
+        if (play_audio)
+            fprintf(stderr, "-C %d: audio up to %.1f ms off the video, "
+                    "%lu samples dropped and %lu repeated to follow it, "
+                    "water level %lu ms after %lu raises\n",
+                    output->m_device, output->m_avOffsetMax / 48,
+                    output->m_samplesDropped, output->m_samplesRepeated,
+                    output->m_audioWaterlevel / 48, output->m_waterlevelRaises);
+    }
+    if (play_audio && !m_cacheCount)
+        fprintf(stderr, "Audio up to %.1f ms off its timestamps, %lu times "
+                "resampled and %lu times realigned\n",
+                audio_drift_max / 48.0, audio_drift_soft, audio_drift_hard);
+    if (serial_fd >= 0)
+        fprintf(stderr, "%lu data packets written to the serial port, "
+                "%lu a frame or more late\n", m_serialWritten, m_serialLate);
+    if (m_clipSwitches)
+        fprintf(stderr, "%lu clip switches, the slowest took %" PRId64
+                " us\n", m_clipSwitches, m_switchTimeMax);
+
+bail:
+    if (m_running == true)
+        StopRunning();
+
+    if (deckLinkIterator != NULL)
+        deckLinkIterator->Release();
+
+    if (m_currentFrame)
+        m_currentFrame->Release();
+    if (m_blackFrame)
+        m_blackFrame->Release();
+    for (unsigned i = 0; i < m_cacheCount; i++)
+        m_cache[i].frame->Release();
+    for (int i = 0; i < kSharedSlots; i++)
+        if (m_slots[i].frame)
+            m_slots[i].frame->Release();
+    // Release the outputs once their frames are gone
+    for (int i = 0; i < m_outputCount; i++) {
+        m_outputs[i]->Close();
+        delete m_outputs[i];
+    }
+    av_freep(&m_cache);
+    av_freep(&loop_samples);
+    av_frame_free(&m_nextFrame);
+    av_frame_free(&m_shownFrame);
+    slice_scaler_free(&scaler);
+    sample_ring_free(&audioring);
+    clip_unref(m_clip);
+
+    return true;
+}
+
+IDeckLinkDisplayMode *Player::GetDisplayModeByIndex(int selectedIndex)
+{
+    // Populate the display mode combo with a list of display modes supported by the installed DeckLink card
+    IDeckLinkDisplayModeIterator *displayModeIterator;
+    IDeckLinkDisplayMode *deckLinkDisplayMode;
+    IDeckLinkDisplayMode *selectedMode = NULL;
+    int index                          = 0;
+
+    if (m_deckLinkOutput->GetDisplayModeIterator(&displayModeIterator) != S_OK)
+        goto bail;
+    while (displayModeIterator->Next(&deckLinkDisplayMode) == S_OK) {
+        BMDProbeString str;
+
+        if (deckLinkDisplayMode->GetName(&str) == S_OK) {
+            if (index == selectedIndex) {
+                printf("Selected mode: %s\n\n\n", ToStr(str));
+                selectedMode = deckLinkDisplayMode;
+                FreeStr(str);
+                goto bail;
+            }
+        }
+        index++;
+    }
+bail:
+    displayModeIterator->Release();
+    return selectedMode;
+}
+
+/*
+ * Wait until the queues hold the buffer target or the timeout expires,
+ * return the number of frames to preroll.
+ */
+unsigned Player::WaitForBuffers()
+{
+    AVRational ms   = { 1, 1000 };
+    int64_t target  = buffer_frames ?
+                      av_rescale(buffer, 1000 * m_frameDuration, m_frameTimescale) :
+                      buffer;
+    int64_t start   = av_gettime_relative();
+    int64_t video_ms, audio_ms, elapsed;
+    unsigned preroll;
+    bool met;
+
+    // the audio ring cannot hold more than this
+    int64_t audio_target = FFMIN(target, kAudioRingSize * 1000LL / 48000 * 3 / 4);
+
+    for (;;) {
+        // a cached loop has all the video in memory already
+        video_ms = m_cacheCount ? target :
+                   av_rescale_q(packet_queue_duration(&videoqueue,
+                                                      m_srcFrameDuration),
+                                timeline_tb, ms);
+        audio_ms = play_audio ?
+                   sample_ring_fill(&audioring) * 1000LL / 48000 +
+                   av_rescale_q(packet_queue_duration(&audioqueue, 0),
+                                timeline_tb, ms) :
+                   audio_target;
+        elapsed  = (av_gettime_relative() - start) / 1000;
+        met      = video_ms >= target && audio_ms >= audio_target;
+
+        if (met || fill_done || !fill_me || elapsed >= buffer_timeout)
+            break;
+        usleep(2000);
+    }
+
+    fprintf(stderr, "Buffered %" PRId64 " ms of video and %" PRId64
+            " ms of audio in %" PRId64 " ms, target of %" PRId64 " ms %s\n",
+            video_ms, audio_ms, elapsed, target, met ? "met" : "NOT met");
+
+    preroll = av_rescale(target, m_frameTimescale, 1000 * m_frameDuration);
+
+    return FFMIN(FFMAX(preroll, kMinPreroll), kMaxPreroll);
+}
+
+void Player::StartRunning(int videomode)
+{
+    IDeckLinkDisplayMode *videoDisplayMode = NULL;
+    BMDDisplayMode displayMode;
+    unsigned preroll;
+
+    // Get the display mode for 1080i 59.95
+    videoDisplayMode = GetDisplayModeByIndex(videomode);
+
+    if (!videoDisplayMode)
+        return;
+
+    m_frameWidth     = videoDisplayMode->GetWidth();
+    m_frameHeight    = videoDisplayMode->GetHeight();
+    m_fieldDominance = videoDisplayMode->GetFieldDominance();
+    videoDisplayMode->GetFrameRate(&m_frameDuration, &m_frameTimescale);
+    displayMode      = videoDisplayMode->GetDisplayMode();
+
+    SetupDecoder();
+
+    for (int i = 0; i < m_outputCount; i++) {
+        Output *output = m_outputs[i];
+
+        // Set the video output mode
+        if (output->m_deckLinkOutput->EnableVideoOutput(displayMode,
+                                                        bmdVideoOutputFlagDefault) !=
+            S_OK) {
+            fprintf(stderr, "Failed to enable video output on -C %d\n",
+                    output->m_device);
+            return;
+        }
+
+        // Set the audio output mode
+        if (play_audio &&
+            output->m_deckLinkOutput->EnableAudioOutput(bmdAudioSampleRate48kHz,
+                                                        m_audioSampleDepth,
+                                                        m_audioChannelCount,
+                                                        bmdAudioOutputStreamTimestamped) !=
+            S_OK) {
+            fprintf(stderr, "Failed to enable audio output on -C %d\n",
+                    output->m_device);
+            return;
+        }
+    }
+
+    StartDecoding();
+    preroll = WaitForBuffers();
+    // slot by slot, each frame is rendered once for all the outputs
+    for (unsigned i = 0; i < preroll; i++)
+        for (int j = 0; j < m_outputCount; j++)
+            m_outputs[j]->ScheduleNextFrame();
+    Arm();
+
+    if (play_audio) {
+        // Begin audio preroll.  This will begin calling our audio callback, which will start the DeckLink output stream.
+        for (int i = 0; i < m_outputCount; i++) {
+            if (m_outputs[i]->m_deckLinkOutput->BeginAudioPreroll() != S_OK) {
+                fprintf(stderr, "Failed to begin audio preroll\n");
+                return;
+            }
+        }
+    } else if (!m_armed) {
+        StartPlayback();
+    }
+
+    m_running = true;
+
+    return;
+}
+
+/*
+ * Start the threads feeding the queues and the audio ring, or with -loop
+ * fill the cache first and only feed the audio if it fits.
+ */
+void Player::StartDecoding()
+{
+    int64_t target = buffer_frames ?
+                     av_rescale(buffer, AV_TIME_BASE * m_frameDuration,
+                                m_frameTimescale) :
+                     buffer * 1000LL;
+    pthread_t th;
+
+    if (cue_point != AV_NOPTS_VALUE) {
+        m_cueStart = av_gettime_relative();
+        m_cueing   = clip_cue(m_clip, cue_point) >= 0;
+        if (!m_cueing)
+            fprintf(stderr, "Cannot seek to the cue point, playing from "
+                    "the start\n");
+    }
+
+    if (loop && FillCache()) {
+        m_cueing = false;
+        if (play_audio)
+            m_audioThreadStarted = !pthread_create(&m_audioThread, NULL,
+                                                   loop_audio, NULL);
+        return;
+    }
+
+    if (loop) {
+        loop_file     = av_strdup(m_clip->filename);
+        playlist_done = 0;
+    }
+
+    // the demuxer keeps this far ahead rather than reading the whole input
+    videoqueue.max_duration = FFMAX(kReadAhead, 2 * target);
+    audioqueue.max_duration = videoqueue.max_duration;
+    m_fillThreadStarted     = !pthread_create(&m_fillThread, NULL,
+                                              fill_queues, m_clip);
+    if (serial_fd >= 0)
+        m_serialThreadStarted = !pthread_create(&m_serialThread, NULL,
+                                                serial_writer, this);
+    if (play_audio)
+        m_audioThreadStarted = !pthread_create(&m_audioThread, NULL,
+                                               decode_audio, m_clip);
+    if (playlist || loop_file) {
+        pthread_create(&th, NULL, load_clips, NULL);
+        pthread_detach(th);
+    }
+}
+
+/* with -arm the preroll is kept until the trigger */
+void Player::Arm()
+{
+    if (!arm)
+        return;
+
+    fprintf(stderr, "Armed with %lu frames prerolled, waiting for SIGUSR1\n",
+            m_nextSlot);
+    __atomic_store_n(&m_armed, true, __ATOMIC_RELEASE);
+}
+
+/* append converted samples to the loop audio, false if over the budget */
+static bool loop_samples_append(int64_t *count, int64_t *size, int64_t *used,
+                                int64_t budget, const uint8_t *src, int64_t n,
+                                int channels, int bytes)
+{
+    int frame_size = audio_channels * bytes;
+
+    if (*count + n > *size) {
+        int64_t grow = FFMAX(*size * 2, *count + n);
+
+        if (*used + (grow - *size) * frame_size > budget ||
+            av_reallocp(&loop_samples, grow * frame_size) < 0)
+            return false;
+        *used += (grow - *size) * frame_size;
+        *size  = grow;
+    }
+
+    if (src)
+        copy_samples(loop_samples + *count * frame_size, src, n,
+                     channels * bytes, frame_size);
+    else
+        memset(loop_samples + *count * frame_size, 0, n * frame_size);
+    *count += n;
+
+    return true;
+}
+
+/*
+ * -loop: decode the whole clip into output frames, and its audio into
+ * output samples, as long as they fit in the memory budget.  The clip is
+ * rewound to be streamed in a loop instead if they do not.
+ */
+bool Player::FillCache()
+{
+    Clip *c              = m_clip;
+    int64_t start        = av_gettime_relative();
+    int64_t budget       = loop_budget << 20;
+    int64_t frame_size   = (int64_t)row_bytes(pix, m_frameWidth) * m_frameHeight;
+    int64_t used         = 0;
+    int64_t samples      = 0;
+    int64_t samples_size = 0;
+    int64_t skip         = 0;
+    int64_t period_samples;
+    int bytes            = av_get_bytes_per_sample(audio_fmt);
+    bool first_audio     = true;
+    bool eof             = false;
+    bool fits            = true;
+    unsigned size        = 0;
+    AVRational tb        = { 1, 48000 };
+    AVFrame *frame       = av_frame_alloc();
+    AudioConverter ac;
+    AVPacket pkt;
+
+    audio_converter_init(&ac);
+
+    // no use decoding if the duration says it will not fit
+    if (c->ic->duration > 0 && c->frame_duration > 0 &&
+        c->ic->duration / c->frame_duration * frame_size > budget)
+        fits = false;
+
+    while (fits && frame && !eof) {
+        if (av_read_frame(c->ic, &pkt) < 0) {
+            eof = true;
+            avcodec_send_packet(c->video.codec, NULL);
+            if (play_audio && c->audio.codec)
+                avcodec_send_packet(c->audio.codec, NULL);
+        } else {
+            switch (clip_rebase(c, &pkt)) {
+            case AVMEDIA_TYPE_VIDEO:
+                avcodec_send_packet(c->video.codec, &pkt);
+                break;
+            case AVMEDIA_TYPE_AUDIO:
+                avcodec_send_packet(c->audio.codec, &pkt);
+                break;
+            default:
+                break;
+            }
+            av_packet_unref(&pkt);
+        }
+
+        while (fits && avcodec_receive_frame(c->video.codec, frame) >= 0) {
+            IDeckLinkMutableVideoFrame *converted;
+            int64_t pts = frame->pts;
+
+            if (used + frame_size > budget) {
+                fits = false;
+                break;
+            }
+            if (pts == AV_NOPTS_VALUE)
+                pts = m_cacheCount ?
+                      m_cache[m_cacheCount - 1].pts + c->frame_duration : 0;
+            if (pts + c->frame_duration <= 0) {
+                // before the cue point
+                av_frame_unref(frame);
+                continue;
+            }
+
+            converted = ConvertFrame(frame);
+            av_frame_unref(frame);
+            if (!converted)
+                continue;
+
+            if (m_cacheCount == size) {
+                LoopFrame *cache;
+
+                size  = FFMAX(size * 2, 64);
+                cache = (LoopFrame *)av_realloc(m_cache, size * sizeof(*cache));
+                if (!cache) {
+                    converted->Release();
+                    fits = false;
+                    break;
+                }
+                m_cache = cache;
+            }
+            m_cache[m_cacheCount].frame = converted;
+            m_cache[m_cacheCount].pts   = pts;
+            m_cacheCount++;
+            used += frame_size;
+        }
+
+        while (fits && play_audio && c->audio.codec &&
+               avcodec_receive_frame(c->audio.codec, frame) >= 0) {
+            int count;
+
+            // the samples start at the beginning of the timeline
+            if (first_audio && frame->pts != AV_NOPTS_VALUE) {
+                int64_t pos = av_rescale_q(frame->pts, timeline_tb, tb);
+
+                if (pos > 0)
+                    fits = loop_samples_append(&samples, &samples_size,
+                                               &used, budget, NULL, pos,
+                                               0, bytes);
+                skip = FFMAX(-pos, 0);
+            }
+            first_audio = false;
+
+            count = audio_convert(&ac, c->audio.codec, frame);
+            av_frame_unref(frame);
+            if (count > skip)
+                fits = fits && loop_samples_append(&samples, &samples_size,
+                                                   &used, budget,
+                                                   ac.buf + skip * ac.channels * bytes,
+                                                   count - skip, ac.channels,
+                                                   bytes);
+            skip = FFMAX(skip - FFMAX(count, 0), 0);
+        }
+    }
+
+    if (fits && play_audio) {
+        int count;
+
+        while ((count = audio_convert(&ac, c->audio.codec, NULL)) > 0 && fits)
+            fits = loop_samples_append(&samples, &samples_size, &used, budget,
+                                       ac.buf, count, ac.channels, bytes);
+    }
+
+    audio_converter_free(&ac);
+    av_frame_free(&frame);
+
+    // the clip lasts as long as its video, the audio is cut or padded
+    loop_period    = c->end;
+    period_samples = av_rescale_q_rnd(loop_period, timeline_tb, tb,
+                                      AV_ROUND_UP);
+    if (fits && play_audio && samples < period_samples)
+        fits = loop_samples_append(&samples, &samples_size, &used, budget,
+                                   NULL, period_samples - samples, 0, bytes);
+
+    if (!fits || !m_cacheCount || loop_period <= 0) {
+        fprintf(stderr, "%s does not fit in %" PRId64 " MB, "
+                "streaming the loop\n", c->filename, loop_budget);
+        for (unsigned i = 0; i < m_cacheCount; i++)
+            m_cache[i].frame->Release();
+        m_cacheCount = 0;
+        av_freep(&m_cache);
+        av_freep(&loop_samples);
+        if (clip_rewind(c) < 0)
+            fprintf(stderr, "Cannot rewind %s\n", c->filename);
+        return false;
+    }
+
+    audio_start_time = 0;
+
+    fprintf(stderr, "Cached %u frames (%" PRId64 " MB) and %" PRId64
+            " ms of audio in %" PRId64 " ms, looping every %" PRId64
+            " ms from memory\n", m_cacheCount, used >> 20,
+            samples * 1000 / 48000,
+            (av_gettime_relative() - start) / 1000, loop_period / 1000);
+
+    return true;
+}
+
+/*
+ * The cached counterpart of DecodeUntil: the last cached frame due at time,
+ * counting the loops, true if it changed.
+ */
+bool Player::CacheUntil(BMDTimeValue time)
+{
+    AVRational tb = { 1, (int)m_frameTimescale };
+    int64_t limit = av_rescale_q(time, tb, timeline_tb);
+    int advanced  = 0;
+
+    while (m_cacheLoop * loop_period + m_cache[m_cacheNext].pts <= limit) {
+        m_cacheShown = m_cacheNext;
+        if (++m_cacheNext == m_cacheCount) {
+            m_cacheNext = 0;
+            m_cacheLoop++;
+        }
+        advanced++;
+    }
+
+    if (advanced > 1)
+        m_framesDropped += advanced - 1;
+
+    return advanced > 0;
+}
+
+void Player::StopRunning()
+{
+    for (int i = 0; i < m_outputCount; i++) {
+        IDeckLinkOutput *output = m_outputs[i]->m_deckLinkOutput;
+
+        // Stop the audio and video output streams immediately
+        output->StopScheduledPlayback(0, NULL, 0);
+        //
+        output->DisableAudioOutput();
+        output->DisableVideoOutput();
+    }
+}
+
+/* copy one field, every other line starting from parity, between frames */
+static void copy_field(IDeckLinkVideoFrame *dst, IDeckLinkVideoFrame *src,
+                       int parity, int width, int height)
+{
+    uint8_t *dst_data[4], *src_data[4];
+    int dst_linesize[4], src_linesize[4];
+    void *dst_bytes, *src_bytes;
+
+    dst->GetBytes(&dst_bytes);
+    src->GetBytes(&src_bytes);
+
+    av_image_fill_arrays(dst_data, dst_linesize, (uint8_t *)dst_bytes,
+                         pix_fmt, width, height, 1);
+    av_image_fill_arrays(src_data, src_linesize, (uint8_t *)src_bytes,
+                         pix_fmt, width, height, 1);
+
+    for (int p = 0; p < 4 && dst_data[p]; p++)
+        for (int y = parity; y < height; y += 2)
+            memcpy(dst_data[p] + y * dst_linesize[p],
+                   src_data[p] + y * src_linesize[p], dst_linesize[p]);
+}
+
+IDeckLinkMutableVideoFrame *Player::ConvertFrame(AVFrame *frame)
+{
+    IDeckLinkMutableVideoFrame *videoFrame;
+    uint8_t *data[4];
+    int linesize[4];
+    void *bytes;
+
+    if (!slice_scaler_match(scaler, frame->width, frame->height,
+                            (AVPixelFormat)frame->format)) {
+        slice_scaler_free(&scaler);
+        scaler = slice_scaler_alloc(frame->width, frame->height,
+                                    (AVPixelFormat)frame->format,
+                                    frame->sample_aspect_ratio,
+                                    m_frameWidth, m_frameHeight,
+                                    pix_fmt, scale_threads);
+    }
+
+    if (!scaler) {
+        fprintf(stderr, "Cannot convert the frame\n");
+        return NULL;
+    }
+
+    if (m_deckLinkOutput->CreateVideoFrame(m_frameWidth,
+                                           m_frameHeight,
+                                           m_frameWidth * 2,
+                                           pix,
+                                           bmdFrameFlagDefault,
+                                           &videoFrame) != S_OK) {
+        fprintf(stderr, "Cannot create a video frame\n");
+        return NULL;
+    }
+
+    videoFrame->GetBytes(&bytes);
+    av_image_fill_arrays(data, linesize, (uint8_t *)bytes,
+                         pix_fmt, m_frameWidth, m_frameHeight, 1);
+
+    slice_scaler_scale(scaler, frame->data, frame->linesize, data, linesize);
+
+    return videoFrame;
+}
+
+/* decoder settings that follow the clip */
+void Player::SetupDecoder()
+{
+    AVCodecContext *avctx         = m_clip->video.codec;
+    const AVCodecDescriptor *desc = avcodec_descriptor_get(avctx->codec_id);
+
+    m_intraOnly        = desc && (desc->props & AV_CODEC_PROP_INTRA_ONLY);
+    m_srcFrameDuration = m_clip->frame_duration;
+    m_dropToKey        = false;
+
+    if (m_lateMode) {
+        avctx->skip_frame       = AVDISCARD_NONREF;
+        avctx->skip_loop_filter = AVDISCARD_NONREF;
+    }
+}
+
+/*
+ * The decoder of the previous clip is drained: move to the next one and
+ * take the picture decoded ahead, true if there is one.
+ */
+bool Player::NextClip(int64_t entered)
+{
+    Clip *next = m_clip->next;
+    bool ready = next->first_frame && next->first_frame->buf[0];
+    int64_t elapsed;
+
+    clip_unref(m_clip);
+    m_clip     = next;
+    m_draining = false;
+    SetupDecoder();
+
+    if (ready)
+        av_frame_move_ref(m_nextFrame, next->first_frame);
+
+    elapsed         = m_switchTime + av_gettime_relative() - entered;
+    m_switchTimeMax = FFMAX(m_switchTimeMax, elapsed);
+    m_clipSwitches++;
+
+    fprintf(stderr, "Clip %d %s at frame %lu: opened in %" PRId64
+            " ms, first picture %s in %" PRId64 " ms, switched in %" PRId64
+            " us\n", next->index, next->filename, m_nextSlot,
+            next->open_time / 1000, ready ? "decoded" : "NOT decoded",
+            next->decode_time / 1000, elapsed);
+    if (next->wait_time > 1000)
+        fprintf(stderr, "Clip %d was not ready, the input stalled %" PRId64
+                " ms\n", next->index, next->wait_time / 1000);
+
+    return ready;
+}
+
+/*
+ * Decode the next frame in m_nextFrame.  Intra-only streams do not decode
+ * packets that would be superseded by the following one before limit.
+ * At a switch marker the decoder is drained and the next clip takes over.
+ */
+bool Player::DecodeFrame(int64_t limit)
+{
+    int64_t entered = av_gettime_relative();
+    AVPacket pkt;
+
+    for (;;) {
+        int ret = avcodec_receive_frame(m_clip->video.codec, m_nextFrame);
+
+        if (ret == AVERROR_EOF && m_draining) {
+            if (!m_clip->next) {
+                m_ended = true;
+                return false;
+            }
+            ret = NextClip(entered) ? 0 : AVERROR(EAGAIN);
+        }
+
+        if (ret >= 0) {
+            if (m_nextFrame->pts == AV_NOPTS_VALUE)
+                m_nextFrame->pts = m_lastPts == AV_NOPTS_VALUE ?
+                                   0 : m_lastPts + m_srcFrameDuration;
+            if (!m_srcFrameDuration && m_lastPts != AV_NOPTS_VALUE &&
+                m_nextFrame->pts > m_lastPts)
+                m_srcFrameDuration = m_nextFrame->pts - m_lastPts;
+            m_lastPts  = m_nextFrame->pts;
+            m_haveNext = true;
+            if (m_draining)
+                m_switchTime += av_gettime_relative() - entered;
+            return true;
+        }
+
+        if (ret != AVERROR(EAGAIN))
+            return false;
+
+        if (packet_queue_get(&videoqueue, &pkt, 0) <= 0)
+            return false;
+
+        if (pkt.data == switch_pkt.data) {
+            avcodec_send_packet(m_clip->video.codec, NULL);
+            m_draining   = true;
+            m_switchTime = 0;
+            continue;
+        }
+
+        // far behind, everything up to the next keyframe goes
+        if (m_dropToKey) {
+            if (!(pkt.flags & AV_PKT_FLAG_KEY)) {
+                m_framesSkipped++;
+                av_packet_unref(&pkt);
+                continue;
+            }
+            avcodec_flush_buffers(m_clip->video.codec);
+            m_dropToKey = false;
+        }
+
+        if (m_intraOnly && pkt.pts != AV_NOPTS_VALUE) {
+            int64_t duration = pkt.duration ? pkt.duration : m_srcFrameDuration;
+            if (duration && pkt.pts + duration <= limit) {
+                m_framesSkipped++;
+                m_lastPts = pkt.pts;
+                av_packet_unref(&pkt);
+                continue;
+            }
+        }
+
+        // cueing, what ends before the cue is only decoded as a reference
+        if (m_cueing) {
+            int64_t duration = pkt.duration ? pkt.duration : m_srcFrameDuration;
+            m_clip->video.codec->skip_frame =
+                pkt.pts != AV_NOPTS_VALUE && pkt.pts + duration <= 0 ?
+                AVDISCARD_NONREF : AVDISCARD_DEFAULT;
+        }
+
+        avcodec_send_packet(m_clip->video.codec, &pkt);
+        av_packet_unref(&pkt);
+    }
+}
+
+/*
+ * Make m_shownFrame the last source frame due at time, true if it changed.
+ * m_starved is set if the queue ran dry while the next frame was due.
+ */
+bool Player::DecodeUntil(BMDTimeValue time)
+{
+    AVRational tb = { 1, (int)m_frameTimescale };
+    int64_t limit = av_rescale_q(time, tb, timeline_tb);
+    int advanced  = 0;
+
+    for (;;) {
+        if (!m_haveNext && !DecodeFrame(limit)) {
+            m_starved = !fill_done &&
+                        (m_lastPts == AV_NOPTS_VALUE ||
+                         m_lastPts + m_srcFrameDuration <= limit);
+            break;
+        }
+        if (m_nextFrame->pts > limit)
+            break;
+        av_frame_unref(m_shownFrame);
+        av_frame_move_ref(m_shownFrame, m_nextFrame);
+        m_haveNext = false;
+        advanced++;
+    }
+
+    if (advanced && m_cueing) {
+        m_cueDecoded += advanced - 1;
+        m_cueing      = false;
+        if (!m_lateMode)
+            m_clip->video.codec->skip_frame = AVDISCARD_DEFAULT;
+        fprintf(stderr, "Cued at %.3f s in %" PRId64 " ms, %lu frames "
+                "decoded to get there\n", cue_point / 1000000.0,
+                (av_gettime_relative() - m_cueStart) / 1000, m_cueDecoded);
+    } else if (advanced > 1) {
+        m_framesDropped += advanced - 1;
+    }
+
+    return advanced > 0;
+}
+
+IDeckLinkMutableVideoFrame *Player::CreateBlackFrame()
+{
+    IDeckLinkMutableVideoFrame *videoFrame;
+    uint8_t *data[4];
+    int linesize[4];
+    void *bytes;
+
+    if (m_deckLinkOutput->CreateVideoFrame(m_frameWidth,
+                                           m_frameHeight,
+                                           m_frameWidth * 2,
+                                           pix,
+                                           bmdFrameFlagDefault,
+                                           &videoFrame) != S_OK) {
+        fprintf(stderr, "Cannot create a video frame\n");
+        return NULL;
+    }
+
+    videoFrame->GetBytes(&bytes);
+    av_image_fill_arrays(data, linesize, (uint8_t *)bytes,
+                         pix_fmt, m_frameWidth, m_frameHeight, 1);
+    fill_black(data, linesize, pix_fmt, 0, 0, m_frameWidth, m_frameHeight);
+
+    return videoFrame;
+}
+
+/*
+ * -live: keep kLiveDepth frames between the newest input and the slot
+ * rendered.  The source timeline is moved by a fraction of the difference
+ * every slot, which follows the input clock and drops or repeats a frame
+ * when the fractions add up.  Far over, it jumps at once.
+ */
+void Player::LiveAdjust(BMDTimeValue time)
+{
+    AVRational tb  = { 1, (int)m_frameTimescale };
+    AVRational out = { (int)m_frameDuration, (int)m_frameTimescale };
+    AVRational sr  = { 1, (int)m_audioSampleRate };
+    int64_t input  = __atomic_load_n(&live_input_pts, __ATOMIC_ACQUIRE);
+    int64_t depth, error, n;
+
+    if (input == AV_NOPTS_VALUE)
+        return;
+
+    depth = av_rescale_q(input, timeline_tb, tb) - (time - m_timeOffset);
+    error = depth - kLiveDepth * m_frameDuration;
+    __atomic_store_n(&m_liveDepth, depth, __ATOMIC_RELAXED);
+
+    // an underrun holds the timeline back already
+    if (m_underrunLength)
+        return;
+
+    if (error > kLiveJump * m_frameDuration) {
+        n = error / m_frameDuration;
+        m_timeOffset -= n * m_frameDuration;
+        m_liveJumped += n;
+        fprintf(stderr, "Live input %" PRId64 " frames ahead, skipped\n", n);
+        for (int i = 0; i < m_outputCount; i++)
+            __atomic_fetch_add(&m_outputs[i]->m_audioSkip,
+                               av_rescale_q(n, out, sr), __ATOMIC_RELAXED);
+        return;
+    }
+
+    m_liveDrift    += error / kLiveGain;
+    n               = (int64_t)m_liveDrift;
+    m_liveDrift    -= n;
+    m_timeOffset   -= n;
+    m_liveAdjusted += n;
+}
+
+/*
+ * The source time of the frame an output shows at stream time now, with
+ * the underrun offset in force when its slot was rendered.
+ */
+BMDTimeValue Player::SourceTime(Output *output, BMDTimeValue now)
+{
+    long slot = FFMAX(now / m_frameDuration + output->m_slotOffset, 0);
+
+    return now + output->m_slotOffset * m_frameDuration -
+           __atomic_load_n(&m_slotTimeOffset[slot % kOffsetHistory],
+                           __ATOMIC_RELAXED);
+}
+
+/*
+ * -S: each data packet goes out on the serial port once the first output
+ * shows its pts, from a thread of its own so that the port never holds up
+ * the schedule.
+ */
+void Player::WriteSerial()
+{
+    Output *output = m_outputs[0];
+    AVRational tb  = { 1, (int)m_frameTimescale };
+    AVPacket pkt;
+
+    while (packet_queue_get(&dataqueue, &pkt, 1) > 0) {
+        BMDTimeValue due = av_rescale_q(pkt.pts, timeline_tb, tb);
+        BMDTimeValue now = 0, shown = 0;
+        double speed     = 0;
+
+        while (fill_me && pkt.pts != AV_NOPTS_VALUE) {
+            int64_t wait = 10000;
+
+            if (output->m_deckLinkOutput->GetScheduledStreamTime(m_frameTimescale,
+                                                                 &now, &speed) == S_OK &&
+                speed > 0) {
+                shown = SourceTime(output, now);
+                if (shown >= due)
+                    break;
+                wait = FFMIN(av_rescale(due - shown, 1000000, m_frameTimescale),
+                             wait);
+            }
+            usleep(wait);
+        }
+
+        if (fill_me && pkt.size && pkt.data[0] != ' ') {
+            if (pkt.pts != AV_NOPTS_VALUE && shown - due >= m_frameDuration)
+                m_serialLate++;
+            if (write(serial_fd, pkt.data, pkt.size) != pkt.size)
+                fprintf(stderr, "Cannot write to the serial port: %s\n",
+                        strerror(errno));
+            else
+                m_serialWritten++;
+        }
+        av_packet_unref(&pkt);
+    }
+}
+
+/* -live: from the input reaching the demuxer to the picture going out */
+void Player::LiveReport()
+{
+    Output *output = m_outputs[0];
+    AVRational tb  = { 1, (int)m_frameTimescale };
+    int64_t input  = __atomic_load_n(&live_input_pts, __ATOMIC_ACQUIRE);
+    int64_t read   = __atomic_load_n(&live_input_time, __ATOMIC_RELAXED);
+    BMDTimeValue now;
+    int64_t latency;
+    double speed;
+
+    if (input == AV_NOPTS_VALUE || !m_running ||
+        output->m_deckLinkOutput->GetScheduledStreamTime(m_frameTimescale,
+                                                         &now, &speed) != S_OK ||
+        speed <= 0)
+        return;
+
+    latency = av_gettime_relative() - read + input -
+              av_rescale_q(SourceTime(output, now), tb, timeline_tb);
+
+    fprintf(stderr, "Live latency %" PRId64 " ms, %" PRId64 " ms queued, "
+            "input clock %+.0f ppm, %lu frames dropped and %lu repeated\n",
+            latency / 1000,
+            av_rescale(__atomic_load_n(&m_liveDepth, __ATOMIC_RELAXED), 1000,
+                       m_frameTimescale),
+            now > 0 ? m_liveAdjusted * 1e6 / now : 0.0,
+            m_framesDropped + m_liveJumped, m_framesRepeated);
+}
+
+/*
+ * A frame was due and there was none: the slot gets the last picture and
+ * the source timeline is held back by one frame, so that the queue depth
+ * is not lost and nothing is dropped once the data is back.  Audio gets a
+ * gap of the same length to stay in sync.
+ */
+void Player::Underrun()
+{
+    AVRational out = { (int)m_frameDuration, (int)m_frameTimescale };
+    AVRational tb  = { 1, (int)m_audioSampleRate };
+    int64_t gap;
+
+    if (!m_underrunLength++)
+        fprintf(stderr, "Video underrun at frame %lu\n", m_nextSlot);
+
+    // rounded on the total, one frame is not a whole number of samples
+    gap = av_rescale_q(m_underrunFrames + 1, out, tb) -
+          av_rescale_q(m_underrunFrames, out, tb);
+
+    m_timeOffset += m_frameDuration;
+    m_underrunFrames++;
+    for (int i = 0; i < m_outputCount; i++)
+        __atomic_fetch_add(&m_outputs[i]->m_audioGap, gap, __ATOMIC_RELAXED);
+}
+
+void Player::UnderrunEnded()
+{
+    fprintf(stderr, "Video underrun of %lu frames (%" PRId64 " ms)\n",
+            m_underrunLength,
+            av_rescale(m_underrunLength, 1000 * m_frameDuration,
+                       m_frameTimescale));
+    m_underruns++;
+    m_underrunLength = 0;
+}
+
+/*
+ * Render an output slot.  The slot time is on the output clock, the
+ * source frames are mapped on it field by field: a source frame starting
+ * on the second field of an interlaced slot is woven with the previous one,
+ * which gives 3:2 pulldown for 24p on 59.94i and proper 50p to 50i.
+ * The frame is kept in m_slots for the outputs behind.
+ */
+IDeckLinkVideoFrame *Player::RenderSlot(unsigned long slot)
+{
+    IDeckLinkMutableVideoFrame *videoFrame = NULL;
+    SlotFrame *s      = &m_slots[slot % kSharedSlots];
+    AVRational tb     = { 1, (int)m_frameTimescale };
+    BMDTimeValue time = slot * m_frameDuration;
+    BMDTimeValue source;
+    int fields        = m_fieldDominance == bmdUpperFieldFirst ||
+                        m_fieldDominance == bmdLowerFieldFirst ? 2 : 1;
+    int first         = m_fieldDominance == bmdLowerFieldFirst;
+    bool changed      = false;
+
+    if (live)
+        LiveAdjust(time);
+
+    // the source timeline is held back by the time spent in underruns
+    source    = time - m_timeOffset;
+    m_starved = false;
+
+    // nothing after the last frame of the playlist, the outputs run out
+    if (m_ended && !m_haveNext &&
+        av_rescale_q(source, tb, timeline_tb) >= m_lastPts + m_srcFrameDuration)
+        return NULL;
+
+    for (unsigned long i = slot - FFMIN(slot - m_nextSlot,
+                                        (unsigned long)kOffsetHistory - 1);
+         i <= slot; i++)
+        __atomic_store_n(&m_slotTimeOffset[i % kOffsetHistory], m_timeOffset,
+                         __ATOMIC_RELAXED);
+
+    for (int field = 0; field < fields; field++) {
+        BMDTimeValue t = source + field * m_frameDuration / fields;
+        IDeckLinkMutableVideoFrame *converted;
+
+        // pick the source frame closest to the field time
+        if (m_cacheCount) {
+            if (!CacheUntil(t + m_frameDuration / (2 * fields)))
+                continue;
+            converted = m_cache[m_cacheShown].frame;
+            converted->AddRef();
+        } else {
+            if (!DecodeUntil(t + m_frameDuration / (2 * fields)))
+                continue;
+            converted = ConvertFrame(m_shownFrame);
+            if (!converted)
+                continue;
+        }
+
+        if (field && m_currentFrame) {
+            if (videoFrame)
+                videoFrame->Release();
+            if (m_deckLinkOutput->CreateVideoFrame(m_frameWidth,
+                                                   m_frameHeight,
+                                                   m_frameWidth * 2,
+                                                   pix,
+                                                   bmdFrameFlagDefault,
+                                                   &videoFrame) == S_OK) {
+                copy_field(videoFrame, m_currentFrame, first,
+                           m_frameWidth, m_frameHeight);
+                copy_field(videoFrame, converted, !first,
+                           m_frameWidth, m_frameHeight);
+            } else {
+                videoFrame = NULL;
+            }
+        }
+
+        if (m_currentFrame)
+            m_currentFrame->Release();
+        m_currentFrame = converted;
+        changed        = true;
+    }
+
+    if (m_starved && !changed)
+        Underrun();
+    else if (m_underrunLength)
+        UnderrunEnded();
+
+    if (!videoFrame) {
+        // keep the schedule going with black until there is a picture
+        if (!m_currentFrame && !m_blackFrame) {
+            m_blackFrame = CreateBlackFrame();
+            if (!m_blackFrame)
+                return NULL;
+        }
+        videoFrame = m_currentFrame ? m_currentFrame : m_blackFrame;
+        videoFrame->AddRef();
+        if (!changed && !m_starved)
+            m_framesRepeated++;
+    }
+
+    if (s->frame)
+        s->frame->Release();
+    s->frame   = videoFrame;
+    s->slot    = slot;
+    m_nextSlot = slot + 1;
+
+    return videoFrame;
 }
 
-Player::Player()
+/*
+ * The frame of an output slot, rendered by the first output to get there.
+ * The outputs behind take it from m_slots, or the closest one still there.
+ * Called with m_renderMutex held, returns a new reference.
+ */
+IDeckLinkVideoFrame *Player::FrameForSlot(unsigned long slot)
 {
-    m_audioSampleRate = bmdAudioSampleRate48kHz;
-    m_running         = false;
-    m_outputSignal    = kOutputSignalDrop;
+    IDeckLinkVideoFrame *frame = NULL;
+    SlotFrame *best            = NULL;
+
+    if (slot >= m_nextSlot) {
+        frame = RenderSlot(slot);
+    } else {
+        for (int i = 0; i < kSharedSlots; i++) {
+            SlotFrame *s = &m_slots[i];
+
+            // the latest one up to slot, else the oldest one after it
+            if (!s->frame)
+                continue;
+            if (!best ||
+                (s->slot <= slot && (best->slot > slot || s->slot > best->slot)) ||
+                (s->slot > slot && best->slot > slot && s->slot < best->slot))
+                best = s;
+        }
+        if (best)
+            frame = best->frame;
+    }
+
+    if (frame)
+        frame->AddRef();
+
+    return frame;
 }
 
-bool Player::Init(int videomode, int connection, int camera)
+void Output::ScheduleNextFrame()
 {
-    // Initialize the DeckLink API
-    IDeckLinkIterator *deckLinkIterator = CreateDeckLinkIteratorInstance();
-    HRESULT result;
-    int i = 0;
+    Player *player = m_player;
+    IDeckLinkVideoFrame *frame;
+    BMDTimeValue time;
+
+    pthread_mutex_lock(&player->m_renderMutex);
+    frame = player->FrameForSlot(FFMAX((long)m_slot + m_slotOffset, 0));
+    time  = m_slot * player->m_frameDuration;
+    if (frame)
+        m_slot++;
+    pthread_mutex_unlock(&player->m_renderMutex);
+
+    if (!frame)
+        return;
 
-    if (!deckLinkIterator) {
-        fprintf(stderr,
-                "This application requires the DeckLink drivers installed.\n");
-        goto bail;
+    if (m_deckLinkOutput->ScheduleVideoFrame(frame, time,
+                                             player->m_frameDuration,
+                                             player->m_frameTimescale) == S_OK)
+        m_framesScheduled++;
+    else
+        fprintf(stderr, "Error scheduling frame on -C %d\n", m_device);
+
+    frame->Release();
+}
+
+/*
+ * Compare what is heard with what is seen: the source time of the sample
+ * playing against the one of the frame on screen.  The sample playing is
+ * the next one to schedule less the time to its timestamp, or less what
+ * the card holds if that is more, when it plays behind the timestamps.
+ * A steady offset is evened out a few samples at a time, a large one at
+ * once.  The water level follows how close the card came to running dry.
+ */
+void Output::CheckAudio(uint32_t buffered)
+{
+    Player *player = m_player;
+    AVRational out = { 1, (int)player->m_frameTimescale };
+    AVRational tb  = { 1, (int)player->m_audioSampleRate };
+    int64_t time   = av_gettime_relative();
+    BMDTimeValue now, seen;
+    double speed;
+    int64_t lead, offset, n;
+
+    if (buffered < m_audioWaterlevel / 4 && !m_audioStarved) {
+        m_audioWaterlevel = FFMIN(m_audioWaterlevel * 3 / 2,
+                                  kMaxAudioWaterlevel);
+        m_waterlevelRaises++;
+        m_lowestBuffered = m_audioWaterlevel;
+        m_waterlevelTime = time;
+    } else if (time - m_waterlevelTime > 2000000) {
+        if (m_lowestBuffered > m_audioWaterlevel / 2)
+            m_audioWaterlevel = FFMAX(m_audioWaterlevel * 7 / 8,
+                                      kMinAudioWaterlevel);
+        m_lowestBuffered = m_audioWaterlevel;
+        m_waterlevelTime = time;
+    } else {
+        m_lowestBuffered = FFMIN(m_lowestBuffered, buffered);
     }
 
-    if (audio.st) {
-        m_audioSampleDepth =
-            av_get_exact_bits_per_sample(audio.codec->codec_id);
+    if (m_audioStreamTime == AV_NOPTS_VALUE ||
+        m_deckLinkOutput->GetScheduledStreamTime(player->m_frameTimescale,
+                                                 &now, &speed) != S_OK ||
+        speed <= 0)
+        return;
 
-        switch (audio.codec->channels) {
-            case  2:
-            case  8:
-            case 16:
-                break;
-            default:
-                fprintf(stderr,
-                        "%d channels not supported, please use 2, 8 or 16\n",
-                        audio.codec->channels);
-                goto bail;
-        }
+    seen   = player->SourceTime(this, now);
+    lead   = m_audioStreamTime - av_rescale_q(now, out, tb);
+    offset = m_audioPosition - FFMAX(lead, (int64_t)buffered) -
+             av_rescale_q(seen, out, tb);
 
-        switch (m_audioSampleDepth) {
-            case 16:
-            case 32:
-                break;
-            default:
-                fprintf(stderr, "%lubit audio not supported use 16bit or 32bit\n",
-                        m_audioSampleDepth);
-        }
-    }
+    // a correction or a gap is on its way
+    if (m_audioRepeat || __atomic_load_n(&m_audioSkip, __ATOMIC_RELAXED) ||
+        __atomic_load_n(&m_audioGap, __ATOMIC_RELAXED))
+        return;
 
-    do
-        result = deckLinkIterator->Next(&m_deckLink);
-    while (i++ < camera);
+    m_avOffset += (offset - m_avOffset) / 16;
+    if (fabs(m_avOffset) > fabs(m_avOffsetMax))
+        m_avOffsetMax = m_avOffset;
 
-    if (result != S_OK) {
-        fprintf(stderr, "No DeckLink PCI cards found\n");
-        goto bail;
+    if (FFABS(offset) > kAudioDriftHard) {
+        // a few callbacks in a row, not the one after an underrun
+        if (++m_avOffsetFar < 8)
+            return;
+        fprintf(stderr, "-C %d: audio %" PRId64 " ms %s the video, "
+                "realigned\n", m_device, FFABS(offset) / 48,
+                offset > 0 ? "ahead of" : "behind");
+        if (offset > 0)
+            __atomic_fetch_add(&m_audioGap, offset, __ATOMIC_RELAXED);
+        else
+            __atomic_fetch_add(&m_audioSkip, -offset, __ATOMIC_RELAXED);
+        m_avOffset    = 0;
+        m_avOffsetFar = 0;
+        return;
     }
+    m_avOffsetFar = 0;
 
-    // Obtain the audio/video output interface (IDeckLinkOutput)
-    if (m_deckLink->QueryInterface(IID_IDeckLinkOutput,
-                                   (void **)&m_deckLinkOutput) != S_OK)
-        goto bail;
+    if (fabs(m_avOffset) <= kAudioDriftSoft)
+        return;
 
-    result = m_deckLink->QueryInterface(IID_IDeckLinkConfiguration,
-                                        (void **)&deckLinkConfiguration);
-    if (result != S_OK) {
-        fprintf(
-            stderr,
-            "Could not obtain the IDeckLinkConfiguration interface - result = %08x\n",
-            result);
-        goto bail;
-    }
-    //XXX make it generic
-    switch (connection) {
-    case 1:
-        DECKLINK_SET_VIDEO_CONNECTION(bmdVideoConnectionComposite);
-        DECKLINK_SET_AUDIO_CONNECTION(bmdAudioConnectionAnalog);
-        break;
-    case 2:
-        DECKLINK_SET_VIDEO_CONNECTION(bmdVideoConnectionComponent);
-        DECKLINK_SET_AUDIO_CONNECTION(bmdAudioConnectionAnalog);
-        break;
-    case 3:
-        DECKLINK_SET_VIDEO_CONNECTION(bmdVideoConnectionHDMI);
-        DECKLINK_SET_AUDIO_CONNECTION(bmdAudioConnectionEmbedded);
-        break;
-    case 4:
-        DECKLINK_SET_VIDEO_CONNECTION(bmdVideoConnectionSDI);
-        DECKLINK_SET_AUDIO_CONNECTION(bmdAudioConnectionEmbedded);
-        break;
-    default:
-        // do not change it
-        break;
+    n = FFMIN(llrint(fabs(m_avOffset)), kAudioDriftStep);
+    if (m_avOffset > 0) {
+        m_audioRepeat     += n;
+        m_samplesRepeated += n;
+        m_avOffset        -= n;
+    } else {
+        __atomic_fetch_add(&m_audioSkip, n, __ATOMIC_RELAXED);
+        m_samplesDropped += n;
+        m_avOffset       += n;
     }
+}
 
-    // Provide this class as a delegate to the audio and video output interfaces
-    m_deckLinkOutput->SetScheduledFrameCompletionCallback(this);
-    m_deckLinkOutput->SetAudioCallback(this);
+/*
+ * Called on the audio callback: top the card up to the water level in one
+ * pass over the ring, a write per contiguous part.  What the card
+ * does not take stays in the ring for the next callback, nothing waits or
+ * locks here.
+ */
+void Output::WriteNextAudioSamples()
+{
+    uint32_t samplesWritten = 0;
+    uint32_t bufferedSamples;
+    uint8_t *samples;
+    unsigned count, repeat;
+    int64_t skip, want;
 
-    avframe = av_frame_alloc();
+    m_deckLinkOutput->GetBufferedAudioSampleFrameCount(&bufferedSamples);
 
-    packet_queue_init(&audioqueue);
-    packet_queue_init(&videoqueue);
-    packet_queue_init(&dataqueue);
-    pthread_t th;
-    pthread_create(&th, NULL, fill_queues, NULL);
+    if (__atomic_load_n(&m_player->m_playing, __ATOMIC_ACQUIRE))
+        CheckAudio(bufferedSamples);
 
-    usleep(buffer); // You can add the microseconds you need for pre-buffering before start playing
-    // Start playing
-    StartRunning(videomode);
+    if (bufferedSamples > m_audioWaterlevel)
+        return;
 
-    pthread_mutex_lock(&sleepMutex);
-    pthread_cond_wait(&sleepCond, &sleepMutex);
-    pthread_mutex_unlock(&sleepMutex);
-    fill_me = 0;
-    fprintf(stderr, "Exiting, cleaning up\n");
-    packet_queue_end(&audioqueue);
-    packet_queue_end(&videoqueue);
+    count = sample_ring_peek(&audioring, m_index, &samples);
 
-bail:
-    if (m_running == true) {
-        StopRunning();
-    } else {
-        // Release any resources that were partially allocated
-        if (m_deckLinkOutput != NULL) {
-            m_deckLinkOutput->Release();
-            m_deckLinkOutput = NULL;
-        }
-        //
-        if (m_deckLink != NULL) {
-            m_deckLink->Release();
-            m_deckLink = NULL;
-        }
+    // the first samples are placed against video, then audio runs on the
+    // output clock, skipping over the video underruns
+    if (count && m_audioStreamTime == AV_NOPTS_VALUE) {
+        m_audioStreamTime = audio_start_time;
+        m_audioPosition   = audio_start_time;
     }
 
-    if (deckLinkIterator != NULL)
-        deckLinkIterator->Release();
+    // realigned ahead of the other outputs, or catching up with the video
+    while (count && (skip = __atomic_load_n(&m_audioSkip, __ATOMIC_RELAXED)) > 0) {
+        unsigned n = FFMIN(count, skip);
 
-    return true;
-}
+        sample_ring_consume(&audioring, m_index, n);
+        __atomic_fetch_sub(&m_audioSkip, n, __ATOMIC_RELAXED);
+        m_audioPosition += n;
+        count = sample_ring_peek(&audioring, m_index, &samples);
+    }
 
-IDeckLinkDisplayMode *Player::GetDisplayModeByIndex(int selectedIndex)
-{
-    // Populate the display mode combo with a list of display modes supported by the installed DeckLink card
-    IDeckLinkDisplayModeIterator *displayModeIterator;
-    IDeckLinkDisplayMode *deckLinkDisplayMode;
-    IDeckLinkDisplayMode *selectedMode = NULL;
-    int index                          = 0;
+    if (!count) {
+        if (!m_audioStarved && m_player->m_running && !fill_done &&
+            bufferedSamples < m_audioWaterlevel / 4) {
+            m_audioStarved = true;
+            m_audioUnderruns++;
+        }
+        return;
+    }
+    m_audioStarved = false;
 
-    if (m_deckLinkOutput->GetDisplayModeIterator(&displayModeIterator) != S_OK)
-        goto bail;
-    while (displayModeIterator->Next(&deckLinkDisplayMode) == S_OK) {
-        BMDProbeString str;
+    m_audioStreamTime += __atomic_exchange_n(&m_audioGap, 0, __ATOMIC_RELAXED);
 
-        if (deckLinkDisplayMode->GetName(&str) == S_OK) {
-            if (index == selectedIndex) {
-                printf("Selected mode: %s\n\n\n", ToStr(str));
-                selectedMode = deckLinkDisplayMode;
-                FreeStr(str);
-                goto bail;
-            }
+    for (want = m_audioWaterlevel - bufferedSamples; want > 0 && count;
+         count = sample_ring_peek(&audioring, m_index, &samples)) {
+        count = FFMIN(count, want);
+
+        if (m_deckLinkOutput->ScheduleAudioSamples(samples, count,
+                                                   m_audioStreamTime,
+                                                   m_player->m_audioSampleRate,
+                                                   &samplesWritten) != S_OK) {
+            fprintf(stderr, "error writing audio sample\n");
+            break;
         }
-        index++;
+
+        // the tail of what was written goes out again, to hold the audio back
+        repeat = FFMIN(m_audioRepeat, samplesWritten);
+        sample_ring_consume(&audioring, m_index, samplesWritten - repeat);
+        m_audioRepeat     -= repeat;
+        m_audioPosition   += samplesWritten - repeat;
+        m_audioStreamTime += samplesWritten;
+        want              -= samplesWritten;
+
+        // the card is full, the rest waits for the next callback
+        if (samplesWritten < count)
+            break;
     }
-bail:
-    displayModeIterator->Release();
-    return selectedMode;
 }
 
-void Player::StartRunning(int videomode)
+/************************* DeckLink API Delegate Methods *****************************/
+
+/*
+ * Called on every completion: if the schedule got too close to the output
+ * clock, or the card reports frames late or dropped, jump the schedule
+ * ahead and cut down on decoding until it is comfortable again.  The
+ * decoder is shared, any output being late slows it down.
+ */
+void Player::CheckLateness(Output *output, BMDOutputFrameCompletionResult result)
 {
-    IDeckLinkDisplayMode *videoDisplayMode = NULL;
-    unsigned long audioSamplesPerFrame;
+    BMDTimeValue now, next, lead;
+    double speed;
 
-    // Get the display mode for 1080i 59.95
-    videoDisplayMode = GetDisplayModeByIndex(videomode);
+    switch (result) {
+    case bmdOutputFrameDisplayedLate:
+        output->m_framesLate++;
+        break;
+    case bmdOutputFrameDropped:
+        output->m_framesDroppedOut++;
+        break;
+    default:
+        break;
+    }
 
-    if (!videoDisplayMode)
+    if (output->m_deckLinkOutput->GetScheduledStreamTime(m_frameTimescale,
+                                                         &now, &speed) != S_OK)
         return;
 
-    m_frameWidth  = videoDisplayMode->GetWidth();
-    m_frameHeight = videoDisplayMode->GetHeight();
-    videoDisplayMode->GetFrameRate(&m_frameDuration, &m_frameTimescale);
+    next = output->m_slot * m_frameDuration;
+    lead = next - now;
 
-    // Set the video output mode
-    if (m_deckLinkOutput->EnableVideoOutput(videoDisplayMode->GetDisplayMode(),
-                                            bmdVideoOutputFlagDefault) !=
-        S_OK) {
-        fprintf(stderr, "Failed to enable video output\n");
-        return;
-    }
+    if (lead < (BMDTimeValue)m_frameDuration ||
+        result == bmdOutputFrameDisplayedLate ||
+        result == bmdOutputFrameDropped) {
+        BMDTimeValue skip = 0;
 
-    // Set the audio output mode
-    if (audio.st) {
-        if (m_deckLinkOutput->EnableAudioOutput(bmdAudioSampleRate48kHz,
-                                                m_audioSampleDepth,
-                                                audio.codec->channels,
-                                                bmdAudioOutputStreamTimestamped) !=
-            S_OK) {
-            fprintf(stderr, "Failed to enable audio output\n");
-            return;
+        if (lead < (BMDTimeValue)kRecoveryFrames * m_frameDuration) {
+            skip = (now - next) / m_frameDuration + kRecoveryFrames;
+            output->m_slot += skip;
         }
 
-        for (unsigned i = 0; i < 10; i++)
-            ScheduleNextFrame(true);
+        // a second of lag is not worth decoding through
+        if (skip * m_frameDuration > m_frameTimescale && !m_intraOnly)
+            m_dropToKey = true;
+
+        if (!m_lateMode) {
+            fprintf(stderr, "Output -C %d late by %" PRId64 " ms at frame "
+                    "%lu, skipping %" PRId64 " slots and non-reference "
+                    "frames\n", output->m_device,
+                    av_rescale(-lead, 1000, m_frameTimescale),
+                    output->m_slot, skip);
+            m_clip->video.codec->skip_frame       = AVDISCARD_NONREF;
+            m_clip->video.codec->skip_loop_filter = AVDISCARD_NONREF;
+            m_lateMode = true;
+            m_lateRecoveries++;
+        }
+        m_healthyCompletions = 0;
+    } else if (m_lateMode &&
+               ++m_healthyCompletions > kHealthyCompletions * m_outputCount) {
+        fprintf(stderr, "Output caught up at frame %lu\n", m_nextSlot);
+        m_clip->video.codec->skip_frame       = AVDISCARD_DEFAULT;
+        m_clip->video.codec->skip_loop_filter = AVDISCARD_DEFAULT;
+        m_lateMode = false;
+    }
+}
 
-        // Begin audio preroll.  This will begin calling our audio callback, which will start the DeckLink output stream.
-    //    m_audioBufferOffset = 0;
-        if (m_deckLinkOutput->BeginAudioPreroll() != S_OK) {
-            fprintf(stderr, "Failed to begin audio preroll\n");
+/*
+ * Outputs started together can still begin on different frames of their
+ * reference.  Once each is running, find when its stream time was 0 and
+ * show the frames of the others that many slots ahead or behind the first.
+ */
+void Player::AlignOutput(Output *output)
+{
+    Output *first    = m_outputs[0];
+    int64_t frame_us = av_rescale(1000000, m_frameDuration, m_frameTimescale);
+    AVRational out   = { (int)m_frameDuration, (int)m_frameTimescale };
+    AVRational tb    = { 1, (int)m_audioSampleRate };
+    BMDTimeValue now;
+    double speed;
+    int64_t diff, samples;
+    long offset;
+
+    if (output->m_origin == AV_NOPTS_VALUE) {
+        if (output->m_deckLinkOutput->GetScheduledStreamTime(1000000, &now,
+                                                             &speed) != S_OK ||
+            speed <= 0)
             return;
-        }
-    } else {
-        for (unsigned i = 0; i < 10; i++)
-            ScheduleNextFrame(true);
+        output->m_origin = av_gettime_relative() - now;
+    }
 
-        m_deckLinkOutput->StartScheduledPlayback(0, 100, 1.0);
+    if (output == first) {
+        output->m_aligned = true;
+        return;
     }
+    if (first->m_origin == AV_NOPTS_VALUE)
+        return;
 
-    m_running = true;
+    output->m_aligned = true;
 
-    return;
-}
+    diff   = output->m_origin - first->m_origin;
+    offset = lrint((double)diff / frame_us);
+    if (FFABS(diff - offset * frame_us) > frame_us / 4)
+        fprintf(stderr, "-C %d runs %" PRId64 " us off the frames of -C %d, "
+                "the outputs are not genlocked\n", output->m_device,
+                diff - offset * frame_us, first->m_device);
+    if (!offset)
+        return;
 
-void Player::StopRunning()
-{
-    // Stop the audio and video output streams immediately
-    m_deckLinkOutput->StopScheduledPlayback(0, NULL, 0);
-    //
-    m_deckLinkOutput->DisableAudioOutput();
-    m_deckLinkOutput->DisableVideoOutput();
+    fprintf(stderr, "-C %d started %ld frames after -C %d, realigned\n",
+            output->m_device, offset, first->m_device);
+    output->m_slotOffset = offset;
+
+    // the audio ahead is skipped, behind it gets a gap
+    samples = av_rescale_q(FFABS(offset), out, tb);
+    if (offset > 0)
+        __atomic_fetch_add(&output->m_audioSkip, samples, __ATOMIC_RELAXED);
+    else
+        __atomic_fetch_add(&output->m_audioGap, samples, __ATOMIC_RELAXED);
 }
 
-void Player::ScheduleNextFrame(bool prerolling)
+void Player::FrameCompleted(Output *output,
+                            BMDOutputFrameCompletionResult result)
 {
-    AVPacket pkt;
-    void *frame;
-    int ret;
+    pthread_mutex_lock(&m_renderMutex);
+    if (!m_firstFrameShown) {
+        m_firstFrameShown = true;
+        fprintf(stderr, "First frame out %" PRId64 " ms after start\n",
+                (av_gettime_relative() - m_initTime) / 1000);
+        if (trigger_time)
+            fprintf(stderr, "First frame out %" PRId64 " ms after the "
+                    "trigger\n", (av_gettime_relative() - trigger_time) / 1000);
+    }
 
-    if (serial_fd > 0 && packet_queue_get(&dataqueue, &pkt, 0)) {
-        if (pkt.data[0] != ' '){
-            fprintf(stderr,"written %.*s  \n", pkt.size, pkt.data);
-            write(serial_fd, pkt.data, pkt.size);
-        }
-        av_packet_unref(&pkt);
+    if (result != bmdOutputFrameFlushed) {
+        if (!output->m_aligned)
+            AlignOutput(output);
+        CheckLateness(output, result);
     }
+    pthread_mutex_unlock(&m_renderMutex);
+}
 
-    if (packet_queue_get(&videoqueue, &pkt, 0) < 0)
+void Player::StartPlayback()
+{
+    if (__atomic_exchange_n(&m_playing, true, __ATOMIC_ACQ_REL))
         return;
 
-    IDeckLinkMutableVideoFrame *videoFrame;
-    m_deckLinkOutput->CreateVideoFrame(m_frameWidth,
-                                       m_frameHeight,
-                                       m_frameWidth * 2,
-                                       pix,
-                                       bmdFrameFlagDefault,
-                                       &videoFrame);
-    videoFrame->GetBytes(&frame);
+    fprintf(stderr, "Prerolled %lu frames, starting playback %" PRId64
+            " ms after start\n", m_nextSlot,
+            (av_gettime_relative() - m_initTime) / 1000);
 
-    avcodec_send_packet(video.codec, &pkt);
+    // back to back, to start on the same reference frame if they can
+    for (int i = 0; i < m_outputCount; i++)
+        m_outputs[i]->m_deckLinkOutput->StartScheduledPlayback(0, 100, 1.0);
+}
 
-    // TODO: support receiving multiple frames
-    ret = avcodec_receive_frame(video.codec, avframe);
-    if (ret >= 0) {
-        uint8_t *data[4];
-        int linesize[4];
+/* the outputs start together, once each has prerolled its audio */
+void Player::OutputPrerolled()
+{
+    if (__atomic_add_fetch(&m_outputsPrerolled, 1, __ATOMIC_ACQ_REL) ==
+        m_outputCount && !__atomic_load_n(&m_armed, __ATOMIC_ACQUIRE))
+        StartPlayback();
+}
 
-        av_image_fill_arrays(data, linesize, (uint8_t *)frame,
-                             pix_fmt, m_frameWidth, m_frameHeight, 1);
+/* the playlist is over once every output has shown its last frame */
+void Player::OutputDrained()
+{
+    if (__atomic_add_fetch(&m_outputsDrained, 1, __ATOMIC_ACQ_REL) !=
+        m_outputCount)
+        return;
 
-        sws_scale(sws, avframe->data, avframe->linesize, 0, avframe->height,
-                  data, linesize);
+    fprintf(stderr, "End of the playlist, the outputs ran out\n");
+    pthread_mutex_lock(&sleepMutex);
+    stopping = 1;
+    pthread_cond_signal(&sleepCond);
+    pthread_mutex_unlock(&sleepMutex);
+}
 
-        if (m_deckLinkOutput->ScheduleVideoFrame(videoFrame,
-                                                 pkt.pts *
-                                                 video.st->time_base.num,
-                                                 pkt.duration *
-                                                 video.st->time_base.num,
-                                                 video.st->time_base.den) !=
-            S_OK)
-            fprintf(stderr, "Error scheduling frame\n");
-    }
-    videoFrame->Release();
-    av_packet_unref(&pkt);
+Output::Output(Player *player, int index, int device)
+{
+    m_player           = player;
+    m_index            = index;
+    m_device           = device;
+    m_deckLink         = NULL;
+    m_deckLinkOutput   = NULL;
+    m_genlocked        = false;
+    m_slot             = 0;
+    m_slotOffset       = 0;
+    m_origin           = AV_NOPTS_VALUE;
+    m_aligned          = false;
+    m_framesScheduled  = 0;
+    m_framesCompleted  = 0;
+    m_framesLate       = 0;
+    m_framesDroppedOut = 0;
+    m_audioStreamTime  = AV_NOPTS_VALUE;
+    m_audioGap         = 0;
+    m_audioSkip        = 0;
+    m_audioStarved     = false;
+    m_audioUnderruns   = 0;
+    m_prerolled        = false;
+    m_audioPosition    = 0;
+    m_audioRepeat      = 0;
+    m_avOffset         = 0;
+    m_avOffsetMax      = 0;
+    m_avOffsetFar      = 0;
+    m_samplesDropped   = 0;
+    m_samplesRepeated  = 0;
+    m_audioWaterlevel  = kAudioWaterlevel;
+    m_lowestBuffered   = kAudioWaterlevel;
+    m_waterlevelTime   = av_gettime_relative();
+    m_waterlevelRaises = 0;
 }
 
-void Player::WriteNextAudioSamples()
+bool Output::Open(IDeckLink *deckLink, int connection)
 {
-    uint32_t samplesWritten = 0;
-    AVPacket pkt            = { 0 };
-    unsigned int bufferedSamples;
-    int got_frame = 0;
-    int i;
-    int bytes_per_sample =
-        av_get_bytes_per_sample(audio.codec->sample_fmt) *
-        audio.codec->channels;
-    int samples, off = 0;
+    BMDReferenceStatus status;
+    HRESULT result;
 
-    m_deckLinkOutput->GetBufferedAudioSampleFrameCount(&bufferedSamples);
+    m_deckLink = deckLink;
 
-    if (bufferedSamples > kAudioWaterlevel)
-        return;
+    // Obtain the audio/video output interface (IDeckLinkOutput)
+    if (m_deckLink->QueryInterface(IID_IDeckLinkOutput,
+                                   (void **)&m_deckLinkOutput) != S_OK) {
+        m_deckLinkOutput = NULL;
+        fprintf(stderr, "-C %d has no output\n", m_device);
+        return false;
+    }
 
-    if (!packet_queue_get(&audioqueue, &pkt, 0))
-        return;
+    result = m_deckLink->QueryInterface(IID_IDeckLinkConfiguration,
+                                        (void **)&deckLinkConfiguration);
+    if (result != S_OK) {
+        fprintf(
+            stderr,
+            "Could not obtain the IDeckLinkConfiguration interface - result = %08x\n",
+            result);
+        return false;
+    }
+    //XXX make it generic
+    switch (connection) {
+    case 1:
+        DECKLINK_SET_VIDEO_CONNECTION(bmdVideoConnectionComposite);
+        DECKLINK_SET_AUDIO_CONNECTION(bmdAudioConnectionAnalog);
+        break;
+    case 2:
+        DECKLINK_SET_VIDEO_CONNECTION(bmdVideoConnectionComponent);
+        DECKLINK_SET_AUDIO_CONNECTION(bmdAudioConnectionAnalog);
+        break;
+    case 3:
+        DECKLINK_SET_VIDEO_CONNECTION(bmdVideoConnectionHDMI);
+        DECKLINK_SET_AUDIO_CONNECTION(bmdAudioConnectionEmbedded);
+        break;
+    case 4:
+        DECKLINK_SET_VIDEO_CONNECTION(bmdVideoConnectionSDI);
+        DECKLINK_SET_AUDIO_CONNECTION(bmdAudioConnectionEmbedded);
+        break;
+    default:
+        // do not change it
+        break;
+    }
+    deckLinkConfiguration->Release();
+    deckLinkConfiguration = NULL;
 
-    samples = pkt.size / bytes_per_sample;
+    m_genlocked = m_deckLinkOutput->GetReferenceStatus(&status) == S_OK &&
+                  (status & bmdReferenceLocked);
 
-    do {
-        if (m_deckLinkOutput->ScheduleAudioSamples(pkt.data +
-                                                   off * bytes_per_sample,
-                                                   samples,
-                                                   pkt.pts + off,
-                                                   audio.st->time_base.den / audio.st->time_base.num,
-                                                   &samplesWritten) != S_OK)
-            fprintf(stderr, "error writing audio sample\n");
-        samples -= samplesWritten;
-        off     += samplesWritten;
-    } while (samples > 0);
+    // Provide this class as a delegate to the audio and video output interfaces
+    m_deckLinkOutput->SetScheduledFrameCompletionCallback(this);
+    m_deckLinkOutput->SetAudioCallback(this);
 
-    av_packet_unref(&pkt);
+    return true;
 }
 
-/************************* DeckLink API Delegate Methods *****************************/
+void Output::Close()
+{
+    if (m_deckLinkOutput) {
+        m_deckLinkOutput->Release();
+        m_deckLinkOutput = NULL;
+    }
+    if (m_deckLink) {
+        m_deckLink->Release();
+        m_deckLink = NULL;
+    }
+}
 
-HRESULT Player::ScheduledFrameCompleted(IDeckLinkVideoFrame *completedFrame,
+HRESULT Output::ScheduledFrameCompleted(IDeckLinkVideoFrame *completedFrame,
                                         BMDOutputFrameCompletionResult result)
 {
-    if (fill_me)
-        ScheduleNextFrame(false);
+    m_player->FrameCompleted(this, result);
+    m_framesCompleted++;
+
+    if (fill_me) {
+        ScheduleNextFrame();
+        if (m_framesCompleted == m_framesScheduled && m_player->m_ended)
+            m_player->OutputDrained();
+    }
     return S_OK;
 }
 
-HRESULT Player::ScheduledPlaybackHasStopped()
+HRESULT Output::ScheduledPlaybackHasStopped()
 {
     return S_OK;
 }
 
-HRESULT Player::RenderAudioSamples(bool preroll)
+HRESULT Output::RenderAudioSamples(bool preroll)
 {
-    if (audio.st) {
+    if (play_audio) {
         // Provide further audio samples to the DeckLink API until our preferred buffer waterlevel is reached
         WriteNextAudioSamples();
 
-        if (preroll) {
-            // Start audio and video output
-            m_deckLinkOutput->StartScheduledPlayback(0, 100, 1.0);
+        if (preroll && !m_prerolled) {
+            m_prerolled = true;
+            m_player->OutputPrerolled();
         }
     }
 
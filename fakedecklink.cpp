@@ -0,0 +1,1920 @@
+/*
+ * Blackmagic Devices Decklink software stand-in
+ * Copyright (c) 2026 the bmdtools authors.
+ *
+ * This file is part of bmdtools.
+ *
+ * bmdtools is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * bmdtools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with bmdtools; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Linked in place of DeckLinkAPIDispatch.cpp with "make FAKE_DECKLINK=1",
+ * it enumerates cards that exist only in software: the input delivers
+ * colour bars and a 1 kHz tone at the exact cadence of the mode from a
+ * timer thread, the output plays the scheduled frames out on its own clock
+ * and reports how each one went, the reference is whatever it is told.
+ *
+ * BMD_FAKE_DECKLINK holds a comma separated list of settings:
+ *   devices=N              cards enumerated, 1 by default
+ *   reference=STATUS       locked (default), unlocked or none
+ *   signal=F:N             the input signal is lost for N frames after F
+ *   format=F:MODE          the input signal switches to the MODE four
+ *                          character code after F frames
+ *   drop=N                 every N-th input callback is not made and every
+ *                          N-th output frame is dropped
+ *   late=N                 every N-th output frame is displayed late
+ *   jitter=US              input callbacks up to US microseconds late
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "compat.h"
+#include "DeckLinkAPI.h"
+
+#define NS 1000000000LL
+
+static const int kFakePool        = 8;      // input frame buffers kept around
+static const int kFakeAudioChunks = 256;    // scheduled audio ranges
+static const int kFakeAudioBuffer = 96000;  // output sample frames, 2 s
+
+struct FakeMode {
+    BMDDisplayMode mode;
+    const char *name;
+    long width, height;
+    BMDTimeValue duration;
+    BMDTimeScale scale;
+    BMDFieldDominance field;
+};
+
+static const FakeMode fake_modes[] = {
+    { bmdModeNTSC,         "NTSC",             720,  486, 1001, 30000, bmdLowerFieldFirst },
+    { bmdModePAL,          "PAL",              720,  576, 1000, 25000, bmdUpperFieldFirst },
+    { bmdModeHD720p50,     "HD 720p 50",      1280,  720, 1000, 50000, bmdProgressiveFrame },
+    { bmdModeHD720p5994,   "HD 720p 59.94",   1280,  720, 1001, 60000, bmdProgressiveFrame },
+    { bmdModeHD720p60,     "HD 720p 60",      1280,  720, 1000, 60000, bmdProgressiveFrame },
+    { bmdModeHD1080p2398,  "HD 1080p 23.98",  1920, 1080, 1001, 24000, bmdProgressiveFrame },
+    { bmdModeHD1080p24,    "HD 1080p 24",     1920, 1080, 1000, 24000, bmdProgressiveFrame },
+    { bmdModeHD1080p25,    "HD 1080p 25",     1920, 1080, 1000, 25000, bmdProgressiveFrame },
+    { bmdModeHD1080p2997,  "HD 1080p 29.97",  1920, 1080, 1001, 30000, bmdProgressiveFrame },
+    { bmdModeHD1080p30,    "HD 1080p 30",     1920, 1080, 1000, 30000, bmdProgressiveFrame },
+    { bmdModeHD1080i50,    "HD 1080i 50",     1920, 1080, 1000, 25000, bmdUpperFieldFirst },
+    { bmdModeHD1080i5994,  "HD 1080i 59.94",  1920, 1080, 1001, 30000, bmdUpperFieldFirst },
+    { bmdModeHD1080i6000,  "HD 1080i 60",     1920, 1080, 1000, 30000, bmdUpperFieldFirst },
+    { bmdModeHD1080p50,    "HD 1080p 50",     1920, 1080, 1000, 50000, bmdProgressiveFrame },
+    { bmdModeHD1080p5994,  "HD 1080p 59.94",  1920, 1080, 1001, 60000, bmdProgressiveFrame },
+    { bmdModeHD1080p6000,  "HD 1080p 60",     1920, 1080, 1000, 60000, bmdProgressiveFrame },
+    { bmdMode4K2160p25,    "4K 2160p 25",     3840, 2160, 1000, 25000, bmdProgressiveFrame },
+    { bmdMode4K2160p50,    "4K 2160p 50",     3840, 2160, 1000, 50000, bmdProgressiveFrame },
+    { bmdMode4K2160p5994,  "4K 2160p 59.94",  3840, 2160, 1001, 60000, bmdProgressiveFrame },
+    { bmdMode4K2160p60,    "4K 2160p 60",     3840, 2160, 1000, 60000, bmdProgressiveFrame },
+};
+
+static const int fake_mode_count = sizeof(fake_modes) / sizeof(fake_modes[0]);
+
+static struct {
+    int devices;
+    BMDReferenceStatus reference;
+    long signal_at, signal_frames;
+    long format_at;
+    const FakeMode *format_mode;
+    long drop, late;
+    int jitter;
+} fake_config = { 1, bmdReferenceLocked, -1, 0, -1, NULL, 0, 0, 0 };
+
+static pthread_once_t fake_once = PTHREAD_ONCE_INIT;
+
+static const FakeMode *fake_find_mode(BMDDisplayMode mode)
+{
+    for (int i = 0; i < fake_mode_count; i++)
+        if (fake_modes[i].mode == mode)
+            return &fake_modes[i];
+    return NULL;
+}
+
+static void fake_parse_config(void)
+{
+    const char *env = getenv("BMD_FAKE_DECKLINK");
+    char *opts, *opt, *val, *save = NULL;
+    char code[5] = { 0 };
+
+    if (!env)
+        return;
+
+    opts = strdup(env);
+    for (opt = strtok_r(opts, ",", &save); opt;
+         opt = strtok_r(NULL, ",", &save)) {
+        val = strchr(opt, '=');
+        if (!val)
+            goto invalid;
+        *val++ = 0;
+
+        if (!strcmp(opt, "devices")) {
+            fake_config.devices = atoi(val);
+        } else if (!strcmp(opt, "reference")) {
+            if (!strcmp(val, "locked"))
+                fake_config.reference = bmdReferenceLocked;
+            else if (!strcmp(val, "unlocked"))
+                fake_config.reference = 0;
+            else if (!strcmp(val, "none"))
+                fake_config.reference = bmdReferenceNotSupportedByHardware;
+            else
+                goto invalid;
+        } else if (!strcmp(opt, "signal")) {
+            if (sscanf(val, "%ld:%ld", &fake_config.signal_at,
+                       &fake_config.signal_frames) != 2)
+                goto invalid;
+        } else if (!strcmp(opt, "format")) {
+            if (sscanf(val, "%ld:%4c", &fake_config.format_at, code) != 2)
+                goto invalid;
+            fake_config.format_mode = fake_find_mode(code[0] << 24 |
+                                                     code[1] << 16 |
+                                                     code[2] <<  8 |
+                                                     code[3]);
+            if (!fake_config.format_mode) {
+                fake_config.format_at = -1;
+                goto invalid;
+            }
+        } else if (!strcmp(opt, "drop")) {
+            fake_config.drop = atol(val);
+        } else if (!strcmp(opt, "late")) {
+            fake_config.late = atol(val);
+        } else if (!strcmp(opt, "jitter")) {
+            fake_config.jitter = atoi(val);
+        } else {
+            goto invalid;
+        }
+        continue;
+invalid:
+        fprintf(stderr, "Fake DeckLink: ignoring %s\n", opt);
+    }
+    free(opts);
+}
+
+static int64_t fake_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NS + ts.tv_nsec;
+}
+
+static void fake_sleep_until(int64_t ns)
+{
+    struct timespec ts = { (time_t)(ns / NS), (long)(ns % NS) };
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+/* a * b / c without overflowing, the way the cards count ticks */
+static int64_t fake_rescale(int64_t a, int64_t b, int64_t c)
+{
+    return (int64_t)((__int128)a * b / c);
+}
+
+static bool fake_iid(REFIID a, REFIID b)
+{
+    return !memcmp(&a, &b, sizeof(REFIID));
+}
+
+static BMDProbeString fake_string(const char *str)
+{
+#ifdef HAVE_CFSTRING
+    return CFStringCreateWithCString(NULL, str, kCFStringEncodingMacRoman);
+#else
+    return strdup(str);
+#endif
+}
+
+static long fake_row_bytes(BMDPixelFormat pix, long width)
+{
+    switch (pix) {
+    case bmdFormat8BitYUV:
+        return width * 2;
+    case bmdFormat10BitYUV:
+        return (width + 47) / 48 * 128;
+    case bmdFormat10BitRGB:
+        return (width + 63) / 64 * 256;
+    default:
+        return width * 4;
+    }
+}
+
+/* 75% bars, white to black */
+static const uint8_t bars_yuv[8][3] = {
+    { 180, 128, 128 }, { 162,  44, 142 }, { 131, 156,  44 }, { 112,  72,  58 },
+    {  84, 184, 198 }, {  65, 100, 212 }, {  35, 212, 114 }, {  16, 128, 128 },
+};
+static const uint8_t bars_rgb[8][3] = {
+    { 191, 191, 191 }, { 191, 191,   0 }, {   0, 191, 191 }, {   0, 191,   0 },
+    { 191,   0, 191 }, { 191,   0,   0 }, {   0,   0, 191 }, {   0,   0,   0 },
+};
+
+static void fake_fill_bars(uint8_t *buf, BMDPixelFormat pix,
+                           long width, long height, long row_bytes)
+{
+    memset(buf, 0, row_bytes);
+
+    for (long x = 0; x < width; x++) {
+        const uint8_t *yuv = bars_yuv[x * 8 / width];
+        const uint8_t *rgb = bars_rgb[x * 8 / width];
+        uint8_t *p;
+        uint32_t *w;
+        uint32_t y, cb, cr;
+
+        switch (pix) {
+        case bmdFormat8BitYUV:
+            if (x & 1)
+                break;
+            p    = buf + x * 2;
+            p[0] = yuv[1];
+            p[1] = yuv[0];
+            p[2] = yuv[2];
+            p[3] = yuv[0];
+            break;
+        case bmdFormat10BitYUV:
+            if (x % 6)
+                break;
+            w    = (uint32_t *)(buf + x / 6 * 16);
+            y    = yuv[0] << 2;
+            cb   = yuv[1] << 2;
+            cr   = yuv[2] << 2;
+            w[0] = cb | y << 10 | cr << 20;
+            w[1] = y | cb << 10 | y << 20;
+            w[2] = cr | y << 10 | cb << 20;
+            w[3] = y | cr << 10 | y << 20;
+            break;
+        case bmdFormat8BitARGB:
+            p    = buf + x * 4;
+            p[0] = 255;
+            p[1] = rgb[0];
+            p[2] = rgb[1];
+            p[3] = rgb[2];
+            break;
+        case bmdFormat8BitBGRA:
+            p    = buf + x * 4;
+            p[0] = rgb[2];
+            p[1] = rgb[1];
+            p[2] = rgb[0];
+            p[3] = 255;
+            break;
+        }
+    }
+
+    for (long i = 1; i < height; i++)
+        memcpy(buf + i * row_bytes, buf, row_bytes);
+}
+
+/* 1 kHz at -18 dBFS, exactly 48 samples at 48 kHz */
+static void fake_fill_tone(void *buf, int64_t position, long count,
+                           int depth, int channels, bool silent)
+{
+    for (long i = 0; i < count; i++) {
+        double v = silent ? 0 :
+                   0.125893 * sin(2 * M_PI * ((position + i) % 48) / 48);
+
+        for (int c = 0; c < channels; c++) {
+            if (depth == 16)
+                ((int16_t *)buf)[i * channels + c] = (int16_t)lrint(v * INT16_MAX);
+            else
+                ((int32_t *)buf)[i * channels + c] = (int32_t)lrint(v * INT32_MAX);
+        }
+    }
+}
+
+template <class T> class FakeUnknown : public T
+{
+public:
+    FakeUnknown() : m_refs(1) {}
+    virtual ~FakeUnknown() {}
+
+    virtual ULONG STDMETHODCALLTYPE AddRef(void)
+    {
+        return __atomic_add_fetch(&m_refs, 1, __ATOMIC_RELAXED);
+    }
+
+    virtual ULONG STDMETHODCALLTYPE Release(void)
+    {
+        ULONG refs = __atomic_sub_fetch(&m_refs, 1, __ATOMIC_ACQ_REL);
+
+        if (!refs)
+            delete this;
+        return refs;
+    }
+
+private:
+    ULONG m_refs;
+};
+
+class FakeDeckLink;
+class FakeInput;
+
+class FakeDisplayMode : public FakeUnknown<IDeckLinkDisplayMode>
+{
+public:
+    FakeDisplayMode(const FakeMode *mode) : m_mode(mode) {}
+
+    virtual HRESULT STDMETHODCALLTYPE QueryInterface(REFIID iid, LPVOID *ppv)
+    {
+        if (fake_iid(iid, IID_IUnknown) || fake_iid(iid, IID_IDeckLinkDisplayMode)) {
+            AddRef();
+            *ppv = this;
+            return S_OK;
+        }
+        *ppv = NULL;
+        return E_NOINTERFACE;
+    }
+
+    virtual HRESULT STDMETHODCALLTYPE GetName(BMDProbeString *name)
+    {
+        *name = fake_string(m_mode->name);
+        return S_OK;
+    }
+    virtual BMDDisplayMode STDMETHODCALLTYPE GetDisplayMode(void) { return m_mode->mode; }
+    virtual long STDMETHODCALLTYPE GetWidth(void) { return m_mode->width; }
+    virtual long STDMETHODCALLTYPE GetHeight(void) { return m_mode->height; }
+    virtual HRESULT STDMETHODCALLTYPE GetFrameRate(BMDTimeValue *frameDuration,
+                                                   BMDTimeScale *timeScale)
+    {
+        *frameDuration = m_mode->duration;
+        *timeScale     = m_mode->scale;
+        return S_OK;
+    }
+    virtual BMDFieldDominance STDMETHODCALLTYPE GetFieldDominance(void) { return m_mode->field; }
+    virtual BMDDisplayModeFlags STDMETHODCALLTYPE GetFlags(void) { return 0; }
+
+private:
+    const FakeMode *m_mode;
+};
+
+class FakeDisplayModeIterator : public FakeUnknown<IDeckLinkDisplayModeIterator>
+{
+public:
+    FakeDisplayModeIterator() : m_next(0) {}
+
+    virtual HRESULT STDMETHODCALLTYPE QueryInterface(REFIID iid, LPVOID *ppv)
+    {
+        *ppv = NULL;
+        return E_NOINTERFACE;
+    }
+
+    virtual HRESULT STDMETHODCALLTYPE Next(IDeckLinkDisplayMode **mode)
+    {
+        if (m_next >= fake_mode_count) {
+            *mode = NULL;
+            return S_FALSE;
+        }
+        *mode = new FakeDisplayMode(&fake_modes[m_next++]);
+        return S_OK;
+    }
+
+private:
+    int m_next;
+};
+
+static HRESULT fake_supports_mode(BMDDisplayMode displayMode,
+                                  BMDPixelFormat pixelFormat,
+                                  BMDDisplayModeSupport *result,
+                                  IDeckLinkDisplayMode **resultDisplayMode)
+{
+    const FakeMode *mode = fake_find_mode(displayMode);
+
+    *result = mode ? bmdDisplayModeSupported : bmdDisplayModeNotSupported;
+    if (resultDisplayMode)
+        *resultDisplayMode = mode ? new FakeDisplayMode(mode) : NULL;
+    return S_OK;
+}
+
+/* what CreateVideoFrame hands out for the output */
+class FakeVideoFrame : public FakeUnknown<IDeckLinkMutableVideoFrame>
+{
+public:
+    FakeVideoFrame(long width, long height, long rowBytes,
+                   BMDPixelFormat pix, BMDFrameFlags flags) :
+        m_width(width), m_height(height), m_rowBytes(rowBytes),
+        m_pix(pix), m_flags(flags), m_bytes(NULL)
+    {
+        if (posix_memalign(&m_bytes, 64, rowBytes * height))
+            m_bytes = NULL;
+    }
+
+    virtual ~FakeVideoFrame() { free(m_bytes); }
+
+    virtual HRESULT STDMETHODCALLTYPE QueryInterface(REFIID iid, LPVOID *ppv)
+    {
+        if (fake_iid(iid, IID_IUnknown) || fake_iid(iid, IID_IDeckLinkVideoFrame) ||
+            fake_iid(iid, IID_IDeckLinkMutableVideoFrame)) {
+            AddRef();
+            *ppv = this;
+            return S_OK;
+        }
+        *ppv = NULL;
+        return E_NOINTERFACE;
+    }
+
+    virtual long STDMETHODCALLTYPE GetWidth(void) { return m_width; }
+    virtual long STDMETHODCALLTYPE GetHeight(void) { return m_height; }
+    virtual long STDMETHODCALLTYPE GetRowBytes(void) { return m_rowBytes; }
+    virtual BMDPixelFormat STDMETHODCALLTYPE GetPixelFormat(void) { return m_pix; }
+    virtual BMDFrameFlags STDMETHODCALLTYPE GetFlags(void) { return m_flags; }
+    virtual HRESULT STDMETHODCALLTYPE GetBytes(void **buffer)
+    {
+        *buffer = m_bytes;
+        return m_bytes ? S_OK : E_FAIL;
+    }
+    virtual HRESULT STDMETHODCALLTYPE GetTimecode(BMDTimecodeFormat format,
+                                                  IDeckLinkTimecode **timecode)
+    {
+        *timecode = NULL;
+        return S_FALSE;
+    }
+    virtual HRESULT STDMETHODCALLTYPE GetAncillaryData(IDeckLinkVideoFrameAncillary **ancillary)
+    {
+        *ancillary = NULL;
+        return S_FALSE;
+    }
+
+    virtual HRESULT STDMETHODCALLTYPE SetFlags(BMDFrameFlags newFlags)
+    {
+        m_flags = newFlags;
+        return S_OK;
+    }
+    virtual HRESULT STDMETHODCALLTYPE SetTimecode(BMDTimecodeFormat format,
+                                                  IDeckLinkTimecode *timecode)
+    {
+        return S_OK;
+    }
+    virtual HRESULT STDMETHODCALLTYPE SetTimecodeFromComponents(BMDTimecodeFormat format,
+                                                                uint8_t hours, uint8_t minutes,
+                                                                uint8_t seconds, uint8_t frames,
+                                                                BMDTimecodeFlags flags)
+    {
+        return S_OK;
+    }
+    virtual HRESULT STDMETHODCALLTYPE SetAncillaryData(IDeckLinkVideoFrameAncillary *ancillary)
+    {
+        return S_OK;
+    }
+    virtual HRESULT STDMETHODCALLTYPE SetTimecodeUserBits(BMDTimecodeFormat format,
+                                                          BMDTimecodeUserBits userBits)
+    {
+        return S_OK;
+    }
+
+private:
+    long m_width, m_height, m_rowBytes;
+    BMDPixelFormat m_pix;
+    BMDFrameFlags m_flags;
+    void *m_bytes;
+};
+
+class FakeAudioPacket : public FakeUnknown<IDeckLinkAudioInputPacket>
+{
+public:
+    FakeAudioPacket(long count, int64_t position, int frameSize) :
+        m_count(count), m_position(position)
+    {
+        m_bytes = malloc(count * frameSize);
+    }
+
+    virtual ~FakeAudioPacket() { free(m_bytes); }
+
+    virtual HRESULT STDMETHODCALLTYPE QueryInterface(REFIID iid, LPVOID *ppv)
+    {
+        if (fake_iid(iid, IID_IUnknown) || fake_iid(iid, IID_IDeckLinkAudioInputPacket)) {
+            AddRef();
+            *ppv = this;
+            return S_OK;
+        }
+        *ppv = NULL;
+        return E_NOINTERFACE;
+    }
+
+    virtual long STDMETHODCALLTYPE GetSampleFrameCount(void) { return m_count; }
+    virtual HRESULT STDMETHODCALLTYPE GetBytes(void **buffer)
+    {
+        *buffer = m_bytes;
+        return m_bytes ? S_OK : E_FAIL;
+    }
+    virtual HRESULT STDMETHODCALLTYPE GetPacketTime(BMDTimeValue *packetTime,
+                                                    BMDTimeScale timeScale)
+    {
+        *packetTime = fake_rescale(m_position, timeScale, 48000);
+        return S_OK;
+    }
+
+    long m_count;
+    int64_t m_position;
+    void *m_bytes;
+};
+
+class FakeInput : public IDeckLinkInput
+{
+public:
+    FakeInput(FakeDeckLink *device);
+    virtual ~FakeInput();
+
+    virtual HRESULT STDMETHODCALLTYPE QueryInterface(REFIID iid, LPVOID *ppv);
+    virtual ULONG STDMETHODCALLTYPE AddRef(void);
+    virtual ULONG STDMETHODCALLTYPE Release(void);
+
+    virtual HRESULT STDMETHODCALLTYPE DoesSupportVideoMode(BMDDisplayMode displayMode,
+                                                           BMDPixelFormat pixelFormat,
+                                                           BMDVideoInputFlags flags,
+                                                           BMDDisplayModeSupport *result,
+                                                           IDeckLinkDisplayMode **resultDisplayMode)
+    {
+        return fake_supports_mode(displayMode, pixelFormat, result, resultDisplayMode);
+    }
+    virtual HRESULT STDMETHODCALLTYPE GetDisplayModeIterator(IDeckLinkDisplayModeIterator **iterator)
+    {
+        *iterator = new FakeDisplayModeIterator();
+        return S_OK;
+    }
+    virtual HRESULT STDMETHODCALLTYPE SetScreenPreviewCallback(IDeckLinkScreenPreviewCallback *previewCallback)
+    {
+        return S_OK;
+    }
+    virtual HRESULT STDMETHODCALLTYPE EnableVideoInput(BMDDisplayMode displayMode,
+                                                       BMDPixelFormat pixelFormat,
+                                                       BMDVideoInputFlags flags);
+    virtual HRESULT STDMETHODCALLTYPE DisableVideoInput(void);
+    virtual HRESULT STDMETHODCALLTYPE GetAvailableVideoFrameCount(uint32_t *availableFrameCount)
+    {
+        *availableFrameCount = 0;
+        return S_OK;
+    }
+    virtual HRESULT STDMETHODCALLTYPE SetVideoInputFrameMemoryAllocator(IDeckLinkMemoryAllocator *theAllocator)
+    {
+        return E_NOTIMPL;
+    }
+    virtual HRESULT STDMETHODCALLTYPE EnableAudioInput(BMDAudioSampleRate sampleRate,
+                                                       BMDAudioSampleType sampleType,
+                                                       uint32_t channelCount);
+    virtual HRESULT STDMETHODCALLTYPE DisableAudioInput(void);
+    virtual HRESULT STDMETHODCALLTYPE GetAvailableAudioSampleFrameCount(uint32_t *availableSampleFrameCount)
+    {
+        *availableSampleFrameCount = 0;
+        return S_OK;
+    }
+    virtual HRESULT STDMETHODCALLTYPE StartStreams(void);
+    virtual HRESULT STDMETHODCALLTYPE StopStreams(void);
+    virtual HRESULT STDMETHODCALLTYPE PauseStreams(void);
+    virtual HRESULT STDMETHODCALLTYPE FlushStreams(void) { return S_OK; }
+    virtual HRESULT STDMETHODCALLTYPE SetCallback(IDeckLinkInputCallback *theCallback);
+    virtual HRESULT STDMETHODCALLTYPE GetHardwareReferenceClock(BMDTimeScale desiredTimeScale,
+                                                                BMDTimeValue *hardwareTime,
+                                                                BMDTimeValue *timeInFrame,
+                                                                BMDTimeValue *ticksPerFrame);
+
+    void Run(void);
+    void PutBuffer(uint8_t *bytes, size_t size);
+
+private:
+    uint8_t *GetBuffer(void);
+    void Reconfigure(void);
+
+    FakeDeckLink *m_device;
+    pthread_mutex_t m_lock;
+    pthread_t m_thread;
+    bool m_threadStarted;
+    bool m_running;
+    bool m_paused;
+    IDeckLinkInputCallback *m_callback;
+
+    // what the application asked for
+    const FakeMode *m_mode;
+    BMDPixelFormat m_pix;
+    BMDVideoInputFlags m_flags;
+    bool m_reconfigured;
+    bool m_audioEnabled;
+    int m_sampleDepth;
+    int m_channels;
+
+    // what is on the wire, the enabled mode until a format fault
+    const FakeMode *m_signal;
+
+    uint8_t *m_pattern;
+    size_t m_frameSize;
+    long m_rowBytes;
+    uint8_t *m_pool[kFakePool];
+    int m_poolCount;
+};
+
+class FakeInputFrame : public FakeUnknown<IDeckLinkVideoInputFrame>
+{
+public:
+    FakeInputFrame(FakeInput *input, uint8_t *bytes, size_t size,
+                   const FakeMode *mode, BMDPixelFormat pix, long rowBytes,
+                   BMDFrameFlags flags, BMDTimeValue time, int64_t hwTime) :
+        m_input(input), m_bytes(bytes), m_size(size), m_mode(mode),
+        m_pix(pix), m_rowBytes(rowBytes), m_flags(flags), m_time(time),
+        m_hwTime(hwTime)
+    {
+        m_input->AddRef();
+    }
+
+    virtual ~FakeInputFrame()
+    {
+        m_input->PutBuffer(m_bytes, m_size);
+        m_input->Release();
+    }
+
+    virtual HRESULT STDMETHODCALLTYPE QueryInterface(REFIID iid, LPVOID *ppv)
+    {
+        if (fake_iid(iid, IID_IUnknown) || fake_iid(iid, IID_IDeckLinkVideoFrame) ||
+            fake_iid(iid, IID_IDeckLinkVideoInputFrame)) {
+            AddRef();
+            *ppv = this;
+            return S_OK;
+        }
+        *ppv = NULL;
+        return E_NOINTERFACE;
+    }
+
+    virtual long STDMETHODCALLTYPE GetWidth(void) { return m_mode->width; }
+    virtual long STDMETHODCALLTYPE GetHeight(void) { return m_mode->height; }
+    virtual long STDMETHODCALLTYPE GetRowBytes(void) { return m_rowBytes; }
+    virtual BMDPixelFormat STDMETHODCALLTYPE GetPixelFormat(void) { return m_pix; }
+    virtual BMDFrameFlags STDMETHODCALLTYPE GetFlags(void) { return m_flags; }
+    virtual HRESULT STDMETHODCALLTYPE GetBytes(void **buffer)
+    {
+        *buffer = m_bytes;
+        return m_bytes ? S_OK : E_FAIL;
+    }
+    virtual HRESULT STDMETHODCALLTYPE GetTimecode(BMDTimecodeFormat format,
+                                                  IDeckLinkTimecode **timecode)
+    {
+        *timecode = NULL;
+        return S_FALSE;
+    }
+    virtual HRESULT STDMETHODCALLTYPE GetAncillaryData(IDeckLinkVideoFrameAncillary **ancillary)
+    {
+        *ancillary = NULL;
+        return S_FALSE;
+    }
+
+    virtual HRESULT STDMETHODCALLTYPE GetStreamTime(BMDTimeValue *frameTime,
+                                                    BMDTimeValue *frameDuration,
+                                                    BMDTimeScale timeScale)
+    {
+        *frameTime     = fake_rescale(m_time, timeScale, m_mode->scale);
+        *frameDuration = fake_rescale(m_mode->duration, timeScale, m_mode->scale);
+        return S_OK;
+    }
+    virtual HRESULT STDMETHODCALLTYPE GetHardwareReferenceTimestamp(BMDTimeScale timeScale,
+                                                                    BMDTimeValue *frameTime,
+                                                                    BMDTimeValue *frameDuration)
+    {
+        *frameTime     = fake_rescale(m_hwTime, timeScale, NS);
+        *frameDuration = fake_rescale(m_mode->duration, timeScale, m_mode->scale);
+        return S_OK;
+    }
+
+private:
+    FakeInput *m_input;
+    uint8_t *m_bytes;
+    size_t m_size;
+    const FakeMode *m_mode;
+    BMDPixelFormat m_pix;
+    long m_rowBytes;
+    BMDFrameFlags m_flags;
+    BMDTimeValue m_time;
+    int64_t m_hwTime;
+};
+
+/* a frame waiting to be shown, being shown or done */
+struct FakeScheduled {
+    IDeckLinkVideoFrame *frame;
+    BMDTimeValue time, duration;    // in the output mode time scale
+    BMDOutputFrameCompletionResult result;
+    FakeScheduled *next;
+};
+
+class FakeOutput : public IDeckLinkOutput
+{
+public:
+    FakeOutput(FakeDeckLink *device);
+    virtual ~FakeOutput();
+
+    virtual HRESULT STDMETHODCALLTYPE QueryInterface(REFIID iid, LPVOID *ppv);
+    virtual ULONG STDMETHODCALLTYPE AddRef(void);
+    virtual ULONG STDMETHODCALLTYPE Release(void);
+
+    virtual HRESULT STDMETHODCALLTYPE DoesSupportVideoMode(BMDDisplayMode displayMode,
+                                                           BMDPixelFormat pixelFormat,
+                                                           BMDVideoOutputFlags flags,
+                                                           BMDDisplayModeSupport *result,
+                                                           IDeckLinkDisplayMode **resultDisplayMode)
+    {
+        return fake_supports_mode(displayMode, pixelFormat, result, resultDisplayMode);
+    }
+    virtual HRESULT STDMETHODCALLTYPE GetDisplayModeIterator(IDeckLinkDisplayModeIterator **iterator)
+    {
+        *iterator = new FakeDisplayModeIterator();
+        return S_OK;
+    }
+    virtual HRESULT STDMETHODCALLTYPE SetScreenPreviewCallback(IDeckLinkScreenPreviewCallback *previewCallback)
+    {
+        return S_OK;
+    }
+    virtual HRESULT STDMETHODCALLTYPE EnableVideoOutput(BMDDisplayMode displayMode,
+                                                        BMDVideoOutputFlags flags);
+    virtual HRESULT STDMETHODCALLTYPE DisableVideoOutput(void);
+    virtual HRESULT STDMETHODCALLTYPE SetVideoOutputFrameMemoryAllocator(IDeckLinkMemoryAllocator *theAllocator)
+    {
+        return E_NOTIMPL;
+    }
+    virtual HRESULT STDMETHODCALLTYPE CreateVideoFrame(int32_t width, int32_t height,
+                                                       int32_t rowBytes,
+                                                       BMDPixelFormat pixelFormat,
+                                                       BMDFrameFlags flags,
+                                                       IDeckLinkMutableVideoFrame **outFrame);
+    virtual HRESULT STDMETHODCALLTYPE CreateAncillaryData(BMDPixelFormat pixelFormat,
+                                                          IDeckLinkVideoFrameAncillary **outBuffer)
+    {
+        return E_NOTIMPL;
+    }
+    virtual HRESULT STDMETHODCALLTYPE DisplayVideoFrameSync(IDeckLinkVideoFrame *theFrame)
+    {
+        return m_mode ? S_OK : E_ACCESSDENIED;
+    }
+    virtual HRESULT STDMETHODCALLTYPE ScheduleVideoFrame(IDeckLinkVideoFrame *theFrame,
+                                                         BMDTimeValue displayTime,
+                                                         BMDTimeValue displayDuration,
+                                                         BMDTimeScale timeScale);
+    virtual HRESULT STDMETHODCALLTYPE SetScheduledFrameCompletionCallback(IDeckLinkVideoOutputCallback *theCallback);
+    virtual HRESULT STDMETHODCALLTYPE GetBufferedVideoFrameCount(uint32_t *bufferedFrameCount);
+    virtual HRESULT STDMETHODCALLTYPE EnableAudioOutput(BMDAudioSampleRate sampleRate,
+                                                        BMDAudioSampleType sampleType,
+                                                        uint32_t channelCount,
+                                                        BMDAudioOutputStreamType streamType);
+    virtual HRESULT STDMETHODCALLTYPE DisableAudioOutput(void);
+    virtual HRESULT STDMETHODCALLTYPE WriteAudioSamplesSync(void *buffer,
+                                                            uint32_t sampleFrameCount,
+                                                            uint32_t *sampleFramesWritten);
+    virtual HRESULT STDMETHODCALLTYPE BeginAudioPreroll(void);
+    virtual HRESULT STDMETHODCALLTYPE EndAudioPreroll(void);
+    virtual HRESULT STDMETHODCALLTYPE ScheduleAudioSamples(void *buffer,
+                                                           uint32_t sampleFrameCount,
+                                                           BMDTimeValue streamTime,
+                                                           BMDTimeScale timeScale,
+                                                           uint32_t *sampleFramesWritten);
+    virtual HRESULT STDMETHODCALLTYPE GetBufferedAudioSampleFrameCount(uint32_t *bufferedSampleFrameCount);
+    virtual HRESULT STDMETHODCALLTYPE FlushBufferedAudioSamples(void);
+    virtual HRESULT STDMETHODCALLTYPE SetAudioCallback(IDeckLinkAudioOutputCallback *theCallback);
+    virtual HRESULT STDMETHODCALLTYPE StartScheduledPlayback(BMDTimeValue playbackStartTime,
+                                                             BMDTimeScale timeScale,
+                                                             double playbackSpeed);
+    virtual HRESULT STDMETHODCALLTYPE StopScheduledPlayback(BMDTimeValue stopPlaybackAtTime,
+                                                            BMDTimeValue *actualStopTime,
+                                                            BMDTimeScale timeScale);
+    virtual HRESULT STDMETHODCALLTYPE IsScheduledPlaybackRunning(bool *active);
+    virtual HRESULT STDMETHODCALLTYPE GetScheduledStreamTime(BMDTimeScale desiredTimeScale,
+                                                             BMDTimeValue *streamTime,
+                                                             double *playbackSpeed);
+    virtual HRESULT STDMETHODCALLTYPE GetReferenceStatus(BMDReferenceStatus *referenceStatus)
+    {
+        *referenceStatus = fake_config.reference;
+        return S_OK;
+    }
+    virtual HRESULT STDMETHODCALLTYPE GetHardwareReferenceClock(BMDTimeScale desiredTimeScale,
+                                                                BMDTimeValue *hardwareTime,
+                                                                BMDTimeValue *timeInFrame,
+                                                                BMDTimeValue *ticksPerFrame);
+    virtual HRESULT STDMETHODCALLTYPE GetFrameCompletionReferenceTimestamp(IDeckLinkVideoFrame *theFrame,
+                                                                           BMDTimeScale desiredTimeScale,
+                                                                           BMDTimeValue *frameCompletionTimestamp)
+    {
+        return E_NOTIMPL;
+    }
+
+    void Run(void);
+
+private:
+    BMDTimeValue StreamTime(int64_t now);
+    uint32_t BufferedAudio(void);
+    HRESULT AddAudio(int64_t start, uint32_t count, uint32_t *written);
+    void Shutdown(void);
+
+    FakeDeckLink *m_device;
+    pthread_mutex_t m_lock;
+    pthread_t m_thread;
+    bool m_running;
+    bool m_rebase;
+
+    const FakeMode *m_mode;
+    IDeckLinkVideoOutputCallback *m_frameCallback;
+    IDeckLinkAudioOutputCallback *m_audioCallback;
+
+    FakeScheduled *m_queue;         // sorted by display time
+    FakeScheduled *m_current;       // on the wire
+    uint32_t m_queued;
+    unsigned long m_shown;
+
+    bool m_playing;
+    BMDTimeValue m_startTime;       // stream time at m_startWall
+    int64_t m_startWall;
+    BMDTimeValue m_stopTime;
+    BMDTimeValue m_lastTime;
+    double m_speed;
+
+    bool m_audioEnabled;
+    bool m_audioPreroll;
+    bool m_audioContinuous;
+    int64_t m_audioPlayed;          // sample frames at 48 kHz
+    int64_t m_audioStart[kFakeAudioChunks];
+    uint32_t m_audioCount[kFakeAudioChunks];
+    int m_audioHead, m_audioChunks;
+};
+
+class FakeConfiguration : public IDeckLinkConfiguration
+{
+public:
+    FakeConfiguration(FakeDeckLink *device) : m_device(device), m_count(0)
+    {
+        pthread_mutex_init(&m_lock, NULL);
+    }
+    virtual ~FakeConfiguration() { pthread_mutex_destroy(&m_lock); }
+
+    virtual HRESULT STDMETHODCALLTYPE QueryInterface(REFIID iid, LPVOID *ppv);
+    virtual ULONG STDMETHODCALLTYPE AddRef(void);
+    virtual ULONG STDMETHODCALLTYPE Release(void);
+
+    virtual HRESULT STDMETHODCALLTYPE SetFlag(BMDDeckLinkConfigurationID cfgID, bool value)
+    {
+        return SetInt(cfgID, value);
+    }
+    virtual HRESULT STDMETHODCALLTYPE GetFlag(BMDDeckLinkConfigurationID cfgID, bool *value)
+    {
+        int64_t v   = 0;
+        HRESULT ret = GetInt(cfgID, &v);
+
+        *value = v;
+        return ret;
+    }
+    virtual HRESULT STDMETHODCALLTYPE SetInt(BMDDeckLinkConfigurationID cfgID, int64_t value);
+    virtual HRESULT STDMETHODCALLTYPE GetInt(BMDDeckLinkConfigurationID cfgID, int64_t *value);
+    virtual HRESULT STDMETHODCALLTYPE SetFloat(BMDDeckLinkConfigurationID cfgID, double value)
+    {
+        return E_INVALIDARG;
+    }
+    virtual HRESULT STDMETHODCALLTYPE GetFloat(BMDDeckLinkConfigurationID cfgID, double *value)
+    {
+        return E_INVALIDARG;
+    }
+    virtual HRESULT STDMETHODCALLTYPE SetString(BMDDeckLinkConfigurationID cfgID, BMDProbeString value)
+    {
+        return E_INVALIDARG;
+    }
+    virtual HRESULT STDMETHODCALLTYPE GetString(BMDDeckLinkConfigurationID cfgID, BMDProbeString *value)
+    {
+        return E_INVALIDARG;
+    }
+    virtual HRESULT STDMETHODCALLTYPE WriteConfigurationToPreferences(void) { return S_OK; }
+
+private:
+    FakeDeckLink *m_device;
+    pthread_mutex_t m_lock;
+    BMDDeckLinkConfigurationID m_ids[32];
+    int64_t m_values[32];
+    int m_count;
+};
+
+class FakeDeckLink : public FakeUnknown<IDeckLink>
+{
+public:
+    FakeDeckLink(int index) :
+        m_index(index), m_input(this), m_output(this), m_configuration(this) {}
+
+    virtual HRESULT STDMETHODCALLTYPE QueryInterface(REFIID iid, LPVOID *ppv)
+    {
+        if (fake_iid(iid, IID_IUnknown) || fake_iid(iid, IID_IDeckLink))
+            *ppv = static_cast<IDeckLink *>(this);
+        else if (fake_iid(iid, IID_IDeckLinkInput))
+            *ppv = static_cast<IDeckLinkInput *>(&m_input);
+        else if (fake_iid(iid, IID_IDeckLinkOutput))
+            *ppv = static_cast<IDeckLinkOutput *>(&m_output);
+        else if (fake_iid(iid, IID_IDeckLinkConfiguration))
+            *ppv = static_cast<IDeckLinkConfiguration *>(&m_configuration);
+        else {
+            *ppv = NULL;
+            return E_NOINTERFACE;
+        }
+        AddRef();
+        return S_OK;
+    }
+
+    virtual HRESULT STDMETHODCALLTYPE GetModelName(BMDProbeString *modelName)
+    {
+        *modelName = fake_string("Fake DeckLink");
+        return S_OK;
+    }
+
+    virtual HRESULT STDMETHODCALLTYPE GetDisplayName(BMDProbeString *displayName)
+    {
+        char name[32];
+
+        snprintf(name, sizeof(name), "Fake DeckLink (%d)", m_index + 1);
+        *displayName = fake_string(name);
+        return S_OK;
+    }
+
+private:
+    int m_index;
+    FakeInput m_input;
+    FakeOutput m_output;
+    FakeConfiguration m_configuration;
+};
+
+/* the interfaces of a card live and die with it */
+#define FAKE_FORWARD_UNKNOWN(cls)                                           \
+HRESULT cls::QueryInterface(REFIID iid, LPVOID *ppv)                        \
+{                                                                           \
+    return m_device->QueryInterface(iid, ppv);                              \
+}                                                                           \
+ULONG cls::AddRef(void)                                                     \
+{                                                                           \
+    return m_device->AddRef();                                              \
+}                                                                           \
+ULONG cls::Release(void)                                                    \
+{                                                                           \
+    return m_device->Release();                                             \
+}
+
+FAKE_FORWARD_UNKNOWN(FakeInput)
+FAKE_FORWARD_UNKNOWN(FakeOutput)
+FAKE_FORWARD_UNKNOWN(FakeConfiguration)
+
+HRESULT FakeConfiguration::SetInt(BMDDeckLinkConfigurationID cfgID, int64_t value)
+{
+    int i;
+
+    if (cfgID == bmdDeckLinkConfigReferenceInputTimingOffset &&
+        (value < -511 || value > 511))
+        return E_INVALIDARG;
+
+    pthread_mutex_lock(&m_lock);
+    for (i = 0; i < m_count && m_ids[i] != cfgID; i++)
+        ;
+    if (i == 32) {
+        pthread_mutex_unlock(&m_lock);
+        return E_OUTOFMEMORY;
+    }
+    m_ids[i]    = cfgID;
+    m_values[i] = value;
+    if (i == m_count)
+        m_count++;
+    pthread_mutex_unlock(&m_lock);
+
+    return S_OK;
+}
+
+HRESULT FakeConfiguration::GetInt(BMDDeckLinkConfigurationID cfgID, int64_t *value)
+{
+    *value = 0;
+
+    pthread_mutex_lock(&m_lock);
+    for (int i = 0; i < m_count; i++)
+        if (m_ids[i] == cfgID)
+            *value = m_values[i];
+    pthread_mutex_unlock(&m_lock);
+
+    return S_OK;
+}
+
+static void *fake_input_thread(void *arg)
+{
+    ((FakeInput *)arg)->Run();
+    return NULL;
+}
+
+FakeInput::FakeInput(FakeDeckLink *device) :
+    m_device(device), m_threadStarted(false), m_running(false),
+    m_paused(false), m_callback(NULL), m_mode(NULL), m_pix(0), m_flags(0),
+    m_reconfigured(false), m_audioEnabled(false), m_sampleDepth(16),
+    m_channels(2), m_signal(NULL), m_pattern(NULL), m_frameSize(0),
+    m_rowBytes(0), m_poolCount(0)
+{
+    pthread_mutex_init(&m_lock, NULL);
+}
+
+FakeInput::~FakeInput()
+{
+    StopStreams();
+    SetCallback(NULL);
+    while (m_poolCount)
+        free(m_pool[--m_poolCount]);
+    free(m_pattern);
+    pthread_mutex_destroy(&m_lock);
+}
+
+HRESULT FakeInput::EnableVideoInput(BMDDisplayMode displayMode,
+                                    BMDPixelFormat pixelFormat,
+                                    BMDVideoInputFlags flags)
+{
+    const FakeMode *mode = fake_find_mode(displayMode);
+
+    if (!mode)
+        return E_INVALIDARG;
+
+    pthread_mutex_lock(&m_lock);
+    m_mode         = mode;
+    m_pix          = pixelFormat;
+    m_flags        = flags;
+    m_reconfigured = true;
+    pthread_mutex_unlock(&m_lock);
+
+    return S_OK;
+}
+
+HRESULT FakeInput::DisableVideoInput(void)
+{
+    StopStreams();
+    pthread_mutex_lock(&m_lock);
+    m_mode = NULL;
+    pthread_mutex_unlock(&m_lock);
+
+    return S_OK;
+}
+
+HRESULT FakeInput::EnableAudioInput(BMDAudioSampleRate sampleRate,
+                                    BMDAudioSampleType sampleType,
+                                    uint32_t channelCount)
+{
+    if (sampleRate != bmdAudioSampleRate48kHz ||
+        (sampleType != bmdAudioSampleType16bitInteger &&
+         sampleType != bmdAudioSampleType32bitInteger) ||
+        (channelCount != 2 && channelCount != 8 && channelCount != 16))
+        return E_INVALIDARG;
+
+    pthread_mutex_lock(&m_lock);
+    m_audioEnabled = true;
+    m_sampleDepth  = sampleType;
+    m_channels     = channelCount;
+    pthread_mutex_unlock(&m_lock);
+
+    return S_OK;
+}
+
+HRESULT FakeInput::DisableAudioInput(void)
+{
+    pthread_mutex_lock(&m_lock);
+    m_audioEnabled = false;
+    pthread_mutex_unlock(&m_lock);
+
+    return S_OK;
+}
+
+HRESULT FakeInput::StartStreams(void)
+{
+    bool start = false;
+
+    pthread_mutex_lock(&m_lock);
+    if (!m_mode) {
+        pthread_mutex_unlock(&m_lock);
+        return E_ACCESSDENIED;
+    }
+    // a running thread is only resumed after PauseStreams
+    start     = !m_running;
+    m_running = true;
+    m_paused  = false;
+    pthread_mutex_unlock(&m_lock);
+
+    if (!start)
+        return S_OK;
+
+    if (m_threadStarted) {
+        if (pthread_equal(m_thread, pthread_self()))
+            pthread_detach(m_thread);
+        else
+            pthread_join(m_thread, NULL);
+    }
+    m_threadStarted = !pthread_create(&m_thread, NULL, fake_input_thread, this);
+    if (!m_threadStarted) {
+        pthread_mutex_lock(&m_lock);
+        m_running = false;
+        pthread_mutex_unlock(&m_lock);
+        return E_FAIL;
+    }
+
+    return S_OK;
+}
+
+HRESULT FakeInput::StopStreams(void)
+{
+    pthread_mutex_lock(&m_lock);
+    m_running = false;
+    pthread_mutex_unlock(&m_lock);
+
+    // the callback may stop the streams, the thread then winds down alone
+    if (m_threadStarted && !pthread_equal(m_thread, pthread_self())) {
+        pthread_join(m_thread, NULL);
+        m_threadStarted = false;
+    }
+
+    return S_OK;
+}
+
+HRESULT FakeInput::PauseStreams(void)
+{
+    pthread_mutex_lock(&m_lock);
+    m_paused = true;
+    pthread_mutex_unlock(&m_lock);
+
+    return S_OK;
+}
+
+HRESULT FakeInput::SetCallback(IDeckLinkInputCallback *theCallback)
+{
+    IDeckLinkInputCallback *old;
+
+    if (theCallback)
+        theCallback->AddRef();
+    pthread_mutex_lock(&m_lock);
+    old        = m_callback;
+    m_callback = theCallback;
+    pthread_mutex_unlock(&m_lock);
+    if (old)
+        old->Release();
+
+    return S_OK;
+}
+
+HRESULT FakeInput::GetHardwareReferenceClock(BMDTimeScale desiredTimeScale,
+                                             BMDTimeValue *hardwareTime,
+                                             BMDTimeValue *timeInFrame,
+                                             BMDTimeValue *ticksPerFrame)
+{
+    const FakeMode *mode = m_mode;
+
+    *hardwareTime  = fake_rescale(fake_now(), desiredTimeScale, NS);
+    *ticksPerFrame = mode ? fake_rescale(mode->duration, desiredTimeScale, mode->scale) : 0;
+    *timeInFrame   = *ticksPerFrame ? *hardwareTime % *ticksPerFrame : 0;
+
+    return S_OK;
+}
+
+/* with m_lock held */
+void FakeInput::Reconfigure(void)
+{
+    m_rowBytes  = fake_row_bytes(m_pix, m_mode->width);
+    m_frameSize = m_rowBytes * m_mode->height;
+    while (m_poolCount)
+        free(m_pool[--m_poolCount]);
+    free(m_pattern);
+    m_pattern = (uint8_t *)malloc(m_frameSize);
+    if (m_pattern)
+        fake_fill_bars(m_pattern, m_pix, m_mode->width, m_mode->height,
+                       m_rowBytes);
+    m_reconfigured = false;
+}
+
+/* with m_lock held */
+uint8_t *FakeInput::GetBuffer(void)
+{
+    void *buf;
+
+    if (m_poolCount)
+        return m_pool[--m_poolCount];
+    if (posix_memalign(&buf, 64, m_frameSize))
+        return NULL;
+    return (uint8_t *)buf;
+}
+
+void FakeInput::PutBuffer(uint8_t *bytes, size_t size)
+{
+    pthread_mutex_lock(&m_lock);
+    if (bytes && size == m_frameSize && m_poolCount < kFakePool) {
+        m_pool[m_poolCount++] = bytes;
+        bytes = NULL;
+    }
+    pthread_mutex_unlock(&m_lock);
+    free(bytes);
+}
+
+/*
+ * One frame per mode duration from a fixed origin, so that the cadence does
+ * not drift with the time spent in the callback.  A mode change restarts
+ * the count from the frame it happens on, the stream time carries on.
+ */
+void FakeInput::Run(void)
+{
+    const FakeMode *mode = NULL;
+    int64_t start        = fake_now();
+    int64_t base         = start, deadline;
+    BMDTimeValue base_time = 0;
+    int64_t position     = 0;
+    unsigned int seed    = (unsigned int)start;
+    long n = 0, frames = 0;
+
+    pthread_mutex_lock(&m_lock);
+    while (m_running) {
+        IDeckLinkInputCallback *callback;
+        FakeInputFrame *frame;
+        FakeAudioPacket *audio = NULL;
+        IDeckLinkDisplayMode *changed = NULL;
+        BMDFrameFlags flags = 0;
+        uint8_t *bytes;
+        bool skip, silent;
+        long count;
+
+        if (!m_mode)
+            break;
+        if (m_mode != mode || m_reconfigured) {
+            if (mode)
+                base += fake_rescale(n * mode->duration, NS, mode->scale);
+            mode      = m_mode;
+            base_time = fake_rescale(base - start, mode->scale, NS);
+            n         = 0;
+            Reconfigure();
+        }
+
+        deadline = base + fake_rescale(n * mode->duration, NS, mode->scale);
+        pthread_mutex_unlock(&m_lock);
+        fake_sleep_until(deadline + (fake_config.jitter ?
+                                     rand_r(&seed) % fake_config.jitter * 1000LL : 0));
+        pthread_mutex_lock(&m_lock);
+        if (!m_running || m_mode != mode || m_reconfigured)
+            continue;
+
+        frames++;
+        if (frames == fake_config.format_at + 1) {
+            m_signal = fake_config.format_mode;
+            if (m_flags & bmdVideoInputEnableFormatDetection)
+                changed = new FakeDisplayMode(m_signal);
+        }
+        if ((m_signal && m_signal != mode) ||
+            (frames > fake_config.signal_at &&
+             frames <= fake_config.signal_at + fake_config.signal_frames))
+            flags |= bmdFrameHasNoInputSource;
+
+        bytes = GetBuffer();
+        frame = new FakeInputFrame(this, bytes, m_frameSize, mode, m_pix,
+                                   m_rowBytes, flags, base_time + n * mode->duration,
+                                   deadline);
+        if (bytes && m_pattern)
+            memcpy(bytes, m_pattern, m_frameSize);
+
+        if (m_audioEnabled) {
+            count = fake_rescale((n + 1) * mode->duration, 48000, mode->scale) -
+                    fake_rescale(n * mode->duration, 48000, mode->scale);
+            audio = new FakeAudioPacket(count, position,
+                                        m_sampleDepth / 8 * m_channels);
+            silent = flags & bmdFrameHasNoInputSource;
+            if (audio->m_bytes)
+                fake_fill_tone(audio->m_bytes, position, count,
+                               m_sampleDepth, m_channels, silent);
+            position += count;
+        }
+
+        callback = m_callback;
+        if (callback)
+            callback->AddRef();
+        skip = m_paused || (fake_config.drop && frames % fake_config.drop == 0);
+        pthread_mutex_unlock(&m_lock);
+
+        if (callback) {
+            if (changed)
+                callback->VideoInputFormatChanged(bmdVideoInputDisplayModeChanged,
+                                                  changed,
+                                                  bmdDetectedVideoInputYCbCr422);
+            if (!skip)
+                callback->VideoInputFrameArrived(frame, audio);
+            callback->Release();
+        }
+        if (changed)
+            changed->Release();
+        frame->Release();
+        if (audio)
+            audio->Release();
+        n++;
+
+        pthread_mutex_lock(&m_lock);
+    }
+    m_running = false;
+    pthread_mutex_unlock(&m_lock);
+}
+
+static void *fake_output_thread(void *arg)
+{
+    ((FakeOutput *)arg)->Run();
+    return NULL;
+}
+
+FakeOutput::FakeOutput(FakeDeckLink *device) :
+    m_device(device), m_running(false), m_rebase(false), m_mode(NULL),
+    m_frameCallback(NULL), m_audioCallback(NULL), m_queue(NULL),
+    m_current(NULL), m_queued(0), m_shown(0), m_playing(false),
+    m_startTime(0), m_startWall(0), m_stopTime(-1), m_lastTime(0),
+    m_speed(0), m_audioEnabled(false), m_audioPreroll(false),
+    m_audioContinuous(false), m_audioPlayed(0), m_audioHead(0),
+    m_audioChunks(0)
+{
+    pthread_mutex_init(&m_lock, NULL);
+}
+
+FakeOutput::~FakeOutput()
+{
+    DisableVideoOutput();
+    SetScheduledFrameCompletionCallback(NULL);
+    SetAudioCallback(NULL);
+    pthread_mutex_destroy(&m_lock);
+}
+
+HRESULT FakeOutput::EnableVideoOutput(BMDDisplayMode displayMode,
+                                      BMDVideoOutputFlags flags)
+{
+    const FakeMode *mode = fake_find_mode(displayMode);
+    HRESULT ret = S_OK;
+
+    if (!mode)
+        return E_INVALIDARG;
+
+    pthread_mutex_lock(&m_lock);
+    m_mode   = mode;
+    m_rebase = true;
+    if (!m_running) {
+        m_running = !pthread_create(&m_thread, NULL, fake_output_thread, this);
+        if (!m_running)
+            ret = E_FAIL;
+    }
+    pthread_mutex_unlock(&m_lock);
+
+    return ret;
+}
+
+/* drop whatever is still scheduled, no callbacks on the way out */
+void FakeOutput::Shutdown(void)
+{
+    FakeScheduled *s;
+
+    pthread_mutex_lock(&m_lock);
+    if (m_current) {
+        m_current->next = m_queue;
+        m_queue         = m_current;
+        m_current       = NULL;
+    }
+    while ((s = m_queue)) {
+        m_queue = s->next;
+        s->frame->Release();
+        free(s);
+    }
+    m_queued  = 0;
+    m_playing = false;
+    m_mode    = NULL;
+    pthread_mutex_unlock(&m_lock);
+}
+
+HRESULT FakeOutput::DisableVideoOutput(void)
+{
+    bool running;
+
+    pthread_mutex_lock(&m_lock);
+    running   = m_running;
+    m_running = false;
+    pthread_mutex_unlock(&m_lock);
+
+    if (running) {
+        if (pthread_equal(m_thread, pthread_self()))
+            pthread_detach(m_thread);
+        else
+            pthread_join(m_thread, NULL);
+    }
+    Shutdown();
+
+    return S_OK;
+}
+
+HRESULT FakeOutput::CreateVideoFrame(int32_t width, int32_t height,
+                                     int32_t rowBytes,
+                                     BMDPixelFormat pixelFormat,
+                                     BMDFrameFlags flags,
+                                     IDeckLinkMutableVideoFrame **outFrame)
+{
+    FakeVideoFrame *frame;
+    void *bytes;
+
+    *outFrame = NULL;
+    if (width <= 0 || height <= 0 ||
+        rowBytes < fake_row_bytes(pixelFormat, width))
+        return E_INVALIDARG;
+
+    frame = new FakeVideoFrame(width, height, rowBytes, pixelFormat, flags);
+    if (frame->GetBytes(&bytes) != S_OK) {
+        frame->Release();
+        return E_OUTOFMEMORY;
+    }
+    *outFrame = frame;
+
+    return S_OK;
+}
+
+HRESULT FakeOutput::ScheduleVideoFrame(IDeckLinkVideoFrame *theFrame,
+                                       BMDTimeValue displayTime,
+                                       BMDTimeValue displayDuration,
+                                       BMDTimeScale timeScale)
+{
+    FakeScheduled *s, **p;
+
+    if (!theFrame || timeScale <= 0)
+        return E_INVALIDARG;
+
+    s = (FakeScheduled *)malloc(sizeof(*s));
+    if (!s)
+        return E_OUTOFMEMORY;
+
+    pthread_mutex_lock(&m_lock);
+    if (!m_mode) {
+        pthread_mutex_unlock(&m_lock);
+        free(s);
+        return E_ACCESSDENIED;
+    }
+    theFrame->AddRef();
+    s->frame    = theFrame;
+    s->time     = fake_rescale(displayTime, m_mode->scale, timeScale);
+    s->duration = fake_rescale(displayDuration, m_mode->scale, timeScale);
+    s->result   = bmdOutputFrameCompleted;
+    for (p = &m_queue; *p && (*p)->time <= s->time; p = &(*p)->next)
+        ;
+    s->next = *p;
+    *p      = s;
+    m_queued++;
+    pthread_mutex_unlock(&m_lock);
+
+    return S_OK;
+}
+
+HRESULT FakeOutput::SetScheduledFrameCompletionCallback(IDeckLinkVideoOutputCallback *theCallback)
+{
+    IDeckLinkVideoOutputCallback *old;
+
+    if (theCallback)
+        theCallback->AddRef();
+    pthread_mutex_lock(&m_lock);
+    old             = m_frameCallback;
+    m_frameCallback = theCallback;
+    pthread_mutex_unlock(&m_lock);
+    if (old)
+        old->Release();
+
+    return S_OK;
+}
+
+HRESULT FakeOutput::GetBufferedVideoFrameCount(uint32_t *bufferedFrameCount)
+{
+    pthread_mutex_lock(&m_lock);
+    *bufferedFrameCount = m_queued;
+    pthread_mutex_unlock(&m_lock);
+
+    return S_OK;
+}
+
+HRESULT FakeOutput::EnableAudioOutput(BMDAudioSampleRate sampleRate,
+                                      BMDAudioSampleType sampleType,
+                                      uint32_t channelCount,
+                                      BMDAudioOutputStreamType streamType)
+{
+    if (sampleRate != bmdAudioSampleRate48kHz ||
+        (sampleType != bmdAudioSampleType16bitInteger &&
+         sampleType != bmdAudioSampleType32bitInteger) ||
+        (channelCount != 2 && channelCount != 8 && channelCount != 16))
+        return E_INVALIDARG;
+
+    pthread_mutex_lock(&m_lock);
+    m_audioEnabled    = true;
+    m_audioContinuous = streamType != bmdAudioOutputStreamTimestamped;
+    m_audioChunks     = 0;
+    pthread_mutex_unlock(&m_lock);
+
+    return S_OK;
+}
+
+HRESULT FakeOutput::DisableAudioOutput(void)
+{
+    pthread_mutex_lock(&m_lock);
+    m_audioEnabled  = false;
+    m_audioPreroll  = false;
+    m_audioChunks   = 0;
+    pthread_mutex_unlock(&m_lock);
+
+    return S_OK;
+}
+
+/* with m_lock held, what is scheduled and not played yet */
+uint32_t FakeOutput::BufferedAudio(void)
+{
+    int64_t buffered = 0;
+
+    for (int i = 0; i < m_audioChunks; i++) {
+        int c = (m_audioHead + i) % kFakeAudioChunks;
+
+        int64_t end = m_audioStart[c] + m_audioCount[c];
+
+        if (end > m_audioPlayed)
+            buffered += end - (m_audioStart[c] > m_audioPlayed ?
+                               m_audioStart[c] : m_audioPlayed);
+    }
+
+    return buffered;
+}
+
+/* with m_lock held */
+HRESULT FakeOutput::AddAudio(int64_t start, uint32_t count, uint32_t *written)
+{
+    uint32_t room = kFakeAudioBuffer - BufferedAudio();
+    int last      = (m_audioHead + m_audioChunks - 1) % kFakeAudioChunks;
+
+    if (written)
+        *written = 0;
+    if (!m_audioEnabled)
+        return E_ACCESSDENIED;
+
+    if (count > room)
+        count = room;
+    if (!count)
+        return S_OK;
+
+    if (m_audioChunks && m_audioStart[last] + m_audioCount[last] == start) {
+        m_audioCount[last] += count;
+    } else if (m_audioChunks < kFakeAudioChunks) {
+        last = (m_audioHead + m_audioChunks++) % kFakeAudioChunks;
+        m_audioStart[last] = start;
+        m_audioCount[last] = count;
+    } else {
+        return S_OK;
+    }
+    if (written)
+        *written = count;
+
+    return S_OK;
+}
+
+HRESULT FakeOutput::WriteAudioSamplesSync(void *buffer,
+                                          uint32_t sampleFrameCount,
+                                          uint32_t *sampleFramesWritten)
+{
+    HRESULT ret;
+
+    pthread_mutex_lock(&m_lock);
+    ret = AddAudio(m_audioPlayed, sampleFrameCount, sampleFramesWritten);
+    pthread_mutex_unlock(&m_lock);
+
+    return ret;
+}
+
+HRESULT FakeOutput::BeginAudioPreroll(void)
+{
+    pthread_mutex_lock(&m_lock);
+    m_audioPreroll = m_audioEnabled;
+    pthread_mutex_unlock(&m_lock);
+
+    return m_audioEnabled ? S_OK : E_ACCESSDENIED;
+}
+
+HRESULT FakeOutput::EndAudioPreroll(void)
+{
+    pthread_mutex_lock(&m_lock);
+    m_audioPreroll = false;
+    pthread_mutex_unlock(&m_lock);
+
+    return S_OK;
+}
+
+HRESULT FakeOutput::ScheduleAudioSamples(void *buffer,
+                                         uint32_t sampleFrameCount,
+                                         BMDTimeValue streamTime,
+                                         BMDTimeScale timeScale,
+                                         uint32_t *sampleFramesWritten)
+{
+    int last;
+    int64_t start;
+    HRESULT ret;
+
+    pthread_mutex_lock(&m_lock);
+    last = (m_audioHead + m_audioChunks - 1) % kFakeAudioChunks;
+    if (m_audioContinuous || timeScale <= 0)
+        start = m_audioChunks ? m_audioStart[last] + m_audioCount[last] :
+                                m_audioPlayed;
+    else
+        start = fake_rescale(streamTime, 48000, timeScale);
+    ret = AddAudio(start, sampleFrameCount, sampleFramesWritten);
+    pthread_mutex_unlock(&m_lock);
+
+    return ret;
+}
+
+HRESULT FakeOutput::GetBufferedAudioSampleFrameCount(uint32_t *bufferedSampleFrameCount)
+{
+    pthread_mutex_lock(&m_lock);
+    *bufferedSampleFrameCount = BufferedAudio();
+    pthread_mutex_unlock(&m_lock);
+
+    return S_OK;
+}
+
+HRESULT FakeOutput::FlushBufferedAudioSamples(void)
+{
+    pthread_mutex_lock(&m_lock);
+    m_audioChunks = 0;
+    pthread_mutex_unlock(&m_lock);
+
+    return S_OK;
+}
+
+HRESULT FakeOutput::SetAudioCallback(IDeckLinkAudioOutputCallback *theCallback)
+{
+    IDeckLinkAudioOutputCallback *old;
+
+    if (theCallback)
+        theCallback->AddRef();
+    pthread_mutex_lock(&m_lock);
+    old             = m_audioCallback;
+    m_audioCallback = theCallback;
+    pthread_mutex_unlock(&m_lock);
+    if (old)
+        old->Release();
+
+    return S_OK;
+}
+
+HRESULT FakeOutput::StartScheduledPlayback(BMDTimeValue playbackStartTime,
+                                           BMDTimeScale timeScale,
+                                           double playbackSpeed)
+{
+    HRESULT ret = S_OK;
+
+    pthread_mutex_lock(&m_lock);
+    if (!m_mode || timeScale <= 0) {
+        ret = E_ACCESSDENIED;
+    } else if (!m_playing) {
+        m_playing      = true;
+        m_startTime    = fake_rescale(playbackStartTime, m_mode->scale, timeScale);
+        m_speed        = playbackSpeed;
+        m_stopTime     = -1;
+        m_rebase       = true;
+        m_audioPreroll = false;
+        m_audioPlayed  = fake_rescale(m_startTime, 48000, m_mode->scale);
+    }
+    pthread_mutex_unlock(&m_lock);
+
+    return ret;
+}
+
+HRESULT FakeOutput::StopScheduledPlayback(BMDTimeValue stopPlaybackAtTime,
+                                          BMDTimeValue *actualStopTime,
+                                          BMDTimeScale timeScale)
+{
+    pthread_mutex_lock(&m_lock);
+    if (m_playing && m_mode && timeScale > 0) {
+        m_stopTime = stopPlaybackAtTime ?
+                     fake_rescale(stopPlaybackAtTime, m_mode->scale, timeScale) : 0;
+        if (actualStopTime)
+            *actualStopTime = stopPlaybackAtTime ? stopPlaybackAtTime :
+                              fake_rescale(StreamTime(fake_now()), timeScale,
+                                           m_mode->scale);
+    } else if (actualStopTime) {
+        *actualStopTime = 0;
+    }
+    pthread_mutex_unlock(&m_lock);
+
+    return S_OK;
+}
+
+HRESULT FakeOutput::IsScheduledPlaybackRunning(bool *active)
+{
+    pthread_mutex_lock(&m_lock);
+    *active = m_playing;
+    pthread_mutex_unlock(&m_lock);
+
+    return S_OK;
+}
+
+/* with m_lock held */
+BMDTimeValue FakeOutput::StreamTime(int64_t now)
+{
+    if (!m_playing || m_rebase)
+        return m_lastTime;
+    return m_startTime + (BMDTimeValue)(fake_rescale(now - m_startWall,
+                                                     m_mode->scale, NS) * m_speed);
+}
+
+HRESULT FakeOutput::GetScheduledStreamTime(BMDTimeScale desiredTimeScale,
+                                           BMDTimeValue *streamTime,
+                                           double *playbackSpeed)
+{
+    HRESULT ret = S_OK;
+
+    pthread_mutex_lock(&m_lock);
+    if (m_mode) {
+        *streamTime    = fake_rescale(StreamTime(fake_now()), desiredTimeScale,
+                                      m_mode->scale);
+        *playbackSpeed = m_playing ? m_speed : 0;
+    } else {
+        ret = E_ACCESSDENIED;
+    }
+    pthread_mutex_unlock(&m_lock);
+
+    return ret;
+}
+
+HRESULT FakeOutput::GetHardwareReferenceClock(BMDTimeScale desiredTimeScale,
+                                              BMDTimeValue *hardwareTime,
+                                              BMDTimeValue *timeInFrame,
+                                              BMDTimeValue *ticksPerFrame)
+{
+    const FakeMode *mode = m_mode;
+
+    *hardwareTime  = fake_rescale(fake_now(), desiredTimeScale, NS);
+    *ticksPerFrame = mode ? fake_rescale(mode->duration, desiredTimeScale, mode->scale) : 0;
+    *timeInFrame   = *ticksPerFrame ? *hardwareTime % *ticksPerFrame : 0;
+
+    return S_OK;
+}
+
+/*
+ * The output clock: at each frame boundary the latest frame due replaces
+ * the one on the wire, which completes with how it went.  Frames overtaken
+ * before they were shown are dropped.  The callbacks run with the lock
+ * released, they schedule the next frames.
+ */
+void FakeOutput::Run(void)
+{
+    const FakeMode *mode = NULL;
+    int64_t base = 0, deadline;
+    long tick = 0;
+
+    pthread_mutex_lock(&m_lock);
+    while (m_running) {
+        IDeckLinkVideoOutputCallback *frameCallback;
+        IDeckLinkAudioOutputCallback *audioCallback;
+        FakeScheduled *done = NULL, **tail = &done, *s;
+        bool preroll, stopped = false;
+        BMDTimeValue now;
+
+        if (!m_mode)
+            break;
+        if (m_rebase || m_mode != mode) {
+            mode        = m_mode;
+            base        = fake_now();
+            tick        = 0;
+            m_startWall = base;
+            m_rebase    = false;
+        }
+
+        deadline = base + fake_rescale(tick * mode->duration, NS, mode->scale);
+        pthread_mutex_unlock(&m_lock);
+        fake_sleep_until(deadline);
+        pthread_mutex_lock(&m_lock);
+        if (!m_running || m_rebase || m_mode != mode)
+            continue;
+
+        if (m_playing) {
+            now = m_startTime + (BMDTimeValue)(tick * mode->duration * m_speed);
+            m_lastTime = now;
+
+            if (m_stopTime >= 0 && now >= m_stopTime) {
+                // everything left is flushed, the last frame shown completes
+                for (s = m_queue; s; s = s->next)
+                    s->result = bmdOutputFrameFlushed;
+                *tail = m_queue;
+                while (*tail)
+                    tail = &(*tail)->next;
+                if (m_current) {
+                    *tail           = m_current;
+                    tail            = &m_current->next;
+                    m_current->next = NULL;
+                }
+                m_queue   = NULL;
+                m_current = NULL;
+                m_queued  = 0;
+                m_playing = false;
+                stopped   = true;
+            }
+
+            while ((s = m_queue) && s->time <= now) {
+                m_queue = s->next;
+                m_queued--;
+                s->next = NULL;
+
+                // drop= and late= count the frames that reach the display
+                bool overtaken = m_queue && m_queue->time <= now;
+                if (!overtaken)
+                    m_shown++;
+                if (overtaken ||
+                    (fake_config.drop && m_shown % fake_config.drop == 0)) {
+                    s->result = bmdOutputFrameDropped;
+                } else {
+                    if (s->time + mode->duration <= now ||
+                        (fake_config.late && m_shown % fake_config.late == 0))
+                        s->result = bmdOutputFrameDisplayedLate;
+                    if (m_current) {
+                        *tail = m_current;
+                        tail  = &m_current->next;
+                    }
+                    m_current = s;
+                    continue;
+                }
+                *tail = s;
+                tail  = &s->next;
+            }
+
+            m_audioPlayed = fake_rescale(now + mode->duration, 48000, mode->scale);
+            while (m_audioChunks &&
+                   m_audioStart[m_audioHead] + m_audioCount[m_audioHead] <= m_audioPlayed) {
+                m_audioHead = (m_audioHead + 1) % kFakeAudioChunks;
+                m_audioChunks--;
+            }
+        }
+        tick++;
+
+        frameCallback = m_frameCallback;
+        audioCallback = m_audioEnabled && (m_audioPreroll || m_playing) ?
+                        m_audioCallback : NULL;
+        preroll       = m_audioPreroll;
+        if (frameCallback)
+            frameCallback->AddRef();
+        if (audioCallback)
+            audioCallback->AddRef();
+        pthread_mutex_unlock(&m_lock);
+
+        while ((s = done)) {
+            done = s->next;
+            if (frameCallback)
+                frameCallback->ScheduledFrameCompleted(s->frame, s->result);
+            s->frame->Release();
+            free(s);
+        }
+        if (frameCallback) {
+            if (stopped)
+                frameCallback->ScheduledPlaybackHasStopped();
+            frameCallback->Release();
+        }
+        if (audioCallback) {
+            audioCallback->RenderAudioSamples(preroll);
+            audioCallback->Release();
+        }
+
+        pthread_mutex_lock(&m_lock);
+    }
+    pthread_mutex_unlock(&m_lock);
+}
+
+class FakeIterator : public FakeUnknown<IDeckLinkIterator>
+{
+public:
+    FakeIterator() : m_next(0) {}
+
+    virtual HRESULT STDMETHODCALLTYPE QueryInterface(REFIID iid, LPVOID *ppv)
+    {
+        if (fake_iid(iid, IID_IUnknown) || fake_iid(iid, IID_IDeckLinkIterator)) {
+            AddRef();
+            *ppv = this;
+            return S_OK;
+        }
+        *ppv = NULL;
+        return E_NOINTERFACE;
+    }
+
+    virtual HRESULT STDMETHODCALLTYPE Next(IDeckLink **deckLinkInstance)
+    {
+        if (m_next >= fake_config.devices) {
+            *deckLinkInstance = NULL;
+            return S_FALSE;
+        }
+        *deckLinkInstance = new FakeDeckLink(m_next++);
+        return S_OK;
+    }
+
+private:
+    int m_next;
+};
+
+extern "C" {
+
+IDeckLinkIterator *CreateDeckLinkIteratorInstance(void)
+{
+    pthread_once(&fake_once, fake_parse_config);
+    return new FakeIterator();
+}
+
+}
@@ -0,0 +1,334 @@
+/*
+ * Blackmagic Devices Decklink shared memory frame bus
+ * Copyright (c) 2026 the bmdtools authors.
+ *
+ * This file is part of bmdtools.
+ *
+ * bmdtools is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * bmdtools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with bmdtools; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#include "framebus.h"
+
+#define FRAMEBUS_MAGIC   "BMDBUS\0"
+#define FRAMEBUS_VERSION 1
+
+/* slots and their pictures start on a cache line */
+#define ALIGNMENT 64
+
+typedef struct BusHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t slots;
+    uint64_t slot_size;
+    uint64_t header_size;       /* where the first slot is */
+    FrameBusFormat format;
+    uint64_t head;              /* frames published */
+    uint32_t wake;              /* bumped at each frame, waited on */
+    uint32_t closed;
+} BusHeader;
+
+/*
+ * The sequence is odd while the slot is written, even and the frame
+ * sequence + 1 times 2 once it is complete: a reader compares it before
+ * and after copying to know whether the publisher went over it.
+ */
+typedef struct BusSlot {
+    uint64_t seq;
+    FrameBusFrame frame;
+} BusSlot;
+
+struct FrameBus {
+    char *name;
+    int publisher;
+    BusHeader *header;
+    size_t size;
+    size_t slot_header;         /* BusSlot, padded */
+
+    uint64_t next;              /* reader, the frame to read */
+    uint64_t frames;
+    uint64_t overruns;
+    uint64_t lost;
+};
+
+static size_t align(size_t size)
+{
+    return (size + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1);
+}
+
+static BusSlot *bus_slot(FrameBus *bus, uint64_t sequence)
+{
+    BusHeader *h = bus->header;
+
+    return (BusSlot *)((uint8_t *)h + h->header_size +
+                       (sequence % h->slots) * h->slot_size);
+}
+
+static void bus_wake(FrameBus *bus)
+{
+    __atomic_add_fetch(&bus->header->wake, 1, __ATOMIC_RELEASE);
+#ifdef __linux__
+    syscall(SYS_futex, &bus->header->wake, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+#endif
+}
+
+static void bus_wait(FrameBus *bus, uint32_t wake, int timeout)
+{
+#ifdef __linux__
+    struct timespec ts = { timeout / 1000, (timeout % 1000) * 1000000L };
+
+    syscall(SYS_futex, &bus->header->wake, FUTEX_WAIT, wake, &ts, NULL, 0);
+#else
+    if (__atomic_load_n(&bus->header->wake, __ATOMIC_ACQUIRE) == wake)
+        usleep(1000);
+#endif
+}
+
+static void bus_free(FrameBus *bus)
+{
+    if (bus->header)
+        munmap(bus->header, bus->size);
+    free(bus->name);
+    free(bus);
+}
+
+FrameBus *framebus_create(const char *name, const FrameBusFormat *format,
+                          unsigned slots)
+{
+    FrameBus *bus = (FrameBus *)calloc(1, sizeof(*bus));
+    size_t header_size = align(sizeof(BusHeader));
+    size_t slot_size;
+    void *p;
+    int fd;
+
+    if (!bus)
+        return NULL;
+    bus->publisher   = 1;
+    bus->name        = strdup(name);
+    bus->slot_header = align(sizeof(BusSlot));
+    slot_size        = bus->slot_header + align(format->video_size) +
+                       align(format->audio_size);
+    bus->size        = header_size + slots * slot_size;
+
+    // readers still attached to an old one keep it until they let go
+    shm_unlink(name);
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "%s: %s\n", name, strerror(errno));
+        bus_free(bus);
+        return NULL;
+    }
+    if (ftruncate(fd, bus->size) < 0) {
+        fprintf(stderr, "%s: %s\n", name, strerror(errno));
+        close(fd);
+        shm_unlink(name);
+        bus_free(bus);
+        return NULL;
+    }
+    p = mmap(NULL, bus->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "%s: %s\n", name, strerror(errno));
+        shm_unlink(name);
+        bus_free(bus);
+        return NULL;
+    }
+    bus->header = (BusHeader *)p;
+
+    bus->header->version     = FRAMEBUS_VERSION;
+    bus->header->slots       = slots;
+    bus->header->slot_size   = slot_size;
+    bus->header->header_size = header_size;
+    bus->header->format      = *format;
+    // readers check it last
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(bus->header->magic, FRAMEBUS_MAGIC, sizeof(bus->header->magic));
+
+    return bus;
+}
+
+void framebus_put(FrameBus *bus, FrameBusFrame *frame,
+                  const void *video, const void *audio)
+{
+    BusHeader *h      = bus->header;
+    uint64_t sequence = h->head;
+    BusSlot *slot     = bus_slot(bus, sequence);
+    uint8_t *data     = (uint8_t *)slot + bus->slot_header;
+
+    if (frame->video_size > h->format.video_size)
+        frame->video_size = h->format.video_size;
+    if (frame->audio_size > h->format.audio_size)
+        frame->audio_size = h->format.audio_size;
+    frame->sequence = sequence;
+
+    __atomic_store_n(&slot->seq, 2 * sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    slot->frame = *frame;
+    if (video && frame->video_size)
+        memcpy(data, video, frame->video_size);
+    if (audio && frame->audio_size)
+        memcpy(data + align(h->format.video_size), audio, frame->audio_size);
+
+    __atomic_store_n(&slot->seq, 2 * sequence + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&h->head, sequence + 1, __ATOMIC_RELEASE);
+    bus_wake(bus);
+    bus->frames++;
+}
+
+FrameBus *framebus_open(const char *name, FrameBusFormat *format)
+{
+    FrameBus *bus = (FrameBus *)calloc(1, sizeof(*bus));
+    BusHeader h;
+    struct stat st;
+    void *p;
+    int fd;
+
+    if (!bus)
+        return NULL;
+    bus->name        = strdup(name);
+    bus->slot_header = align(sizeof(BusSlot));
+
+    fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0 || fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(h)) {
+        fprintf(stderr, "%s: %s\n", name, fd < 0 ? strerror(errno) :
+                                                   "not a frame bus");
+        if (fd >= 0)
+            close(fd);
+        bus_free(bus);
+        return NULL;
+    }
+    bus->size = st.st_size;
+    p = mmap(NULL, bus->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "%s: %s\n", name, strerror(errno));
+        bus_free(bus);
+        return NULL;
+    }
+    bus->header = (BusHeader *)p;
+
+    memcpy(h.magic, bus->header->magic, sizeof(h.magic));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    h = *bus->header;
+    if (memcmp(h.magic, FRAMEBUS_MAGIC, sizeof(h.magic)) ||
+        h.version != FRAMEBUS_VERSION ||
+        h.header_size + (uint64_t)h.slots * h.slot_size > bus->size) {
+        fprintf(stderr, "%s: not a frame bus of this version\n", name);
+        bus_free(bus);
+        return NULL;
+    }
+
+    *format   = h.format;
+    bus->next = __atomic_load_n(&bus->header->head, __ATOMIC_ACQUIRE);
+
+    return bus;
+}
+
+int framebus_read(FrameBus *bus, FrameBusFrame *frame, void *video,
+                  void *audio, int timeout)
+{
+    BusHeader *h = bus->header;
+
+    for (;;) {
+        uint32_t wake = __atomic_load_n(&h->wake, __ATOMIC_ACQUIRE);
+        uint64_t head = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+        BusSlot *slot;
+        const uint8_t *data;
+        uint64_t seq;
+
+        if (bus->next >= head) {
+            if (__atomic_load_n(&h->closed, __ATOMIC_ACQUIRE))
+                return -1;
+            if (timeout <= 0)
+                return 0;
+            bus_wait(bus, wake, timeout);
+            timeout = 0;
+            continue;
+        }
+
+        // a whole ring behind, the newest frame is the best bet
+        if (head - bus->next >= h->slots) {
+            bus->overruns++;
+            bus->lost += head - 1 - bus->next;
+            bus->next  = head - 1;
+        }
+
+        slot = bus_slot(bus, bus->next);
+        data = (const uint8_t *)slot + bus->slot_header;
+        seq  = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq == 2 * bus->next + 2) {
+            *frame = slot->frame;
+            if (frame->video_size > h->format.video_size)
+                frame->video_size = h->format.video_size;
+            if (frame->audio_size > h->format.audio_size)
+                frame->audio_size = h->format.audio_size;
+            if (video && frame->video_size)
+                memcpy(video, data, frame->video_size);
+            if (audio && frame->audio_size)
+                memcpy(audio, data + align(h->format.video_size),
+                       frame->audio_size);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq) {
+                bus->next++;
+                bus->frames++;
+                return 1;
+            }
+        }
+
+        // overwritten under us, jump ahead
+        bus->overruns++;
+        head = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+        if (head > bus->next + 1) {
+            bus->lost += head - 1 - bus->next;
+            bus->next  = head - 1;
+        }
+    }
+}
+
+void framebus_close(FrameBus *bus)
+{
+    if (!bus)
+        return;
+
+    if (bus->publisher) {
+        __atomic_store_n(&bus->header->closed, 1, __ATOMIC_RELEASE);
+        bus_wake(bus);
+        shm_unlink(bus->name);
+        fprintf(stderr, "%s: %" PRIu64 " frames published\n",
+                bus->name, bus->frames);
+    } else {
+        fprintf(stderr,
+                "%s: %" PRIu64 " frames read, %" PRIu64 " overruns, "
+                "%" PRIu64 " frames lost\n",
+                bus->name, bus->frames, bus->overruns, bus->lost);
+    }
+
+    bus_free(bus);
+}
@@ -0,0 +1,82 @@
+/*
+ * Blackmagic Devices Decklink shared memory frame bus
+ * Copyright (c) 2026 the bmdtools authors.
+ *
+ * This file is part of bmdtools.
+ *
+ * bmdtools is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * bmdtools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with bmdtools; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef BMDTOOLS_FRAMEBUS_H
+#define BMDTOOLS_FRAMEBUS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A POSIX shared memory ring of captured frames, each slot holding the
+ * picture and the audio packet that came with it.  One process publishes,
+ * any number read without locks: a reader left behind by a whole ring
+ * finds out and skips to the newest frame.
+ */
+typedef struct FrameBusFormat {
+    uint32_t pixel_format;      /* BMDPixelFormat */
+    uint32_t width, height;
+    uint32_t row_bytes;
+    int64_t frame_duration;     /* in time_scale units */
+    int64_t time_scale;
+    uint32_t audio_channels;
+    uint32_t audio_depth;       /* 16 or 32, 48kHz */
+    uint32_t video_size;        /* the most a slot holds */
+    uint32_t audio_size;
+} FrameBusFormat;
+
+typedef struct FrameBusFrame {
+    uint64_t sequence;          /* set by framebus_put */
+    int64_t pts;                /* time_scale units, -1 without a picture */
+    int64_t audio_pts;          /* 48kHz units, -1 without audio */
+    uint32_t flags;             /* BMDFrameFlags */
+    uint32_t pixel_format;
+    uint32_t row_bytes;
+    uint32_t video_size;
+    uint32_t audio_samples;
+    uint32_t audio_size;
+} FrameBusFrame;
+
+typedef struct FrameBus FrameBus;
+
+/* /name in /dev/shm, replaced if it is there already */
+FrameBus *framebus_create(const char *name, const FrameBusFormat *format,
+                          unsigned slots);
+
+/* never waits, the sizes are cut to the format */
+void framebus_put(FrameBus *bus, FrameBusFrame *frame,
+                  const void *video, const void *audio);
+
+/* attach as a reader, from the next frame published */
+FrameBus *framebus_open(const char *name, FrameBusFormat *format);
+
+/*
+ * Copy the next frame out, the buffers take the sizes of the format.
+ * 1 on success, 0 if none came within timeout ms, -1 once the publisher
+ * is gone.
+ */
+int framebus_read(FrameBus *bus, FrameBusFrame *frame, void *video,
+                  void *audio, int timeout);
+
+/* the publisher removes the bus, the readers report the overruns */
+void framebus_close(FrameBus *bus);
+
+#endif /* BMDTOOLS_FRAMEBUS_H */
@@ -146,3 +146,17 @@ bail:
     if (deckLinkOutput != NULL)
         deckLinkOutput->Release();
 }
+
+long row_bytes(BMDPixelFormat pix, long width)
+{
+    switch (pix) {
+    case bmdFormat8BitARGB:
+        return width * 4;
+    case bmdFormat10BitYUV:
+        return (width + 47) / 48 * 128;
+    case bmdFormat10BitRGB:
+        return (width + 63) / 64 * 256;
+    default:
+        return width * 2;
+    }
+}
@@ -27,5 +27,8 @@
 void print_input_modes(IDeckLink *deckLink);
 void print_output_modes(IDeckLink *deckLink);
 
+/* bytes in a row of width pixels, as the cards lay them out */
+long row_bytes(BMDPixelFormat pix, long width);
+
 #endif /* BMDTOOLS_MODES_H */
 
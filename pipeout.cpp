@@ -0,0 +1,331 @@
+/*
+ * Blackmagic Devices Decklink capture
+ * Copyright (c) 2026 the bmdtools authors.
+ *
+ * This file is part of bmdtools.
+ *
+ * bmdtools is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * bmdtools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with bmdtools; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avio.h>
+#include <libavutil/buffer.h>
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+#include <libavutil/time.h>
+}
+
+#include "pipeout.h"
+
+/* headers and trailers, the payloads skip it */
+#define AVIO_BUFFER_SIZE (64 * 1024)
+
+/* below this a mapping costs more than the copy it saves */
+#define SPLICE_MIN (128 * 1024)
+
+/*
+ * Transparent huge pages: a frame is faulted in and zeroed in two goes
+ * instead of a thousand, without them a fresh mapping costs more than
+ * write() saves.
+ */
+#define HUGE_PAGE (2 * 1024 * 1024)
+
+/* what an unprivileged process may ask for by default */
+#define PIPE_SIZE_FALLBACK (1024 * 1024)
+
+/*
+ * The mappings handed out by pipeout_alloc().  Their pages are never
+ * written again once filled and are unmapped rather than reused, so what
+ * the pipe still holds of them stays intact.
+ */
+typedef struct PipeBuffer {
+    uint8_t *data;
+    size_t size;
+    struct PipeBuffer *next;
+} PipeBuffer;
+
+static pthread_mutex_t buffers_mutex = PTHREAD_MUTEX_INITIALIZER;
+static PipeBuffer *buffers;
+static int huge_pages = -1;
+
+static int has_huge_pages(void)
+{
+    char mode[64] = "";
+    FILE *f;
+
+    if (huge_pages >= 0)
+        return huge_pages;
+
+    f = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+    if (f) {
+        if (!fgets(mode, sizeof(mode), f))
+            mode[0] = 0;
+        fclose(f);
+    }
+    huge_pages = mode[0] && !strstr(mode, "[never]");
+    if (!huge_pages)
+        fprintf(stderr, "pipe: no transparent huge pages, not splicing\n");
+
+    return huge_pages;
+}
+
+typedef struct PipeOut {
+    int fd;
+    int pipe_size;
+    size_t page_size;
+
+    int64_t start;
+    int64_t spliced;
+    int64_t gifted;
+    int64_t written;
+    int64_t calls;
+    int64_t write_time;
+} PipeOut;
+
+static void pipeout_free(void *opaque, uint8_t *data)
+{
+    PipeBuffer *b = (PipeBuffer *)opaque;
+
+    pthread_mutex_lock(&buffers_mutex);
+    for (PipeBuffer **p = &buffers; *p; p = &(*p)->next) {
+        if (*p == b) {
+            *p = b->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&buffers_mutex);
+
+    munmap(b->data, b->size);
+    free(b);
+}
+
+AVBufferRef *pipeout_alloc(int size)
+{
+#ifdef __linux__
+    PipeBuffer *b;
+    AVBufferRef *buf;
+    uint8_t *p;
+    size_t head;
+
+    if (size < SPLICE_MIN || !has_huge_pages())
+        return NULL;
+
+    b = (PipeBuffer *)calloc(1, sizeof(*b));
+    if (!b)
+        return NULL;
+    // the padding is zeroed by the kernel like the rest
+    b->size = FFALIGN((size_t)size + AV_INPUT_BUFFER_PADDING_SIZE, HUGE_PAGE);
+    p = (uint8_t *)mmap(NULL, b->size + HUGE_PAGE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        free(b);
+        return NULL;
+    }
+    // only aligned huge pages are backed by huge pages
+    head = FFALIGN((uintptr_t)p, HUGE_PAGE) - (uintptr_t)p;
+    if (head)
+        munmap(p, head);
+    munmap(p + head + b->size, HUGE_PAGE - head);
+    b->data = p + head;
+    madvise(b->data, b->size, MADV_HUGEPAGE);
+
+    buf = av_buffer_create(b->data, size, pipeout_free, b, 0);
+    if (!buf) {
+        munmap(b->data, b->size);
+        free(b);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&buffers_mutex);
+    b->next = buffers;
+    buffers = b;
+    pthread_mutex_unlock(&buffers_mutex);
+
+    return buf;
+#else
+    return NULL;
+#endif
+}
+
+static int spliceable(const uint8_t *buf, int size)
+{
+    int found = 0;
+
+    if (size < SPLICE_MIN)
+        return 0;
+
+    pthread_mutex_lock(&buffers_mutex);
+    for (PipeBuffer *b = buffers; b && !found; b = b->next)
+        found = buf >= b->data && buf + size <= b->data + b->size;
+    pthread_mutex_unlock(&buffers_mutex);
+
+    return found;
+}
+
+static int write_all(PipeOut *po, const uint8_t *buf, int size)
+{
+    int done = 0;
+
+    while (done < size) {
+        ssize_t n = write(po->fd, buf + done, size - done);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return AVERROR(errno);
+        }
+        po->calls++;
+        done += n;
+    }
+    po->written += size;
+
+    return 0;
+}
+
+#ifdef __linux__
+static int splice_all(PipeOut *po, const uint8_t *buf, int size,
+                      unsigned flags)
+{
+    struct iovec iov = { (void *)buf, (size_t)size };
+
+    while (iov.iov_len) {
+        ssize_t n = vmsplice(po->fd, &iov, 1, flags);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return AVERROR(errno);
+        }
+        po->calls++;
+        iov.iov_base = (uint8_t *)iov.iov_base + n;
+        iov.iov_len -= n;
+    }
+    po->spliced += size;
+    if (flags & SPLICE_F_GIFT)
+        po->gifted += size;
+
+    return 0;
+}
+#endif
+
+static int pipeout_write(void *opaque, uint8_t *buf, int buf_size)
+{
+    PipeOut *po   = (PipeOut *)opaque;
+    int64_t start = av_gettime_relative();
+    int ret;
+
+#ifdef __linux__
+    if (spliceable(buf, buf_size)) {
+        // whole pages can be given away, the tail shares one with nothing
+        size_t head = (po->page_size - ((uintptr_t)buf & (po->page_size - 1))) &
+                      (po->page_size - 1);
+        size_t pages;
+
+        head  = FFMIN(head, (size_t)buf_size);
+        pages = (buf_size - head) & ~(po->page_size - 1);
+
+        ret = splice_all(po, buf, head, 0);
+        if (!ret && pages)
+            ret = splice_all(po, buf + head, pages, SPLICE_F_GIFT);
+        if (!ret && head + pages < (size_t)buf_size)
+            ret = splice_all(po, buf + head + pages, buf_size - head - pages, 0);
+    } else
+#endif
+        ret = write_all(po, buf, buf_size);
+
+    po->write_time += av_gettime_relative() - start;
+
+    return ret < 0 ? ret : buf_size;
+}
+
+AVIOContext *pipeout_open(int fd, int pipe_size)
+{
+#ifdef __linux__
+    AVIOContext *pb;
+    PipeOut *po;
+    uint8_t *buffer;
+    struct stat st;
+
+    if (fstat(fd, &st) < 0 || !S_ISFIFO(st.st_mode))
+        return NULL;
+
+    po = (PipeOut *)av_mallocz(sizeof(PipeOut));
+    if (!po)
+        return NULL;
+    po->fd        = fd;
+    po->page_size = sysconf(_SC_PAGESIZE);
+    po->start     = av_gettime_relative();
+
+    // the reader gets a few frames of slack, as much as it is allowed
+    if (fcntl(fd, F_SETPIPE_SZ, pipe_size) < 0 && pipe_size > PIPE_SIZE_FALLBACK)
+        fcntl(fd, F_SETPIPE_SZ, PIPE_SIZE_FALLBACK);
+    po->pipe_size = fcntl(fd, F_GETPIPE_SZ);
+
+    buffer = (uint8_t *)av_malloc(AVIO_BUFFER_SIZE);
+    if (!buffer) {
+        av_free(po);
+        return NULL;
+    }
+    pb = avio_alloc_context(buffer, AVIO_BUFFER_SIZE, 1, po,
+                            NULL, pipeout_write, NULL);
+    if (!pb) {
+        av_free(buffer);
+        av_free(po);
+        return NULL;
+    }
+    // large writes reach pipeout_write from the packet itself
+    pb->direct = 1;
+
+    return pb;
+#else
+    return NULL;
+#endif
+}
+
+void pipeout_close(AVIOContext **pb)
+{
+    PipeOut *po;
+
+    if (!*pb)
+        return;
+
+    avio_flush(*pb);
+    po = (PipeOut *)(*pb)->opaque;
+
+    fprintf(stderr, "pipe: %" PRId64 " MB vmspliced (%" PRId64 " MB gifted), "
+            "%" PRId64 " MB written in %" PRId64 " calls, %" PRId64 " s in "
+            "the pipe for %" PRId64 " s, %.1f MB/s while writing, pipe of "
+            "%d kB\n", po->spliced >> 20, po->gifted >> 20, po->written >> 20,
+            po->calls, po->write_time / 1000000,
+            (av_gettime_relative() - po->start) / 1000000,
+            po->write_time ? (po->spliced + po->written) /
+                             (double)po->write_time : 0.0,
+            po->pipe_size / 1024);
+
+    av_free(po);
+    av_freep(&(*pb)->buffer);
+    avio_context_free(pb);
+}
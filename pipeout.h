@@ -0,0 +1,49 @@
+/*
+ * Blackmagic Devices Decklink capture
+ * Copyright (c) 2026 the bmdtools authors.
+ *
+ * This file is part of bmdtools.
+ *
+ * bmdtools is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * bmdtools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with bmdtools; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef BMDTOOLS_PIPEOUT_H
+#define BMDTOOLS_PIPEOUT_H
+
+extern "C" {
+#include <libavformat/avio.h>
+#include <libavutil/buffer.h>
+}
+
+/*
+ * Output AVIOContext for a pipe, enlarged to pipe_size if the system lets
+ * it.  Payloads in buffers from pipeout_alloc() are handed to the pipe with
+ * vmsplice() instead of being copied by write(), the rest is written as
+ * usual.  Returns NULL if fd is not a pipe, libavformat's own I/O should be
+ * used then.
+ */
+AVIOContext *pipeout_open(int fd, int pipe_size);
+
+/*
+ * A packet buffer of its own pages, unmapped once freed so the pipe can
+ * keep them until they are read.  NULL if size is too small to be worth
+ * it, av_dup_packet() does then.
+ */
+AVBufferRef *pipeout_alloc(int size);
+
+/* report the bytes spliced and written, then free everything */
+void pipeout_close(AVIOContext **pb);
+
+#endif /* BMDTOOLS_PIPEOUT_H */
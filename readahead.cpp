@@ -0,0 +1,447 @@
+/*
+ * Blackmagic Devices Decklink playout
+ * Copyright (c) 2026 the bmdtools authors.
+ *
+ * This file is part of bmdtools.
+ *
+ * bmdtools is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * bmdtools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with bmdtools; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+extern "C" {
+#include <libavformat/avio.h>
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+#include <libavutil/time.h>
+}
+
+#include "readahead.h"
+
+/* O_DIRECT wants the offsets, the sizes and the memory aligned to this */
+#define ALIGNMENT 4096
+
+/* copied by libavformat in its own buffer, larger reads bypass it */
+#define AVIO_BUFFER_SIZE (256 * 1024)
+
+/* waits longer than this are logged as they happen, in us */
+#define STALL_REPORT 20000
+
+typedef struct ReadBlock {
+    uint8_t *data;
+    int64_t pos;
+    int size;               /* short at the end of the file */
+} ReadBlock;
+
+typedef struct ReadAhead {
+    char *filename;
+    enum ReadaheadMode mode;
+    int fd;
+    int64_t file_size;
+    uint8_t *map;
+    int64_t advised;        /* mmap, requested from the kernel up to here */
+
+    ReadBlock *blocks;
+    int nb_blocks;
+    int block_size;
+
+    pthread_t thread;
+    int has_thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    unsigned head;          /* blocks filled by the thread */
+    unsigned tail;          /* blocks the reader is done with */
+    unsigned generation;    /* a seek drops what is being read */
+    int64_t next_pos;       /* where the thread reads next */
+    int64_t pos;            /* where the reader is */
+    int eof;
+    int error;
+    int quit;
+
+    int64_t start;
+    int64_t bytes;
+    int64_t read_time;
+    int64_t stalls;
+    int64_t stall_time;
+    int64_t stall_max;
+} ReadAhead;
+
+/* a whole block, unless the file ends */
+static int read_block(ReadAhead *ra, uint8_t *data, int64_t pos)
+{
+    int done = 0;
+
+    while (done < ra->block_size) {
+        ssize_t n = pread(ra->fd, data + done, ra->block_size - done,
+                          pos + done);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            // some filesystems accept O_DIRECT on open and not on read
+            if (errno == EINVAL && ra->mode == READAHEAD_DIRECT &&
+                !done && !ra->bytes) {
+                fprintf(stderr, "%s: O_DIRECT refused, reading buffered\n",
+                        ra->filename);
+                fcntl(ra->fd, F_SETFL, fcntl(ra->fd, F_GETFL) & ~O_DIRECT);
+                pthread_mutex_lock(&ra->mutex);
+                ra->mode = READAHEAD_BUFFERED;
+                pthread_mutex_unlock(&ra->mutex);
+                continue;
+            }
+            return AVERROR(errno);
+        }
+        // the next O_DIRECT read would be unaligned, short is the end
+        if (ra->mode == READAHEAD_DIRECT && n < ra->block_size - done) {
+            done += n;
+            break;
+        }
+        if (!n)
+            break;
+        done += n;
+    }
+
+    return done;
+}
+
+static void *readahead_thread(void *arg)
+{
+    ReadAhead *ra = (ReadAhead *)arg;
+
+    pthread_mutex_lock(&ra->mutex);
+    while (!ra->quit) {
+        ReadBlock *b;
+        unsigned generation;
+        int64_t pos, start;
+        int size;
+
+        if (ra->head - ra->tail == (unsigned)ra->nb_blocks ||
+            ra->eof || ra->error) {
+            pthread_cond_wait(&ra->cond, &ra->mutex);
+            continue;
+        }
+
+        b          = &ra->blocks[ra->head % ra->nb_blocks];
+        pos        = ra->next_pos;
+        generation = ra->generation;
+        pthread_mutex_unlock(&ra->mutex);
+
+        start = av_gettime_relative();
+        size  = read_block(ra, b->data, pos);
+        start = av_gettime_relative() - start;
+
+        // the copy is ours, keeping the pages around only evicts others
+        if (size > 0 && ra->mode == READAHEAD_BUFFERED)
+            posix_fadvise(ra->fd, pos, size, POSIX_FADV_DONTNEED);
+
+        pthread_mutex_lock(&ra->mutex);
+        if (generation != ra->generation)
+            continue;
+
+        if (size < 0) {
+            ra->error = size;
+        } else {
+            b->pos        = pos;
+            b->size       = size;
+            ra->next_pos  = pos + size;
+            ra->eof       = size < ra->block_size;
+            ra->bytes    += size;
+            ra->read_time += start;
+            ra->head++;
+        }
+        pthread_cond_broadcast(&ra->cond);
+    }
+    pthread_mutex_unlock(&ra->mutex);
+
+    return NULL;
+}
+
+static void count_stall(ReadAhead *ra, int64_t elapsed)
+{
+    ra->stalls++;
+    ra->stall_time += elapsed;
+    if (elapsed > ra->stall_max)
+        ra->stall_max = elapsed;
+    if (elapsed > STALL_REPORT)
+        fprintf(stderr, "%s: input stalled %" PRId64 " ms at %" PRId64
+                " MB\n", ra->filename, elapsed / 1000, ra->pos >> 20);
+}
+
+static int read_mapped(ReadAhead *ra, uint8_t *buf, int buf_size)
+{
+    int64_t window = (int64_t)ra->block_size * ra->nb_blocks;
+    int64_t start;
+    int n;
+
+    if (ra->pos >= ra->file_size)
+        return AVERROR_EOF;
+
+    // keep the kernel reading a window ahead
+    if (ra->pos + window / 2 > ra->advised) {
+        int64_t from = FFMAX(ra->advised, ra->pos) & ~(int64_t)(ALIGNMENT - 1);
+        int64_t to   = FFMIN(ra->pos + window, ra->file_size);
+
+        if (to > from)
+            madvise(ra->map + from, to - from, MADV_WILLNEED);
+        ra->advised = to;
+    }
+
+    n     = FFMIN((int64_t)buf_size, ra->file_size - ra->pos);
+    start = av_gettime_relative();
+    memcpy(buf, ra->map + ra->pos, n);
+    start = av_gettime_relative() - start;
+
+    // at memory speed the copy is well under a millisecond
+    ra->read_time += start;
+    ra->bytes     += n;
+    if (start > 1000)
+        count_stall(ra, start);
+
+    ra->pos += n;
+
+    return n;
+}
+
+static int readahead_read(void *opaque, uint8_t *buf, int buf_size)
+{
+    ReadAhead *ra = (ReadAhead *)opaque;
+    int ret;
+
+    if (ra->mode == READAHEAD_MMAP)
+        return read_mapped(ra, buf, buf_size);
+
+    pthread_mutex_lock(&ra->mutex);
+    for (;;) {
+        if (ra->head != ra->tail) {
+            ReadBlock *b = &ra->blocks[ra->tail % ra->nb_blocks];
+            int64_t off  = ra->pos - b->pos;
+
+            if (off >= b->size) {
+                ra->tail++;
+                pthread_cond_broadcast(&ra->cond);
+                continue;
+            }
+
+            // only the reader moves the tail, the block stays put
+            pthread_mutex_unlock(&ra->mutex);
+            ret = FFMIN((int64_t)buf_size, b->size - off);
+            memcpy(buf, b->data + off, ret);
+            ra->pos += ret;
+            return ret;
+        }
+
+        if (ra->error || ra->eof) {
+            ret = ra->error ? ra->error : AVERROR_EOF;
+            break;
+        }
+
+        int64_t start = av_gettime_relative();
+        while (ra->head == ra->tail && !ra->error && !ra->eof)
+            pthread_cond_wait(&ra->cond, &ra->mutex);
+        count_stall(ra, av_gettime_relative() - start);
+    }
+    pthread_mutex_unlock(&ra->mutex);
+
+    return ret;
+}
+
+static int64_t readahead_seek(void *opaque, int64_t offset, int whence)
+{
+    ReadAhead *ra = (ReadAhead *)opaque;
+    int64_t target;
+
+    switch (whence & ~AVSEEK_FORCE) {
+    case AVSEEK_SIZE:
+        return ra->file_size;
+    case SEEK_SET:
+        target = offset;
+        break;
+    case SEEK_CUR:
+        target = ra->pos + offset;
+        break;
+    case SEEK_END:
+        target = ra->file_size + offset;
+        break;
+    default:
+        return AVERROR(EINVAL);
+    }
+
+    if (target < 0)
+        return AVERROR(EINVAL);
+
+    if (ra->mode == READAHEAD_MMAP) {
+        ra->pos     = target;
+        ra->advised = target;
+        return target;
+    }
+
+    pthread_mutex_lock(&ra->mutex);
+    if (ra->head != ra->tail &&
+        target >= ra->blocks[ra->tail % ra->nb_blocks].pos &&
+        target < ra->next_pos) {
+        // still buffered, drop what is before it
+        while (target >= ra->blocks[ra->tail % ra->nb_blocks].pos +
+                         ra->blocks[ra->tail % ra->nb_blocks].size)
+            ra->tail++;
+    } else {
+        ra->tail     = ra->head;
+        ra->next_pos = target & ~(int64_t)(ALIGNMENT - 1);
+        ra->eof      = 0;
+        ra->error    = 0;
+        ra->generation++;
+    }
+    ra->pos = target;
+    pthread_cond_broadcast(&ra->cond);
+    pthread_mutex_unlock(&ra->mutex);
+
+    return target;
+}
+
+static void readahead_free(ReadAhead *ra)
+{
+    if (ra->has_thread) {
+        pthread_mutex_lock(&ra->mutex);
+        ra->quit = 1;
+        pthread_cond_broadcast(&ra->cond);
+        pthread_mutex_unlock(&ra->mutex);
+        pthread_join(ra->thread, NULL);
+    }
+    pthread_mutex_destroy(&ra->mutex);
+    pthread_cond_destroy(&ra->cond);
+
+    for (int i = 0; ra->blocks && i < ra->nb_blocks; i++)
+        free(ra->blocks[i].data);
+    av_freep(&ra->blocks);
+    if (ra->map)
+        munmap(ra->map, ra->file_size);
+    if (ra->fd >= 0)
+        close(ra->fd);
+    av_freep(&ra->filename);
+    av_free(ra);
+}
+
+AVIOContext *readahead_open(const char *filename, enum ReadaheadMode mode,
+                            int block_size, int nb_blocks)
+{
+    AVIOContext *pb;
+    ReadAhead *ra;
+    uint8_t *buffer;
+    struct stat st;
+
+    if (!strncmp(filename, "file:", 5))
+        filename += 5;
+
+    if (stat(filename, &st) < 0 || !S_ISREG(st.st_mode) || !st.st_size)
+        return NULL;
+
+    ra = (ReadAhead *)av_mallocz(sizeof(ReadAhead));
+    if (!ra)
+        return NULL;
+
+    pthread_mutex_init(&ra->mutex, NULL);
+    pthread_cond_init(&ra->cond, NULL);
+    ra->filename   = av_strdup(filename);
+    ra->mode       = mode;
+    ra->file_size  = st.st_size;
+    ra->block_size = FFALIGN(block_size, ALIGNMENT);
+    ra->nb_blocks  = FFMAX(nb_blocks, 2);
+    ra->start      = av_gettime_relative();
+
+    ra->fd = open(filename, O_RDONLY | (mode == READAHEAD_DIRECT ? O_DIRECT : 0));
+    if (ra->fd < 0 && mode == READAHEAD_DIRECT) {
+        fprintf(stderr, "%s: cannot open with O_DIRECT, reading buffered\n",
+                filename);
+        ra->mode = READAHEAD_BUFFERED;
+        ra->fd   = open(filename, O_RDONLY);
+    }
+    if (ra->fd < 0)
+        goto fail;
+
+    if (ra->mode == READAHEAD_MMAP) {
+        ra->map = (uint8_t *)mmap(NULL, ra->file_size, PROT_READ, MAP_SHARED,
+                                  ra->fd, 0);
+        if (ra->map == MAP_FAILED) {
+            ra->map = NULL;
+            goto fail;
+        }
+        madvise(ra->map, ra->file_size, MADV_SEQUENTIAL);
+    } else {
+        if (ra->mode == READAHEAD_BUFFERED)
+            posix_fadvise(ra->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        ra->blocks = (ReadBlock *)av_mallocz_array(ra->nb_blocks,
+                                                   sizeof(ReadBlock));
+        if (!ra->blocks)
+            goto fail;
+        for (int i = 0; i < ra->nb_blocks; i++)
+            if (posix_memalign((void **)&ra->blocks[i].data, ALIGNMENT,
+                               ra->block_size))
+                goto fail;
+
+        if (pthread_create(&ra->thread, NULL, readahead_thread, ra))
+            goto fail;
+        ra->has_thread = 1;
+    }
+
+    buffer = (uint8_t *)av_malloc(AVIO_BUFFER_SIZE);
+    if (!buffer)
+        goto fail;
+
+    pb = avio_alloc_context(buffer, AVIO_BUFFER_SIZE, 0, ra,
+                            readahead_read, NULL, readahead_seek);
+    if (!pb) {
+        av_free(buffer);
+        goto fail;
+    }
+
+    return pb;
+
+fail:
+    fprintf(stderr, "%s: cannot set up the readahead: %s\n", filename,
+            strerror(errno));
+    readahead_free(ra);
+    return NULL;
+}
+
+void readahead_close(AVIOContext **pb)
+{
+    static const char *const modes[] = { "buffered", "direct", "mmap" };
+    ReadAhead *ra;
+    int64_t elapsed;
+
+    if (!*pb)
+        return;
+
+    ra      = (ReadAhead *)(*pb)->opaque;
+    elapsed = av_gettime_relative() - ra->start;
+
+    fprintf(stderr, "%s: %" PRId64 " MB read %s in %" PRId64 " s, %.1f MB/s "
+            "while reading, %" PRId64 " stalls for %" PRId64 " ms, the "
+            "longest %" PRId64 " ms\n", ra->filename, ra->bytes >> 20,
+            modes[ra->mode], elapsed / 1000000,
+            ra->read_time ? ra->bytes / (double)ra->read_time : 0.0,
+            ra->stalls, ra->stall_time / 1000, ra->stall_max / 1000);
+
+    readahead_free(ra);
+    av_freep(&(*pb)->buffer);
+    avio_context_free(pb);
+}
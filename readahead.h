@@ -0,0 +1,46 @@
+/*
+ * Blackmagic Devices Decklink playout
+ * Copyright (c) 2026 the bmdtools authors.
+ *
+ * This file is part of bmdtools.
+ *
+ * bmdtools is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * bmdtools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with bmdtools; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef BMDTOOLS_READAHEAD_H
+#define BMDTOOLS_READAHEAD_H
+
+extern "C" {
+#include <libavformat/avio.h>
+}
+
+enum ReadaheadMode {
+    READAHEAD_BUFFERED,     /* read(), the page cache is dropped behind */
+    READAHEAD_DIRECT,       /* O_DIRECT, buffered if the filesystem refuses */
+    READAHEAD_MMAP,         /* mapped, the kernel is asked for pages ahead */
+};
+
+/*
+ * Input AVIOContext for a local file, read in large aligned blocks by a
+ * background thread ahead of the demuxer.  Returns NULL if filename is not
+ * a regular file, libavformat's own I/O should be used then.
+ */
+AVIOContext *readahead_open(const char *filename, enum ReadaheadMode mode,
+                            int block_size, int nb_blocks);
+
+/* report the throughput and the stalls, then free everything */
+void readahead_close(AVIOContext **pb);
+
+#endif /* BMDTOOLS_READAHEAD_H */
@@ -0,0 +1,460 @@
+/*
+ * Blackmagic Devices Decklink playout
+ * Copyright (c) 2026 the bmdtools authors.
+ *
+ * This file is part of bmdtools.
+ *
+ * bmdtools is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * bmdtools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with bmdtools; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+extern "C" {
+#include <libavutil/imgutils.h>
+#include <libavutil/mathematics.h>
+#include <libavutil/mem.h>
+#include <libavutil/pixdesc.h>
+#include "libswscale/swscale.h"
+}
+
+#include "scaler.h"
+
+/* do not bother splitting the picture in bands thinner than this */
+#define MIN_SLICE_HEIGHT 32
+
+struct SliceScaler;
+
+typedef struct ScaleSlice {
+    struct SliceScaler *owner;
+    struct SwsContext *sws;
+    pthread_t thread;
+    int src_y, src_h;       /* the band and the rows around it its taps reach */
+    int dst_y, dst_h;       /* the band */
+    int pad_top, pad_bottom; /* scaled from the rows around it, dropped */
+    uint8_t *buf[4];        /* band and padding, when there is padding */
+    int buf_stride[4];
+} ScaleSlice;
+
+struct SliceScaler {
+    int src_w, src_h;
+    enum AVPixelFormat src_fmt;
+    int dst_w, dst_h;
+    enum AVPixelFormat dst_fmt;
+
+    /* the picture area inside the output frame, the rest is border */
+    int rect_x, rect_y, rect_w, rect_h;
+
+    ScaleSlice *slices;
+    int nb_slices;
+    int nb_threads;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_cond_t done;
+    unsigned job;
+    int pending;
+    int quit;
+
+    const uint8_t *const *src;
+    const int *src_stride;
+    uint8_t *const *dst;
+    const int *dst_stride;
+};
+
+/* byte offset of the pixel x, y in every plane */
+static void plane_offsets(enum AVPixelFormat fmt, const int stride[],
+                          int x, int y, ptrdiff_t off[4])
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(fmt);
+    int bytes[4] = { 0 };
+
+    if (x)
+        av_image_fill_linesizes(bytes, fmt, x);
+
+    for (int p = 0; p < 4; p++) {
+        int shift = 0;
+        if ((p == 1 || p == 2) && !(desc->flags & AV_PIX_FMT_FLAG_RGB))
+            shift = desc->log2_chroma_h;
+        off[p] = (ptrdiff_t)(y >> shift) * stride[p] + bytes[p];
+    }
+}
+
+void fill_black(uint8_t *const dst[], const int dst_stride[],
+                enum AVPixelFormat fmt, int x, int y, int w, int h)
+{
+    ptrdiff_t off[4];
+
+    if (w <= 0 || h <= 0)
+        return;
+
+    plane_offsets(fmt, dst_stride, x, y, off);
+
+    switch (fmt) {
+    case AV_PIX_FMT_UYVY422:
+        for (int j = 0; j < h; j++) {
+            uint32_t *p = (uint32_t *)(dst[0] + off[0] +
+                                       (ptrdiff_t)j * dst_stride[0]);
+            for (int i = 0; i < w / 2; i++)
+                p[i] = 0x10801080;
+        }
+        break;
+    case AV_PIX_FMT_YUV422P10:
+        for (int j = 0; j < h; j++) {
+            uint16_t *luma = (uint16_t *)(dst[0] + off[0] +
+                                          (ptrdiff_t)j * dst_stride[0]);
+            uint16_t *cb   = (uint16_t *)(dst[1] + off[1] +
+                                          (ptrdiff_t)j * dst_stride[1]);
+            uint16_t *cr   = (uint16_t *)(dst[2] + off[2] +
+                                          (ptrdiff_t)j * dst_stride[2]);
+            for (int i = 0; i < w; i++)
+                luma[i] = 64;
+            for (int i = 0; i < w / 2; i++)
+                cb[i] = cr[i] = 512;
+        }
+        break;
+    default: {
+        /* RGB, black is all zeroes */
+        int bytes[4] = { 0 };
+        av_image_fill_linesizes(bytes, fmt, w);
+        for (int p = 0; p < 4 && dst[p]; p++)
+            for (int j = 0; j < h; j++)
+                memset(dst[p] + off[p] + (ptrdiff_t)j * dst_stride[p],
+                       0, bytes[p]);
+    }
+    }
+}
+
+static void scale_slice(SliceScaler *s, ScaleSlice *sl)
+{
+    const uint8_t *src[4] = { NULL };
+    uint8_t *dst[4]       = { NULL };
+    int stride[4];
+    ptrdiff_t off[4];
+
+    plane_offsets(s->src_fmt, s->src_stride, 0, sl->src_y, off);
+    for (int p = 0; p < 4; p++)
+        if (s->src[p])
+            src[p] = s->src[p] + off[p];
+
+    plane_offsets(s->dst_fmt, s->dst_stride,
+                  s->rect_x, s->rect_y + sl->dst_y, off);
+    for (int p = 0; p < 4; p++)
+        if (s->dst[p])
+            dst[p] = s->dst[p] + off[p];
+
+    if (!sl->buf[0]) {
+        sws_scale(sl->sws, src, s->src_stride, 0, sl->src_h,
+                  dst, s->dst_stride);
+        return;
+    }
+
+    // the padding rows go to the side buffer, only the band is kept
+    sws_scale(sl->sws, src, s->src_stride, 0, sl->src_h,
+              sl->buf, sl->buf_stride);
+
+    plane_offsets(s->dst_fmt, sl->buf_stride, 0, sl->pad_top, off);
+    for (int p = 0; p < 4; p++)
+        if (sl->buf[p])
+            src[p] = sl->buf[p] + off[p];
+
+    memcpy(stride, s->dst_stride, sizeof(stride));
+    av_image_copy(dst, stride, src, sl->buf_stride,
+                  s->dst_fmt, s->rect_w, sl->dst_h);
+}
+
+static void *slice_worker(void *arg)
+{
+    ScaleSlice *sl  = (ScaleSlice *)arg;
+    SliceScaler *s  = sl->owner;
+    unsigned job    = 0;
+
+    pthread_mutex_lock(&s->mutex);
+    for (;;) {
+        while (!s->quit && s->job == job)
+            pthread_cond_wait(&s->cond, &s->mutex);
+        if (s->quit)
+            break;
+        job = s->job;
+        pthread_mutex_unlock(&s->mutex);
+
+        scale_slice(s, sl);
+
+        pthread_mutex_lock(&s->mutex);
+        if (!--s->pending)
+            pthread_cond_signal(&s->done);
+    }
+    pthread_mutex_unlock(&s->mutex);
+
+    return NULL;
+}
+
+/* SD modes are 4:3 with non-square pixels, everything else is square */
+static AVRational output_dar(int w, int h)
+{
+    AVRational dar = { w, h };
+
+    if (h == 480 || h == 486 || h == 576) {
+        dar.num = 4;
+        dar.den = 3;
+    }
+
+    return dar;
+}
+
+/* fit the source in the output frame keeping its display aspect ratio */
+static void fit_rect(SliceScaler *s, AVRational src_sar)
+{
+    AVRational out = output_dar(s->dst_w, s->dst_h);
+    AVRational dar;
+
+    if (src_sar.num <= 0 || src_sar.den <= 0) {
+        src_sar.num = 1;
+        src_sar.den = 1;
+    }
+
+    av_reduce(&dar.num, &dar.den,
+              (int64_t)s->src_w * src_sar.num,
+              (int64_t)s->src_h * src_sar.den, 1024 * 1024);
+
+    s->rect_w = av_rescale(s->dst_w, (int64_t)dar.num * out.den,
+                           (int64_t)dar.den * out.num);
+    s->rect_h = s->dst_h;
+
+    if (s->rect_w > s->dst_w) {
+        s->rect_w = s->dst_w;
+        s->rect_h = av_rescale(s->dst_h, (int64_t)dar.den * out.num,
+                               (int64_t)dar.num * out.den);
+    }
+
+    /* rounding noise is not worth a border */
+    if (s->dst_w - s->rect_w < 4)
+        s->rect_w = s->dst_w;
+    if (s->dst_h - s->rect_h < 4)
+        s->rect_h = s->dst_h;
+
+    s->rect_w &= ~1;
+    s->rect_h &= ~1;
+    s->rect_x  = ((s->dst_w - s->rect_w) / 2) & ~1;
+    s->rect_y  = ((s->dst_h - s->rect_h) / 2) & ~1;
+}
+
+/*
+ * Split the picture in bands that map an integer number of source rows
+ * onto an integer number of output rows, so that every band has the same
+ * scaling ratio and no band starts in the middle of a chroma row.  Each
+ * band is scaled with the source rows its filter taps reach past its edges
+ * and the output rows they give are dropped, so that the edges are filtered
+ * as they would be in a single pass instead of clamped.
+ */
+static int split_slices(SliceScaler *s, int threads)
+{
+    const AVPixFmtDescriptor *sd = av_pix_fmt_desc_get(s->src_fmt);
+    const AVPixFmtDescriptor *dd = av_pix_fmt_desc_get(s->dst_fmt);
+    int src_align = 1 << sd->log2_chroma_h;
+    int dst_align = FFMAX(2, 1 << dd->log2_chroma_h);
+    int units     = av_gcd(s->src_h, s->rect_h);
+    int unit_src  = s->src_h / units;
+    int unit_dst  = s->rect_h / units;
+    int support, pad, nb;
+
+    while ((unit_src % src_align || unit_dst % dst_align) && !(units & 1)) {
+        units    /= 2;
+        unit_src *= 2;
+        unit_dst *= 2;
+    }
+
+    if (unit_src % src_align || unit_dst % dst_align)
+        units = 1;
+
+    // bilinear taps reach the ratio plus a row, chroma ones twice as far
+    support = 2 * ((s->src_h + s->rect_h - 1) / s->rect_h) + 2;
+    pad     = (support + unit_src - 1) / unit_src;
+
+    nb = FFMIN(threads, units);
+    nb = FFMIN(nb, s->rect_h / MIN_SLICE_HEIGHT);
+    nb = FFMAX(nb, 1);
+
+    s->slices = (ScaleSlice *)av_mallocz(nb * sizeof(*s->slices));
+    if (!s->slices)
+        return -1;
+    s->nb_slices = nb;
+
+    for (int i = 0; i < nb; i++) {
+        ScaleSlice *sl = &s->slices[i];
+        int u0 = i * units / nb;
+        int u1 = (i + 1) * units / nb;
+
+        sl->owner = s;
+        if (nb == 1) {
+            sl->src_h = s->src_h;
+            sl->dst_h = s->rect_h;
+        } else {
+            int top    = FFMIN(pad, u0);
+            int bottom = FFMIN(pad, units - u1);
+
+            sl->src_y      = (u0 - top) * unit_src;
+            sl->src_h      = (u1 - u0 + top + bottom) * unit_src;
+            sl->dst_y      = u0 * unit_dst;
+            sl->dst_h      = (u1 - u0) * unit_dst;
+            sl->pad_top    = top * unit_dst;
+            sl->pad_bottom = bottom * unit_dst;
+        }
+    }
+
+    return 0;
+}
+
+SliceScaler *slice_scaler_alloc(int src_w, int src_h,
+                                enum AVPixelFormat src_fmt,
+                                AVRational src_sar,
+                                int dst_w, int dst_h,
+                                enum AVPixelFormat dst_fmt,
+                                int threads)
+{
+    SliceScaler *s;
+
+    if (src_w <= 0 || src_h <= 0 || src_fmt == AV_PIX_FMT_NONE)
+        return NULL;
+
+    s = (SliceScaler *)av_mallocz(sizeof(*s));
+    if (!s)
+        return NULL;
+
+    s->src_w   = src_w;
+    s->src_h   = src_h;
+    s->src_fmt = src_fmt;
+    s->dst_w   = dst_w;
+    s->dst_h   = dst_h;
+    s->dst_fmt = dst_fmt;
+
+    pthread_mutex_init(&s->mutex, NULL);
+    pthread_cond_init(&s->cond, NULL);
+    pthread_cond_init(&s->done, NULL);
+
+    fit_rect(s, src_sar);
+
+    if (split_slices(s, FFMAX(threads, 1)) < 0)
+        goto fail;
+
+    for (int i = 0; i < s->nb_slices; i++) {
+        ScaleSlice *sl = &s->slices[i];
+
+        int h          = sl->pad_top + sl->dst_h + sl->pad_bottom;
+
+        sl->sws = sws_getContext(s->src_w, sl->src_h, s->src_fmt,
+                                 s->rect_w, h, s->dst_fmt,
+                                 SWS_BILINEAR, NULL, NULL, NULL);
+        if (!sl->sws)
+            goto fail;
+        if (h > sl->dst_h &&
+            av_image_alloc(sl->buf, sl->buf_stride, s->rect_w, h,
+                           s->dst_fmt, 32) < 0)
+            goto fail;
+    }
+
+    /* the caller thread scales the first band itself */
+    for (int i = 1; i < s->nb_slices; i++) {
+        if (pthread_create(&s->slices[i].thread, NULL,
+                           slice_worker, &s->slices[i]))
+            goto fail;
+        s->nb_threads++;
+    }
+
+    fprintf(stderr, "Scaling %dx%d to %dx%d at %d,%d of %dx%d "
+            "in %d slices\n",
+            s->src_w, s->src_h, s->rect_w, s->rect_h,
+            s->rect_x, s->rect_y, s->dst_w, s->dst_h, s->nb_slices);
+
+    return s;
+
+fail:
+    fprintf(stderr, "Cannot scale %dx%d %s to %dx%d %s\n",
+            src_w, src_h, av_get_pix_fmt_name(src_fmt),
+            dst_w, dst_h, av_get_pix_fmt_name(dst_fmt));
+    slice_scaler_free(&s);
+    return NULL;
+}
+
+int slice_scaler_match(SliceScaler *s, int src_w, int src_h,
+                       enum AVPixelFormat src_fmt)
+{
+    return s && s->src_w == src_w && s->src_h == src_h &&
+           s->src_fmt == src_fmt;
+}
+
+void slice_scaler_scale(SliceScaler *s,
+                        const uint8_t *const src[], const int src_stride[],
+                        uint8_t *const dst[], const int dst_stride[])
+{
+    int bottom = s->rect_y + s->rect_h;
+    int right  = s->rect_x + s->rect_w;
+
+    /* the output buffers are recycled, the borders must be redrawn */
+    fill_black(dst, dst_stride, s->dst_fmt, 0, 0, s->dst_w, s->rect_y);
+    fill_black(dst, dst_stride, s->dst_fmt,
+               0, bottom, s->dst_w, s->dst_h - bottom);
+    fill_black(dst, dst_stride, s->dst_fmt,
+               0, s->rect_y, s->rect_x, s->rect_h);
+    fill_black(dst, dst_stride, s->dst_fmt,
+               right, s->rect_y, s->dst_w - right, s->rect_h);
+
+    pthread_mutex_lock(&s->mutex);
+    s->src        = src;
+    s->src_stride = src_stride;
+    s->dst        = dst;
+    s->dst_stride = dst_stride;
+    s->pending    = s->nb_slices - 1;
+    s->job++;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->mutex);
+
+    scale_slice(s, &s->slices[0]);
+
+    pthread_mutex_lock(&s->mutex);
+    while (s->pending)
+        pthread_cond_wait(&s->done, &s->mutex);
+    pthread_mutex_unlock(&s->mutex);
+}
+
+void slice_scaler_free(SliceScaler **ps)
+{
+    SliceScaler *s = *ps;
+
+    if (!s)
+        return;
+
+    pthread_mutex_lock(&s->mutex);
+    s->quit = 1;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->mutex);
+
+    for (int i = 1; i <= s->nb_threads; i++)
+        pthread_join(s->slices[i].thread, NULL);
+
+    for (int i = 0; i < s->nb_slices; i++) {
+        sws_freeContext(s->slices[i].sws);
+        av_freep(&s->slices[i].buf[0]);
+    }
+
+    pthread_mutex_destroy(&s->mutex);
+    pthread_cond_destroy(&s->cond);
+    pthread_cond_destroy(&s->done);
+
+    av_freep(&s->slices);
+    av_freep(ps);
+}
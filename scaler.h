@@ -0,0 +1,62 @@
+/*
+ * Blackmagic Devices Decklink playout
+ * Copyright (c) 2026 the bmdtools authors.
+ *
+ * This file is part of bmdtools.
+ *
+ * bmdtools is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * bmdtools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with bmdtools; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef BMDTOOLS_SCALER_H
+#define BMDTOOLS_SCALER_H
+
+#include <stdint.h>
+
+extern "C" {
+#include <libavutil/pixfmt.h>
+#include <libavutil/rational.h>
+}
+
+/*
+ * Scale a decoded picture into an output frame of a (possibly) different
+ * size, keeping the source display aspect ratio and painting the borders
+ * black.  The output rows are split in horizontal bands, each one with its
+ * own SwsContext and scaled by a worker thread from the source rows it
+ * covers and the few around it its filter reaches.
+ */
+typedef struct SliceScaler SliceScaler;
+
+SliceScaler *slice_scaler_alloc(int src_w, int src_h,
+                                enum AVPixelFormat src_fmt,
+                                AVRational src_sar,
+                                int dst_w, int dst_h,
+                                enum AVPixelFormat dst_fmt,
+                                int threads);
+
+/* true if the scaler has been set up for this source */
+int slice_scaler_match(SliceScaler *s, int src_w, int src_h,
+                       enum AVPixelFormat src_fmt);
+
+void slice_scaler_scale(SliceScaler *s,
+                        const uint8_t *const src[], const int src_stride[],
+                        uint8_t *const dst[], const int dst_stride[]);
+
+void slice_scaler_free(SliceScaler **s);
+
+/* paint a w x h rectangle at x, y black */
+void fill_black(uint8_t *const dst[], const int dst_stride[],
+                enum AVPixelFormat fmt, int x, int y, int w, int h);
+
+#endif /* BMDTOOLS_SCALER_H */
@@ -0,0 +1,385 @@
+/*
+ * Blackmagic Devices Decklink capture to playout loop
+ * Copyright (c) 2026 the bmdtools authors.
+ *
+ * This file is part of bmdtools.
+ *
+ * bmdtools is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * bmdtools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with bmdtools; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "timeshift.h"
+
+/* slots start on a page, writes and reads are whole slots */
+#define ALIGNMENT 4096
+
+/* the header is padded to this, the picture follows */
+#define HEADER_SIZE 64
+
+/* frames copied in and not on disk yet */
+#define STAGING 8
+
+/* the writer waits for this many frames, or for WRITE_WAIT us */
+#define WRITE_BATCH 4
+#define WRITE_WAIT  200000
+
+/* slots the kernel is asked to read ahead */
+#define READ_AHEAD 8
+
+struct Timeshift {
+    char *filename;
+    int fd;
+    unsigned slots;
+    size_t slot_size;
+    size_t video_size;
+    size_t audio_size;
+
+    uint8_t *staging;           /* STAGING slots back to back */
+    pthread_t thread;
+    int has_thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    uint64_t head;              /* frames copied in, the next index */
+    uint64_t tail;              /* frames on disk */
+    int error;
+    int quit;
+
+    int64_t start;
+    uint64_t dropped;
+    int64_t bytes_written;
+    int64_t write_time;
+    int64_t writes;
+    int64_t write_max;
+    int64_t bytes_read;
+    int64_t read_time;
+    uint64_t misses;
+};
+
+static int64_t timeshift_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static int write_all(int fd, const uint8_t *data, size_t size, off_t pos)
+{
+    while (size) {
+        ssize_t n = pwrite(fd, data, size, pos);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        data += n;
+        pos  += n;
+        size -= n;
+    }
+
+    return 0;
+}
+
+static void *timeshift_thread(void *arg)
+{
+    Timeshift *ts = (Timeshift *)arg;
+
+    pthread_mutex_lock(&ts->mutex);
+    while (!ts->quit) {
+        uint64_t tail = ts->tail;
+        unsigned count;
+        int64_t t;
+        int ret;
+
+        if (ts->head == tail) {
+            pthread_cond_wait(&ts->cond, &ts->mutex);
+            continue;
+        }
+
+        // a few frames in one write, unless they are slow to come
+        if (ts->head - tail < WRITE_BATCH) {
+            struct timespec deadline;
+
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += WRITE_WAIT * 1000;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            while (ts->head - tail < WRITE_BATCH && !ts->quit &&
+                   pthread_cond_timedwait(&ts->cond, &ts->mutex,
+                                          &deadline) != ETIMEDOUT)
+                ;
+            if (ts->quit)
+                break;
+        }
+
+        // consecutive in the staging ring and in the file
+        count = ts->head - tail;
+        if (count > STAGING - tail % STAGING)
+            count = STAGING - tail % STAGING;
+        if (count > ts->slots - tail % ts->slots)
+            count = ts->slots - tail % ts->slots;
+        pthread_mutex_unlock(&ts->mutex);
+
+        t   = timeshift_now();
+        ret = write_all(ts->fd, ts->staging + (tail % STAGING) * ts->slot_size,
+                        count * ts->slot_size,
+                        (off_t)(tail % ts->slots) * ts->slot_size);
+        t   = timeshift_now() - t;
+
+        pthread_mutex_lock(&ts->mutex);
+        if (ret < 0 && !ts->error) {
+            fprintf(stderr, "%s: %s\n", ts->filename, strerror(-ret));
+            ts->error = ret;
+        }
+        ts->tail          += count;
+        ts->bytes_written += count * ts->slot_size;
+        ts->write_time    += t;
+        ts->writes++;
+        if (t > ts->write_max)
+            ts->write_max = t;
+        pthread_cond_broadcast(&ts->cond);
+    }
+    pthread_mutex_unlock(&ts->mutex);
+
+    return NULL;
+}
+
+static void timeshift_free(Timeshift *ts)
+{
+    if (ts->has_thread) {
+        pthread_mutex_lock(&ts->mutex);
+        ts->quit = 1;
+        pthread_cond_broadcast(&ts->cond);
+        pthread_mutex_unlock(&ts->mutex);
+        pthread_join(ts->thread, NULL);
+    }
+    pthread_mutex_destroy(&ts->mutex);
+    pthread_cond_destroy(&ts->cond);
+    if (ts->fd >= 0)
+        close(ts->fd);
+    free(ts->staging);
+    free(ts->filename);
+    free(ts);
+}
+
+Timeshift *timeshift_open(const char *filename, unsigned slots,
+                          size_t video_size, size_t audio_size)
+{
+    Timeshift *ts = (Timeshift *)calloc(1, sizeof(*ts));
+    void *staging;
+    int ret;
+
+    if (!ts)
+        return NULL;
+
+    pthread_mutex_init(&ts->mutex, NULL);
+    pthread_cond_init(&ts->cond, NULL);
+    ts->fd         = -1;
+    ts->slots      = slots;
+    ts->video_size = video_size;
+    ts->audio_size = audio_size;
+    ts->slot_size  = (HEADER_SIZE + video_size + audio_size + ALIGNMENT - 1) &
+                     ~(size_t)(ALIGNMENT - 1);
+    ts->filename   = strdup(filename);
+    ts->start      = timeshift_now();
+
+    if (!ts->filename || slots < 2 * STAGING) {
+        fprintf(stderr, "%s: at least %d frames are needed\n", filename,
+                2 * STAGING);
+        goto fail;
+    }
+
+    if (posix_memalign(&staging, ALIGNMENT, STAGING * ts->slot_size))
+        goto fail;
+    ts->staging = (uint8_t *)staging;
+    memset(ts->staging, 0, STAGING * ts->slot_size);
+
+    ts->fd = open(filename, O_RDWR | O_CREAT, 0644);
+    if (ts->fd < 0) {
+        fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+        goto fail;
+    }
+
+    // the blocks are there before the capture starts
+    ret = posix_fallocate(ts->fd, 0, (off_t)slots * ts->slot_size);
+    if (ret == EOPNOTSUPP || ret == EINVAL)
+        ret = ftruncate(ts->fd, (off_t)slots * ts->slot_size) ? errno : 0;
+    if (ret) {
+        fprintf(stderr, "%s: cannot allocate %u frames, %s\n", filename,
+                slots, strerror(ret));
+        goto fail;
+    }
+
+    if (pthread_create(&ts->thread, NULL, timeshift_thread, ts))
+        goto fail;
+    ts->has_thread = 1;
+
+    return ts;
+
+fail:
+    timeshift_free(ts);
+    return NULL;
+}
+
+int timeshift_put(Timeshift *ts, TimeshiftFrame *frame,
+                  const void *video, const void *audio, size_t audio_bytes)
+{
+    uint8_t *slot;
+
+    pthread_mutex_lock(&ts->mutex);
+    if (ts->head - ts->tail == STAGING || ts->error) {
+        ts->dropped++;
+        pthread_mutex_unlock(&ts->mutex);
+        return -1;
+    }
+    frame->index = ts->head;
+    pthread_mutex_unlock(&ts->mutex);
+
+    // the writer does not touch the slot past head
+    slot = ts->staging + (frame->index % STAGING) * ts->slot_size;
+    memcpy(slot, frame, sizeof(*frame));
+    memcpy(slot + HEADER_SIZE, video, ts->video_size);
+    if (audio_bytes > ts->audio_size)
+        audio_bytes = ts->audio_size;
+    if (audio_bytes)
+        memcpy(slot + HEADER_SIZE + ts->video_size, audio, audio_bytes);
+
+    pthread_mutex_lock(&ts->mutex);
+    ts->head++;
+    pthread_cond_broadcast(&ts->cond);
+    pthread_mutex_unlock(&ts->mutex);
+
+    return 0;
+}
+
+uint64_t timeshift_written(Timeshift *ts)
+{
+    uint64_t tail;
+
+    pthread_mutex_lock(&ts->mutex);
+    tail = ts->tail;
+    pthread_mutex_unlock(&ts->mutex);
+
+    return tail;
+}
+
+/* with the mutex held, what the next write can not overwrite */
+static uint64_t oldest(Timeshift *ts)
+{
+    return ts->tail + STAGING > ts->slots ? ts->tail + STAGING - ts->slots : 0;
+}
+
+uint64_t timeshift_oldest(Timeshift *ts)
+{
+    uint64_t index;
+
+    pthread_mutex_lock(&ts->mutex);
+    index = oldest(ts);
+    pthread_mutex_unlock(&ts->mutex);
+
+    return index;
+}
+
+int timeshift_read(Timeshift *ts, uint64_t index, TimeshiftFrame *frame,
+                   void *video, void *audio)
+{
+    uint8_t header[HEADER_SIZE];
+    struct iovec iov[3];
+    off_t pos = (off_t)(index % ts->slots) * ts->slot_size;
+    unsigned ahead;
+    size_t size = HEADER_SIZE + ts->video_size + ts->audio_size;
+    ssize_t n;
+    int64_t t;
+    int ok;
+
+    pthread_mutex_lock(&ts->mutex);
+    ok = index < ts->tail && index >= oldest(ts);
+    // not written yet is not a miss, only overwritten
+    if (index < oldest(ts))
+        ts->misses++;
+    pthread_mutex_unlock(&ts->mutex);
+    if (!ok)
+        return -1;
+
+    iov[0].iov_base = header;
+    iov[0].iov_len  = HEADER_SIZE;
+    iov[1].iov_base = video;
+    iov[1].iov_len  = ts->video_size;
+    iov[2].iov_base = audio;
+    iov[2].iov_len  = ts->audio_size;
+
+    t = timeshift_now();
+    do
+        n = preadv(ts->fd, iov, 3, pos);
+    while (n < 0 && errno == EINTR);
+    t = timeshift_now() - t;
+
+    // the next slots are read by the kernel while this one plays
+    ahead = ts->slots - (index + 1) % ts->slots;
+    if (ahead > READ_AHEAD)
+        ahead = READ_AHEAD;
+    posix_fadvise(ts->fd, (off_t)((index + 1) % ts->slots) * ts->slot_size,
+                  (off_t)ahead * ts->slot_size, POSIX_FADV_WILLNEED);
+
+    memcpy(frame, header, sizeof(*frame));
+
+    pthread_mutex_lock(&ts->mutex);
+    // overwritten meanwhile
+    ok = n == (ssize_t)size && frame->index == index && index >= oldest(ts);
+    if (ok) {
+        ts->bytes_read += n;
+        ts->read_time  += t;
+    } else {
+        ts->misses++;
+    }
+    pthread_mutex_unlock(&ts->mutex);
+
+    return ok ? 0 : -1;
+}
+
+void timeshift_close(Timeshift *ts)
+{
+    int64_t elapsed;
+
+    if (!ts)
+        return;
+
+    elapsed = timeshift_now() - ts->start;
+    fprintf(stderr, "%s: %" PRId64 " MB written in %" PRId64 " s, %.1f MB/s "
+            "while writing, %" PRId64 " writes of %.1f frames, the longest "
+            "%" PRId64 " ms, %" PRIu64 " frames dropped; %" PRId64 " MB read, "
+            "%.1f MB/s, %" PRIu64 " frames missed\n", ts->filename,
+            ts->bytes_written >> 20, elapsed / 1000000,
+            ts->write_time ? ts->bytes_written / (double)ts->write_time : 0.0,
+            ts->writes,
+            ts->writes ? ts->bytes_written / (double)ts->slot_size / ts->writes : 0.0,
+            ts->write_max / 1000, ts->dropped, ts->bytes_read >> 20,
+            ts->read_time ? ts->bytes_read / (double)ts->read_time : 0.0,
+            ts->misses);
+
+    timeshift_free(ts);
+}
@@ -0,0 +1,64 @@
+/*
+ * Blackmagic Devices Decklink capture to playout loop
+ * Copyright (c) 2026 the bmdtools authors.
+ *
+ * This file is part of bmdtools.
+ *
+ * bmdtools is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * bmdtools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with bmdtools; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef BMDTOOLS_TIMESHIFT_H
+#define BMDTOOLS_TIMESHIFT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A file preallocated as a ring of fixed size slots, one frame each,
+ * addressed by frame index.  A thread writes the frames in runs of
+ * consecutive slots, they can be read back until they are overwritten.
+ */
+typedef struct TimeshiftFrame {
+    uint64_t index;
+    int64_t arrival;            /* us on the host clock */
+    uint32_t flags;             /* BMDFrameFlags */
+    uint32_t audio_samples;
+} TimeshiftFrame;
+
+typedef struct Timeshift Timeshift;
+
+Timeshift *timeshift_open(const char *filename, unsigned slots,
+                          size_t video_size, size_t audio_size);
+
+/*
+ * Copy a frame in without waiting for the disk, the index is set.  -1 if
+ * the writer fell behind and the frame was dropped.  The audio is cut to
+ * the size given at open.
+ */
+int timeshift_put(Timeshift *ts, TimeshiftFrame *frame,
+                  const void *video, const void *audio, size_t audio_bytes);
+
+/* frames on disk are from timeshift_oldest() up to timeshift_written() */
+uint64_t timeshift_written(Timeshift *ts);
+uint64_t timeshift_oldest(Timeshift *ts);
+
+/* -1 if the index is not on disk, the kernel is asked for the next ones */
+int timeshift_read(Timeshift *ts, uint64_t index, TimeshiftFrame *frame,
+                   void *video, void *audio);
+
+/* report the throughput and the drops, then free everything */
+void timeshift_close(Timeshift *ts);
+
+#endif /* BMDTOOLS_TIMESHIFT_H */
@@ -0,0 +1,294 @@
+/*
+ * Blackmagic Devices Decklink capture
+ * Copyright (c) 2026 the bmdtools authors.
+ *
+ * This file is part of bmdtools.
+ *
+ * bmdtools is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * bmdtools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with bmdtools; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "compat.h"
+#include "trace.h"
+
+FILE *trace_create(const char *filename, const TraceHeader *h)
+{
+    TraceHeader header = *h;
+    FILE *f = fopen(filename, "wb");
+
+    if (!f)
+        return NULL;
+
+    // written from the capture callback, a write(2) every few hundred
+    setvbuf(f, NULL, _IOFBF, 64 * 1024);
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    if (fwrite(&header, sizeof(header), 1, f) != 1) {
+        fclose(f);
+        return NULL;
+    }
+    return f;
+}
+
+int trace_write(FILE *f, const TraceRecord *r)
+{
+    return fwrite(r, sizeof(*r), 1, f) == 1 ? 0 : -1;
+}
+
+FILE *trace_open(const char *filename, TraceHeader *h)
+{
+    FILE *f = fopen(filename, "rb");
+
+    if (!f)
+        return NULL;
+
+    if (fread(h, sizeof(*h), 1, f) != 1 ||
+        memcmp(h->magic, TRACE_MAGIC, sizeof(h->magic)) ||
+        h->version != TRACE_VERSION ||
+        h->width <= 0 || h->height <= 0 ||
+        h->frame_duration <= 0 || h->time_scale <= 0) {
+        fclose(f);
+        return NULL;
+    }
+    return f;
+}
+
+int trace_read(FILE *f, TraceRecord *r)
+{
+    return fread(r, sizeof(*r), 1, f) == 1;
+}
+
+static int64_t rescale(int64_t a, int64_t b, int64_t c)
+{
+    return (int64_t)((__int128)a * b / c);
+}
+
+static bool same_iid(REFIID a, REFIID b)
+{
+    return !memcmp(&a, &b, sizeof(REFIID));
+}
+
+class TraceVideoFrame : public IDeckLinkVideoInputFrame
+{
+public:
+    TraceVideoFrame(const TraceHeader *h, const TraceRecord *r, void *bytes) :
+        m_refs(1), m_header(*h), m_record(*r), m_bytes(bytes) {}
+    virtual ~TraceVideoFrame() {}
+
+    virtual HRESULT STDMETHODCALLTYPE QueryInterface(REFIID iid, LPVOID *ppv)
+    {
+        if (same_iid(iid, IID_IUnknown) || same_iid(iid, IID_IDeckLinkVideoFrame) ||
+            same_iid(iid, IID_IDeckLinkVideoInputFrame)) {
+            AddRef();
+            *ppv = this;
+            return S_OK;
+        }
+        *ppv = NULL;
+        return E_NOINTERFACE;
+    }
+    virtual ULONG STDMETHODCALLTYPE AddRef(void)
+    {
+        return __atomic_add_fetch(&m_refs, 1, __ATOMIC_RELAXED);
+    }
+    virtual ULONG STDMETHODCALLTYPE Release(void)
+    {
+        ULONG refs = __atomic_sub_fetch(&m_refs, 1, __ATOMIC_ACQ_REL);
+
+        if (!refs)
+            delete this;
+        return refs;
+    }
+
+    virtual long STDMETHODCALLTYPE GetWidth(void) { return m_header.width; }
+    virtual long STDMETHODCALLTYPE GetHeight(void) { return m_header.height; }
+    virtual long STDMETHODCALLTYPE GetRowBytes(void) { return m_record.row_bytes; }
+    virtual BMDPixelFormat STDMETHODCALLTYPE GetPixelFormat(void)
+    {
+        return m_header.pixel_format;
+    }
+    virtual BMDFrameFlags STDMETHODCALLTYPE GetFlags(void) { return m_record.flags; }
+    virtual HRESULT STDMETHODCALLTYPE GetBytes(void **buffer)
+    {
+        *buffer = m_bytes;
+        return S_OK;
+    }
+    virtual HRESULT STDMETHODCALLTYPE GetTimecode(BMDTimecodeFormat format,
+                                                  IDeckLinkTimecode **timecode)
+    {
+        *timecode = NULL;
+        return S_FALSE;
+    }
+    virtual HRESULT STDMETHODCALLTYPE GetAncillaryData(IDeckLinkVideoFrameAncillary **ancillary)
+    {
+        *ancillary = NULL;
+        return S_FALSE;
+    }
+    virtual HRESULT STDMETHODCALLTYPE GetStreamTime(BMDTimeValue *frameTime,
+                                                    BMDTimeValue *frameDuration,
+                                                    BMDTimeScale timeScale)
+    {
+        *frameTime     = rescale(m_record.video_time, timeScale,
+                                 m_header.time_scale);
+        *frameDuration = rescale(m_header.frame_duration, timeScale,
+                                 m_header.time_scale);
+        return S_OK;
+    }
+    virtual HRESULT STDMETHODCALLTYPE GetHardwareReferenceTimestamp(BMDTimeScale timeScale,
+                                                                    BMDTimeValue *frameTime,
+                                                                    BMDTimeValue *frameDuration)
+    {
+        *frameTime     = rescale(m_record.arrival, timeScale, 1000000);
+        *frameDuration = rescale(m_header.frame_duration, timeScale,
+                                 m_header.time_scale);
+        return S_OK;
+    }
+
+private:
+    ULONG m_refs;
+    TraceHeader m_header;
+    TraceRecord m_record;
+    void *m_bytes;
+};
+
+class TraceAudioPacket : public IDeckLinkAudioInputPacket
+{
+public:
+    TraceAudioPacket(const TraceRecord *r, void *bytes) :
+        m_refs(1), m_record(*r), m_bytes(bytes) {}
+    virtual ~TraceAudioPacket() {}
+
+    virtual HRESULT STDMETHODCALLTYPE QueryInterface(REFIID iid, LPVOID *ppv)
+    {
+        if (same_iid(iid, IID_IUnknown) || same_iid(iid, IID_IDeckLinkAudioInputPacket)) {
+            AddRef();
+            *ppv = this;
+            return S_OK;
+        }
+        *ppv = NULL;
+        return E_NOINTERFACE;
+    }
+    virtual ULONG STDMETHODCALLTYPE AddRef(void)
+    {
+        return __atomic_add_fetch(&m_refs, 1, __ATOMIC_RELAXED);
+    }
+    virtual ULONG STDMETHODCALLTYPE Release(void)
+    {
+        ULONG refs = __atomic_sub_fetch(&m_refs, 1, __ATOMIC_ACQ_REL);
+
+        if (!refs)
+            delete this;
+        return refs;
+    }
+
+    virtual long STDMETHODCALLTYPE GetSampleFrameCount(void)
+    {
+        return m_record.audio_samples;
+    }
+    virtual HRESULT STDMETHODCALLTYPE GetBytes(void **buffer)
+    {
+        *buffer = m_bytes;
+        return S_OK;
+    }
+    virtual HRESULT STDMETHODCALLTYPE GetPacketTime(BMDTimeValue *packetTime,
+                                                    BMDTimeScale timeScale)
+    {
+        *packetTime = rescale(m_record.audio_time, timeScale, 48000);
+        return S_OK;
+    }
+
+private:
+    ULONG m_refs;
+    TraceRecord m_record;
+    void *m_bytes;
+};
+
+class TraceDisplayMode : public IDeckLinkDisplayMode
+{
+public:
+    TraceDisplayMode(const TraceHeader *h) : m_refs(1), m_header(*h) {}
+    virtual ~TraceDisplayMode() {}
+
+    virtual HRESULT STDMETHODCALLTYPE QueryInterface(REFIID iid, LPVOID *ppv)
+    {
+        if (same_iid(iid, IID_IUnknown) || same_iid(iid, IID_IDeckLinkDisplayMode)) {
+            AddRef();
+            *ppv = this;
+            return S_OK;
+        }
+        *ppv = NULL;
+        return E_NOINTERFACE;
+    }
+    virtual ULONG STDMETHODCALLTYPE AddRef(void)
+    {
+        return __atomic_add_fetch(&m_refs, 1, __ATOMIC_RELAXED);
+    }
+    virtual ULONG STDMETHODCALLTYPE Release(void)
+    {
+        ULONG refs = __atomic_sub_fetch(&m_refs, 1, __ATOMIC_ACQ_REL);
+
+        if (!refs)
+            delete this;
+        return refs;
+    }
+
+    virtual HRESULT STDMETHODCALLTYPE GetName(BMDProbeString *name)
+    {
+#ifdef HAVE_CFSTRING
+        *name = CFStringCreateWithCString(NULL, "Trace", kCFStringEncodingMacRoman);
+#else
+        *name = strdup("Trace");
+#endif
+        return S_OK;
+    }
+    virtual BMDDisplayMode STDMETHODCALLTYPE GetDisplayMode(void) { return bmdModeUnknown; }
+    virtual long STDMETHODCALLTYPE GetWidth(void) { return m_header.width; }
+    virtual long STDMETHODCALLTYPE GetHeight(void) { return m_header.height; }
+    virtual HRESULT STDMETHODCALLTYPE GetFrameRate(BMDTimeValue *frameDuration,
+                                                   BMDTimeScale *timeScale)
+    {
+        *frameDuration = m_header.frame_duration;
+        *timeScale     = m_header.time_scale;
+        return S_OK;
+    }
+    virtual BMDFieldDominance STDMETHODCALLTYPE GetFieldDominance(void)
+    {
+        return bmdUnknownFieldDominance;
+    }
+    virtual BMDDisplayModeFlags STDMETHODCALLTYPE GetFlags(void) { return 0; }
+
+private:
+    ULONG m_refs;
+    TraceHeader m_header;
+};
+
+IDeckLinkVideoInputFrame *trace_video_frame(const TraceHeader *h,
+                                            const TraceRecord *r,
+                                            void *bytes)
+{
+    return new TraceVideoFrame(h, r, bytes);
+}
+
+IDeckLinkAudioInputPacket *trace_audio_packet(const TraceRecord *r,
+                                              void *bytes)
+{
+    return new TraceAudioPacket(r, bytes);
+}
+
+IDeckLinkDisplayMode *trace_display_mode(const TraceHeader *h)
+{
+    return new TraceDisplayMode(h);
+}
@@ -0,0 +1,80 @@
+/*
+ * Blackmagic Devices Decklink capture
+ * Copyright (c) 2026 the bmdtools authors.
+ *
+ * This file is part of bmdtools.
+ *
+ * bmdtools is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * bmdtools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with bmdtools; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef BMDTOOLS_TRACE_H
+#define BMDTOOLS_TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "DeckLinkAPI.h"
+
+/*
+ * bmdcapture -T keeps what every input callback carried, not the picture
+ * nor the sound: a header, then one fixed size record per callback, in
+ * host byte order.  bmdcapture -R replays it through the queue and the
+ * muxer with frames of the recorded sizes.
+ */
+#define TRACE_MAGIC   "BMDTRACE"
+#define TRACE_VERSION 1
+
+typedef struct TraceHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t pixel_format;      /* BMDPixelFormat */
+    int32_t width, height;
+    int64_t frame_duration;     /* the video times are in 1 / time_scale */
+    int64_t time_scale;
+    int32_t audio_channels;
+    int32_t audio_depth;        /* bits */
+} TraceHeader;
+
+typedef struct TraceRecord {
+    int64_t arrival;            /* us after the first callback */
+    int64_t video_time;         /* 1 / time_scale, -1 without a frame */
+    int64_t audio_time;         /* 1 / 48000, -1 without a packet */
+    uint32_t flags;             /* BMDFrameFlags */
+    uint32_t row_bytes;
+    uint32_t video_size;        /* bytes */
+    uint32_t audio_samples;     /* sample frames */
+} TraceRecord;
+
+FILE *trace_create(const char *filename, const TraceHeader *h);
+int trace_write(FILE *f, const TraceRecord *r);
+
+/* NULL if filename is not a trace this version can read */
+FILE *trace_open(const char *filename, TraceHeader *h);
+
+/* 1 if a record was read, 0 at the end */
+int trace_read(FILE *f, TraceRecord *r);
+
+/*
+ * What the card would have handed to the callback for a record, the
+ * picture and the samples are taken from the buffers given.
+ */
+IDeckLinkVideoInputFrame *trace_video_frame(const TraceHeader *h,
+                                            const TraceRecord *r,
+                                            void *bytes);
+IDeckLinkAudioInputPacket *trace_audio_packet(const TraceRecord *r,
+                                              void *bytes);
+IDeckLinkDisplayMode *trace_display_mode(const TraceHeader *h);
+
+#endif /* BMDTOOLS_TRACE_H */
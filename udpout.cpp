@@ -0,0 +1,431 @@
+/*
+ * Blackmagic Devices Decklink capture
+ * Copyright (c) 2026 the bmdtools authors.
+ *
+ * This file is part of bmdtools.
+ *
+ * bmdtools is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * bmdtools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with bmdtools; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <linux/net_tstamp.h>
+#include <sys/prctl.h>
+#endif
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavformat/avio.h>
+#include <libavutil/mem.h>
+#include <libavutil/parseutils.h>
+#include <libavutil/time.h>
+}
+
+#include "udpout.h"
+
+/* what fits in an Ethernet frame after the IP and UDP headers */
+#define DEFAULT_PACKET_SIZE 1472
+
+/* datagrams a sendmmsg() takes, and the most the bucket lets out at once */
+#define BATCH 8
+
+/* the frame is sent in this much of its interval, the rest is headroom */
+#define SPREAD 0.9
+
+typedef struct UdpOut {
+    char *url;
+    int fd;
+    int packet_size;
+    int txtime;                 /* SO_TXTIME took, launch times are set */
+    int64_t frame_duration;     /* us */
+
+    uint8_t *slots;             /* packet_size each */
+    int *lengths;
+    unsigned nb_slots;
+
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    unsigned head;              /* datagrams queued by the muxer */
+    unsigned tail;              /* datagrams sent */
+    int64_t queued;             /* bytes between them */
+    double rate;                /* bytes per us, 0 until a frame is written */
+    int quit;
+
+    int64_t start;
+    int64_t datagrams;
+    int64_t bytes;
+    int64_t frames;
+    int64_t batches;
+    int64_t errors;
+    int64_t queued_max;
+} UdpOut;
+
+#ifdef __linux__
+static int send_batch(UdpOut *u, unsigned n, double rate)
+{
+    struct mmsghdr msgs[BATCH];
+    struct iovec iov[BATCH];
+    char control[BATCH][CMSG_SPACE(sizeof(uint64_t))];
+    struct timespec ts;
+    uint64_t launch;
+    unsigned sent = 0;
+
+    // the kernel spreads the batch too where the qdisc honours it
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    launch = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+    memset(msgs, 0, sizeof(msgs));
+    for (unsigned i = 0; i < n; i++) {
+        unsigned slot = (u->tail + i) % u->nb_slots;
+
+        iov[i].iov_base = u->slots + (size_t)slot * u->packet_size;
+        iov[i].iov_len  = u->lengths[slot];
+        msgs[i].msg_hdr.msg_iov    = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+
+        if (u->txtime) {
+            struct cmsghdr *cm;
+
+            msgs[i].msg_hdr.msg_control    = control[i];
+            msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+            cm             = CMSG_FIRSTHDR(&msgs[i].msg_hdr);
+            cm->cmsg_level = SOL_SOCKET;
+            cm->cmsg_type  = SCM_TXTIME;
+            cm->cmsg_len   = CMSG_LEN(sizeof(uint64_t));
+            memcpy(CMSG_DATA(cm), &launch, sizeof(launch));
+            launch += (uint64_t)(u->lengths[slot] / rate * 1000);
+        }
+    }
+
+    while (sent < n) {
+        int ret = sendmmsg(u->fd, msgs + sent, n - sent, 0);
+
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            // no receiver yet or a full device queue, the datagram is lost
+            u->errors++;
+            sent++;
+            continue;
+        }
+        sent += ret;
+    }
+
+    return 0;
+}
+#else
+static int send_batch(UdpOut *u, unsigned n, double rate)
+{
+    for (unsigned i = 0; i < n; i++) {
+        unsigned slot = (u->tail + i) % u->nb_slots;
+
+        if (send(u->fd, u->slots + (size_t)slot * u->packet_size,
+                 u->lengths[slot], 0) < 0)
+            u->errors++;
+    }
+
+    return 0;
+}
+#endif
+
+/*
+ * A token bucket a batch deep: it fills at the rate of the last frame, a
+ * batch goes out in one call once it fits and the thread sleeps meanwhile.
+ */
+static void *udpout_thread(void *arg)
+{
+    UdpOut *u    = (UdpOut *)arg;
+    double depth = (double)BATCH * u->packet_size;
+    double tokens = 0;
+    int64_t last = av_gettime_relative();
+
+#ifdef __linux__
+    // sleeps of a hundred us are worth nothing with the default 50 us slack
+    prctl(PR_SET_TIMERSLACK, 1000UL);
+#endif
+
+    pthread_mutex_lock(&u->mutex);
+    for (;;) {
+        unsigned avail, n = 0;
+        int64_t now, bytes = 0;
+        double rate;
+
+        if (u->head == u->tail && u->quit)
+            break;
+        if (u->head == u->tail || !u->rate) {
+            pthread_cond_wait(&u->cond, &u->mutex);
+            continue;
+        }
+        avail = u->head - u->tail;
+        rate  = u->rate;
+        pthread_mutex_unlock(&u->mutex);
+
+        now    = av_gettime_relative();
+        tokens = FFMIN(depth, tokens + (now - last) * rate);
+        last   = now;
+
+        // only the thread moves the tail, the slots stay put
+        while (n < avail && n < BATCH)
+            bytes += u->lengths[(u->tail + n++) % u->nb_slots];
+        if (bytes > tokens) {
+            av_usleep(FFMAX(1, (int64_t)((bytes - tokens) / rate)));
+            pthread_mutex_lock(&u->mutex);
+            continue;
+        }
+
+        send_batch(u, n, rate);
+        tokens -= bytes;
+        u->datagrams += n;
+        u->bytes     += bytes;
+        u->batches++;
+
+        pthread_mutex_lock(&u->mutex);
+        u->tail   += n;
+        u->queued -= bytes;
+        pthread_cond_broadcast(&u->cond);
+    }
+    pthread_mutex_unlock(&u->mutex);
+
+    return NULL;
+}
+
+static int udpout_write(void *opaque, uint8_t *buf, int buf_size)
+{
+    UdpOut *u = (UdpOut *)opaque;
+    int left  = buf_size;
+
+    pthread_mutex_lock(&u->mutex);
+    while (left > 0) {
+        int len = FFMIN(left, u->packet_size);
+        unsigned slot;
+
+        // the muxer waits, the capture queue takes up the slack
+        while (u->head - u->tail == u->nb_slots) {
+            // more than the queue before the first frame is done
+            if (!u->rate)
+                u->rate = u->queued / (u->frame_duration * SPREAD);
+            pthread_cond_broadcast(&u->cond);
+            pthread_cond_wait(&u->cond, &u->mutex);
+        }
+
+        slot = u->head % u->nb_slots;
+        memcpy(u->slots + (size_t)slot * u->packet_size, buf, len);
+        u->lengths[slot] = len;
+        u->head++;
+        u->queued += len;
+        u->queued_max = FFMAX(u->queued_max, u->queued);
+        buf  += len;
+        left -= len;
+    }
+    pthread_cond_broadcast(&u->cond);
+    pthread_mutex_unlock(&u->mutex);
+
+    return buf_size;
+}
+
+void udpout_frame(AVIOContext *pb)
+{
+    UdpOut *u = (UdpOut *)pb->opaque;
+
+    // a datagram does not straddle two frames
+    avio_flush(pb);
+
+    // a backlog is caught up with in the same interval
+    pthread_mutex_lock(&u->mutex);
+    if (u->queued)
+        u->rate = u->queued / (u->frame_duration * SPREAD);
+    u->frames++;
+    pthread_cond_broadcast(&u->cond);
+    pthread_mutex_unlock(&u->mutex);
+}
+
+static int udpout_socket(UdpOut *u, const char *url)
+{
+    char hostname[256], path[1024], port_str[16], arg[64];
+    struct addrinfo hints = { 0 }, *ai, *p;
+    const char *query;
+    int port, ttl = -1, txtime = 0, ret;
+
+    av_url_split(NULL, 0, NULL, 0, hostname, sizeof(hostname), &port,
+                 path, sizeof(path), url);
+    if (!hostname[0] || port <= 0) {
+        fprintf(stderr, "%s: needs a host and a port\n", url);
+        return -1;
+    }
+
+    u->packet_size = DEFAULT_PACKET_SIZE;
+    query          = strchr(url, '?');
+    if (query) {
+        if (av_find_info_tag(arg, sizeof(arg), "pkt_size", query))
+            u->packet_size = FFMAX(atoi(arg), 64);
+        if (av_find_info_tag(arg, sizeof(arg), "ttl", query))
+            ttl = atoi(arg);
+        if (av_find_info_tag(arg, sizeof(arg), "txtime", query))
+            txtime = atoi(arg);
+    }
+
+    snprintf(port_str, sizeof(port_str), "%d", port);
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    ret = getaddrinfo(hostname, port_str, &hints, &ai);
+    if (ret) {
+        fprintf(stderr, "%s: %s\n", url, gai_strerror(ret));
+        return -1;
+    }
+
+    for (p = ai; p; p = p->ai_next) {
+        u->fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        if (u->fd < 0)
+            continue;
+        if (connect(u->fd, p->ai_addr, p->ai_addrlen) == 0)
+            break;
+        close(u->fd);
+        u->fd = -1;
+    }
+    if (u->fd < 0) {
+        fprintf(stderr, "%s: %s\n", url, strerror(errno));
+        freeaddrinfo(ai);
+        return -1;
+    }
+
+    if (ttl > 0) {
+        if (p->ai_family == AF_INET6)
+            setsockopt(u->fd, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &ttl, sizeof(ttl));
+        else
+            setsockopt(u->fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+    }
+    freeaddrinfo(ai);
+
+    // fq paces on CLOCK_MONOTONIC launch times, etf would drop them
+#if defined(__linux__) && defined(SO_TXTIME)
+    if (txtime) {
+        struct sock_txtime txt = { CLOCK_MONOTONIC, 0 };
+
+        u->txtime = setsockopt(u->fd, SOL_SOCKET, SO_TXTIME,
+                               &txt, sizeof(txt)) == 0;
+        if (!u->txtime)
+            fprintf(stderr, "%s: no SO_TXTIME, %s\n", url, strerror(errno));
+    }
+#endif
+
+    return 0;
+}
+
+static void udpout_free(UdpOut *u)
+{
+    pthread_mutex_destroy(&u->mutex);
+    pthread_cond_destroy(&u->cond);
+    if (u->fd >= 0)
+        close(u->fd);
+    av_freep(&u->slots);
+    av_freep(&u->lengths);
+    av_freep(&u->url);
+    av_free(u);
+}
+
+AVIOContext *udpout_open(const char *url, int64_t frame_duration,
+                         int queue_size)
+{
+    AVIOContext *pb;
+    UdpOut *u;
+    uint8_t *buffer;
+
+    u = (UdpOut *)av_mallocz(sizeof(UdpOut));
+    if (!u)
+        return NULL;
+    pthread_mutex_init(&u->mutex, NULL);
+    pthread_cond_init(&u->cond, NULL);
+    u->fd             = -1;
+    u->url            = av_strdup(url);
+    u->frame_duration = FFMAX(frame_duration, 1);
+    u->start          = av_gettime_relative();
+
+    if (udpout_socket(u, url) < 0) {
+        udpout_free(u);
+        return NULL;
+    }
+
+    u->nb_slots = FFMAX(queue_size / u->packet_size, 2 * BATCH);
+    u->slots    = (uint8_t *)av_malloc((size_t)u->nb_slots * u->packet_size);
+    u->lengths  = (int *)av_mallocz_array(u->nb_slots, sizeof(int));
+    buffer      = (uint8_t *)av_malloc(u->packet_size);
+    if (!u->slots || !u->lengths || !buffer)
+        goto fail;
+
+    // each flush of a full or partial buffer is a datagram
+    pb = avio_alloc_context(buffer, u->packet_size, 1, u, NULL,
+                            udpout_write, NULL);
+    if (!pb)
+        goto fail;
+    pb->max_packet_size = u->packet_size;
+    pb->seekable        = 0;
+
+    if (pthread_create(&u->thread, NULL, udpout_thread, u)) {
+        avio_context_free(&pb);
+        goto fail;
+    }
+
+    return pb;
+
+fail:
+    fprintf(stderr, "%s: cannot set up the output\n", url);
+    av_free(buffer);
+    udpout_free(u);
+    return NULL;
+}
+
+void udpout_close(AVIOContext **pb)
+{
+    UdpOut *u;
+
+    if (!*pb)
+        return;
+
+    avio_flush(*pb);
+    u = (UdpOut *)(*pb)->opaque;
+
+    // what no frame paced yet goes at the last rate, or at once
+    pthread_mutex_lock(&u->mutex);
+    u->quit = 1;
+    if (!u->rate)
+        u->rate = 1e9;
+    pthread_cond_broadcast(&u->cond);
+    pthread_mutex_unlock(&u->mutex);
+    pthread_join(u->thread, NULL);
+
+    fprintf(stderr, "%s: %" PRId64 " datagrams, %" PRId64 " MB in %" PRId64
+            " frames over %" PRId64 " s, %.1f datagrams a call%s, %" PRId64
+            " lost sending, up to %" PRId64 " kB queued\n", u->url,
+            u->datagrams, u->bytes >> 20, u->frames,
+            (av_gettime_relative() - u->start) / 1000000,
+            u->batches ? (double)u->datagrams / u->batches : 0.0,
+            u->txtime ? ", SO_TXTIME" : "", u->errors, u->queued_max >> 10);
+
+    udpout_free(u);
+    av_freep(&(*pb)->buffer);
+    avio_context_free(pb);
+}
@@ -0,0 +1,51 @@
+/*
+ * Blackmagic Devices Decklink capture
+ * Copyright (c) 2026 the bmdtools authors.
+ *
+ * This file is part of bmdtools.
+ *
+ * bmdtools is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * bmdtools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with bmdtools; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef BMDTOOLS_UDPOUT_H
+#define BMDTOOLS_UDPOUT_H
+
+#include <stdint.h>
+
+extern "C" {
+#include <libavformat/avio.h>
+}
+
+/*
+ * Output AVIOContext for udp://host:port or rtp://host:port, pkt_size and
+ * ttl taken from the query as libavformat does, txtime=1 to also give the
+ * kernel a launch time for each datagram (SO_TXTIME, for the fq qdisc).
+ * What the muxer writes is cut in datagrams and queued, up to queue_size
+ * bytes; a thread sends them through a token bucket instead of in a burst
+ * per frame.
+ */
+AVIOContext *udpout_open(const char *url, int64_t frame_duration,
+                         int queue_size);
+
+/*
+ * A frame is written: what is queued is spread over the next
+ * frame_duration (us), give or take the headroom to catch up.
+ */
+void udpout_frame(AVIOContext *pb);
+
+/* send what is left, report and free everything */
+void udpout_close(AVIOContext **pb);
+
+#endif /* BMDTOOLS_UDPOUT_H */